@@ -0,0 +1,333 @@
+/* Blob stores hold the values of messages that are too big to send through Kafka
+ * (see --claim-check-threshold in kafka/bottledwater.c). Such a message carries a
+ * reference to its value instead, which consumers resolve with blob_store_resolve():
+ *
+ *   - 1 byte: BLOB_REF_MAGIC, which tells a reference apart from an Avro-encoded
+ *     value (those start with the schema registry's magic byte, 0).
+ *   - 8 bytes: the size of the value, big-endian.
+ *   - BLOB_DIGEST_LEN bytes: the SHA-256 digest of the value, which names the blob.
+ *
+ * The blob holds the value exactly as it would have been sent to Kafka, i.e. prefixed
+ * with its schema ID. Since blobs are content-addressed, they can be written more than
+ * once (e.g. when a transaction is replayed after a restart) without harm.
+ *
+ * Only a filesystem store is implemented here ("file:DIR"): each blob is a file named
+ * by its digest in hex, in a subdirectory named by the first two hex digits, written
+ * to a temporary file and renamed into place once it has been synced to disk. Stores
+ * backed by an object store implement blob_store_ops in the same way. */
+
+#include "blob_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BLOB_NAME_LEN (2 * BLOB_DIGEST_LEN)
+
+static int file_blob_store_open(blob_store_t store);
+static int file_blob_store_put(blob_store_t store, const char *name, const void *data, size_t len);
+static int file_blob_store_get(blob_store_t store, const char *name, void *buf, size_t len);
+void blob_name(const uint8_t *digest, char *name_out);
+char *file_blob_path(blob_store_t store, const char *name, const char *suffix);
+void file_blob_sync_dir(const char *path);
+void sha256_block(uint32_t *state, const uint8_t *block);
+
+const blob_store_ops file_blob_store_ops = {"file", file_blob_store_open,
+    file_blob_store_put, file_blob_store_get, NULL};
+
+
+/* Allocates a blob store, which then needs to be opened with blob_store_open(). */
+blob_store_t blob_store_new(const blob_store_ops *ops, const char *target) {
+    blob_store_t store = malloc(sizeof(blob_store));
+    memset(store, 0, sizeof(blob_store));
+    store->ops = ops;
+    store->target = target ? strdup(target) : NULL;
+    return store;
+}
+
+
+/* Returns the blob store of the given name, or NULL if there is none. */
+const blob_store_ops *blob_store_lookup(const char *name) {
+    const blob_store_ops *all[] = {&file_blob_store_ops};
+    for (int i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (strcmp(all[i]->name, name) == 0) return all[i];
+    }
+    return NULL;
+}
+
+
+int blob_store_open(blob_store_t store) {
+    return store->ops->open ? store->ops->open(store) : 0;
+}
+
+
+/* Stores a value durably, and writes the reference to it (BLOB_REF_LEN bytes) to
+ * ref_out, which may point into data (it is only written once data has been stored). */
+int blob_store_put(blob_store_t store, const void *data, size_t len, char *ref_out) {
+    uint8_t digest[BLOB_DIGEST_LEN];
+    char name[BLOB_NAME_LEN + 1];
+    blob_sha256(data, len, digest);
+    blob_name(digest, name);
+
+    int err = store->ops->put(store, name, data, len);
+    if (err) return err;
+    store->num_put++;
+    store->bytes_put += len;
+
+    ref_out[0] = BLOB_REF_MAGIC;
+    for (int i = 0; i < 8; i++) ref_out[1 + i] = ((uint64_t) len >> (56 - 8 * i)) & 0xff;
+    memcpy(ref_out + 9, digest, BLOB_DIGEST_LEN);
+    return 0;
+}
+
+
+/* Returns true if a message value is a reference to a blob, rather than the value
+ * itself. */
+bool blob_ref_check(const void *val, size_t len) {
+    return val && len == BLOB_REF_LEN && ((const uint8_t *) val)[0] == BLOB_REF_MAGIC;
+}
+
+
+/* For consumers: if a message value is a reference to a blob, reads the blob into a
+ * newly allocated buffer (which the caller frees), and checks that it is intact. If
+ * it isn't a reference, sets *blob_out to NULL, so that the value is used as it is. */
+int blob_store_resolve(blob_store_t store, const void *val, size_t len,
+        void **blob_out, size_t *blob_len) {
+    *blob_out = NULL;
+    *blob_len = 0;
+    if (!blob_ref_check(val, len)) return 0;
+
+    const uint8_t *ref = val;
+    uint64_t size = 0;
+    for (int i = 0; i < 8; i++) size = (size << 8) | ref[1 + i];
+    if (size > SIZE_MAX) {
+        blob_store_error(store, "Blob of %llu bytes is too big", (unsigned long long) size);
+        return EINVAL;
+    }
+
+    char name[BLOB_NAME_LEN + 1];
+    blob_name(ref + 9, name);
+
+    void *blob = malloc(size > 0 ? size : 1);
+    if (!blob) {
+        blob_store_error(store, "Out of memory for blob %s", name);
+        return ENOMEM;
+    }
+
+    int err = store->ops->get(store, name, blob, size);
+    if (err) {
+        free(blob);
+        return err;
+    }
+
+    uint8_t digest[BLOB_DIGEST_LEN];
+    blob_sha256(blob, size, digest);
+    if (memcmp(digest, ref + 9, BLOB_DIGEST_LEN) != 0) {
+        blob_store_error(store, "Blob %s is corrupt", name);
+        free(blob);
+        return EIO;
+    }
+
+    *blob_out = blob;
+    *blob_len = size;
+    return 0;
+}
+
+
+void blob_store_free(blob_store_t store) {
+    if (store->ops->close) store->ops->close(store);
+    free(store->target);
+    free(store);
+}
+
+
+/* Updates the store's statically allocated error buffer with a message. */
+void blob_store_error(blob_store_t store, char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(store->error, BLOB_STORE_ERROR_LEN, fmt, args);
+    va_end(args);
+}
+
+
+static int file_blob_store_open(blob_store_t store) {
+    if (!store->target || !store->target[0]) {
+        blob_store_error(store, "The file blob store needs a directory (file:DIR)");
+        return EINVAL;
+    }
+    if (mkdir(store->target, 0755) != 0 && errno != EEXIST) {
+        blob_store_error(store, "Could not create directory %s: %s", store->target, strerror(errno));
+        return EIO;
+    }
+    return 0;
+}
+
+
+static int file_blob_store_put(blob_store_t store, const char *name, const void *data, size_t len) {
+    char *path = file_blob_path(store, name, "");
+    struct stat st;
+
+    // Already stored, e.g. before a restart
+    if (stat(path, &st) == 0 && st.st_size == len) {
+        free(path);
+        return 0;
+    }
+
+    char *dir = strdup(path);
+    *strrchr(dir, '/') = '\0';
+    if (mkdir(dir, 0755) == 0) {
+        file_blob_sync_dir(store->target);
+    } else if (errno != EEXIST) {
+        blob_store_error(store, "Could not create directory %s: %s", dir, strerror(errno));
+        free(dir);
+        free(path);
+        return EIO;
+    }
+
+    char *tmp_path = file_blob_path(store, name, ".tmp");
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int err = fd < 0 ? EIO : 0;
+
+    for (size_t written = 0; !err && written < len; ) {
+        ssize_t n = write(fd, (const char *) data + written, len - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) err = EIO;
+        else written += n;
+    }
+    if (!err && fsync(fd) != 0) err = EIO;
+    if (fd >= 0 && close(fd) != 0) err = EIO;
+    if (!err && rename(tmp_path, path) != 0) err = EIO;
+
+    if (err) {
+        blob_store_error(store, "Could not write blob %s: %s", path, strerror(errno));
+        unlink(tmp_path);
+    } else {
+        file_blob_sync_dir(dir);
+    }
+
+    free(tmp_path);
+    free(dir);
+    free(path);
+    return err;
+}
+
+
+static int file_blob_store_get(blob_store_t store, const char *name, void *buf, size_t len) {
+    char *path = file_blob_path(store, name, "");
+    int fd = open(path, O_RDONLY);
+    int err = fd < 0 ? EIO : 0;
+
+    for (size_t done = 0; !err && done < len; ) {
+        ssize_t n = read(fd, (char *) buf + done, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) err = EIO;
+        else if (n == 0) err = EINVAL; // shorter than the reference says
+        else done += n;
+    }
+
+    if (err == EINVAL) {
+        blob_store_error(store, "Blob %s is shorter than %llu bytes", path, (unsigned long long) len);
+    } else if (err) {
+        blob_store_error(store, "Could not read blob %s: %s", path, strerror(errno));
+    }
+
+    if (fd >= 0) close(fd);
+    free(path);
+    return err;
+}
+
+
+/* Formats a digest in hex, as the name of its blob. */
+void blob_name(const uint8_t *digest, char *name_out) {
+    for (int i = 0; i < BLOB_DIGEST_LEN; i++) sprintf(name_out + 2 * i, "%02x", digest[i]);
+}
+
+
+/* Returns the (newly allocated) path of a blob: DIR/ab/abcdef...suffix */
+char *file_blob_path(blob_store_t store, const char *name, const char *suffix) {
+    size_t size = strlen(store->target) + BLOB_NAME_LEN + strlen(suffix) + 5;
+    char *path = malloc(size);
+    snprintf(path, size, "%s/%.2s/%s%s", store->target, name, name, suffix);
+    return path;
+}
+
+
+/* Makes sure that a newly created file or directory is still there after a crash. */
+void file_blob_sync_dir(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* Computes the SHA-256 digest of some data (FIPS 180-4). */
+void blob_sha256(const void *data, size_t len, uint8_t digest[BLOB_DIGEST_LEN]) {
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    const uint8_t *bytes = data;
+    size_t offset = 0;
+    for (; offset + 64 <= len; offset += 64) sha256_block(state, bytes + offset);
+
+    // The last block(s): the remaining data, a 1 bit, zeros, and the length in bits
+    uint8_t tail[128];
+    size_t tail_len = len - offset;
+    memset(tail, 0, sizeof(tail));
+    if (tail_len > 0) memcpy(tail, bytes + offset, tail_len);
+    tail[tail_len] = 0x80;
+    size_t tail_blocks = tail_len + 9 > 64 ? 2 : 1;
+    uint64_t bits = (uint64_t) len * 8;
+    for (int i = 0; i < 8; i++) tail[64 * tail_blocks - 1 - i] = (bits >> (8 * i)) & 0xff;
+    for (size_t i = 0; i < tail_blocks; i++) sha256_block(state, tail + 64 * i);
+
+    for (int i = 0; i < 8; i++) {
+        for (int j = 0; j < 4; j++) digest[4 * i + j] = (state[i] >> (24 - 8 * j)) & 0xff;
+    }
+}
+
+
+void sha256_block(uint32_t *state, const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[4 * i] << 24 | (uint32_t) block[4 * i + 1] << 16 |
+            (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+            sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
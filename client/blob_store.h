@@ -0,0 +1,54 @@
+#ifndef BLOB_STORE_H
+#define BLOB_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOB_STORE_ERROR_LEN 512
+#define BLOB_DIGEST_LEN 32              /* SHA-256 */
+#define BLOB_REF_MAGIC 0x42             /* First byte of a reference ('B'); Avro messages start with 0 */
+#define BLOB_REF_LEN (1 + 8 + BLOB_DIGEST_LEN)
+
+typedef struct blob_store blob_store;
+typedef blob_store *blob_store_t;
+
+/* The operations that each kind of blob store implements (see blob_store.c). Blobs
+ * are named by the hex SHA-256 digest of their contents, so putting the same blob
+ * twice is harmless. Those returning int return 0 on success, or non-zero (with
+ * store->error set) on failure. */
+typedef struct {
+    const char *name;
+    int (*open)(blob_store_t store);                            /* Called once, before anything else */
+    int (*put)(blob_store_t store, const char *name,            /* Stores a blob durably */
+            const void *data, size_t len);
+    int (*get)(blob_store_t store, const char *name,            /* Reads exactly len bytes of a blob */
+            void *buf, size_t len);
+    void (*close)(blob_store_t store);                          /* Releases everything (even if open() failed) */
+} blob_store_ops;
+
+/* Where the values of messages that are too big for Kafka are stored instead (the
+ * "claim check" pattern): the message then only carries a reference to its value. */
+struct blob_store {
+    const blob_store_ops *ops;
+    char *target;               /* Argument of the store, e.g. a directory (NULL = none) */
+    void *state;                /* Owned by the implementation */
+    uint64_t num_put;           /* Blobs stored so far */
+    uint64_t bytes_put;         /* Total size of those blobs */
+    char error[BLOB_STORE_ERROR_LEN];
+};
+
+extern const blob_store_ops file_blob_store_ops;
+
+blob_store_t blob_store_new(const blob_store_ops *ops, const char *target);
+const blob_store_ops *blob_store_lookup(const char *name);
+int blob_store_open(blob_store_t store);
+int blob_store_put(blob_store_t store, const void *data, size_t len, char *ref_out);
+bool blob_ref_check(const void *val, size_t len);
+int blob_store_resolve(blob_store_t store, const void *val, size_t len,
+        void **blob_out, size_t *blob_len);
+void blob_store_free(blob_store_t store);
+void blob_store_error(blob_store_t store, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+void blob_sha256(const void *data, size_t len, uint8_t digest[BLOB_DIGEST_LEN]);
+
+#endif /* BLOB_STORE_H */
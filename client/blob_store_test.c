@@ -0,0 +1,158 @@
+/* Tests for the blob store (blob_store.c): the SHA-256 digests that name blobs, checked
+ * against the test vectors of FIPS 180-2, and a round trip of a value through the file
+ * store, in a directory under /tmp.
+ *
+ * Run with "make test". */
+
+#include "blob_store.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOB_TEST_LEN 100000
+
+#define expect(cond, ...) { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+}
+
+typedef struct {
+    const char *message;
+    size_t repeat;              /* Number of times the message is repeated */
+    const char *digest;         /* Expected SHA-256 digest, in hex */
+} sha256_vector;
+
+/* From FIPS 180-2, appendix B */
+static const sha256_vector sha256_vectors[] = {
+    {"", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+    {"abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+    {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+        "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    {"a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"}
+};
+
+static char *progname;
+static int failures = 0;
+
+void digest_hex(const uint8_t *digest, char *hex_out);
+void test_sha256(void);
+void test_put_resolve(void);
+
+
+/* Formats a digest in hex. */
+void digest_hex(const uint8_t *digest, char *hex_out) {
+    for (int i = 0; i < BLOB_DIGEST_LEN; i++) sprintf(hex_out + 2 * i, "%02x", digest[i]);
+}
+
+
+void test_sha256() {
+    for (int i = 0; i < sizeof(sha256_vectors) / sizeof(sha256_vectors[0]); i++) {
+        const sha256_vector *vector = &sha256_vectors[i];
+        size_t message_len = strlen(vector->message);
+        size_t len = message_len * vector->repeat;
+
+        char *data = malloc(len > 0 ? len : 1);
+        for (size_t j = 0; j < vector->repeat; j++) {
+            memcpy(data + j * message_len, vector->message, message_len);
+        }
+
+        uint8_t digest[BLOB_DIGEST_LEN];
+        char hex[2 * BLOB_DIGEST_LEN + 1];
+        blob_sha256(data, len, digest);
+        digest_hex(digest, hex);
+        expect(strcmp(hex, vector->digest) == 0, "SHA-256 of \"%s\" x %zu is %s, not %s",
+                vector->message, vector->repeat, hex, vector->digest);
+        free(data);
+    }
+}
+
+
+/* Stores a value in the file store, and checks the reference, the file, reading it
+ * back, and that a damaged blob is detected. */
+void test_put_resolve() {
+    char dir[] = "/tmp/blob_store_test.XXXXXX";
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "%s: Could not create directory: %s\n", progname, strerror(errno));
+        exit(1);
+    }
+
+    char *data = malloc(BLOB_TEST_LEN);
+    for (int i = 0; i < BLOB_TEST_LEN; i++) data[i] = (char) (i * 7 + i / 251);
+
+    blob_store_t store = blob_store_new(blob_store_lookup("file"), dir);
+    expect(blob_store_open(store) == 0, "open failed: %s", store->error);
+
+    char ref[BLOB_REF_LEN];
+    expect(blob_store_put(store, data, BLOB_TEST_LEN, ref) == 0, "put failed: %s", store->error);
+    expect(blob_ref_check(ref, BLOB_REF_LEN), "not recognized as a reference");
+    expect(!blob_ref_check(data, BLOB_TEST_LEN), "value mistaken for a reference");
+
+    uint64_t size = 0;
+    for (int i = 0; i < 8; i++) size = (size << 8) | (uint8_t) ref[1 + i];
+    expect(size == BLOB_TEST_LEN, "reference has size %llu", (unsigned long long) size);
+
+    uint8_t digest[BLOB_DIGEST_LEN];
+    char name[2 * BLOB_DIGEST_LEN + 1];
+    blob_sha256(data, BLOB_TEST_LEN, digest);
+    digest_hex(digest, name);
+    expect(memcmp(ref + 9, digest, BLOB_DIGEST_LEN) == 0, "reference has the wrong digest");
+
+    char subdir[sizeof(dir) + 8], path[sizeof(subdir) + sizeof(name) + 1];
+    snprintf(subdir, sizeof(subdir), "%s/%.2s", dir, name);
+    snprintf(path, sizeof(path), "%s/%s", subdir, name);
+    expect(access(path, R_OK) == 0, "blob not stored as %s", path);
+
+    // Content-addressed, so storing it again is fine
+    expect(blob_store_put(store, data, BLOB_TEST_LEN, ref) == 0, "second put failed: %s", store->error);
+
+    void *blob;
+    size_t blob_len;
+    expect(blob_store_resolve(store, ref, BLOB_REF_LEN, &blob, &blob_len) == 0,
+            "resolve failed: %s", store->error);
+    expect(blob && blob_len == BLOB_TEST_LEN && memcmp(blob, data, BLOB_TEST_LEN) == 0,
+            "resolved blob differs from the value that was stored");
+    free(blob);
+
+    expect(blob_store_resolve(store, data, 10, &blob, &blob_len) == 0 && !blob && blob_len == 0,
+            "a plain value was resolved as a blob");
+
+    // Damage the blob
+    FILE *file = fopen(path, "r+b");
+    expect(file != NULL, "could not open %s: %s", path, strerror(errno));
+    if (file) {
+        fseek(file, BLOB_TEST_LEN / 2, SEEK_SET);
+        fputc(~data[BLOB_TEST_LEN / 2], file);
+        fclose(file);
+        expect(blob_store_resolve(store, ref, BLOB_REF_LEN, &blob, &blob_len) != 0,
+                "corrupt blob not detected");
+        expect(strstr(store->error, "corrupt") != NULL, "unexpected error message: %s", store->error);
+    }
+
+    blob_store_free(store);
+    free(data);
+    unlink(path);
+    rmdir(subdir);
+    rmdir(dir);
+}
+
+
+int main(int argc, char **argv) {
+    progname = argv[0];
+
+    test_sha256();
+    test_put_resolve();
+
+    if (failures) {
+        fprintf(stderr, "%s: %d check(s) failed\n", progname, failures);
+        return 1;
+    }
+    fprintf(stderr, "%s: all tests passed\n", progname);
+    return 0;
+}
@@ -25,21 +25,13 @@ static char *progname;
 
 void usage(void);
 void parse_options(client_context_t context, int argc, char **argv);
-static int print_begin_txn(void *context, uint64_t wal_pos, uint32_t xid);
-static int print_commit_txn(void *context, uint64_t wal_pos, uint32_t xid);
-static int print_table_schema(void *context, uint64_t wal_pos, Oid relid,
-        const char *key_schema_json, size_t key_schema_len, avro_schema_t key_schema,
-        const char *row_schema_json, size_t row_schema_len, avro_schema_t row_schema);
-static int print_insert_row(void *context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len, avro_value_t *key_val,
-        const void *new_bin, size_t new_len, avro_value_t *new_val);
-static int print_update_row(void *context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len, avro_value_t *key_val,
-        const void *old_bin, size_t old_len, avro_value_t *old_val,
-        const void *new_bin, size_t new_len, avro_value_t *new_val);
-static int print_delete_row(void *context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len, avro_value_t *key_val,
-        const void *old_bin, size_t old_len, avro_value_t *old_val);
+static int print_batch(void *context, frame_batch_t batch);
+static int print_begin_txn(client_context_t context, frame_event *event);
+static int print_commit_txn(client_context_t context, frame_event *event);
+static int print_table_schema(client_context_t context, frame_event *event);
+static int print_insert_row(client_context_t context, frame_event *event);
+static int print_update_row(client_context_t context, frame_event *event);
+static int print_delete_row(client_context_t context, frame_event *event);
 void checkpoint(void *context, uint64_t wal_pos);
 client_context_t init_client(void);
 void exit_nicely(client_context_t context);
@@ -93,45 +85,75 @@ void parse_options(client_context_t context, int argc, char **argv) {
     if (!context->conninfo || optind < argc) usage();
 }
 
-static int print_begin_txn(void *_context, uint64_t wal_pos, uint32_t xid) {
+/* Called by the frame reader with every batch of events from the stream. */
+static int print_batch(void *_context, frame_batch_t batch) {
     client_context_t context = (client_context_t) _context;
-    if (xid == 0) {
+    int err = 0;
+
+    for (int i = 0; i < batch->num_events; i++) {
+        frame_event *event = &batch->events[i];
+        switch (event->type) {
+            case PROTOCOL_MSG_BEGIN_TXN:
+                check(err, print_begin_txn(context, event));
+                break;
+            case PROTOCOL_MSG_COMMIT_TXN:
+                check(err, print_commit_txn(context, event));
+                break;
+            case PROTOCOL_MSG_TABLE_SCHEMA:
+                check(err, print_table_schema(context, event));
+                break;
+            case PROTOCOL_MSG_INSERT:
+                check(err, print_insert_row(context, event));
+                break;
+            case PROTOCOL_MSG_UPDATE:
+                check(err, print_update_row(context, event));
+                break;
+            case PROTOCOL_MSG_DELETE:
+                check(err, print_delete_row(context, event));
+                break;
+        }
+    }
+    return err;
+}
+
+static int print_begin_txn(client_context_t context, frame_event *event) {
+    uint64_t wal_pos = event->wal_pos;
+    if (event->xid == 0) {
         fprintf(stderr, "Created replication slot \"%s\", capturing consistent snapshot \"%s\".\n",
                 context->repl.slot_name, context->repl.snapshot_name);
     } else {
-        printf("begin xid=%u wal_pos=%X/%X\n", xid, (uint32) (wal_pos >> 32), (uint32) wal_pos);
+        printf("begin xid=%u wal_pos=%X/%X\n", event->xid, (uint32) (wal_pos >> 32), (uint32) wal_pos);
         checkpoint(context, wal_pos);
     }
     return 0;
 }
 
-static int print_commit_txn(void *_context, uint64_t wal_pos, uint32_t xid) {
-    client_context_t context = (client_context_t) _context;
-    if (xid == 0) {
+static int print_commit_txn(client_context_t context, frame_event *event) {
+    uint64_t wal_pos = event->wal_pos;
+    if (event->xid == 0) {
         fprintf(stderr, "Snapshot complete, streaming changes from %X/%X.\n",
                 (uint32) (wal_pos >> 32), (uint32) wal_pos);
         context->taking_snapshot = false;
     } else {
-        printf("commit xid=%u wal_pos=%X/%X\n", xid, (uint32) (wal_pos >> 32), (uint32) wal_pos);
+        printf("commit xid=%u wal_pos=%X/%X\n", event->xid, (uint32) (wal_pos >> 32), (uint32) wal_pos);
         checkpoint(context, wal_pos);
     }
     return 0;
 }
 
-static int print_table_schema(void *context, uint64_t wal_pos, Oid relid,
-        const char *key_schema_json, size_t key_schema_len, avro_schema_t key_schema,
-        const char *row_schema_json, size_t row_schema_len, avro_schema_t row_schema) {
-    printf("new schema for relid=%u\n\tkey = %.*s\n\trow = %.*s\n", relid,
-            (int) key_schema_len, key_schema_json,
-            (int) row_schema_len, row_schema_json);
+static int print_table_schema(client_context_t context, frame_event *event) {
+    printf("new schema for relid=%u\n\tkey = %.*s\n\trow = %.*s\n", event->relid,
+            (int) event->key_len, (const char *) event->key_bin,
+            (int) event->new_len, (const char *) event->new_bin);
     return 0;
 }
 
-static int print_insert_row(void *context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len, avro_value_t *key_val,
-        const void *new_bin, size_t new_len, avro_value_t *new_val) {
+static int print_insert_row(client_context_t context, frame_event *event) {
     int err = 0;
+    avro_value_t *key_val, *new_val;
     char *key_json, *new_json;
+    check(err, frame_reader_decode(context->repl.frame_reader, event, &key_val, NULL, &new_val));
+
     const char *table_name = avro_schema_name(avro_value_get_schema(new_val));
     check(err, avro_value_to_json(new_val, 1, &new_json));
 
@@ -144,16 +166,16 @@ static int print_insert_row(void *context, uint64_t wal_pos, Oid relid,
     }
 
     free(new_json);
-    if (err == 0) checkpoint(context, wal_pos);
+    if (err == 0) checkpoint(context, event->wal_pos);
     return err;
 }
 
-static int print_update_row(void *context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len, avro_value_t *key_val,
-        const void *old_bin, size_t old_len, avro_value_t *old_val,
-        const void *new_bin, size_t new_len, avro_value_t *new_val) {
+static int print_update_row(client_context_t context, frame_event *event) {
     int err = 0;
+    avro_value_t *key_val, *old_val, *new_val;
     char *key_json = NULL, *old_json = NULL, *new_json = NULL;
+    check(err, frame_reader_decode(context->repl.frame_reader, event, &key_val, &old_val, &new_val));
+
     const char *table_name = avro_schema_name(avro_value_get_schema(new_val));
     check(err, avro_value_to_json(new_val, 1, &new_json));
 
@@ -173,16 +195,16 @@ static int print_update_row(void *context, uint64_t wal_pos, Oid relid,
     if (key_json) free(key_json);
     if (old_json) free(old_json);
     free(new_json);
-    if (err == 0) checkpoint(context, wal_pos);
+    if (err == 0) checkpoint(context, event->wal_pos);
     return err;
 }
 
-static int print_delete_row(void *context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len, avro_value_t *key_val,
-        const void *old_bin, size_t old_len, avro_value_t *old_val) {
+static int print_delete_row(client_context_t context, frame_event *event) {
     int err = 0;
+    avro_value_t *key_val, *old_val;
     char *key_json = NULL, *old_json = NULL;
     const char *table_name = NULL;
+    check(err, frame_reader_decode(context->repl.frame_reader, event, &key_val, &old_val, NULL));
 
     if (key_val) check(err, avro_value_to_json(key_val, 1, &key_json));
     if (old_val) {
@@ -195,14 +217,14 @@ static int print_delete_row(void *context, uint64_t wal_pos, Oid relid,
     } else if (old_json) {
         printf("delete from %s: %s\n", table_name, old_json);
     } else if (key_json) {
-        printf("delete from relid %u: %s\n", relid, key_json);
+        printf("delete from relid %u: %s\n", event->relid, key_json);
     } else {
-        printf("delete to relid %u (?)\n", relid);
+        printf("delete to relid %u (?)\n", event->relid);
     }
 
     if (key_json) free(key_json);
     if (old_json) free(old_json);
-    if (err == 0) checkpoint(context, wal_pos);
+    if (err == 0) checkpoint(context, event->wal_pos);
     return err;
 }
 
@@ -213,12 +235,8 @@ void checkpoint(void *context, uint64_t wal_pos) {
 
 client_context_t init_client() {
     frame_reader_t frame_reader = frame_reader_new();
-    frame_reader->on_begin_txn    = print_begin_txn;
-    frame_reader->on_commit_txn   = print_commit_txn;
-    frame_reader->on_table_schema = print_table_schema;
-    frame_reader->on_insert_row   = print_insert_row;
-    frame_reader->on_update_row   = print_update_row;
-    frame_reader->on_delete_row   = print_delete_row;
+    frame_reader->on_batch  = print_batch;
+    frame_reader->batch_txn = true;
 
     client_context_t context = db_client_new();
     context->app_name = APP_NAME;
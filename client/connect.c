@@ -6,6 +6,7 @@
 #include <string.h>
 #include <sys/time.h>
 
+#include <datatype/timestamp.h>
 #include <internal/pqexpbuffer.h>
 
 /* Wrap around a function call to bail on error. */
@@ -26,9 +27,11 @@ void client_error(client_context_t context, char *fmt, ...) __attribute__ ((form
 int exec_sql(client_context_t context, char *query);
 int client_connect(client_context_t context);
 int replication_slot_exists(client_context_t context, bool *exists);
+int protocol_version_negotiate(client_context_t context);
 int snapshot_start(client_context_t context);
 int snapshot_poll(client_context_t context);
 int snapshot_tuple(client_context_t context, PGresult *res, int row_number);
+int stream_start(client_context_t context);
 
 
 /* Allocates a client_context struct. After this is done and before
@@ -37,18 +40,30 @@ int snapshot_tuple(client_context_t context, PGresult *res, int row_number);
 client_context_t db_client_new() {
     client_context_t context = malloc(sizeof(client_context));
     memset(context, 0, sizeof(client_context));
+    context->repl.feedback_interval = DEFAULT_FEEDBACK_INTERVAL_SEC * USECS_PER_SEC;
+    context->repl.feedback_min_interval = DEFAULT_FEEDBACK_MIN_INTERVAL_MS * 1000;
+    context->repl.feedback_bytes = DEFAULT_FEEDBACK_BYTES;
     return context;
 }
 
 
 /* Closes any network connections, if applicable, and frees the client_context struct. */
 void db_client_free(client_context_t context) {
+    if (context->pipeline) pipeline_free(context->pipeline);
     if (context->sql_conn) PQfinish(context->sql_conn);
     if (context->repl.conn) PQfinish(context->repl.conn);
     free(context);
 }
 
 
+/* Stops the background threads of a pipelined client, if any. This must be done
+ * before the replication connection can be used again by the calling thread, for
+ * example to drop the replication slot while shutting down. */
+void db_client_stop(client_context_t context) {
+    if (context->pipeline) pipeline_stop(context->pipeline);
+}
+
+
 /* Connects to the Postgres server (using context->conninfo for server info and
  * context->app_name as client name), and checks whether replication slot
  * context->repl.slot_name already exists. If yes, sets up the context to start
@@ -60,6 +75,7 @@ int db_client_start(client_context_t context) {
 
     check(err, client_connect(context));
     checkRepl(err, context, replication_stream_check(&context->repl));
+    check(err, protocol_version_negotiate(context));
     check(err, replication_slot_exists(context, &slot_exists));
 
     if (slot_exists) {
@@ -67,7 +83,12 @@ int db_client_start(client_context_t context) {
         context->sql_conn = NULL;
         context->taking_snapshot = false;
 
-        checkRepl(err, context, replication_stream_start(&context->repl));
+        /* Transactions that committed before resume_lsn are skipped by the server. */
+        if (context->resume_lsn > context->repl.start_lsn) {
+            context->repl.start_lsn = context->resume_lsn;
+        }
+
+        check(err, stream_start(context));
         return err;
 
     } else {
@@ -80,29 +101,37 @@ int db_client_start(client_context_t context) {
 
 
 /* Checks whether new data has arrived from the server (on either the snapshot
- * connection or the replication connection, as appropriate). If yes, it is
- * processed, and context->status is set to 1. If no data is available, this
+ * connection or the replication connection, as appropriate). If yes, all of the
+ * data that is already buffered is processed, and context->status is set to 1. If no data is available, this
  * function does not block, but returns immediately, and context->status is set
  * to 0. If the data stream has ended, context->status is set to -1. */
 int db_client_poll(client_context_t context) {
     int err = 0;
 
     if (context->sql_conn) {
-        /* To make PQgetResult() non-blocking, check PQisBusy() first */
-        if (PQisBusy(context->sql_conn)) {
-            context->status = 0;
-            return err;
+        /* To make PQgetResult() non-blocking, check PQisBusy() first. Process all the
+         * results that are already buffered, so that one wakeup handles as many rows
+         * as possible. */
+        context->status = 0;
+        while (context->sql_conn && !PQisBusy(context->sql_conn)) {
+            check(err, snapshot_poll(context));
+            context->status = 1;
         }
 
-        check(err, snapshot_poll(context));
-        context->status = 1;
-
         /* If the snapshot is finished, switch over to the replication stream */
         if (!context->sql_conn) {
-            checkRepl(err, context, replication_stream_start(&context->repl));
+            check(err, stream_start(context));
         }
         return err;
 
+    } else if (context->pipeline) {
+        err = pipeline_poll(context->pipeline);
+        if (err) {
+            strncpy(context->error, context->pipeline->error, CLIENT_CONTEXT_ERROR_LEN);
+        }
+        context->status = context->pipeline->status;
+        return err;
+
     } else {
         checkRepl(err, context, replication_stream_poll(&context->repl));
         context->status = context->repl.status;
@@ -111,27 +140,81 @@ int db_client_poll(client_context_t context) {
 }
 
 
-/* Blocks until more data is received from the server. You don't have to use
- * this if you have your own select loop. */
+/* Stores the file descriptors of the client's server connections in the fds array
+ * (which has space for max_fds entries), and returns the number of descriptors
+ * stored. If you have your own event loop, wait for these to become readable, then
+ * call db_client_consume_input() followed by db_client_poll(). The set of
+ * descriptors changes when the snapshot completes, so call this again after each
+ * db_client_poll(). */
+int db_client_get_fds(client_context_t context, int *fds, int max_fds) {
+    int num_fds = 0;
+    if (context->pipeline && context->pipeline->running) {
+        /* The replication connection belongs to the receiver thread */
+        if (num_fds < max_fds) fds[num_fds++] = pipeline_fd(context->pipeline);
+        return num_fds;
+    }
+    if (context->repl.conn && num_fds < max_fds) {
+        fds[num_fds++] = PQsocket(context->repl.conn);
+    }
+    if (context->sql_conn && num_fds < max_fds) {
+        fds[num_fds++] = PQsocket(context->sql_conn);
+    }
+    return num_fds;
+}
+
+
+/* Returns the number of milliseconds an event loop may wait for input before it
+ * needs to call db_client_poll() again, so that keepalive messages are sent to the
+ * server in time, or -1 if there is no such deadline (because a background thread
+ * takes care of keepalives). */
+int db_client_get_timeout(client_context_t context) {
+    if (context->pipeline && context->pipeline->running) return -1;
+    return replication_stream_timeout(&context->repl);
+}
+
+
+/* Reads any data that is available on the client's sockets into libpq's buffers,
+ * without blocking. Call this when one of the descriptors returned by
+ * db_client_get_fds() is readable. */
+int db_client_consume_input(client_context_t context) {
+    if (context->pipeline && context->pipeline->running) {
+        pipeline_clear_wakeup(context->pipeline);
+        return 0;
+    }
+    if (!PQconsumeInput(context->repl.conn)) {
+        client_error(context, "Could not receive replication data: %s",
+                PQerrorMessage(context->repl.conn));
+        return EIO;
+    }
+    if (context->sql_conn && !PQconsumeInput(context->sql_conn)) {
+        client_error(context, "Could not receive snapshot data: %s",
+                PQerrorMessage(context->sql_conn));
+        return EIO;
+    }
+    return 0;
+}
+
+
+/* Blocks until more data is received from the server, or until it's time to send
+ * the next keepalive. You don't have to use this if you have your own event loop;
+ * see db_client_get_fds() instead. */
 int db_client_wait(client_context_t context) {
     fd_set input_mask;
     FD_ZERO(&input_mask);
 
-    int rep_fd = PQsocket(context->repl.conn);
-    int max_fd = rep_fd;
-    FD_SET(rep_fd, &input_mask);
-
-    if (context->sql_conn) {
-        int sql_fd = PQsocket(context->sql_conn);
-        if (sql_fd > max_fd) max_fd = sql_fd;
-        FD_SET(sql_fd, &input_mask);
+    int fds[2], max_fd = -1;
+    int num_fds = db_client_get_fds(context, fds, 2);
+    for (int i = 0; i < num_fds; i++) {
+        if (fds[i] > max_fd) max_fd = fds[i];
+        FD_SET(fds[i], &input_mask);
     }
 
+    int timeout_ms = db_client_get_timeout(context);
     struct timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
 
-    int ret = select(max_fd + 1, &input_mask, NULL, NULL, &timeout);
+    int ret = select(max_fd + 1, &input_mask, NULL, NULL, timeout_ms < 0 ? NULL : &timeout);
 
     if (ret == 0 || (ret < 0 && errno == EINTR)) {
         return 0; /* timeout or signal */
@@ -142,17 +225,28 @@ int db_client_wait(client_context_t context) {
     }
 
     /* Data has arrived on the socket */
-    if (!PQconsumeInput(context->repl.conn)) {
-        client_error(context, "Could not receive replication data: %s",
-                PQerrorMessage(context->repl.conn));
-        return EIO;
+    return db_client_consume_input(context);
+}
+
+
+/* Starts streaming changes from the replication slot, and if requested, hands the
+ * stream over to a pipeline of background threads. */
+int stream_start(client_context_t context) {
+    int err = 0;
+    checkRepl(err, context, replication_stream_start(&context->repl));
+    if (!context->pipelined) return err;
+
+    context->pipeline = pipeline_new(&context->repl, context->decode_workers);
+    if (!context->pipeline) {
+        client_error(context, "Could not allocate replication pipeline");
+        return ENOMEM;
     }
-    if (context->sql_conn && !PQconsumeInput(context->sql_conn)) {
-        client_error(context, "Could not receive snapshot data: %s",
-                PQerrorMessage(context->sql_conn));
-        return EIO;
+
+    err = pipeline_start(context->pipeline);
+    if (err) {
+        strncpy(context->error, context->pipeline->error, CLIENT_CONTEXT_ERROR_LEN);
     }
-    return 0;
+    return err;
 }
 
 
@@ -288,6 +382,51 @@ done:
 }
 
 
+/* Asks the extension for the latest version of the frame protocol it can send, and
+ * sets up the replication stream and frame reader to use the latest version that
+ * both sides support. Versions of the extension before 0.2 don't have the function
+ * and only speak version 1, in which case features that need a later version
+ * (structural schemas, or whatever context->min_protocol_version was set for) are
+ * refused rather than silently dropped. */
+int protocol_version_negotiate(client_context_t context) {
+    int version = PROTOCOL_VERSION_1;
+
+    PGresult *res = PQexec(context->sql_conn, "SELECT bottledwater_protocol_version()");
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1) {
+        version = atoi(PQgetvalue(res, 0, 0));
+        if (version > PROTOCOL_VERSION) version = PROTOCOL_VERSION;
+
+    } else {
+        const char *sqlstate = PQresultErrorField(res, PG_DIAG_SQLSTATE);
+        if (!sqlstate || strcmp(sqlstate, "42883") != 0) { // 42883 == undefined_function
+            client_error(context, "Could not check the bottledwater protocol version: %s",
+                    PQerrorMessage(context->sql_conn));
+            PQclear(res);
+            return EIO;
+        }
+    }
+    PQclear(res);
+
+    if (version < PROTOCOL_VERSION_2 && context->repl.structural_schemas) {
+        client_error(context, "Structural schemas need version 0.2 of the bottledwater "
+                "extension (run ALTER EXTENSION bottledwater UPDATE)");
+        return EINVAL;
+    }
+    if (version < context->min_protocol_version) {
+        client_error(context, "Version %d of the frame protocol is needed, but the bottledwater "
+                "extension only supports version %d (run ALTER EXTENSION bottledwater UPDATE)",
+                context->min_protocol_version, version);
+        return EINVAL;
+    }
+
+    context->repl.protocol_version = version;
+    if (context->repl.frame_reader) {
+        frame_reader_set_protocol_version(context->repl.frame_reader, version);
+    }
+    return 0;
+}
+
+
 /* Initiates the non-blocking capture of a consistent snapshot of the database,
  * using the exported snapshot context->repl.snapshot_name. */
 int snapshot_start(client_context_t context) {
@@ -305,12 +444,21 @@ int snapshot_start(client_context_t context) {
     check(err, exec_sql(context, query->data));
     destroyPQExpBuffer(query);
 
-    Oid argtypes[] = { 25, 16 }; // 25 == TEXTOID, 16 == BOOLOID
-    const char *args[] = { "%", context->allow_unkeyed ? "t" : "f" };
-
-    if (!PQsendQueryParams(context->sql_conn,
-                "SELECT bottledwater_export(table_pattern := $1, allow_unkeyed := $2)",
-                2, argtypes, args, NULL, NULL, 1)) { // The final 1 requests results in binary format
+    char version[12];
+    snprintf(version, sizeof(version), "%d", context->repl.protocol_version);
+    Oid argtypes[] = { 25, 16, 16, 23 }; // 25 == TEXTOID, 16 == BOOLOID, 23 == INT4OID
+    const char *args[] = { "%", context->allow_unkeyed ? "t" : "f",
+        context->repl.structural_schemas ? "t" : "f", version };
+
+    // Extensions before 0.2 only have the first two arguments, and only speak version 1
+    const char *export_query = context->repl.protocol_version >= PROTOCOL_VERSION_2 ?
+        "SELECT bottledwater_export(table_pattern := $1, allow_unkeyed := $2, "
+                "structural_schemas := $3, protocol_version := $4)" :
+        "SELECT bottledwater_export(table_pattern := $1, allow_unkeyed := $2)";
+    int num_args = context->repl.protocol_version >= PROTOCOL_VERSION_2 ? 4 : 2;
+
+    if (!PQsendQueryParams(context->sql_conn, export_query,
+                num_args, argtypes, args, NULL, NULL, 1)) { // The final 1 requests results in binary format
         client_error(context, "Could not dispatch snapshot fetch: %s",
                 PQerrorMessage(context->sql_conn));
         return EIO;
@@ -321,12 +469,8 @@ int snapshot_start(client_context_t context) {
         return EIO;
     }
 
-    // Invoke the begin-transaction callback with xid==0 to indicate start of snapshot
-    begin_txn_cb begin_txn = context->repl.frame_reader->on_begin_txn;
-    void *cb_context = context->repl.frame_reader->cb_context;
-    if (begin_txn) {
-        check(err, begin_txn(cb_context, context->repl.start_lsn, 0));
-    }
+    // Emit a begin-transaction event with xid==0 to indicate start of snapshot
+    check(err, frame_reader_begin_txn(context->repl.frame_reader, context->repl.start_lsn, 0));
     return 0;
 }
 
@@ -342,12 +486,8 @@ int snapshot_poll(client_context_t context) {
         PQfinish(context->sql_conn);
         context->sql_conn = NULL;
 
-        // Invoke the commit callback with xid==0 to indicate end of snapshot
-        commit_txn_cb on_commit = context->repl.frame_reader->on_commit_txn;
-        void *cb_context = context->repl.frame_reader->cb_context;
-        if (on_commit) {
-            check(err, on_commit(cb_context, context->repl.start_lsn, 0));
-        }
+        // Emit a commit event with xid==0 to indicate end of snapshot
+        check(err, frame_reader_commit_txn(context->repl.frame_reader, context->repl.start_lsn, 0));
         return 0;
     }
 
@@ -1,6 +1,7 @@
 #ifndef CONNECT_H
 #define CONNECT_H
 
+#include "pipeline.h"
 #include "replication.h"
 
 #define CLIENT_CONTEXT_ERROR_LEN 512
@@ -11,6 +12,11 @@ typedef struct {
     replication_stream repl;
     bool allow_unkeyed;
     bool taking_snapshot;
+    bool pipelined;         /* Receive and decode the replication stream on background threads */
+    int decode_workers;     /* If pipelined, number of threads that parse frames in parallel */
+    pipeline_context_t pipeline;
+    XLogRecPtr resume_lsn;  /* If the slot exists, start streaming no earlier than this */
+    int min_protocol_version; /* Refuse to start if the extension can't send this version */
     int status; /* 1 = message was processed on last poll; 0 = no data available right now; -1 = stream ended */
     char error[CLIENT_CONTEXT_ERROR_LEN];
 } client_context;
@@ -19,8 +25,12 @@ typedef client_context *client_context_t;
 
 client_context_t db_client_new(void);
 void db_client_free(client_context_t context);
+void db_client_stop(client_context_t context);
 int db_client_start(client_context_t context);
 int db_client_poll(client_context_t context);
+int db_client_get_fds(client_context_t context, int *fds, int max_fds);
+int db_client_get_timeout(client_context_t context);
+int db_client_consume_input(client_context_t context);
 int db_client_wait(client_context_t context);
 
 #endif /* CONNECT_H */
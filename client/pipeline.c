@@ -0,0 +1,614 @@
+/* Runs the replication stream as a pipeline of threads, so that receiving data from
+ * Postgres, decoding frames and processing the resulting batches (e.g. sending them
+ * to Kafka) can use separate CPU cores:
+ *
+ *   - The receiver thread owns the replication connection. It reads XLogData messages
+ *     and passes the raw frames on without parsing them, and sends keepalives (even
+ *     while the downstream stages are applying backpressure).
+ *   - The decoder thread owns the frame reader. It parses frames and groups the events
+ *     into batches.
+ *   - Optionally, a pool of worker threads takes over parsing (and if the frame reader's
+ *     decode_rows option is set, decoding the rows). Frames are numbered and dealt out
+ *     round-robin; each worker has its own copy of the schemas, so frames that change
+ *     a schema are shown to every worker. The decoder thread then collects the parsed
+ *     frames from the workers in sequence, and groups them into batches as before.
+ *   - The consumer is the application's thread that calls pipeline_poll(), which
+ *     invokes the frame reader's batch callback.
+ *
+ * Stages are connected by bounded single-producer, single-consumer ring buffers, so
+ * each stage sees data in WAL order. The consumer reports progress by updating the
+ * stream's fsync_lsn (atomically), which the receiver includes in its keepalives. */
+
+#include "pipeline.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PIPELINE_FRAME_SLOTS 4096 /* Raw frames buffered between receiver and decoder */
+#define PIPELINE_BATCH_SLOTS 64   /* Batches buffered between decoder and consumer */
+#define PIPELINE_PARSED_SLOTS 64  /* Parsed frames buffered between each worker and decoder */
+#define PIPELINE_WAIT_MS 100      /* How often blocked threads check for shutdown */
+
+#define PIPELINE_ITEM_DATA 0
+#define PIPELINE_ITEM_END 1       /* The replication stream has ended */
+
+typedef struct {
+    int type;
+    uint64_t seq;                 /* Position in the stream, for reassembly after the decode pool */
+    uint64_t wal_pos;
+    char *buf;                    /* Message allocated by libpq; release with PQfreemem() */
+    char *frame;                  /* Frame data within buf */
+    int frame_len;
+    bool schema_only;             /* Copy of a frame owned by another worker; buf is from malloc() */
+} pipeline_frame;
+
+typedef struct {
+    int type;
+    uint64_t seq;
+    frame_batch_t batch;
+} pipeline_batch;
+
+void pipeline_error(pipeline_context_t pipeline, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+bool pipeline_should_stop(pipeline_context_t pipeline);
+void *pipeline_receive(void *_pipeline);
+void *pipeline_decode(void *_pipeline);
+void *pipeline_collect(void *_pipeline);
+void *pipeline_work(void *_worker);
+int pipeline_wait_socket(pipeline_context_t pipeline);
+int pipeline_dispatch(pipeline_context_t pipeline, pipeline_frame *item);
+int pipeline_push_frame(pipeline_context_t pipeline, ring_buffer_t ring, pipeline_frame *item);
+int pipeline_push_batch(pipeline_context_t pipeline, ring_buffer_t ring, pipeline_batch *item);
+void pipeline_cleanup(pipeline_context_t pipeline);
+void pipeline_wakeup_all(pipeline_context_t pipeline);
+void pipeline_release_frame(pipeline_frame *item);
+static int pipeline_on_frame(void *_pipeline, uint64_t wal_pos, char *buf, char *frame, int frame_len);
+static int pipeline_on_batch(void *_pipeline, frame_batch_t batch);
+
+
+/* Allocates a pipeline for a replication stream whose frame reader has a batch
+ * callback set, with num_workers threads in the decode pool (or none, if zero).
+ * Returns NULL if allocation fails. */
+pipeline_context_t pipeline_new(replication_stream_t stream, int num_workers) {
+    pipeline_context_t pipeline = malloc(sizeof(pipeline_context));
+    if (!pipeline) return NULL;
+    memset(pipeline, 0, sizeof(pipeline_context));
+
+    pipeline->stream = stream;
+    pipeline->reader = stream->frame_reader;
+    pipeline->frames = ring_buffer_new(PIPELINE_FRAME_SLOTS, sizeof(pipeline_frame));
+    pipeline->batches = ring_buffer_new(PIPELINE_BATCH_SLOTS, sizeof(pipeline_batch));
+    pipeline->free_batches = ring_buffer_new(PIPELINE_BATCH_SLOTS, sizeof(frame_batch_t));
+
+    if (!pipeline->frames || !pipeline->batches || !pipeline->free_batches) {
+        pipeline_free(pipeline);
+        return NULL;
+    }
+
+    if (num_workers > 0) {
+        pipeline->workers = malloc(num_workers * sizeof(pipeline_worker));
+        if (!pipeline->workers) {
+            pipeline_free(pipeline);
+            return NULL;
+        }
+        memset(pipeline->workers, 0, num_workers * sizeof(pipeline_worker));
+        pipeline->num_workers = num_workers;
+    }
+
+    for (int i = 0; i < num_workers; i++) {
+        pipeline_worker *worker = &pipeline->workers[i];
+        worker->pipeline = pipeline;
+        worker->reader = frame_reader_new();
+        frame_reader_set_protocol_version(worker->reader, stream->frame_reader->protocol_version);
+        worker->reader->batch_txn = true;
+        worker->reader->manual_flush = true;
+        worker->frames = ring_buffer_new(PIPELINE_FRAME_SLOTS / num_workers, sizeof(pipeline_frame));
+        worker->parsed = ring_buffer_new(PIPELINE_PARSED_SLOTS, sizeof(pipeline_batch));
+        worker->free_batches = ring_buffer_new(PIPELINE_PARSED_SLOTS, sizeof(frame_batch_t));
+
+        if (!worker->frames || !worker->parsed || !worker->free_batches) {
+            pipeline_free(pipeline);
+            return NULL;
+        }
+    }
+    return pipeline;
+}
+
+/* Redirects the replication stream and frame reader into the pipeline, and starts the
+ * receiver and decoder threads. From now on, the calling thread must not touch the
+ * stream's connection or frame reader until pipeline_stop() is called. */
+int pipeline_start(pipeline_context_t pipeline) {
+    frame_reader_t reader = pipeline->reader;
+    if (!reader->on_batch) {
+        pipeline_error(pipeline, "Running the stream as a pipeline requires a batch callback");
+        return EINVAL;
+    }
+
+    pipeline->on_batch = reader->on_batch;
+    pipeline->cb_context = reader->cb_context;
+    pipeline->decode_rows = reader->decode_rows;
+
+    // Batches outlive the frames they came from, so payloads must be copied
+    reader->batch_txn = true;
+    reader->on_batch = pipeline_on_batch;
+    reader->cb_context = pipeline;
+    pipeline->stream->on_frame = pipeline_on_frame;
+    pipeline->stream->on_frame_context = pipeline;
+
+    int err = 0, num_workers_started = 0;
+    bool decoder_started = false;
+
+    for (; num_workers_started < pipeline->num_workers; num_workers_started++) {
+        pipeline_worker *worker = &pipeline->workers[num_workers_started];
+        err = pthread_create(&worker->thread, NULL, pipeline_work, worker);
+        if (err) break;
+    }
+    if (!err) {
+        err = pthread_create(&pipeline->decoder, NULL,
+                pipeline->num_workers > 0 ? pipeline_collect : pipeline_decode, pipeline);
+        decoder_started = !err;
+    }
+    if (!err) {
+        err = pthread_create(&pipeline->receiver, NULL, pipeline_receive, pipeline);
+    }
+
+    if (err) {
+        __atomic_store_n(&pipeline->stopping, 1, __ATOMIC_RELEASE);
+        pipeline_wakeup_all(pipeline);
+        if (decoder_started) pthread_join(pipeline->decoder, NULL);
+        for (int i = 0; i < num_workers_started; i++) {
+            pthread_join(pipeline->workers[i].thread, NULL);
+        }
+        pipeline_cleanup(pipeline);
+        pipeline_error(pipeline, "Could not start pipeline thread: %s", strerror(err));
+        return err;
+    }
+
+    pipeline->running = true;
+    return 0;
+}
+
+/* Called by the consumer thread to process the batches that have been decoded so far,
+ * by passing them to the application's batch callback. Does not block. Sets
+ * pipeline->status to 1 if at least one batch was processed, 0 if none was ready, or
+ * -1 if the replication stream has ended. Returns an error if any stage failed. */
+int pipeline_poll(pipeline_context_t pipeline) {
+    pipeline_batch item;
+    int err = 0;
+    pipeline->status = 0;
+
+    // Bounded, so that the caller gets to do other work (e.g. polling Kafka) regularly
+    for (int i = 0; i < PIPELINE_BATCH_SLOTS && ring_buffer_pop(pipeline->batches, &item); i++) {
+        if (item.type == PIPELINE_ITEM_END) {
+            pipeline->status = -1;
+            return err;
+        }
+
+        pipeline->status = 1;
+        err = pipeline->on_batch(pipeline->cb_context, item.batch);
+
+        frame_batch_clear(item.batch);
+        if (!ring_buffer_push(pipeline->free_batches, &item.batch)) {
+            frame_batch_free(item.batch);
+        }
+
+        if (err) {
+            pipeline_error(pipeline, "Error processing batch: %s", avro_strerror());
+            return err;
+        }
+    }
+
+    if (__atomic_load_n(&pipeline->failed, __ATOMIC_ACQUIRE) == 2) return EIO;
+
+    // If there is more to do, make sure the caller's event loop doesn't go to sleep
+    if (!ring_buffer_arm_readable(pipeline->batches)) ring_buffer_wakeup(pipeline->batches);
+    return err;
+}
+
+/* File descriptor that becomes readable when pipeline_poll() has work to do. */
+int pipeline_fd(pipeline_context_t pipeline) {
+    return ring_buffer_readable_fd(pipeline->batches);
+}
+
+/* Resets the descriptor returned by pipeline_fd() after it has become readable. */
+void pipeline_clear_wakeup(pipeline_context_t pipeline) {
+    ring_buffer_clear_wakeup(pipeline->batches);
+}
+
+/* Asks the threads to exit, waits for them, and releases any data still queued
+ * between the stages. Afterwards the stream and frame reader may be used by the
+ * calling thread again. */
+void pipeline_stop(pipeline_context_t pipeline) {
+    if (!pipeline->running) return;
+
+    __atomic_store_n(&pipeline->stopping, 1, __ATOMIC_RELEASE);
+    pipeline_wakeup_all(pipeline);
+    pthread_join(pipeline->receiver, NULL);
+    pthread_join(pipeline->decoder, NULL);
+    for (int i = 0; i < pipeline->num_workers; i++) {
+        pthread_join(pipeline->workers[i].thread, NULL);
+    }
+    pipeline->running = false;
+    pipeline_cleanup(pipeline);
+}
+
+/* Stops the pipeline if necessary, and frees it. */
+void pipeline_free(pipeline_context_t pipeline) {
+    pipeline_stop(pipeline);
+    if (pipeline->frames) ring_buffer_free(pipeline->frames);
+    if (pipeline->batches) ring_buffer_free(pipeline->batches);
+    if (pipeline->free_batches) ring_buffer_free(pipeline->free_batches);
+
+    for (int i = 0; i < pipeline->num_workers; i++) {
+        pipeline_worker *worker = &pipeline->workers[i];
+        if (worker->reader) frame_reader_free(worker->reader);
+        if (worker->frames) ring_buffer_free(worker->frames);
+        if (worker->parsed) ring_buffer_free(worker->parsed);
+        if (worker->free_batches) ring_buffer_free(worker->free_batches);
+    }
+    if (pipeline->workers) free(pipeline->workers);
+    free(pipeline);
+}
+
+/* Once the threads have exited, releases whatever is left in the ring buffers, and
+ * gives the stream and frame reader back to the application. */
+void pipeline_cleanup(pipeline_context_t pipeline) {
+    pipeline_frame frame;
+    pipeline_batch item;
+    frame_batch_t batch;
+
+    while (ring_buffer_pop(pipeline->frames, &frame)) pipeline_release_frame(&frame);
+    while (ring_buffer_pop(pipeline->batches, &item)) {
+        if (item.batch) frame_batch_free(item.batch);
+    }
+    while (ring_buffer_pop(pipeline->free_batches, &batch)) frame_batch_free(batch);
+
+    for (int i = 0; i < pipeline->num_workers; i++) {
+        pipeline_worker *worker = &pipeline->workers[i];
+        while (ring_buffer_pop(worker->frames, &frame)) pipeline_release_frame(&frame);
+        while (ring_buffer_pop(worker->parsed, &item)) {
+            if (item.batch) frame_batch_free(item.batch);
+        }
+        while (ring_buffer_pop(worker->free_batches, &batch)) frame_batch_free(batch);
+        frame_batch_clear(worker->reader->batch);
+    }
+
+    pipeline->stream->on_frame = NULL;
+    pipeline->stream->on_frame_context = NULL;
+    pipeline->reader->on_batch = pipeline->on_batch;
+    pipeline->reader->cb_context = pipeline->cb_context;
+}
+
+
+/* Receiver thread: reads from the replication connection until the stream ends, the
+ * pipeline is stopped, or an error occurs. */
+void *pipeline_receive(void *_pipeline) {
+    pipeline_context_t pipeline = (pipeline_context_t) _pipeline;
+    replication_stream_t stream = pipeline->stream;
+
+    while (!pipeline_should_stop(pipeline)) {
+        if (replication_stream_poll(stream)) {
+            if (!pipeline_should_stop(pipeline)) pipeline_error(pipeline, "%s", stream->error);
+            break;
+        }
+
+        if (stream->status < 0) {
+            pipeline_frame end;
+            memset(&end, 0, sizeof(pipeline_frame));
+            end.type = PIPELINE_ITEM_END;
+            pipeline_dispatch(pipeline, &end);
+            break;
+        }
+
+        if (stream->status == 0 && pipeline_wait_socket(pipeline)) break;
+    }
+    return NULL;
+}
+
+/* Decoder thread, without a decode pool: parses frames in the order they were
+ * received. Batches are handed to the consumer by pipeline_on_batch(). */
+void *pipeline_decode(void *_pipeline) {
+    pipeline_context_t pipeline = (pipeline_context_t) _pipeline;
+    pipeline_frame item;
+
+    while (!pipeline_should_stop(pipeline)) {
+        if (!ring_buffer_pop(pipeline->frames, &item)) {
+            ring_buffer_wait_readable(pipeline->frames, PIPELINE_WAIT_MS);
+            continue;
+        }
+
+        if (item.type == PIPELINE_ITEM_END) {
+            pipeline_batch end;
+            memset(&end, 0, sizeof(pipeline_batch));
+            end.type = PIPELINE_ITEM_END;
+            if (frame_reader_flush(pipeline->reader) == 0) {
+                pipeline_push_batch(pipeline, pipeline->batches, &end);
+            }
+            break;
+        }
+
+        int err = parse_frame(pipeline->reader, item.wal_pos, item.frame, item.frame_len);
+        pipeline_release_frame(&item);
+
+        if (err) {
+            if (!pipeline_should_stop(pipeline)) {
+                pipeline_error(pipeline, "Error parsing frame data: %s", avro_strerror());
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Decoder thread, with a decode pool: collects the parsed frames from the workers in
+ * sequence order, and appends their events to the frame reader's batches. */
+void *pipeline_collect(void *_pipeline) {
+    pipeline_context_t pipeline = (pipeline_context_t) _pipeline;
+    pipeline_batch item;
+    uint64_t seq = 0;
+
+    while (!pipeline_should_stop(pipeline)) {
+        pipeline_worker *worker = &pipeline->workers[seq % pipeline->num_workers];
+        if (!ring_buffer_pop(worker->parsed, &item)) {
+            ring_buffer_wait_readable(worker->parsed, PIPELINE_WAIT_MS);
+            continue;
+        }
+
+        if (item.seq != seq) {
+            pipeline_error(pipeline, "Decode pool returned frame %llu when expecting %llu",
+                    (unsigned long long) item.seq, (unsigned long long) seq);
+            if (item.batch) frame_batch_free(item.batch);
+            break;
+        }
+        seq++;
+
+        if (item.type == PIPELINE_ITEM_END) {
+            if (frame_reader_flush(pipeline->reader) == 0) {
+                pipeline_push_batch(pipeline, pipeline->batches, &item);
+            }
+            break;
+        }
+
+        int err = frame_reader_append(pipeline->reader, item.batch);
+        frame_batch_clear(item.batch);
+        if (!ring_buffer_push(worker->free_batches, &item.batch)) {
+            frame_batch_free(item.batch);
+        }
+
+        if (err) {
+            if (!pipeline_should_stop(pipeline)) {
+                pipeline_error(pipeline, "Error processing frame data: %s", avro_strerror());
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Worker thread of the decode pool: parses each frame it is given into a batch of its
+ * own, using its own copy of the schemas. Frames marked schema_only belong to another
+ * worker; they are parsed only to keep this worker's schemas up to date. */
+void *pipeline_work(void *_worker) {
+    pipeline_worker *worker = (pipeline_worker *) _worker;
+    pipeline_context_t pipeline = worker->pipeline;
+    pipeline_frame item;
+
+    while (!pipeline_should_stop(pipeline)) {
+        if (!ring_buffer_pop(worker->frames, &item)) {
+            ring_buffer_wait_readable(worker->frames, PIPELINE_WAIT_MS);
+            continue;
+        }
+
+        pipeline_batch parsed;
+        memset(&parsed, 0, sizeof(pipeline_batch));
+        parsed.type = item.type;
+        parsed.seq = item.seq;
+
+        if (item.type == PIPELINE_ITEM_DATA) {
+            int err = parse_frame(worker->reader, item.wal_pos, item.frame, item.frame_len);
+            if (!err && !item.schema_only && pipeline->decode_rows) {
+                err = frame_reader_decode_batch(worker->reader, worker->reader->batch);
+            }
+
+            bool schema_only = item.schema_only;
+            pipeline_release_frame(&item);
+
+            if (err) {
+                if (!pipeline_should_stop(pipeline)) {
+                    pipeline_error(pipeline, "Error parsing frame data: %s", avro_strerror());
+                }
+                break;
+            }
+
+            if (schema_only) {
+                frame_batch_clear(worker->reader->batch);
+                continue;
+            }
+
+            frame_batch_t empty;
+            if (!ring_buffer_pop(worker->free_batches, &empty)) {
+                empty = frame_batch_new();
+            }
+            parsed.batch = frame_reader_swap_batch(worker->reader, empty);
+        }
+
+        if (pipeline_push_batch(pipeline, worker->parsed, &parsed)) {
+            if (parsed.batch) frame_batch_free(parsed.batch);
+            break;
+        }
+        if (parsed.type == PIPELINE_ITEM_END) break;
+    }
+    return NULL;
+}
+
+/* Waits until the replication socket is readable (or it's time to check for shutdown
+ * or send a keepalive), and reads the available data into libpq's buffer. */
+int pipeline_wait_socket(pipeline_context_t pipeline) {
+    PGconn *conn = pipeline->stream->conn;
+    struct pollfd fd;
+    fd.fd = PQsocket(conn);
+    fd.events = POLLIN;
+    fd.revents = 0;
+
+    int timeout = replication_stream_timeout(pipeline->stream);
+    if (timeout > PIPELINE_WAIT_MS) timeout = PIPELINE_WAIT_MS;
+
+    int ret = poll(&fd, 1, timeout);
+    if (ret < 0 && errno != EINTR) {
+        pipeline_error(pipeline, "poll() failed: %s", strerror(errno));
+        return errno;
+    }
+
+    if (ret > 0 && !PQconsumeInput(conn)) {
+        pipeline_error(pipeline, "Could not receive replication data: %s", PQerrorMessage(conn));
+        return EIO;
+    }
+    return 0;
+}
+
+/* Called on the receiver thread to pass a frame on to the decoder thread or, if there
+ * is a decode pool, to the next worker in turn. Frames that may change the schema
+ * are also copied to all the other workers, ahead of any later frames. Takes care of
+ * releasing the frame if it can't be passed on. */
+int pipeline_dispatch(pipeline_context_t pipeline, pipeline_frame *item) {
+    int err = 0;
+    if (pipeline->num_workers == 0) {
+        err = pipeline_push_frame(pipeline, pipeline->frames, item);
+        if (err) pipeline_release_frame(item);
+        return err;
+    }
+
+    item->seq = pipeline->next_seq++;
+    int owner = item->seq % pipeline->num_workers;
+
+    if (item->type == PIPELINE_ITEM_DATA && frame_may_contain_schema(item->frame, item->frame_len)) {
+        for (int i = 0; i < pipeline->num_workers && !err; i++) {
+            if (i == owner) continue;
+
+            pipeline_frame copy = *item;
+            copy.schema_only = true;
+            copy.buf = malloc(item->frame_len);
+            if (!copy.buf) {
+                pipeline_error(pipeline, "Out of memory copying frame for decode pool");
+                err = ENOMEM;
+                break;
+            }
+            memcpy(copy.buf, item->frame, item->frame_len);
+            copy.frame = copy.buf;
+
+            err = pipeline_push_frame(pipeline, pipeline->workers[i].frames, &copy);
+            if (err) pipeline_release_frame(&copy);
+        }
+    }
+
+    if (!err) err = pipeline_push_frame(pipeline, pipeline->workers[owner].frames, item);
+    if (err) pipeline_release_frame(item);
+    return err;
+}
+
+/* Pushes a frame into a ring on the receiver thread. If the next stage is falling
+ * behind, blocks until there is space, while keeping the replication connection
+ * alive. */
+int pipeline_push_frame(pipeline_context_t pipeline, ring_buffer_t ring, pipeline_frame *item) {
+    while (!ring_buffer_push(ring, item)) {
+        if (pipeline_should_stop(pipeline)) return ECANCELED;
+
+        int err = replication_stream_keepalive(pipeline->stream);
+        if (err) {
+            pipeline_error(pipeline, "While sending standby status update for keepalive: %s",
+                    pipeline->stream->error);
+            return err;
+        }
+
+        ring_buffer_wait_writable(ring, PIPELINE_WAIT_MS);
+    }
+    return 0;
+}
+
+/* Pushes a batch into a ring, blocking until there is space. */
+int pipeline_push_batch(pipeline_context_t pipeline, ring_buffer_t ring, pipeline_batch *item) {
+    while (!ring_buffer_push(ring, item)) {
+        if (pipeline_should_stop(pipeline)) return ECANCELED;
+        ring_buffer_wait_writable(ring, PIPELINE_WAIT_MS);
+    }
+    return 0;
+}
+
+/* Frees the message buffer of a frame that has been dealt with. */
+void pipeline_release_frame(pipeline_frame *item) {
+    if (!item->buf) return;
+    if (item->schema_only) {
+        free(item->buf);
+    } else {
+        PQfreemem(item->buf);
+    }
+    item->buf = NULL;
+}
+
+/* Called on the receiver thread for every XLogData message. Takes ownership of buf. */
+static int pipeline_on_frame(void *_pipeline, uint64_t wal_pos, char *buf, char *frame, int frame_len) {
+    pipeline_context_t pipeline = (pipeline_context_t) _pipeline;
+    pipeline_frame item;
+    memset(&item, 0, sizeof(pipeline_frame));
+    item.type = PIPELINE_ITEM_DATA;
+    item.wal_pos = wal_pos;
+    item.buf = buf;
+    item.frame = frame;
+    item.frame_len = frame_len;
+    return pipeline_dispatch(pipeline, &item);
+}
+
+/* Called on the decoder thread whenever the frame reader has a batch ready. Takes the
+ * batch away from the reader (giving it a recycled one instead), and queues it for
+ * the consumer. */
+static int pipeline_on_batch(void *_pipeline, frame_batch_t batch) {
+    pipeline_context_t pipeline = (pipeline_context_t) _pipeline;
+    frame_batch_t empty;
+    if (!ring_buffer_pop(pipeline->free_batches, &empty)) {
+        empty = frame_batch_new();
+    }
+
+    pipeline_batch item;
+    memset(&item, 0, sizeof(pipeline_batch));
+    item.type = PIPELINE_ITEM_DATA;
+    item.batch = frame_reader_swap_batch(pipeline->reader, empty);
+
+    int err = pipeline_push_batch(pipeline, pipeline->batches, &item);
+    if (err) frame_batch_free(item.batch);
+    return err;
+}
+
+/* Records the first error that occurs in any stage, and wakes up all the threads so
+ * that they shut down. */
+void pipeline_error(pipeline_context_t pipeline, char *fmt, ...) {
+    int expected = 0;
+    if (!__atomic_compare_exchange_n(&pipeline->failed, &expected, 1, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(pipeline->error, PIPELINE_ERROR_LEN, fmt, args);
+    va_end(args);
+
+    __atomic_store_n(&pipeline->failed, 2, __ATOMIC_RELEASE);
+    pipeline_wakeup_all(pipeline);
+}
+
+/* Wakes up every thread that is waiting on one of the pipeline's ring buffers. */
+void pipeline_wakeup_all(pipeline_context_t pipeline) {
+    ring_buffer_wakeup(pipeline->frames);
+    ring_buffer_wakeup(pipeline->batches);
+    for (int i = 0; i < pipeline->num_workers; i++) {
+        ring_buffer_wakeup(pipeline->workers[i].frames);
+        ring_buffer_wakeup(pipeline->workers[i].parsed);
+    }
+}
+
+bool pipeline_should_stop(pipeline_context_t pipeline) {
+    return __atomic_load_n(&pipeline->stopping, __ATOMIC_ACQUIRE) ||
+        __atomic_load_n(&pipeline->failed, __ATOMIC_ACQUIRE);
+}
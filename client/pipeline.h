@@ -0,0 +1,54 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "replication.h"
+#include "ring_buffer.h"
+
+#include <pthread.h>
+
+#define PIPELINE_ERROR_LEN 512
+
+struct pipeline_context;
+
+/* One thread of the decode pool. Frames are dealt out to the workers round-robin, so
+ * the decoder thread can restore their order by collecting from the workers in turn. */
+typedef struct {
+    struct pipeline_context *pipeline;
+    pthread_t thread;
+    frame_reader_t reader;           /* Worker's own frame reader, with its own copy of the schemas */
+    ring_buffer_t frames;            /* Raw frames, from receiver to worker */
+    ring_buffer_t parsed;            /* Parsed frames, from worker to decoder thread */
+    ring_buffer_t free_batches;      /* Batches returned by the decoder thread for reuse */
+} pipeline_worker;
+
+typedef struct pipeline_context {
+    replication_stream_t stream;     /* Replication connection; owned by the receiver thread while running */
+    frame_reader_t reader;           /* Owned by the decoder thread while running */
+    frame_batch_cb on_batch;         /* The application's batch callback, run by pipeline_poll() */
+    void *cb_context;                /* Context for on_batch */
+    ring_buffer_t frames;            /* Raw frames, from receiver to decoder */
+    ring_buffer_t batches;           /* Decoded batches, from decoder to consumer */
+    ring_buffer_t free_batches;      /* Processed batches, from consumer back to decoder for reuse */
+    int num_workers;                 /* Size of the decode pool; 0 = frames are parsed by the decoder thread */
+    pipeline_worker *workers;
+    uint64_t next_seq;               /* Sequence number of the next frame; used by receiver thread only */
+    bool decode_rows;                /* Whether row payloads are decoded before batches reach the consumer */
+    pthread_t receiver, decoder;
+    bool running;                    /* True if the threads have been started and not yet joined */
+    int stopping;                    /* Set (atomically) to ask the threads to exit */
+    int failed;                      /* 0 = ok, 1 = error being recorded, 2 = error recorded */
+    int status;                      /* 1 = batch was processed on last poll; 0 = nothing ready; -1 = stream ended */
+    char error[PIPELINE_ERROR_LEN];
+} pipeline_context;
+
+typedef pipeline_context *pipeline_context_t;
+
+pipeline_context_t pipeline_new(replication_stream_t stream, int num_workers);
+int pipeline_start(pipeline_context_t pipeline);
+int pipeline_poll(pipeline_context_t pipeline);
+int pipeline_fd(pipeline_context_t pipeline);
+void pipeline_clear_wakeup(pipeline_context_t pipeline);
+void pipeline_stop(pipeline_context_t pipeline);
+void pipeline_free(pipeline_context_t pipeline);
+
+#endif /* PIPELINE_H */
@@ -16,6 +16,11 @@
     } while (0)
 
 
+#define DEFAULT_BATCH_MAX_EVENTS 1024
+#define DEFAULT_BATCH_MAX_BYTES 1048576
+#define ARENA_BLOCK_SIZE 65536
+
+
 int process_frame(avro_value_t *frame_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_begin_txn(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_commit_txn(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
@@ -23,17 +28,34 @@ int process_frame_table_schema(avro_value_t *record_val, frame_reader_t reader,
 int process_frame_insert(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_update(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
 int process_frame_delete(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos);
-schema_list_entry *schema_list_lookup(frame_reader_t reader, int64_t relid);
+int get_optional_bytes(avro_value_t *union_val, const void **bin, size_t *len);
+frame_event *batch_append(frame_reader_t reader, int type, uint64_t wal_pos, Oid relid);
+const void *batch_slice(frame_reader_t reader, const void *bin, size_t len);
+int batch_maybe_flush(frame_reader_t reader);
+int batch_implicit_flush(frame_reader_t reader);
+int decode_part(schema_list_entry *entry, avro_value_iface_t *iface, avro_value_t *value,
+        const void *bin, size_t len);
+int read_varint(const char **buf, const char *end, int64_t *value);
+void *frame_arena_alloc(frame_batch_t batch, size_t len);
+int dispatch_event(frame_reader_t reader, frame_event *event);
 schema_list_entry *schema_list_replace(frame_reader_t reader, int64_t relid);
 schema_list_entry *schema_list_entry_new(frame_reader_t reader);
 void schema_list_entry_decrefs(schema_list_entry *entry);
+schema_list_entry *schema_list_lookup_shape(frame_reader_t reader, schema_list_entry *entry);
 int read_entirely(avro_value_t *value, avro_reader_t reader, const void *buf, size_t len);
 
 
+/* Parses one frame of the wire protocol and appends its messages to the current batch
+ * of events. Unless the reader batches whole transactions, the batch is handed to the
+ * callbacks before returning, since the events point into the frame's memory. */
 int parse_frame(frame_reader_t reader, uint64_t wal_pos, char *buf, int buflen) {
     int err = 0;
     check(err, read_entirely(&reader->frame_value, reader->avro_reader, buf, buflen));
     check(err, process_frame(&reader->frame_value, reader, wal_pos));
+
+    if (!reader->batch_txn) {
+        check(err, frame_reader_flush(reader));
+    }
     return err;
 }
 
@@ -80,15 +102,24 @@ int process_frame(avro_value_t *frame_val, frame_reader_t reader, uint64_t wal_p
 
 int process_frame_begin_txn(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
     int err = 0;
-    avro_value_t xid_val;
-    int64_t xid;
+    avro_value_t xid_val, lsn_val, time_val;
+    int64_t xid, commit_lsn = 0, commit_time = 0;
 
     check(err, avro_value_get_by_index(record_val, 0, &xid_val, NULL));
     check(err, avro_value_get_long(&xid_val, &xid));
 
-    if (reader->on_begin_txn) {
-        check(err, reader->on_begin_txn(reader->cb_context, wal_pos, (uint32_t) xid));
+    // The commit LSN and time are only sent from protocol version 2 onwards.
+    if (reader->protocol_version >= PROTOCOL_VERSION_2) {
+        check(err, avro_value_get_by_index(record_val, 1, &lsn_val, NULL));
+        check(err, avro_value_get_by_index(record_val, 2, &time_val, NULL));
+        check(err, avro_value_get_long(&lsn_val, &commit_lsn));
+        check(err, avro_value_get_long(&time_val, &commit_time));
     }
+
+    reader->xid = (uint32_t) xid;
+    frame_event *event = batch_append(reader, PROTOCOL_MSG_BEGIN_TXN, wal_pos, InvalidOid);
+    event->commit_lsn = (uint64_t) commit_lsn;
+    event->commit_time = commit_time;
     return err;
 }
 
@@ -100,21 +131,25 @@ int process_frame_commit_txn(avro_value_t *record_val, frame_reader_t reader, ui
     check(err, avro_value_get_by_index(record_val, 0, &xid_val, NULL));
     check(err, avro_value_get_long(&xid_val, &xid));
 
-    if (reader->on_commit_txn) {
-        check(err, reader->on_commit_txn(reader->cb_context, wal_pos, (uint32_t) xid));
-    }
+    reader->xid = (uint32_t) xid;
+    batch_append(reader, PROTOCOL_MSG_COMMIT_TXN, wal_pos, InvalidOid);
+    check(err, batch_implicit_flush(reader));
     return err;
 }
 
 int process_frame_table_schema(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
-    int err = 0, key_schema_present;
-    avro_value_t relid_val, hash_val, key_schema_val, row_schema_val, branch_val;
+    int err = 0, key_schema_present, namespace_present;
+    avro_value_t relid_val, hash_val, key_schema_val, row_schema_val, namespace_val, branch_val;
     int64_t relid;
     const void *hash;
-    const char *key_schema_json = NULL, *row_schema_json;
-    size_t hash_len, key_schema_len = 1, row_schema_len;
+    const char *key_schema_json = NULL, *row_schema_json, *namespace = NULL;
+    size_t hash_len, key_schema_len = 1, row_schema_len, namespace_len = 1;
     avro_schema_t key_schema = NULL, row_schema;
 
+    /* Events already in the batch must be decoded with the old schema, so hand them
+     * over before the schema list entry is replaced. */
+    check(err, batch_implicit_flush(reader));
+
     check(err, avro_value_get_by_index(record_val, 0, &relid_val,      NULL));
     check(err, avro_value_get_by_index(record_val, 1, &hash_val,       NULL));
     check(err, avro_value_get_by_index(record_val, 2, &key_schema_val, NULL));
@@ -125,37 +160,66 @@ int process_frame_table_schema(avro_value_t *record_val, frame_reader_t reader,
     check(err, avro_value_get_string(&row_schema_val, &row_schema_json, &row_schema_len));
     check(err, avro_schema_from_json_length(row_schema_json, row_schema_len - 1, &row_schema));
 
+    if (key_schema_present) {
+        check(err, avro_value_get_current_branch(&key_schema_val, &branch_val));
+        check(err, avro_value_get_string(&branch_val, &key_schema_json, &key_schema_len));
+        check(err, avro_schema_from_json_length(key_schema_json, key_schema_len - 1, &key_schema));
+    }
+
+    // The table's Postgres schema is only sent from protocol version 2 onwards.
+    if (reader->protocol_version >= PROTOCOL_VERSION_2) {
+        check(err, avro_value_get_by_index(record_val, 4, &namespace_val, NULL));
+        check(err, avro_value_get_discriminant(&namespace_val, &namespace_present));
+        if (namespace_present) {
+            check(err, avro_value_get_current_branch(&namespace_val, &branch_val));
+            check(err, avro_value_get_string(&branch_val, &namespace, &namespace_len));
+        }
+    }
+
     schema_list_entry *entry = schema_list_replace(reader, relid);
     entry->relid = relid;
     entry->hash = *((uint64_t *) hash);
     entry->row_schema = row_schema;
-    entry->row_iface = avro_generic_class_from_schema(row_schema);
+    entry->key_schema = key_schema;
+    entry->avro_reader = avro_reader_memory(NULL, 0);
+
+    // With structural schemas, many tables may have the same shape; they can share
+    // generic interfaces, but each needs values of its own.
+    schema_list_entry *same = schema_list_lookup_shape(reader, entry);
+    if (same) {
+        avro_schema_decref(row_schema);
+        entry->row_schema = avro_schema_incref(same->row_schema);
+        entry->row_iface = avro_value_iface_incref(same->row_iface);
+    } else {
+        entry->row_iface = avro_generic_class_from_schema(row_schema);
+    }
     avro_generic_value_new(entry->row_iface, &entry->row_value);
     avro_generic_value_new(entry->row_iface, &entry->old_value);
-    entry->avro_reader = avro_reader_memory(NULL, 0);
 
-    if (key_schema_present) {
-        check(err, avro_value_get_current_branch(&key_schema_val, &branch_val));
-        check(err, avro_value_get_string(&branch_val, &key_schema_json, &key_schema_len));
-        check(err, avro_schema_from_json_length(key_schema_json, key_schema_len - 1, &key_schema));
-        entry->key_schema = key_schema;
+    if (key_schema && same) {
+        avro_schema_decref(key_schema);
+        entry->key_schema = avro_schema_incref(same->key_schema);
+        entry->key_iface = avro_value_iface_incref(same->key_iface);
+    } else if (key_schema) {
         entry->key_iface = avro_generic_class_from_schema(key_schema);
+    }
+    if (entry->key_schema) {
         avro_generic_value_new(entry->key_iface, &entry->key_value);
-    } else {
-        entry->key_schema = NULL;
     }
 
-    if (reader->on_table_schema) {
-        check(err, reader->on_table_schema(reader->cb_context, wal_pos, relid,
-                    key_schema_json, key_schema_len - 1, key_schema,
-                    row_schema_json, row_schema_len - 1, row_schema));
-    }
+    frame_event *event = batch_append(reader, PROTOCOL_MSG_TABLE_SCHEMA, wal_pos, relid);
+    event->key_bin = batch_slice(reader, key_schema_json, key_schema_len - 1);
+    event->key_len = key_schema_len - 1;
+    event->new_bin = batch_slice(reader, row_schema_json, row_schema_len - 1);
+    event->new_len = row_schema_len - 1;
+    event->relnamespace = batch_slice(reader, namespace, namespace_len - 1);
+    event->relnamespace_len = namespace_len - 1;
     return err;
 }
 
 int process_frame_insert(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
-    int err = 0, key_present;
-    avro_value_t relid_val, key_val, new_val, branch_val;
+    int err = 0;
+    avro_value_t relid_val, key_val, new_val;
     int64_t relid;
     const void *key_bin = NULL, *new_bin = NULL;
     size_t key_len = 0, new_len = 0;
@@ -164,34 +228,25 @@ int process_frame_insert(avro_value_t *record_val, frame_reader_t reader, uint64
     check(err, avro_value_get_by_index(record_val, 1, &key_val,   NULL));
     check(err, avro_value_get_by_index(record_val, 2, &new_val,   NULL));
     check(err, avro_value_get_long(&relid_val, &relid));
-    check(err, avro_value_get_discriminant(&key_val, &key_present));
+    check(err, get_optional_bytes(&key_val, &key_bin, &key_len));
     check(err, avro_value_get_bytes(&new_val, &new_bin, &new_len));
 
-    schema_list_entry *entry = schema_list_lookup(reader, relid);
-    if (!entry) {
-        avro_set_error("Received insert for unknown relid %u", relid);
+    if (!schema_list_lookup(reader, relid)) {
+        avro_set_error("Received insert for unknown relid %u", (Oid) relid);
         return EINVAL;
     }
 
-    if (key_present) {
-        check(err, avro_value_get_current_branch(&key_val, &branch_val));
-        check(err, avro_value_get_bytes(&branch_val, &key_bin, &key_len));
-        check(err, read_entirely(&entry->key_value, entry->avro_reader, key_bin, key_len));
-    }
-
-    check(err, read_entirely(&entry->row_value, entry->avro_reader, new_bin, new_len));
-
-    if (reader->on_insert_row) {
-        check(err, reader->on_insert_row(reader->cb_context, wal_pos, relid,
-                    key_bin, key_len, key_bin ? &entry->key_value : NULL,
-                    new_bin, new_len, &entry->row_value));
-    }
-    return err;
+    frame_event *event = batch_append(reader, PROTOCOL_MSG_INSERT, wal_pos, relid);
+    event->key_bin = batch_slice(reader, key_bin, key_len);
+    event->key_len = key_len;
+    event->new_bin = batch_slice(reader, new_bin, new_len);
+    event->new_len = new_len;
+    return batch_maybe_flush(reader);
 }
 
 int process_frame_update(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
-    int err = 0, key_present, old_present;
-    avro_value_t relid_val, key_val, old_val, new_val, branch_val;
+    int err = 0;
+    avro_value_t relid_val, key_val, old_val, new_val;
     int64_t relid;
     const void *key_bin = NULL, *old_bin = NULL, *new_bin = NULL;
     size_t key_len = 0, old_len = 0, new_len = 0;
@@ -201,42 +256,28 @@ int process_frame_update(avro_value_t *record_val, frame_reader_t reader, uint64
     check(err, avro_value_get_by_index(record_val, 2, &old_val,   NULL));
     check(err, avro_value_get_by_index(record_val, 3, &new_val,   NULL));
     check(err, avro_value_get_long(&relid_val, &relid));
-    check(err, avro_value_get_discriminant(&key_val, &key_present));
-    check(err, avro_value_get_discriminant(&old_val, &old_present));
+    check(err, get_optional_bytes(&key_val, &key_bin, &key_len));
+    check(err, get_optional_bytes(&old_val, &old_bin, &old_len));
     check(err, avro_value_get_bytes(&new_val, &new_bin, &new_len));
 
-    schema_list_entry *entry = schema_list_lookup(reader, relid);
-    if (!entry) {
-        avro_set_error("Received update for unknown relid %u", relid);
+    if (!schema_list_lookup(reader, relid)) {
+        avro_set_error("Received update for unknown relid %u", (Oid) relid);
         return EINVAL;
     }
 
-    if (key_present) {
-        check(err, avro_value_get_current_branch(&key_val, &branch_val));
-        check(err, avro_value_get_bytes(&branch_val, &key_bin, &key_len));
-        check(err, read_entirely(&entry->key_value, entry->avro_reader, key_bin, key_len));
-    }
-
-    if (old_present) {
-        check(err, avro_value_get_current_branch(&old_val, &branch_val));
-        check(err, avro_value_get_bytes(&branch_val, &old_bin, &old_len));
-        check(err, read_entirely(&entry->old_value, entry->avro_reader, old_bin, old_len));
-    }
-
-    check(err, read_entirely(&entry->row_value, entry->avro_reader, new_bin, new_len));
-
-    if (reader->on_update_row) {
-        check(err, reader->on_update_row(reader->cb_context, wal_pos, relid,
-                    key_bin, key_len, key_bin ? &entry->key_value : NULL,
-                    old_bin, old_len, old_bin ? &entry->old_value : NULL,
-                    new_bin, new_len, &entry->row_value));
-    }
-    return err;
+    frame_event *event = batch_append(reader, PROTOCOL_MSG_UPDATE, wal_pos, relid);
+    event->key_bin = batch_slice(reader, key_bin, key_len);
+    event->key_len = key_len;
+    event->old_bin = batch_slice(reader, old_bin, old_len);
+    event->old_len = old_len;
+    event->new_bin = batch_slice(reader, new_bin, new_len);
+    event->new_len = new_len;
+    return batch_maybe_flush(reader);
 }
 
 int process_frame_delete(avro_value_t *record_val, frame_reader_t reader, uint64_t wal_pos) {
-    int err = 0, key_present, old_present;
-    avro_value_t relid_val, key_val, old_val, branch_val;
+    int err = 0;
+    avro_value_t relid_val, key_val, old_val;
     int64_t relid;
     const void *key_bin = NULL, *old_bin = NULL;
     size_t key_len = 0, old_len = 0;
@@ -245,35 +286,426 @@ int process_frame_delete(avro_value_t *record_val, frame_reader_t reader, uint64
     check(err, avro_value_get_by_index(record_val, 1, &key_val,   NULL));
     check(err, avro_value_get_by_index(record_val, 2, &old_val,   NULL));
     check(err, avro_value_get_long(&relid_val, &relid));
-    check(err, avro_value_get_discriminant(&key_val, &key_present));
-    check(err, avro_value_get_discriminant(&old_val, &old_present));
+    check(err, get_optional_bytes(&key_val, &key_bin, &key_len));
+    check(err, get_optional_bytes(&old_val, &old_bin, &old_len));
 
-    schema_list_entry *entry = schema_list_lookup(reader, relid);
+    if (!schema_list_lookup(reader, relid)) {
+        avro_set_error("Received delete for unknown relid %u", (Oid) relid);
+        return EINVAL;
+    }
+
+    frame_event *event = batch_append(reader, PROTOCOL_MSG_DELETE, wal_pos, relid);
+    event->key_bin = batch_slice(reader, key_bin, key_len);
+    event->key_len = key_len;
+    event->old_bin = batch_slice(reader, old_bin, old_len);
+    event->old_len = old_len;
+    return batch_maybe_flush(reader);
+}
+
+/* Reads a value of type ["null", "bytes"]. Leaves *bin and *len untouched if null. */
+int get_optional_bytes(avro_value_t *union_val, const void **bin, size_t *len) {
+    int err = 0, present;
+    avro_value_t branch_val;
+
+    check(err, avro_value_get_discriminant(union_val, &present));
+    if (present) {
+        check(err, avro_value_get_current_branch(union_val, &branch_val));
+        check(err, avro_value_get_bytes(&branch_val, bin, len));
+    }
+    return err;
+}
+
+
+/* Indicates the start of a transaction that does not come from the replication stream
+ * (namely, the initial snapshot, which uses xid 0). It is committed at wal_pos, and
+ * has no commit time. */
+int frame_reader_begin_txn(frame_reader_t reader, uint64_t wal_pos, uint32_t xid) {
+    int err = 0;
+    reader->xid = xid;
+    frame_event *event = batch_append(reader, PROTOCOL_MSG_BEGIN_TXN, wal_pos, InvalidOid);
+    event->commit_lsn = wal_pos;
+
+    if (!reader->batch_txn) {
+        check(err, frame_reader_flush(reader));
+    }
+    return err;
+}
+
+/* Indicates the end of a transaction started with frame_reader_begin_txn(). */
+int frame_reader_commit_txn(frame_reader_t reader, uint64_t wal_pos, uint32_t xid) {
+    reader->xid = xid;
+    batch_append(reader, PROTOCOL_MSG_COMMIT_TXN, wal_pos, InvalidOid);
+    return frame_reader_flush(reader);
+}
+
+/* Hands any buffered events to the batch callback (or, if no batch callback is set,
+ * to the per-event callbacks), and empties the batch. */
+int frame_reader_flush(frame_reader_t reader) {
+    int err = 0;
+    if (reader->batch->num_events == 0) return err;
+
+    if (reader->decode_rows) {
+        check(err, frame_reader_decode_batch(reader, reader->batch));
+    }
+
+    if (reader->on_batch) {
+        err = reader->on_batch(reader->cb_context, reader->batch);
+    } else {
+        err = frame_reader_dispatch(reader, reader->batch);
+    }
+
+    frame_batch_clear(reader->batch);
+    return err;
+}
+
+/* May be called by a batch callback to take ownership of the batch it was given,
+ * e.g. to process it on another thread. The reader continues with the empty batch
+ * passed in, and the caller becomes responsible for freeing the returned one. */
+frame_batch_t frame_reader_swap_batch(frame_reader_t reader, frame_batch_t empty) {
+    frame_batch_t batch = reader->batch;
+    reader->batch = empty;
+    return batch;
+}
+
+/* Invokes the per-event callbacks (on_begin_txn, on_insert_row etc.) for every event
+ * in a batch. This is what happens if no batch callback is set, but a batch callback
+ * may also call it to fall back to the per-event interface. */
+int frame_reader_dispatch(frame_reader_t reader, frame_batch_t batch) {
+    int err = 0;
+    for (int i = 0; i < batch->num_events; i++) {
+        check(err, dispatch_event(reader, &batch->events[i]));
+    }
+    return err;
+}
+
+int dispatch_event(frame_reader_t reader, frame_event *event) {
+    int err = 0;
+    avro_value_t *key_val, *old_val, *new_val;
+    schema_list_entry *entry;
+    void *ctx = reader->cb_context;
+
+    switch (event->type) {
+        case PROTOCOL_MSG_BEGIN_TXN:
+            if (reader->on_begin_txn) {
+                check(err, reader->on_begin_txn(ctx, event->wal_pos, event->xid));
+            }
+            break;
+
+        case PROTOCOL_MSG_COMMIT_TXN:
+            if (reader->on_commit_txn) {
+                check(err, reader->on_commit_txn(ctx, event->wal_pos, event->xid));
+            }
+            break;
+
+        case PROTOCOL_MSG_TABLE_SCHEMA:
+            entry = schema_list_lookup(reader, event->relid);
+            if (reader->on_table_schema && entry) {
+                check(err, reader->on_table_schema(ctx, event->wal_pos, event->relid,
+                            event->key_bin, event->key_len, entry->key_schema,
+                            event->new_bin, event->new_len, entry->row_schema,
+                            event->relnamespace, event->relnamespace_len));
+            }
+            break;
+
+        case PROTOCOL_MSG_INSERT:
+            if (reader->on_insert_row) {
+                check(err, frame_reader_decode(reader, event, &key_val, NULL, &new_val));
+                check(err, reader->on_insert_row(ctx, event->wal_pos, event->relid,
+                            event->key_bin, event->key_len, key_val,
+                            event->new_bin, event->new_len, new_val));
+            }
+            break;
+
+        case PROTOCOL_MSG_UPDATE:
+            if (reader->on_update_row) {
+                check(err, frame_reader_decode(reader, event, &key_val, &old_val, &new_val));
+                check(err, reader->on_update_row(ctx, event->wal_pos, event->relid,
+                            event->key_bin, event->key_len, key_val,
+                            event->old_bin, event->old_len, old_val,
+                            event->new_bin, event->new_len, new_val));
+            }
+            break;
+
+        case PROTOCOL_MSG_DELETE:
+            if (reader->on_delete_row) {
+                check(err, frame_reader_decode(reader, event, &key_val, &old_val, NULL));
+                check(err, reader->on_delete_row(ctx, event->wal_pos, event->relid,
+                            event->key_bin, event->key_len, key_val,
+                            event->old_bin, event->old_len, old_val));
+            }
+            break;
+
+        default:
+            avro_set_error("Unknown event type %d", event->type);
+            return EINVAL;
+    }
+    return err;
+}
+
+/* Decodes the Avro-encoded parts of a row event, using the current schema for the
+ * event's table. The values are owned by the frame reader, and are overwritten by the
+ * next call for the same table. Pass NULL for any part you don't need; parts that are
+ * absent from the event are returned as NULL. If the event was already decoded (see
+ * decode_rows), its own values are returned instead. */
+int frame_reader_decode(frame_reader_t reader, const frame_event *event,
+        avro_value_t **key_val, avro_value_t **old_val, avro_value_t **new_val) {
+    int err = 0;
+
+    if ((!event->key_bin || event->key_val.iface) &&
+            (!event->old_bin || event->old_val.iface) &&
+            (!event->new_bin || event->new_val.iface)) {
+        frame_event *decoded = (frame_event *) event;
+        if (key_val) *key_val = decoded->key_val.iface ? &decoded->key_val : NULL;
+        if (old_val) *old_val = decoded->old_val.iface ? &decoded->old_val : NULL;
+        if (new_val) *new_val = decoded->new_val.iface ? &decoded->new_val : NULL;
+        return err;
+    }
+
+    schema_list_entry *entry = schema_list_lookup(reader, event->relid);
     if (!entry) {
-        avro_set_error("Received delete for unknown relid %u", relid);
+        avro_set_error("Received event for unknown relid %u", event->relid);
         return EINVAL;
     }
 
-    if (key_present) {
-        check(err, avro_value_get_current_branch(&key_val, &branch_val));
-        check(err, avro_value_get_bytes(&branch_val, &key_bin, &key_len));
-        check(err, read_entirely(&entry->key_value, entry->avro_reader, key_bin, key_len));
+    if (key_val) {
+        *key_val = NULL;
+        if (event->key_bin) {
+            check(err, read_entirely(&entry->key_value, entry->avro_reader, event->key_bin, event->key_len));
+            *key_val = &entry->key_value;
+        }
+    }
+
+    if (old_val) {
+        *old_val = NULL;
+        if (event->old_bin) {
+            check(err, read_entirely(&entry->old_value, entry->avro_reader, event->old_bin, event->old_len));
+            *old_val = &entry->old_value;
+        }
+    }
+
+    if (new_val) {
+        *new_val = NULL;
+        if (event->new_bin) {
+            check(err, read_entirely(&entry->row_value, entry->avro_reader, event->new_bin, event->new_len));
+            *new_val = &entry->row_value;
+        }
+    }
+    return err;
+}
+
+/* Decodes the row payloads of all events in a batch that haven't been decoded yet,
+ * using the reader's current schemas, into new Avro values that belong to the batch.
+ * This lets the (expensive) decoding happen on a different thread from the one that
+ * consumes the batch. */
+int frame_reader_decode_batch(frame_reader_t reader, frame_batch_t batch) {
+    int err = 0;
+    schema_list_entry *entry = NULL;
+
+    for (int i = 0; i < batch->num_events; i++) {
+        frame_event *event = &batch->events[i];
+        bool pending = (event->key_bin && !event->key_val.iface) ||
+            (event->old_bin && !event->old_val.iface) ||
+            (event->new_bin && !event->new_val.iface);
+
+        if (!pending || (event->type != PROTOCOL_MSG_INSERT &&
+                    event->type != PROTOCOL_MSG_UPDATE && event->type != PROTOCOL_MSG_DELETE)) {
+            continue;
+        }
+
+        if (!entry || entry->relid != event->relid) {
+            entry = schema_list_lookup(reader, event->relid);
+            if (!entry) {
+                avro_set_error("Received event for unknown relid %u", event->relid);
+                return EINVAL;
+            }
+        }
+
+        check(err, decode_part(entry, entry->key_iface, &event->key_val, event->key_bin, event->key_len));
+        check(err, decode_part(entry, entry->row_iface, &event->old_val, event->old_bin, event->old_len));
+        check(err, decode_part(entry, entry->row_iface, &event->new_val, event->new_bin, event->new_len));
+    }
+    return err;
+}
+
+/* Decodes one part of a row event into a newly allocated value, unless the part is
+ * absent or has already been decoded. */
+int decode_part(schema_list_entry *entry, avro_value_iface_t *iface, avro_value_t *value,
+        const void *bin, size_t len) {
+    if (!bin || value->iface) return 0;
+    if (!iface) {
+        avro_set_error("Received key for relid %u, which has no key schema", entry->relid);
+        return EINVAL;
     }
 
-    if (old_present) {
-        check(err, avro_value_get_current_branch(&old_val, &branch_val));
-        check(err, avro_value_get_bytes(&branch_val, &old_bin, &old_len));
-        check(err, read_entirely(&entry->old_value, entry->avro_reader, old_bin, old_len));
+    int err = avro_generic_value_new(iface, value);
+    if (err) return err;
+
+    err = read_entirely(value, entry->avro_reader, bin, len);
+    if (err) {
+        avro_value_decref(value);
+        value->iface = NULL;
     }
+    return err;
+}
+
+/* Appends the events of another batch (typically holding one frame that was parsed
+ * by a different reader, e.g. on a worker thread) to the reader's current batch, and
+ * hands over batches at the same points as if the frames had been parsed by this
+ * reader. Payloads are copied, and ownership of any decoded values is transferred,
+ * so the other batch can be cleared and reused afterwards. Transaction IDs are taken
+ * from this reader's BEGIN/COMMIT events, since the other reader may not have seen
+ * the start of the transaction. */
+int frame_reader_append(frame_reader_t reader, frame_batch_t batch) {
+    int err = 0;
 
-    if (reader->on_delete_row) {
-        check(err, reader->on_delete_row(reader->cb_context, wal_pos, relid,
-                    key_bin, key_len, key_bin ? &entry->key_value : NULL,
-                    old_bin, old_len, old_bin ? &entry->old_value : NULL));
+    for (int i = 0; i < batch->num_events; i++) {
+        frame_event *from = &batch->events[i];
+
+        if (from->type == PROTOCOL_MSG_BEGIN_TXN || from->type == PROTOCOL_MSG_COMMIT_TXN) {
+            reader->xid = from->xid;
+        }
+        if (from->type == PROTOCOL_MSG_TABLE_SCHEMA) {
+            check(err, batch_implicit_flush(reader));
+        }
+
+        frame_event *event = batch_append(reader, from->type, from->wal_pos, from->relid);
+        event->commit_lsn = from->commit_lsn;
+        event->commit_time = from->commit_time;
+        event->key_bin = batch_slice(reader, from->key_bin, from->key_len);
+        event->key_len = from->key_len;
+        event->old_bin = batch_slice(reader, from->old_bin, from->old_len);
+        event->old_len = from->old_len;
+        event->new_bin = batch_slice(reader, from->new_bin, from->new_len);
+        event->new_len = from->new_len;
+        event->relnamespace = batch_slice(reader, from->relnamespace, from->relnamespace_len);
+        event->relnamespace_len = from->relnamespace_len;
+
+        event->key_val = from->key_val;
+        event->old_val = from->old_val;
+        event->new_val = from->new_val;
+        from->key_val.iface = from->old_val.iface = from->new_val.iface = NULL;
+
+        if (from->type == PROTOCOL_MSG_COMMIT_TXN) {
+            check(err, batch_implicit_flush(reader));
+        } else {
+            check(err, batch_maybe_flush(reader));
+        }
     }
     return err;
 }
 
+/* Takes a quick look at a binary-encoded frame (without decoding it) to determine
+ * whether its first message is a table schema. The output plugin puts a table's
+ * schema in front of the first row change that needs it, so this identifies the
+ * frames that change the schema list. Returns true if the frame can't be parsed,
+ * to be on the safe side. */
+bool frame_may_contain_schema(const char *buf, int buflen) {
+    const char *end = buf + buflen;
+    int64_t count, msg_type;
+
+    if (read_varint(&buf, end, &count)) return true;
+    if (count == 0) return false;
+    if (count < 0) {
+        int64_t block_size;
+        if (read_varint(&buf, end, &block_size)) return true;
+    }
+
+    if (read_varint(&buf, end, &msg_type)) return true;
+    return msg_type == PROTOCOL_MSG_TABLE_SCHEMA;
+}
+
+/* Reads a zigzag-encoded variable-length integer, as used by the Avro binary encoding
+ * for int and long values. Returns nonzero if the buffer ends too soon. */
+int read_varint(const char **buf, const char *end, int64_t *value) {
+    uint64_t result = 0;
+    int shift = 0;
+
+    while (*buf < end && shift < 64) {
+        uint8_t byte = (uint8_t) *(*buf)++;
+        result |= ((uint64_t) (byte & 0x7f)) << shift;
+        if (!(byte & 0x80)) {
+            *value = (int64_t) ((result >> 1) ^ -(result & 1));
+            return 0;
+        }
+        shift += 7;
+    }
+    return EINVAL;
+}
+
+/* Adds a blank event of the given type to the reader's current batch. */
+frame_event *batch_append(frame_reader_t reader, int type, uint64_t wal_pos, Oid relid) {
+    frame_batch_t batch = reader->batch;
+    if (batch->num_events == batch->capacity) {
+        batch->capacity *= 4;
+        batch->events = realloc(batch->events, batch->capacity * sizeof(frame_event));
+        check_alloc(batch->events);
+    }
+
+    frame_event *event = &batch->events[batch->num_events];
+    batch->num_events++;
+
+    memset(event, 0, sizeof(frame_event));
+    event->type = type;
+    event->xid = reader->xid;
+    event->relid = relid;
+    event->wal_pos = wal_pos;
+    return event;
+}
+
+/* Makes a byte range of the current frame part of the current batch. If the batch may
+ * outlive the frame, the bytes are copied into the batch's arena, followed by a zero
+ * byte (so that JSON strings remain null-terminated). */
+const void *batch_slice(frame_reader_t reader, const void *bin, size_t len) {
+    if (!bin) return NULL;
+    reader->batch->num_bytes += len;
+    if (!reader->batch_txn) return bin;
+
+    char *copy = frame_arena_alloc(reader->batch, len + 1);
+    memcpy(copy, bin, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/* When batching whole transactions, hands over a batch early once it gets big, so that
+ * huge transactions (and the snapshot) don't have to be buffered in their entirety. */
+int batch_maybe_flush(frame_reader_t reader) {
+    if (!reader->batch_txn) return 0;
+
+    frame_batch_t batch = reader->batch;
+    if (batch->num_events >= reader->batch_max_events ||
+            batch->num_bytes >= reader->batch_max_bytes) {
+        return batch_implicit_flush(reader);
+    }
+    return 0;
+}
+
+/* Hands over the current batch at a point where the protocol calls for it (end of
+ * transaction, schema change), unless the owner of the reader flushes manually. */
+int batch_implicit_flush(frame_reader_t reader) {
+    if (reader->manual_flush) return 0;
+    return frame_reader_flush(reader);
+}
+
+/* Allocates len bytes within a batch's arena. The memory is freed when the batch is
+ * cleared. */
+void *frame_arena_alloc(frame_batch_t batch, size_t len) {
+    frame_arena_block *block = batch->arena;
+
+    if (!block || block->size - block->used < len) {
+        size_t size = Max(len, ARENA_BLOCK_SIZE);
+        block = malloc(sizeof(frame_arena_block) + size);
+        check_alloc(block);
+        block->next = batch->arena;
+        block->size = size;
+        block->used = 0;
+        batch->arena = block;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += len;
+    return ptr;
+}
+
 frame_reader_t frame_reader_new() {
     frame_reader_t reader = malloc(sizeof(frame_reader));
     check_alloc(reader);
@@ -283,13 +715,34 @@ frame_reader_t frame_reader_new() {
     reader->schemas = malloc(reader->capacity * sizeof(void*));
     check_alloc(reader->schemas);
 
-    reader->frame_schema = schema_for_frame();
+    reader->protocol_version = PROTOCOL_VERSION_1;
+    reader->frame_schema = schema_for_frame(reader->protocol_version);
     reader->frame_iface = avro_generic_class_from_schema(reader->frame_schema);
     avro_generic_value_new(reader->frame_iface, &reader->frame_value);
     reader->avro_reader = avro_reader_memory(NULL, 0);
+
+    reader->batch_txn = false;
+    reader->batch_max_events = DEFAULT_BATCH_MAX_EVENTS;
+    reader->batch_max_bytes = DEFAULT_BATCH_MAX_BYTES;
+    reader->batch = frame_batch_new();
     return reader;
 }
 
+/* Switches the reader to another version of the frame protocol (see protocol.h). This
+ * must be called before any frames are parsed, since the frame schema is replaced. */
+void frame_reader_set_protocol_version(frame_reader_t reader, int version) {
+    if (version == reader->protocol_version) return;
+
+    avro_value_decref(&reader->frame_value);
+    avro_value_iface_decref(reader->frame_iface);
+    avro_schema_decref(reader->frame_schema);
+
+    reader->protocol_version = version;
+    reader->frame_schema = schema_for_frame(version);
+    reader->frame_iface = avro_generic_class_from_schema(reader->frame_schema);
+    avro_generic_value_new(reader->frame_iface, &reader->frame_value);
+}
+
 /* Obtains the schema list entry for the given relid, and returns null if there is
  * no matching entry. */
 schema_list_entry *schema_list_lookup(frame_reader_t reader, int64_t relid) {
@@ -330,6 +783,20 @@ schema_list_entry *schema_list_entry_new(frame_reader_t reader) {
     return new_entry;
 }
 
+/* Returns another table's schema list entry whose key and row schemas are the same
+ * as those of the given entry, or NULL if there is none. */
+schema_list_entry *schema_list_lookup_shape(frame_reader_t reader, schema_list_entry *entry) {
+    for (int i = 0; i < reader->num_schemas; i++) {
+        schema_list_entry *other = reader->schemas[i];
+        if (other == entry || other->hash != entry->hash) continue;
+        if (!avro_schema_equal(other->row_schema, entry->row_schema)) continue;
+        if ((other->key_schema == NULL) != (entry->key_schema == NULL)) continue;
+        if (entry->key_schema && !avro_schema_equal(other->key_schema, entry->key_schema)) continue;
+        return other;
+    }
+    return NULL;
+}
+
 /* Decrements the reference counts of a schema list entry. */
 void schema_list_entry_decrefs(schema_list_entry *entry) {
     avro_reader_free(entry->avro_reader);
@@ -359,9 +826,63 @@ void frame_reader_free(frame_reader_t reader) {
     }
 
     free(reader->schemas);
+    frame_batch_free(reader->batch);
     free(reader);
 }
 
+
+/* Allocates an empty batch of events. */
+frame_batch_t frame_batch_new() {
+    frame_batch_t batch = malloc(sizeof(frame_batch));
+    check_alloc(batch);
+    memset(batch, 0, sizeof(frame_batch));
+    batch->capacity = 16;
+    batch->events = malloc(batch->capacity * sizeof(frame_event));
+    check_alloc(batch->events);
+    return batch;
+}
+
+/* Removes all events from a batch, so that it can be reused. One arena block is kept
+ * around to avoid a malloc for the next batch. */
+void frame_batch_clear(frame_batch_t batch) {
+    for (int i = 0; i < batch->num_events; i++) {
+        frame_event *event = &batch->events[i];
+        if (event->key_val.iface) avro_value_decref(&event->key_val);
+        if (event->old_val.iface) avro_value_decref(&event->old_val);
+        if (event->new_val.iface) avro_value_decref(&event->new_val);
+    }
+
+    frame_arena_block *block = batch->arena;
+    if (block) {
+        frame_arena_block *next = block->next;
+        while (next) {
+            frame_arena_block *tmp = next->next;
+            free(next);
+            next = tmp;
+        }
+        block->next = NULL;
+        block->used = 0;
+    }
+
+    batch->num_events = 0;
+    batch->num_bytes = 0;
+}
+
+/* Frees a batch and all the memory it references. */
+void frame_batch_free(frame_batch_t batch) {
+    frame_batch_clear(batch);
+
+    frame_arena_block *block = batch->arena;
+    while (block) {
+        frame_arena_block *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    free(batch->events);
+    free(batch);
+}
+
 /* Parses the contents of a binary-encoded Avro buffer into an Avro value, ensuring
  * that the entire buffer is read. */
 int read_entirely(avro_value_t *value, avro_reader_t reader, const void *buf, size_t len) {
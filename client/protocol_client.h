@@ -13,10 +13,12 @@ typedef int (*commit_txn_cb)(void *, uint64_t, uint32_t);
 
 /* Parameters: context, wal_pos, relid,
  *             key_schema_json, key_schema_len, key_schema,
- *             row_schema_json, row_schema_len, row_schema */
+ *             row_schema_json, row_schema_len, row_schema,
+ *             namespace, namespace_len */
 typedef int (*table_schema_cb)(void *, uint64_t, Oid,
         const char *, size_t, avro_schema_t,
-        const char *, size_t, avro_schema_t);
+        const char *, size_t, avro_schema_t,
+        const char *, size_t);
 
 /* Parameters: context, wal_pos, relid,
  *             key_bin, key_len, key_val,
@@ -42,6 +44,59 @@ typedef int (*delete_row_cb)(void *, uint64_t, Oid,
         const void *, size_t, avro_value_t *);
 
 
+/* One message from the change stream, in compact form. Row events point at the raw
+ * Avro-encoded key, old row and new row; use frame_reader_decode() to turn them into
+ * Avro values. For PROTOCOL_MSG_TABLE_SCHEMA events, the key and new slices hold the
+ * key and row schemas as JSON strings, and relnamespace holds the name of the table's
+ * Postgres schema. Absent slices are NULL with zero length. If the reader's
+ * decode_rows option is set, the decoded values are stored in the event itself, and
+ * owned by the batch; otherwise their iface is NULL. */
+typedef struct {
+    int                 type;        /* One of the PROTOCOL_MSG_* constants */
+    uint32_t            xid;         /* Transaction to which the event belongs (0 = snapshot) */
+    Oid                 relid;       /* Table affected by a row or schema event */
+    uint64_t            wal_pos;     /* WAL position of the frame that contained the event */
+    uint64_t            commit_lsn;  /* For begin events, WAL position of the transaction's commit
+                                        (0 before protocol version 2) */
+    int64_t             commit_time; /* For begin events, commit time in microseconds since the Unix epoch
+                                        (0 before protocol version 2) */
+    const void         *key_bin;     /* Avro-encoded primary key or replica identity */
+    size_t              key_len;
+    const void         *old_bin;     /* Avro-encoded old row (in updates and deletes) */
+    size_t              old_len;
+    const void         *new_bin;     /* Avro-encoded new row (in inserts and updates) */
+    size_t              new_len;
+    const char         *relnamespace; /* For schema events, the table's Postgres schema (which,
+                                         with structural schemas, appears nowhere else; NULL
+                                         before protocol version 2) */
+    size_t              relnamespace_len;
+    avro_value_t        key_val;     /* Decoded key, if decoded ahead of time */
+    avro_value_t        old_val;     /* Decoded old row, if decoded ahead of time */
+    avro_value_t        new_val;     /* Decoded new row, if decoded ahead of time */
+} frame_event;
+
+/* Block of memory into which event payloads are copied when a batch spans more than
+ * one frame. Blocks are never moved, so pointers into them stay valid. */
+typedef struct frame_arena_block {
+    struct frame_arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} frame_arena_block;
+
+typedef struct {
+    int num_events;                  /* Number of events in the batch */
+    int capacity;                    /* Allocated size of events array */
+    frame_event *events;             /* Events in stream order */
+    size_t num_bytes;                /* Total size of the payloads referenced by the events */
+    frame_arena_block *arena;        /* Copies of payloads, if the batch spans several frames */
+} frame_batch;
+
+typedef frame_batch *frame_batch_t;
+
+/* Parameters: context, batch */
+typedef int (*frame_batch_cb)(void *, frame_batch_t);
+
 typedef struct {
     Oid                 relid;       /* Uniquely identifies a table, even when it is renamed */
     uint64_t            hash;        /* Hash of table schema, to detect changes */
@@ -63,6 +118,15 @@ typedef struct {
     insert_row_cb on_insert_row;     /* Called when a row is inserted into a relation */
     update_row_cb on_update_row;     /* Called when a row in a relation is updated */
     delete_row_cb on_delete_row;     /* Called when a row in a relation is deleted */
+    frame_batch_cb on_batch;         /* If set, called with batches of events instead of the callbacks above */
+    bool batch_txn;                  /* If true, batches span a transaction rather than a single frame */
+    int batch_max_events;            /* Hand over a transaction batch early when it has this many events */
+    size_t batch_max_bytes;          /* Hand over a transaction batch early when it has this many bytes */
+    int protocol_version;            /* Version of the frame protocol being read (see protocol.h) */
+    bool decode_rows;                /* Decode row payloads into each batch's events before handing it over */
+    bool manual_flush;               /* Only hand over batches on frame_reader_flush() (requires batch_txn) */
+    frame_batch_t batch;             /* Events received but not yet handed to the callbacks */
+    uint32_t xid;                    /* Transaction currently being received */
     int num_schemas;                 /* Number of schemas in use */
     int capacity;                    /* Allocated size of schemas array */
     schema_list_entry **schemas;     /* Array of pointers to schema_list_entry structs */
@@ -75,7 +139,23 @@ typedef struct {
 typedef frame_reader *frame_reader_t;
 
 int parse_frame(frame_reader_t reader, uint64_t wal_pos, char *buf, int buflen);
+int frame_reader_begin_txn(frame_reader_t reader, uint64_t wal_pos, uint32_t xid);
+int frame_reader_commit_txn(frame_reader_t reader, uint64_t wal_pos, uint32_t xid);
+int frame_reader_flush(frame_reader_t reader);
+frame_batch_t frame_reader_swap_batch(frame_reader_t reader, frame_batch_t empty);
+int frame_reader_dispatch(frame_reader_t reader, frame_batch_t batch);
+int frame_reader_decode(frame_reader_t reader, const frame_event *event,
+        avro_value_t **key_val, avro_value_t **old_val, avro_value_t **new_val);
+int frame_reader_decode_batch(frame_reader_t reader, frame_batch_t batch);
+int frame_reader_append(frame_reader_t reader, frame_batch_t batch);
+bool frame_may_contain_schema(const char *buf, int buflen);
+schema_list_entry *schema_list_lookup(frame_reader_t reader, int64_t relid);
 frame_reader_t frame_reader_new(void);
+void frame_reader_set_protocol_version(frame_reader_t reader, int version);
 void frame_reader_free(frame_reader_t reader);
 
+frame_batch_t frame_batch_new(void);
+void frame_batch_clear(frame_batch_t batch);
+void frame_batch_free(frame_batch_t batch);
+
 #endif /* PROTOCOL_CLIENT_H */
@@ -12,14 +12,15 @@
 #include <datatype/timestamp.h>
 #include <internal/pqexpbuffer.h>
 
-#define CHECKPOINT_INTERVAL_SEC 10
 
 // #define DEBUG 1
 
 int replication_stream_finish(replication_stream_t stream);
 int parse_keepalive_message(replication_stream_t stream, char *buf, int buflen);
-int parse_xlogdata_message(replication_stream_t stream, char *buf, int buflen);
+XLogRecPtr flushed_lsn(replication_stream_t stream);
+int parse_xlogdata_message(replication_stream_t stream, char **buf, int buflen);
 int send_checkpoint(replication_stream_t stream, int64 now);
+bool checkpoint_due(replication_stream_t stream, int64 now);
 void repl_error(replication_stream_t stream, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
 int64 current_time(void);
 void sendint64(int64 i64, char *buf);
@@ -142,12 +143,22 @@ int replication_stream_check(replication_stream_t stream) {
 
 
 /* Starts streaming logical changes from replication slot stream->slot_name,
- * starting from position stream->start_lsn. */
+ * starting from position stream->start_lsn. Plugin options are only passed when they
+ * differ from the defaults. Versions of the extension that predate an option ignore
+ * it, so the caller must only ask for a protocol version that the extension says it
+ * supports (see db_client_start), or it would silently get version 1 frames. */
 int replication_stream_start(replication_stream_t stream) {
     PQExpBuffer query = createPQExpBuffer();
     appendPQExpBuffer(query, "START_REPLICATION SLOT \"%s\" LOGICAL %X/%X",
             stream->slot_name,
             (uint32) (stream->start_lsn >> 32), (uint32) stream->start_lsn);
+    if (stream->protocol_version > PROTOCOL_VERSION_1) {
+        appendPQExpBuffer(query, " (\"protocol_version\" '%d'", stream->protocol_version);
+        if (stream->structural_schemas) {
+            appendPQExpBufferStr(query, ", \"structural_schemas\" 'true'");
+        }
+        appendPQExpBufferChar(query, ')');
+    }
 
     PGresult *res = PQexec(stream->conn, query->data);
 
@@ -178,60 +189,64 @@ int replication_stream_finish(replication_stream_t stream) {
 }
 
 
-/* Tries to read and process one message from a replication stream, using async I/O.
- * Updates stream->status to 1 if a message was processed, 0 if there is no data
- * available right now, or -1 if the stream has ended. Does not block. */
+/* Reads and processes all the messages that are currently buffered for a replication
+ * stream, using async I/O. Updates stream->status to 1 if at least one message was
+ * processed, 0 if there is no data available right now, or -1 if the stream has ended.
+ * Does not block; call PQconsumeInput() when the socket is readable to buffer more. */
 int replication_stream_poll(replication_stream_t stream) {
-    char *buf = NULL;
-    int ret = PQgetCopyData(stream->conn, &buf, 1);
     int err = 0;
-
-    if (ret < 0) {
-        if (ret == -1) {
-            err = replication_stream_finish(stream);
-        } else {
-            repl_error(stream, "Could not read from replication stream: %s",
-                    PQerrorMessage(stream->conn));
-            err = EIO;
+    stream->status = 0;
+
+    while (!err) {
+        char *buf = NULL;
+        int ret = PQgetCopyData(stream->conn, &buf, 1);
+
+        if (ret < 0) {
+            if (ret == -1) {
+                err = replication_stream_finish(stream);
+            } else {
+                repl_error(stream, "Could not read from replication stream: %s",
+                        PQerrorMessage(stream->conn));
+                err = EIO;
+            }
+            if (buf) PQfreemem(buf);
+            stream->status = ret;
+            return err;
         }
-        if (buf) PQfreemem(buf);
-        stream->status = ret;
-        return err;
-    }
 
-    if (ret > 0) {
+        if (ret == 0) break;
+
         stream->status = 1;
         switch (buf[0]) {
             case 'k':
                 err = parse_keepalive_message(stream, buf, ret);
                 break;
             case 'w':
-                err = parse_xlogdata_message(stream, buf, ret);
+                err = parse_xlogdata_message(stream, &buf, ret);
                 break;
             default:
                 repl_error(stream, "Unknown streaming message type: \"%c\"", buf[0]);
                 err = EIO;
         }
-    } else {
-        stream->status = 0;
+        if (buf) PQfreemem(buf);
     }
 
     /* Periodically let the server know up to which point we've consumed the stream. */
     if (!err) err = replication_stream_keepalive(stream);
-
-    if (buf) PQfreemem(buf);
     return err;
 }
 
 
-/* Periodically sends a checkpoint ("Standby status update") message to the server.
- * This is required, as the server will otherwise consider the client dead and
- * close the connection. */
+/* Sends a checkpoint ("Standby status update") message to the server when one is due.
+ * This is required periodically, as the server will otherwise consider the client
+ * dead and close the connection. It is also sent early when fsync_lsn has made enough
+ * progress, so that the server can release WAL (and the replication slot doesn't hold
+ * back gigabytes of it during bursts), but no more often than feedback_min_interval. */
 int replication_stream_keepalive(replication_stream_t stream) {
     int err = 0;
     if (stream->recvd_lsn != InvalidXLogRecPtr) {
         int64 now = current_time();
-        if (now - stream->last_checkpoint > CHECKPOINT_INTERVAL_SEC * USECS_PER_SEC) {
+        if (checkpoint_due(stream, now)) {
             err = send_checkpoint(stream, now);
         }
     }
@@ -239,6 +254,72 @@ int replication_stream_keepalive(replication_stream_t stream) {
 }
 
 
+/* Returns the number of milliseconds until replication_stream_keepalive() next needs
+ * to be called, so that callers can sleep for that long when there is no data. */
+int replication_stream_timeout(replication_stream_t stream) {
+    if (stream->recvd_lsn == InvalidXLogRecPtr) {
+        return stream->feedback_interval / 1000;
+    }
+
+    int64 interval = stream->feedback_interval;
+    XLogRecPtr fsync_lsn = flushed_lsn(stream);
+    if (stream->feedback_bytes > 0 && fsync_lsn >= stream->sent_fsync_lsn + stream->feedback_bytes) {
+        interval = stream->feedback_min_interval;
+    }
+
+    int64 wait = stream->last_checkpoint + interval - current_time();
+    if (wait <= 0) return 0;
+    return (wait + 999) / 1000;
+}
+
+
+/* Returns the number of bytes of WAL that the server has written, but which we have
+ * not yet confirmed as durably processed -- i.e. roughly how much WAL the replication
+ * slot is forcing the server to retain. Returns 0 if not known yet. */
+uint64 replication_stream_held_back(replication_stream_t stream) {
+    XLogRecPtr wal_end = __atomic_load_n(&stream->server_wal_end, __ATOMIC_RELAXED);
+    XLogRecPtr fsync_lsn = flushed_lsn(stream);
+    if (wal_end == InvalidXLogRecPtr || fsync_lsn == InvalidXLogRecPtr || wal_end < fsync_lsn) {
+        return 0;
+    }
+    return wal_end - fsync_lsn;
+}
+
+
+/* Decides whether a status update should be sent now: either because the periodic
+ * interval has elapsed, or because fsync_lsn has advanced by at least feedback_bytes
+ * and the minimum interval has elapsed. */
+bool checkpoint_due(replication_stream_t stream, int64 now) {
+    int64 elapsed = now - stream->last_checkpoint;
+    if (elapsed > stream->feedback_interval) return true;
+    if (stream->feedback_bytes == 0 || elapsed < stream->feedback_min_interval) return false;
+
+    XLogRecPtr fsync_lsn = flushed_lsn(stream);
+    return fsync_lsn >= stream->sent_fsync_lsn + stream->feedback_bytes;
+}
+
+
+/* Returns the position up to which we can tell the server that we have durably
+ * processed the stream. This is normally fsync_lsn, as set by the application. But
+ * the output plugin sends nothing at all for transactions without changes, so if the
+ * application has processed everything that was received before the most recent
+ * keepalive, we can report the server position from that keepalive instead: every
+ * transaction that committed before that position has been sent to us in full. That
+ * allows the slot to advance while the server is only producing empty transactions.
+ * Not used before the application has set fsync_lsn at least once, e.g. while the
+ * initial snapshot is still being sent to Kafka. */
+XLogRecPtr flushed_lsn(replication_stream_t stream) {
+    XLogRecPtr fsync_lsn = __atomic_load_n(&stream->fsync_lsn, __ATOMIC_ACQUIRE);
+    XLogRecPtr idle_lsn = __atomic_load_n(&stream->idle_lsn, __ATOMIC_ACQUIRE);
+    XLogRecPtr idle_after = __atomic_load_n(&stream->idle_after, __ATOMIC_ACQUIRE);
+
+    if (fsync_lsn != InvalidXLogRecPtr && fsync_lsn >= idle_after && idle_lsn > fsync_lsn) {
+        return idle_lsn;
+    }
+    return fsync_lsn;
+}
+
+
 /* Parses a "Primary keepalive message" received from the server. It is packed binary
  * with the following structure:
  *
@@ -265,7 +346,14 @@ int parse_keepalive_message(replication_stream_t stream, char *buf, int buflen)
      * the keepalive message indicates the latest position on the server, which might not
      * necessarily correspond to the latest position on the client. But this is what
      * pg_recvlogical does, so it's probably ok. */
-    stream->recvd_lsn = Max(wal_pos, stream->recvd_lsn);
+    __atomic_store_n(&stream->recvd_lsn, Max(wal_pos, stream->recvd_lsn), __ATOMIC_RELAXED);
+    __atomic_store_n(&stream->server_wal_end, wal_pos, __ATOMIC_RELAXED);
+
+    /* Remember that everything up to wal_pos is accounted for once the data received
+     * so far has been processed (see flushed_lsn()). Written in this order, so that a
+     * reader never pairs the new idle_lsn with an older idle_after. */
+    __atomic_store_n(&stream->idle_after, stream->data_lsn, __ATOMIC_RELEASE);
+    __atomic_store_n(&stream->idle_lsn, wal_pos, __ATOMIC_RELEASE);
 
 #ifdef DEBUG
     fprintf(stderr, "Keepalive: wal_pos %X/%X, reply_requested %d\n",
@@ -289,8 +377,9 @@ int parse_keepalive_message(replication_stream_t stream, char *buf, int buflen)
  *            since midnight on 2000-01-01.
  *   - Byte(n): The output from the logical replication output plugin.
  */
-int parse_xlogdata_message(replication_stream_t stream, char *buf, int buflen) {
-    int hdrlen = 1 + 8 + 8 + 8;
+int parse_xlogdata_message(replication_stream_t stream, char **bufp, int buflen) {
+    int hdrlen = 1 + 8 + 8 + 8, err = 0;
+    char *buf = *bufp;
 
     if (buflen < hdrlen + 1) {
         repl_error(stream, "XLogData header too small: %d bytes", buflen);
@@ -298,17 +387,27 @@ int parse_xlogdata_message(replication_stream_t stream, char *buf, int buflen) {
     }
 
     XLogRecPtr wal_pos = recvint64(&buf[1]);
+    XLogRecPtr wal_end = recvint64(&buf[1 + 8]);
+    __atomic_store_n(&stream->server_wal_end, wal_end, __ATOMIC_RELAXED);
+    stream->data_lsn = Max(wal_pos, stream->data_lsn);
 
 #ifdef DEBUG
     fprintf(stderr, "XLogData: wal_pos %X/%X\n", (uint32) (wal_pos >> 32), (uint32) wal_pos);
 #endif
 
-    int err = parse_frame(stream->frame_reader, wal_pos, buf + hdrlen, buflen - hdrlen);
-    if (err) {
-        repl_error(stream, "Error parsing frame data: %s", avro_strerror());
+    if (stream->on_frame) {
+        /* Hand the message over to be parsed elsewhere; the callback now owns it, and
+         * sets our error message if it fails. */
+        *bufp = NULL;
+        err = stream->on_frame(stream->on_frame_context, wal_pos, buf, buf + hdrlen, buflen - hdrlen);
+    } else {
+        err = parse_frame(stream->frame_reader, wal_pos, buf + hdrlen, buflen - hdrlen);
+        if (err) {
+            repl_error(stream, "Error parsing frame data: %s", avro_strerror());
+        }
     }
 
-    stream->recvd_lsn = Max(wal_pos, stream->recvd_lsn);
+    __atomic_store_n(&stream->recvd_lsn, Max(wal_pos, stream->recvd_lsn), __ATOMIC_RELAXED);
     return err;
 }
 
@@ -326,10 +425,11 @@ int parse_xlogdata_message(replication_stream_t stream, char *buf, int buflen) {
 int send_checkpoint(replication_stream_t stream, int64 now) {
     char buf[1 + 8 + 8 + 8 + 8 + 1];
     int offset = 0;
+    XLogRecPtr fsync_lsn = flushed_lsn(stream);
 
     buf[offset] = 'r';                          offset += 1;
     sendint64(stream->recvd_lsn, &buf[offset]); offset += 8;
-    sendint64(stream->fsync_lsn, &buf[offset]); offset += 8;
+    sendint64(fsync_lsn,         &buf[offset]); offset += 8;
     sendint64(InvalidXLogRecPtr, &buf[offset]); offset += 8; // only used by physical replication
     sendint64(now,               &buf[offset]); offset += 8;
     buf[offset] = 0;                            offset += 1;
@@ -343,10 +443,11 @@ int send_checkpoint(replication_stream_t stream, int64 now) {
 #ifdef DEBUG
     fprintf(stderr, "Checkpoint: recvd_lsn %X/%X, fsync_lsn %X/%X\n",
             (uint32) (stream->recvd_lsn >> 32), (uint32) stream->recvd_lsn,
-            (uint32) (stream->fsync_lsn >> 32), (uint32) stream->fsync_lsn);
+            (uint32) (fsync_lsn >> 32), (uint32) fsync_lsn);
 #endif
 
     stream->last_checkpoint = now;
+    stream->sent_fsync_lsn = fsync_lsn;
     return 0;
 }
 
@@ -9,14 +9,35 @@
 
 #define REPLICATION_STREAM_ERROR_LEN 512
 
+#define DEFAULT_FEEDBACK_INTERVAL_SEC 10
+#define DEFAULT_FEEDBACK_MIN_INTERVAL_MS 100
+#define DEFAULT_FEEDBACK_BYTES (16 * 1024 * 1024)
+
+/* Parameters: context, wal_pos, buf, frame, frame_len.
+ * buf is the message as allocated by libpq, and frame points at the frame data within
+ * it. The callback takes ownership of buf, and must release it with PQfreemem(). */
+typedef int (*replication_frame_cb)(void *, uint64_t, char *, char *, int);
+
 typedef struct {
     char *slot_name, *output_plugin, *snapshot_name;
     PGconn *conn;
     XLogRecPtr start_lsn;
-    XLogRecPtr recvd_lsn;
-    XLogRecPtr fsync_lsn;
+    int protocol_version;    /* Version of the frame protocol to ask the plugin for (see protocol.h) */
+    bool structural_schemas; /* Ask the plugin to share schemas between identically shaped tables */
+    XLogRecPtr recvd_lsn; /* Written atomically, as it may be read by another thread */
+    XLogRecPtr fsync_lsn; /* Accessed atomically, as it may be set by another thread */
+    XLogRecPtr sent_fsync_lsn;  /* fsync_lsn as reported in the last status update */
+    XLogRecPtr server_wal_end;  /* End of WAL on the server, as of the last message (written atomically) */
+    XLogRecPtr data_lsn;  /* Highest WAL position of any XLogData message received */
+    XLogRecPtr idle_lsn;  /* Server position from a keepalive that followed data_lsn == idle_after */
+    XLogRecPtr idle_after;      /* Once fsync_lsn reaches this, idle_lsn may be reported as flushed */
     int64 last_checkpoint;
+    int64 feedback_interval;     /* Longest time between status updates, in microseconds */
+    int64 feedback_min_interval; /* Shortest time between status updates sent due to progress */
+    uint64 feedback_bytes;       /* Send an update as soon as fsync_lsn has advanced this far (0 = never) */
     frame_reader_t frame_reader;
+    replication_frame_cb on_frame; /* If set, frames are passed here instead of to frame_reader */
+    void *on_frame_context;
     int status; /* 1 = message was processed on last poll; 0 = no data available right now; -1 = stream ended */
     char error[REPLICATION_STREAM_ERROR_LEN];
 } replication_stream;
@@ -29,5 +50,7 @@ int replication_stream_check(replication_stream_t stream);
 int replication_stream_start(replication_stream_t stream);
 int replication_stream_poll(replication_stream_t stream);
 int replication_stream_keepalive(replication_stream_t stream);
+int replication_stream_timeout(replication_stream_t stream);
+uint64 replication_stream_held_back(replication_stream_t stream);
 
 #endif /* REPLICATION_H */
@@ -0,0 +1,190 @@
+/* Lock-free single-producer, single-consumer ring buffer, used to connect the stages
+ * of the replication pipeline. Each side keeps a cached copy of the other side's
+ * position, so that the shared counters are only read when the ring looks full (to
+ * the producer) or empty (to the consumer). A side that runs out of work can sleep on
+ * a pipe, which the other side only writes to if the sleeper has announced itself. */
+
+#include "ring_buffer.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int waiter_init(ring_waiter *waiter);
+void waiter_destroy(ring_waiter *waiter);
+void waiter_arm(ring_waiter *waiter);
+void waiter_notify(ring_waiter *waiter, bool force);
+void waiter_drain(ring_waiter *waiter);
+void waiter_sleep(ring_waiter *waiter, int timeout_ms);
+
+
+/* Allocates a ring buffer with room for at least capacity elements of elem_size bytes
+ * each. Returns NULL on failure. */
+ring_buffer_t ring_buffer_new(size_t capacity, size_t elem_size) {
+    size_t slots = 1;
+    while (slots < capacity) slots *= 2;
+
+    ring_buffer_t ring = malloc(sizeof(ring_buffer));
+    if (!ring) return NULL;
+    memset(ring, 0, sizeof(ring_buffer));
+    ring->elem_size = elem_size;
+    ring->capacity = slots;
+    ring->slots = malloc(slots * elem_size);
+    ring->readable.fds[0] = ring->readable.fds[1] = -1;
+    ring->writable.fds[0] = ring->writable.fds[1] = -1;
+
+    if (!ring->slots || waiter_init(&ring->readable) || waiter_init(&ring->writable)) {
+        ring_buffer_free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+/* Frees a ring buffer. Any elements still in it are discarded; the caller should pop
+ * them first if they own resources. */
+void ring_buffer_free(ring_buffer_t ring) {
+    waiter_destroy(&ring->readable);
+    waiter_destroy(&ring->writable);
+    if (ring->slots) free(ring->slots);
+    free(ring);
+}
+
+/* Copies an element into the ring. Returns false if the ring is full. May only be
+ * called by the producer thread. */
+bool ring_buffer_push(ring_buffer_t ring, const void *elem) {
+    size_t head = ring->head;
+
+    if (head - ring->cached_tail == ring->capacity) {
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head - ring->cached_tail == ring->capacity) return false;
+    }
+
+    memcpy(ring->slots + (head & (ring->capacity - 1)) * ring->elem_size, elem, ring->elem_size);
+
+    // Sequentially consistent, so that it is ordered before reading readable.armed
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    waiter_notify(&ring->readable, false);
+    return true;
+}
+
+/* Copies the oldest element out of the ring into elem. Returns false if the ring is
+ * empty. May only be called by the consumer thread. */
+bool ring_buffer_pop(ring_buffer_t ring, void *elem) {
+    size_t tail = ring->tail;
+
+    if (tail == ring->cached_head) {
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail == ring->cached_head) return false;
+    }
+
+    memcpy(elem, ring->slots + (tail & (ring->capacity - 1)) * ring->elem_size, ring->elem_size);
+
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+    waiter_notify(&ring->writable, false);
+    return true;
+}
+
+/* Called by the consumer before it goes to sleep on ring_buffer_readable_fd(), e.g. in
+ * its own event loop. Returns false if elements are available, in which case the
+ * consumer should pop them instead of sleeping. If it returns true, the fd becomes
+ * readable as soon as the producer pushes an element. */
+bool ring_buffer_arm_readable(ring_buffer_t ring) {
+    waiter_arm(&ring->readable);
+
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail) {
+        __atomic_store_n(&ring->readable.armed, 0, __ATOMIC_SEQ_CST);
+        return false;
+    }
+    return true;
+}
+
+/* File descriptor that becomes readable when elements arrive, after the consumer has
+ * called ring_buffer_arm_readable(). */
+int ring_buffer_readable_fd(ring_buffer_t ring) {
+    return ring->readable.fds[0];
+}
+
+/* Called by the consumer after its fd has become readable, to reset it. */
+void ring_buffer_clear_wakeup(ring_buffer_t ring) {
+    waiter_drain(&ring->readable);
+}
+
+/* Blocks the consumer until an element is available, or the timeout (in milliseconds)
+ * elapses, or ring_buffer_wakeup() is called. */
+void ring_buffer_wait_readable(ring_buffer_t ring, int timeout_ms) {
+    if (!ring_buffer_arm_readable(ring)) return;
+    waiter_sleep(&ring->readable, timeout_ms);
+}
+
+/* Blocks the producer until a slot is free, or the timeout (in milliseconds) elapses,
+ * or ring_buffer_wakeup() is called. */
+void ring_buffer_wait_writable(ring_buffer_t ring, int timeout_ms) {
+    waiter_arm(&ring->writable);
+
+    if (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) < ring->capacity) {
+        __atomic_store_n(&ring->writable.armed, 0, __ATOMIC_SEQ_CST);
+        return;
+    }
+    waiter_sleep(&ring->writable, timeout_ms);
+}
+
+/* Wakes up both sides of the ring, whether or not they are waiting, so that they can
+ * notice that the pipeline is shutting down. May be called from any thread. */
+void ring_buffer_wakeup(ring_buffer_t ring) {
+    waiter_notify(&ring->readable, true);
+    waiter_notify(&ring->writable, true);
+}
+
+
+int waiter_init(ring_waiter *waiter) {
+    waiter->armed = 0;
+    if (pipe(waiter->fds) != 0) {
+        waiter->fds[0] = waiter->fds[1] = -1;
+        return -1;
+    }
+    if (fcntl(waiter->fds[0], F_SETFL, O_NONBLOCK) != 0 ||
+            fcntl(waiter->fds[1], F_SETFL, O_NONBLOCK) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void waiter_destroy(ring_waiter *waiter) {
+    if (waiter->fds[0] >= 0) close(waiter->fds[0]);
+    if (waiter->fds[1] >= 0) close(waiter->fds[1]);
+}
+
+/* Announces that the calling thread is about to sleep. The caller must re-check the
+ * ring afterwards, since the other side may have made progress just before. */
+void waiter_arm(ring_waiter *waiter) {
+    __atomic_store_n(&waiter->armed, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Wakes up the thread sleeping on a waiter, if it is armed (or unconditionally, if
+ * force is set). Only the first notification after arming writes to the pipe. */
+void waiter_notify(ring_waiter *waiter, bool force) {
+    if (force || (__atomic_load_n(&waiter->armed, __ATOMIC_SEQ_CST) &&
+                __atomic_exchange_n(&waiter->armed, 0, __ATOMIC_SEQ_CST))) {
+        char byte = 0;
+        // If the pipe is full, the sleeper is going to wake up anyway
+        if (write(waiter->fds[1], &byte, 1) < 0) return;
+    }
+}
+
+/* Discards any pending wakeup bytes, and disarms the waiter. */
+void waiter_drain(ring_waiter *waiter) {
+    char buf[64];
+    __atomic_store_n(&waiter->armed, 0, __ATOMIC_SEQ_CST);
+    while (read(waiter->fds[0], buf, sizeof(buf)) > 0);
+}
+
+void waiter_sleep(ring_waiter *waiter, int timeout_ms) {
+    struct pollfd fd;
+    fd.fd = waiter->fds[0];
+    fd.events = POLLIN;
+    fd.revents = 0;
+    poll(&fd, 1, timeout_ms);
+    waiter_drain(waiter);
+}
@@ -0,0 +1,50 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Padding between fields written by different threads, so that they don't share a
+ * cache line. */
+#define RING_BUFFER_PADDING 64
+
+/* Lets one side of a ring buffer sleep until the other side has made progress. The
+ * sleeping side sets armed and then re-checks the ring; the other side writes a byte
+ * to the pipe if it finds armed set after updating the ring. */
+typedef struct {
+    int armed;                       /* Accessed atomically by both threads */
+    int fds[2];                      /* Non-blocking pipe: read end, write end */
+} ring_waiter;
+
+/* Bounded queue of fixed-size elements, for passing data from exactly one producer
+ * thread to exactly one consumer thread without taking any locks. Elements come out
+ * in the order they were pushed. */
+typedef struct {
+    size_t elem_size;                /* Size of one element in bytes */
+    size_t capacity;                 /* Number of slots (a power of two) */
+    char *slots;                     /* capacity * elem_size bytes */
+    ring_waiter readable;            /* The consumer waits here for elements to arrive */
+    ring_waiter writable;            /* The producer waits here for slots to free up */
+    char pad0[RING_BUFFER_PADDING];
+    size_t head;                     /* Number of elements pushed; written by producer only */
+    size_t cached_tail;              /* Producer's last view of tail */
+    char pad1[RING_BUFFER_PADDING];
+    size_t tail;                     /* Number of elements popped; written by consumer only */
+    size_t cached_head;              /* Consumer's last view of head */
+    char pad2[RING_BUFFER_PADDING];
+} ring_buffer;
+
+typedef ring_buffer *ring_buffer_t;
+
+ring_buffer_t ring_buffer_new(size_t capacity, size_t elem_size);
+void ring_buffer_free(ring_buffer_t ring);
+bool ring_buffer_push(ring_buffer_t ring, const void *elem);
+bool ring_buffer_pop(ring_buffer_t ring, void *elem);
+bool ring_buffer_arm_readable(ring_buffer_t ring);
+int ring_buffer_readable_fd(ring_buffer_t ring);
+void ring_buffer_clear_wakeup(ring_buffer_t ring);
+void ring_buffer_wait_readable(ring_buffer_t ring, int timeout_ms);
+void ring_buffer_wait_writable(ring_buffer_t ring, int timeout_ms);
+void ring_buffer_wakeup(ring_buffer_t ring);
+
+#endif /* RING_BUFFER_H */
@@ -0,0 +1,20 @@
+-- Version 0.2 adds protocol version negotiation (see protocol.h) and structural schemas.
+-- The new arguments change the functions' signatures, so the old ones are dropped.
+DROP FUNCTION bottledwater_frame_schema();
+DROP FUNCTION bottledwater_export(text, boolean);
+
+CREATE OR REPLACE FUNCTION bottledwater_protocol_version() RETURNS integer
+    AS 'bottledwater', 'bottledwater_protocol_version' LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION bottledwater_frame_schema(
+        protocol_version integer DEFAULT 1
+    ) RETURNS text
+    AS 'bottledwater', 'bottledwater_frame_schema' LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION bottledwater_export(
+        table_pattern text         DEFAULT '%',
+        allow_unkeyed boolean      DEFAULT false,
+        structural_schemas boolean DEFAULT false,
+        protocol_version integer   DEFAULT 1
+    ) RETURNS setof bytea
+    AS 'bottledwater', 'bottledwater_export' LANGUAGE C VOLATILE STRICT;
@@ -0,0 +1,21 @@
+CREATE OR REPLACE FUNCTION bottledwater_key_schema(name) RETURNS text
+    AS 'bottledwater', 'bottledwater_key_schema' LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION bottledwater_row_schema(name) RETURNS text
+    AS 'bottledwater', 'bottledwater_row_schema' LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION bottledwater_protocol_version() RETURNS integer
+    AS 'bottledwater', 'bottledwater_protocol_version' LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION bottledwater_frame_schema(
+        protocol_version integer DEFAULT 1
+    ) RETURNS text
+    AS 'bottledwater', 'bottledwater_frame_schema' LANGUAGE C VOLATILE STRICT;
+
+CREATE OR REPLACE FUNCTION bottledwater_export(
+        table_pattern text         DEFAULT '%',
+        allow_unkeyed boolean      DEFAULT false,
+        structural_schemas boolean DEFAULT false,
+        protocol_version integer   DEFAULT 1
+    ) RETURNS setof bytea
+    AS 'bottledwater', 'bottledwater_export' LANGUAGE C VOLATILE STRICT;
@@ -0,0 +1,2 @@
+-- Complain if script is sourced in psql, rather than via ALTER EXTENSION.
+\echo Use "ALTER EXTENSION bottledwater UPDATE TO '0.2'" to load this file. \quit
@@ -4,6 +4,8 @@
 #include "protocol_server.h"
 #include "oid2avro.h"
 
+#include "commands/defrem.h"
+
 static void output_avro_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt, bool is_init);
 static void output_avro_shutdown(LogicalDecodingContext *ctx);
 static void output_avro_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn);
@@ -15,8 +17,11 @@ typedef struct {
     avro_value_iface_t *frame_iface;
     avro_value_t frame_value;
     schema_cache_t schema_cache;
+    int protocol_version;
 } plugin_state_avro;
 
+bool structural_schemas_option(LogicalDecodingContext *ctx);
+int protocol_version_option(LogicalDecodingContext *ctx);
 void reset_frame(plugin_state_avro *state);
 int write_frame(LogicalDecodingContext *ctx, plugin_state_avro *state);
 
@@ -36,10 +41,51 @@ static void output_avro_startup(LogicalDecodingContext *ctx, OutputPluginOptions
     private_state(ctx) = state;
     opt->output_type = OUTPUT_PLUGIN_BINARY_OUTPUT;
 
-    state->frame_schema = schema_for_frame();
+    state->protocol_version = protocol_version_option(ctx);
+    state->frame_schema = schema_for_frame(state->protocol_version);
     state->frame_iface = avro_generic_class_from_schema(state->frame_schema);
     avro_generic_value_new(state->frame_iface, &state->frame_value);
-    state->schema_cache = schema_cache_new(ctx->context);
+    state->schema_cache = schema_cache_new(ctx->context, structural_schemas_option(ctx),
+            state->protocol_version);
+}
+
+/* Returns the value of the STRUCTURAL_SCHEMAS plugin option, which makes tables
+ * that differ only in their Postgres schema share Avro schemas (default false). */
+bool structural_schemas_option(LogicalDecodingContext *ctx) {
+    ListCell *o;
+    bool structural = false;
+
+    foreach(o, ctx->output_plugin_options) {
+        DefElem *e = (DefElem *) lfirst(o);
+        if (strcasecmp(e->defname, "STRUCTURAL_SCHEMAS") == 0) {
+            structural = defGetBoolean(e);
+        }
+    }
+    return structural;
+}
+
+/* Returns the value of the PROTOCOL_VERSION plugin option, which selects the version
+ * of the frame protocol to send (see protocol.h). Clients that predate the option
+ * don't send it, so it defaults to version 1. */
+int protocol_version_option(LogicalDecodingContext *ctx) {
+    ListCell *o;
+    int64 version = PROTOCOL_VERSION_1;
+
+    foreach(o, ctx->output_plugin_options) {
+        DefElem *e = (DefElem *) lfirst(o);
+        if (strcasecmp(e->defname, "PROTOCOL_VERSION") == 0) {
+            version = defGetInt64(e);
+        }
+    }
+
+    if (version < PROTOCOL_VERSION_1 || version > PROTOCOL_VERSION) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("protocol version " INT64_FORMAT " is not supported by this version "
+                        "of bottledwater (supported: %d to %d)",
+                        version, PROTOCOL_VERSION_1, PROTOCOL_VERSION)));
+    }
+    return (int) version;
 }
 
 static void output_avro_shutdown(LogicalDecodingContext *ctx) {
@@ -55,7 +101,7 @@ static void output_avro_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN
     plugin_state_avro *state = private_state(ctx);
     reset_frame(state);
 
-    if (update_frame_with_begin_txn(&state->frame_value, txn)) {
+    if (update_frame_with_begin_txn(&state->frame_value, txn, state->protocol_version)) {
         elog(ERROR, "output_avro_begin_txn: Avro conversion failed: %s", avro_strerror());
     }
     if (write_frame(ctx, state)) {
@@ -130,20 +130,26 @@ static void output_shutdown(LogicalDecodingContext *ctx) {
     }
 }
 
+/* BEGIN is not written until the first change of the transaction is, since many
+ * decoded transactions contain no changes we can see (e.g. they only touch unlogged
+ * tables, or only vacuum). Empty transactions produce no output at all; the client
+ * learns how far decoding has got from the walsender's keepalive messages instead. */
 static void output_begin_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn) {
     plugin_state *state = ctx->output_plugin_private;
-    MemoryContext oldctx = MemoryContextSwitchTo(state->memctx);
-
-    state->format_cb->begin_cb(ctx, txn);
-
-    MemoryContextSwitchTo(oldctx);
-    MemoryContextReset(state->memctx);
+    state->txn_started = false;
 }
 
 static void output_commit_txn(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
         XLogRecPtr commit_lsn) {
     plugin_state *state = ctx->output_plugin_private;
-    MemoryContext oldctx = MemoryContextSwitchTo(state->memctx);
+    MemoryContext oldctx;
+
+    if (!state->txn_started) {
+        return;
+    }
+    state->txn_started = false;
+
+    oldctx = MemoryContextSwitchTo(state->memctx);
 
     state->format_cb->commit_cb(ctx, txn, commit_lsn);
 
@@ -156,6 +162,11 @@ static void output_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
     plugin_state *state = ctx->output_plugin_private;
     MemoryContext oldctx = MemoryContextSwitchTo(state->memctx);
 
+    if (!state->txn_started) {
+        state->format_cb->begin_cb(ctx, txn);
+        state->txn_started = true;
+    }
+
     state->format_cb->change_cb(ctx, txn, rel, change);
 
     MemoryContextSwitchTo(oldctx);
@@ -10,6 +10,7 @@ typedef struct {
     MemoryContext memctx; /* reset after every change event, to prevent leaks */
     OutputPluginCallbacks *format_cb;
     void *format_state;
+    bool txn_started;     /* whether BEGIN has been written for the current transaction */
 } plugin_state;
 
 #define private_state(ctx) (((plugin_state *) ctx->output_plugin_private)->format_state)
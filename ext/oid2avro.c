@@ -42,15 +42,16 @@ int update_avro_with_string(avro_value_t *output_val, Oid typid, Datum pg_datum)
 
 
 /* Generates an Avro schema for the key (replica identity or primary key)
- * of a given table. Returns null if the table is unkeyed. */
-avro_schema_t schema_for_table_key(Relation rel, Form_pg_index *index_out) {
+ * of a given table. Returns null if the table is unkeyed. The structural
+ * argument is as for schema_for_table_row(). */
+avro_schema_t schema_for_table_key(Relation rel, bool structural, Form_pg_index *index_out) {
     Relation index_rel;
         avro_schema_t schema;
 
     index_rel = table_key_index(rel);
     if (!index_rel) return NULL;
 
-    schema = schema_for_table_row(index_rel);
+    schema = schema_for_table_row(index_rel, structural);
     if (index_out) {
         *index_out = index_rel->rd_index;
     }
@@ -59,8 +60,11 @@ avro_schema_t schema_for_table_key(Relation rel, Form_pg_index *index_out) {
 }
 
 
-/* Generates an Avro schema corresponding to a given table (relation). */
-avro_schema_t schema_for_table_row(Relation rel) {
+/* Generates an Avro schema corresponding to a given table (relation). If structural
+ * is true, the table's namespace (Postgres schema) is left out of the record name,
+ * so that tables with the same name and columns in different namespaces (such as
+ * one schema per tenant) have identical Avro schemas. */
+avro_schema_t schema_for_table_row(Relation rel, bool structural) {
     char *rel_namespace, *relname;
     StringInfoData namespace;
     avro_schema_t record_schema, column_schema;
@@ -70,7 +74,7 @@ avro_schema_t schema_for_table_row(Relation rel) {
     appendStringInfoString(&namespace, GENERATED_SCHEMA_NAMESPACE);
 
     /* TODO ensure that names abide by Avro's requirements */
-    rel_namespace = get_namespace_name(RelationGetNamespace(rel));
+    rel_namespace = structural ? NULL : get_namespace_name(RelationGetNamespace(rel));
     if (rel_namespace) appendStringInfo(&namespace, ".%s", rel_namespace);
 
     relname = RelationGetRelationName(rel);
@@ -9,8 +9,8 @@
 #define GENERATED_SCHEMA_NAMESPACE "com.martinkl.bottledwater.dbschema"
 #define PREDEFINED_SCHEMA_NAMESPACE "com.martinkl.bottledwater.datatypes"
 
-avro_schema_t schema_for_table_key(Relation rel, Form_pg_index *index_out);
-avro_schema_t schema_for_table_row(Relation rel);
+avro_schema_t schema_for_table_key(Relation rel, bool structural, Form_pg_index *index_out);
+avro_schema_t schema_for_table_row(Relation rel, bool structural);
 int tuple_to_avro_row(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple);
 int tuple_to_avro_key(avro_value_t *output_val, TupleDesc tupdesc, HeapTuple tuple,
         Relation rel, Form_pg_index key_index);
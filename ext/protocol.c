@@ -5,20 +5,21 @@
 #include "protocol.h"
 #include <assert.h>
 
-avro_schema_t schema_for_begin_txn(void);
+avro_schema_t schema_for_begin_txn(int version);
 avro_schema_t schema_for_commit_txn(void);
-avro_schema_t schema_for_table_schema(void);
+avro_schema_t schema_for_table_schema(int version);
 avro_schema_t schema_for_insert(void);
 avro_schema_t schema_for_update(void);
 avro_schema_t schema_for_delete(void);
 avro_schema_t nullable_schema(avro_schema_t value_schema);
 
-avro_schema_t schema_for_frame() {
+/* Returns the schema of a frame in the given version of the protocol. */
+avro_schema_t schema_for_frame(int version) {
     avro_schema_t union_schema, branch_schema, array_schema, record_schema;
     union_schema = avro_schema_union();
 
     assert(avro_schema_union_size(union_schema) == PROTOCOL_MSG_BEGIN_TXN);
-    branch_schema = schema_for_begin_txn();
+    branch_schema = schema_for_begin_txn(version);
     avro_schema_union_append(union_schema, branch_schema);
     avro_schema_decref(branch_schema);
 
@@ -28,7 +29,7 @@ avro_schema_t schema_for_frame() {
     avro_schema_decref(branch_schema);
 
     assert(avro_schema_union_size(union_schema) == PROTOCOL_MSG_TABLE_SCHEMA);
-    branch_schema = schema_for_table_schema();
+    branch_schema = schema_for_table_schema(version);
     avro_schema_union_append(union_schema, branch_schema);
     avro_schema_decref(branch_schema);
 
@@ -56,13 +57,25 @@ avro_schema_t schema_for_frame() {
     return record_schema;
 }
 
-avro_schema_t schema_for_begin_txn() {
+avro_schema_t schema_for_begin_txn(int version) {
     avro_schema_t record_schema = avro_schema_record("BeginTxn", PROTOCOL_SCHEMA_NAMESPACE);
 
     avro_schema_t field_schema = avro_schema_long();
     avro_schema_record_field_append(record_schema, "xid", field_schema);
     avro_schema_decref(field_schema);
 
+    // Logical decoding only replays a transaction once it has committed, so the begin
+    // event can already tell the client where and when the transaction committed.
+    if (version >= PROTOCOL_VERSION_2) {
+        field_schema = avro_schema_long();
+        avro_schema_record_field_append(record_schema, "commitLsn", field_schema);
+        avro_schema_decref(field_schema);
+
+        field_schema = avro_schema_long(); /* Microseconds since the Unix epoch */
+        avro_schema_record_field_append(record_schema, "commitTime", field_schema);
+        avro_schema_decref(field_schema);
+    }
+
     return record_schema;
 }
 
@@ -80,7 +93,7 @@ avro_schema_t schema_for_commit_txn() {
     return record_schema;
 }
 
-avro_schema_t schema_for_table_schema() {
+avro_schema_t schema_for_table_schema(int version) {
     avro_schema_t record_schema = avro_schema_record("TableSchema", PROTOCOL_SCHEMA_NAMESPACE);
 
     avro_schema_t field_schema = avro_schema_long();
@@ -99,6 +112,12 @@ avro_schema_t schema_for_table_schema() {
     avro_schema_record_field_append(record_schema, "rowSchema", field_schema);
     avro_schema_decref(field_schema);
 
+    if (version >= PROTOCOL_VERSION_2) {
+        field_schema = nullable_schema(avro_schema_string());
+        avro_schema_record_field_append(record_schema, "relnamespace", field_schema);
+        avro_schema_decref(field_schema);
+    }
+
     return record_schema;
 }
 
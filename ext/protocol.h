@@ -23,7 +23,15 @@
 #define PROTOCOL_MSG_UPDATE         4
 #define PROTOCOL_MSG_DELETE         5
 
+/* Versions of the frame protocol. Version 2 adds the commit LSN and commit time
+ * to BeginTxn messages, and the Postgres schema (relnamespace) to TableSchema
+ * messages. The output plugin sends version 1 unless the client asks for a
+ * later one, and the client only asks for versions that the extension installed
+ * in the database says it supports, so either side can be upgraded first. */
+#define PROTOCOL_VERSION_1          1
+#define PROTOCOL_VERSION_2          2
+#define PROTOCOL_VERSION            PROTOCOL_VERSION_2 /* Latest we speak */
 
-avro_schema_t schema_for_frame(void);
+avro_schema_t schema_for_frame(int version);
 
 #endif /* PROTOCOL_H */
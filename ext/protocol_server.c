@@ -11,19 +11,21 @@
 #include "access/heapam.h"
 #include "lib/stringinfo.h"
 #include "utils/lsyscache.h"
+#include "utils/timestamp.h"
 
 int extract_tuple_key(schema_cache_entry *entry, Relation rel, TupleDesc tupdesc, HeapTuple tuple, bytea **key_out);
-int update_frame_with_table_schema(avro_value_t *frame_val, schema_cache_entry *entry);
+int update_frame_with_table_schema(avro_value_t *frame_val, schema_cache_t cache, schema_cache_entry *entry);
 int update_frame_with_insert_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *new_bin);
 int update_frame_with_update_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *old_bin, bytea *new_bin);
 int update_frame_with_delete_raw(avro_value_t *frame_val, Oid relid, bytea *key_bin, bytea *old_bin);
 int schema_cache_lookup(schema_cache_t cache, Relation rel, schema_cache_entry **entry_out);
 schema_cache_entry *schema_cache_entry_new(schema_cache_t cache);
-void schema_cache_entry_update(schema_cache_entry *entry, Relation rel);
+void schema_cache_entry_update(schema_cache_t cache, schema_cache_entry *entry, Relation rel);
+bool schema_cache_entry_share(schema_cache_t cache, schema_cache_entry *entry);
 void schema_cache_entry_decrefs(schema_cache_entry *entry);
 uint64 fnv_hash(uint64 base, char *str, int len);
 uint64 fnv_format(uint64 base, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
-uint64 schema_hash_for_relation(Relation rel);
+uint64 schema_hash_for_relation(Relation rel, bool structural);
 void tupdesc_debug_info(StringInfo msg, TupleDesc tupdesc);
 
 /* http://www.isthe.com/chongo/tech/comp/fnv/index.html#FNV-param */
@@ -31,16 +33,29 @@ void tupdesc_debug_info(StringInfo msg, TupleDesc tupdesc);
 #define FNV_HASH_PRIME UINT64CONST(0x100000001b3)
 #define FNV_HASH_BUFSIZE 256
 
-/* Populates a wire protocol message for a "begin transaction" event. */
-int update_frame_with_begin_txn(avro_value_t *frame_val, ReorderBufferTXN *txn) {
+/* Populates a wire protocol message for a "begin transaction" event. From protocol
+ * version 2 onwards, it includes the commit LSN, which is the WAL position that the
+ * commit event will be sent with, and the commit time, converted from the Postgres
+ * epoch (2000-01-01) to the Unix epoch. */
+int update_frame_with_begin_txn(avro_value_t *frame_val, ReorderBufferTXN *txn,
+        int protocol_version) {
     int err = 0;
-    avro_value_t msg_val, union_val, record_val, xid_val;
+    avro_value_t msg_val, union_val, record_val, xid_val, lsn_val, time_val;
+    int64 commit_time = txn->commit_time +
+        (int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * USECS_PER_DAY;
 
     check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
     check(err, avro_value_append(&msg_val, &union_val, NULL));
     check(err, avro_value_set_branch(&union_val, PROTOCOL_MSG_BEGIN_TXN, &record_val));
     check(err, avro_value_get_by_index(&record_val, 0, &xid_val, NULL));
     check(err, avro_value_set_long(&xid_val, txn->xid));
+
+    if (protocol_version >= PROTOCOL_VERSION_2) {
+        check(err, avro_value_get_by_index(&record_val, 1, &lsn_val, NULL));
+        check(err, avro_value_get_by_index(&record_val, 2, &time_val, NULL));
+        check(err, avro_value_set_long(&lsn_val, txn->end_lsn));
+        check(err, avro_value_set_long(&time_val, commit_time));
+    }
     return err;
 }
 
@@ -88,7 +103,7 @@ int update_frame_with_insert(avro_value_t *frame_val, schema_cache_t cache, Rela
 
     int changed = schema_cache_lookup(cache, rel, &entry);
     if (changed) {
-        check(err, update_frame_with_table_schema(frame_val, entry));
+        check(err, update_frame_with_table_schema(frame_val, cache, entry));
     }
 
     check(err, extract_tuple_key(entry, rel, tupdesc, newtuple, &key_bin));
@@ -111,7 +126,7 @@ int update_frame_with_update(avro_value_t *frame_val, schema_cache_t cache, Rela
 
     int changed = schema_cache_lookup(cache, rel, &entry);
     if (changed) {
-        check(err, update_frame_with_table_schema(frame_val, entry));
+        check(err, update_frame_with_table_schema(frame_val, cache, entry));
     }
 
     /* oldtuple is non-NULL when replident = FULL, or when replident = DEFAULT and there is no
@@ -153,7 +168,7 @@ int update_frame_with_delete(avro_value_t *frame_val, schema_cache_t cache, Rela
 
     int changed = schema_cache_lookup(cache, rel, &entry);
     if (changed) {
-        check(err, update_frame_with_table_schema(frame_val, entry));
+        check(err, update_frame_with_table_schema(frame_val, cache, entry));
     }
 
     if (oldtuple) {
@@ -172,11 +187,13 @@ int update_frame_with_delete(avro_value_t *frame_val, schema_cache_t cache, Rela
 
 /* Sends Avro schemas for a table to the client. This is called the first time we send
  * row-level events for a table, as well as every time the schema changes. All subsequent
- * inserts/updates/deletes are assumed to be encoded with this schema. */
-int update_frame_with_table_schema(avro_value_t *frame_val, schema_cache_entry *entry) {
+ * inserts/updates/deletes are assumed to be encoded with this schema. The name of the
+ * table's Postgres schema is only sent from protocol version 2 onwards. */
+int update_frame_with_table_schema(avro_value_t *frame_val, schema_cache_t cache,
+        schema_cache_entry *entry) {
     int err = 0;
     avro_value_t msg_val, union_val, record_val, relid_val, hash_val, key_schema_val,
-                 row_schema_val, branch_val;
+                 row_schema_val, namespace_val, branch_val;
     bytea *key_schema_json = NULL, *row_schema_json = NULL;
 
     check(err, avro_value_get_by_index(frame_val, 0, &msg_val, NULL));
@@ -187,7 +204,17 @@ int update_frame_with_table_schema(avro_value_t *frame_val, schema_cache_entry *
     check(err, avro_value_get_by_index(&record_val, 2, &key_schema_val, NULL));
     check(err, avro_value_get_by_index(&record_val, 3, &row_schema_val, NULL));
     check(err, avro_value_set_long(&relid_val, entry->relid));
-    check(err, avro_value_set_fixed(&hash_val, &entry->hash, 8));
+    check(err, avro_value_set_fixed(&hash_val, &entry->shape_hash, 8));
+
+    if (cache->protocol_version >= PROTOCOL_VERSION_2) {
+        check(err, avro_value_get_by_index(&record_val, 4, &namespace_val, NULL));
+        if (entry->relnamespace) {
+            check(err, avro_value_set_branch(&namespace_val, 1, &branch_val));
+            check(err, avro_value_set_string(&branch_val, entry->relnamespace));
+        } else {
+            check(err, avro_value_set_branch(&namespace_val, 0, NULL));
+        }
+    }
 
     if (entry->key_schema) {
         check(err, try_writing(&key_schema_json, &write_schema_json, entry->key_schema));
@@ -291,11 +318,23 @@ int update_frame_with_delete_raw(avro_value_t *frame_val, Oid relid, bytea *key_
 }
 
 /* Creates a new schema cache. All palloc allocations for this cache will be
- * performed in the given memory context. */
-schema_cache_t schema_cache_new(MemoryContext context) {
-    MemoryContext oldctx = MemoryContextSwitchTo(context);
+ * performed in the given memory context. If structural is true, tables that differ
+ * only in their namespace get the same Avro schemas, and share them in the cache.
+ * Table schemas are sent in the given version of the frame protocol, which must be 2
+ * or later for structural schemas, since only the table schema message then says
+ * which Postgres schema a table is in. */
+schema_cache_t schema_cache_new(MemoryContext context, bool structural, int protocol_version) {
+    MemoryContext oldctx;
+
+    if (structural && protocol_version < PROTOCOL_VERSION_2) {
+        elog(ERROR, "Structural schemas require protocol version %d or later", PROTOCOL_VERSION_2);
+    }
+
+    oldctx = MemoryContextSwitchTo(context);
     schema_cache_t cache = palloc0(sizeof(schema_cache));
     cache->context = context;
+    cache->structural = structural;
+    cache->protocol_version = protocol_version;
     cache->num_entries = 0;
     cache->capacity = 16;
     cache->entries = palloc0(cache->capacity * sizeof(void*));
@@ -315,7 +354,7 @@ int schema_cache_lookup(schema_cache_t cache, Relation rel, schema_cache_entry *
         entry = cache->entries[i];
         if (entry->relid != relid) continue;
 
-        hash = schema_hash_for_relation(rel);
+        hash = schema_hash_for_relation(rel, false);
         if (entry->hash == hash) {
             /* Schema has not changed */
             *entry_out = entry;
@@ -324,7 +363,7 @@ int schema_cache_lookup(schema_cache_t cache, Relation rel, schema_cache_entry *
         } else {
             /* Schema has changed since we last saw it -- update the cache */
             schema_cache_entry_decrefs(entry);
-            schema_cache_entry_update(entry, rel);
+            schema_cache_entry_update(cache, entry, rel);
             *entry_out = entry;
             return 1;
         }
@@ -332,7 +371,7 @@ int schema_cache_lookup(schema_cache_t cache, Relation rel, schema_cache_entry *
 
     /* Schema not previously seen -- create a new cache entry */
     entry = schema_cache_entry_new(cache);
-    schema_cache_entry_update(entry, rel);
+    schema_cache_entry_update(cache, entry, rel);
     *entry_out = entry;
     return 2;
 }
@@ -357,11 +396,20 @@ schema_cache_entry *schema_cache_entry_new(schema_cache_t cache) {
 }
 
 /* Populates a schema cache entry with the information from a given table. */
-void schema_cache_entry_update(schema_cache_entry *entry, Relation rel) {
+void schema_cache_entry_update(schema_cache_t cache, schema_cache_entry *entry, Relation rel) {
+    MemoryContext oldctx = MemoryContextSwitchTo(cache->context);
+    if (entry->relnamespace) pfree(entry->relnamespace);
+    entry->relnamespace = pstrdup(get_namespace_name(RelationGetNamespace(rel)));
+    MemoryContextSwitchTo(oldctx);
+
     entry->relid = RelationGetRelid(rel);
-    entry->hash = schema_hash_for_relation(rel);
-    entry->key_schema = schema_for_table_key(rel, &entry->key_index);
-    entry->row_schema = schema_for_table_row(rel);
+    entry->hash = schema_hash_for_relation(rel, false);
+    entry->shape_hash = cache->structural ? schema_hash_for_relation(rel, true) : entry->hash;
+    entry->key_schema = schema_for_table_key(rel, cache->structural, &entry->key_index);
+    entry->row_schema = schema_for_table_row(rel, cache->structural);
+
+    if (schema_cache_entry_share(cache, entry)) return;
+
     entry->row_iface = avro_generic_class_from_schema(entry->row_schema);
     avro_generic_value_new(entry->row_iface, &entry->row_value);
 
@@ -371,6 +419,36 @@ void schema_cache_entry_update(schema_cache_entry *entry, Relation rel) {
     }
 }
 
+/* With structural schemas, looks for another table whose Avro schemas are the same
+ * as those just generated for this entry. If there is one, the entry takes a reference
+ * to that table's schemas and generic interfaces instead (which are what take up most
+ * of the memory), and true is returned. Each entry still has values of its own. */
+bool schema_cache_entry_share(schema_cache_t cache, schema_cache_entry *entry) {
+    if (!cache->structural) return false;
+
+    for (int i = 0; i < cache->num_entries; i++) {
+        schema_cache_entry *other = cache->entries[i];
+        if (other == entry || other->shape_hash != entry->shape_hash) continue;
+        if (!other->row_schema || !avro_schema_equal(other->row_schema, entry->row_schema)) continue;
+        if ((other->key_schema == NULL) != (entry->key_schema == NULL)) continue;
+        if (entry->key_schema && !avro_schema_equal(other->key_schema, entry->key_schema)) continue;
+
+        avro_schema_decref(entry->row_schema);
+        entry->row_schema = avro_schema_incref(other->row_schema);
+        entry->row_iface = avro_value_iface_incref(other->row_iface);
+        avro_generic_value_new(entry->row_iface, &entry->row_value);
+
+        if (entry->key_schema) {
+            avro_schema_decref(entry->key_schema);
+            entry->key_schema = avro_schema_incref(other->key_schema);
+            entry->key_iface = avro_value_iface_incref(other->key_iface);
+            avro_generic_value_new(entry->key_iface, &entry->key_value);
+        }
+        return true;
+    }
+    return false;
+}
+
 /* Decrements the reference counts for a schema cache entry. */
 void schema_cache_entry_decrefs(schema_cache_entry *entry) {
     avro_value_decref(&entry->row_value);
@@ -391,6 +469,7 @@ void schema_cache_free(schema_cache_t cache) {
     for (int i = 0; i < cache->num_entries; i++) {
         schema_cache_entry *entry = cache->entries[i];
         schema_cache_entry_decrefs(entry);
+        if (entry->relnamespace) pfree(entry->relnamespace);
         pfree(entry);
     }
 
@@ -430,12 +509,20 @@ uint64 fnv_format(uint64 base, char *fmt, ...) {
 
 /* Computes a hash over the definition of a relation. This is used to efficiently detect
  * schema changes: if the hash is unchanged, the schema is (very likely) unchanged, but any
- * change in the table definition will cause a different value to be returned. */
-uint64 schema_hash_for_relation(Relation rel) {
-    uint64 hash = fnv_format(FNV_HASH_BASE, "oid=%u name=%s ns=%s\n",
-            RelationGetRelid(rel),
-            RelationGetRelationName(rel),
-            get_namespace_name(RelationGetNamespace(rel)));
+ * change in the table definition will cause a different value to be returned. If
+ * structural is true, the relation's OID and namespace are left out, so that tables
+ * with the same shape (see schema_for_table_row()) hash to the same value. */
+uint64 schema_hash_for_relation(Relation rel, bool structural) {
+    uint64 hash;
+
+    if (structural) {
+        hash = fnv_format(FNV_HASH_BASE, "name=%s\n", RelationGetRelationName(rel));
+    } else {
+        hash = fnv_format(FNV_HASH_BASE, "oid=%u name=%s ns=%s\n",
+                RelationGetRelid(rel),
+                RelationGetRelationName(rel),
+                get_namespace_name(RelationGetNamespace(rel)));
+    }
 
     TupleDesc tupdesc = RelationGetDescr(rel);
     for (int i = 0; i < tupdesc->natts; i++) {
@@ -448,7 +535,7 @@ uint64 schema_hash_for_relation(Relation rel) {
     if (RelationGetForm(rel)->relkind == RELKIND_RELATION) {
         Relation index_rel = table_key_index(rel);
         if (index_rel) {
-            hash = (hash * FNV_HASH_PRIME) ^ schema_hash_for_relation(index_rel);
+            hash = (hash * FNV_HASH_PRIME) ^ schema_hash_for_relation(index_rel, structural);
             relation_close(index_rel, AccessShareLock);
         }
     }
@@ -8,6 +8,8 @@
 typedef struct {
     Oid                 relid;      /* Uniquely identifies a table, even when it is renamed */
     uint64_t            hash;       /* Hash of table schema, to detect changes */
+    uint64_t            shape_hash; /* Hash of the Avro schemas (see schema_cache->structural) */
+    char               *relnamespace; /* Name of the table's Postgres schema */
     avro_schema_t       key_schema; /* Avro schema for the table's primary key or replica identity */
     avro_schema_t       row_schema; /* Avro schema for one row of the table */
     avro_value_iface_t *key_iface;  /* Avro generic interface for creating key values */
@@ -19,6 +21,8 @@ typedef struct {
 
 typedef struct {
     MemoryContext context;         /* Context in which cache entries are allocated */
+    bool structural;               /* Share Avro schemas between identically shaped tables */
+    int protocol_version;          /* Version of the frame protocol being sent (see protocol.h) */
     int num_entries;               /* Number of entries in use */
     int capacity;                  /* Allocated size of entries array */
     schema_cache_entry **entries;  /* Array of pointers to cache entries */
@@ -26,13 +30,13 @@ typedef struct {
 
 typedef schema_cache *schema_cache_t;
 
-int update_frame_with_begin_txn(avro_value_t *frame_val, ReorderBufferTXN *txn);
+int update_frame_with_begin_txn(avro_value_t *frame_val, ReorderBufferTXN *txn, int protocol_version);
 int update_frame_with_commit_txn(avro_value_t *frame_val, ReorderBufferTXN *txn, XLogRecPtr commit_lsn);
 int update_frame_with_insert(avro_value_t *frame_val, schema_cache_t cache, Relation rel, TupleDesc tupdesc, HeapTuple newtuple);
 int update_frame_with_update(avro_value_t *frame_val, schema_cache_t cache, Relation rel, HeapTuple oldtuple, HeapTuple newtuple);
 int update_frame_with_delete(avro_value_t *frame_val, schema_cache_t cache, Relation rel, HeapTuple oldtuple);
 
-schema_cache_t schema_cache_new(MemoryContext context);
+schema_cache_t schema_cache_new(MemoryContext context, bool structural, int protocol_version);
 void schema_cache_free(schema_cache_t cache);
 char *schema_debug_info(Relation rel, TupleDesc tupdesc);
 
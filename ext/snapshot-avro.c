@@ -42,6 +42,7 @@ void open_next_table(export_state *state);
 void close_current_table(export_state *state);
 bytea *format_snapshot_row(export_state *state);
 bytea *schema_for_relname(char *relname, bool get_key);
+int protocol_version_arg(FunctionCallInfo fcinfo, int argno);
 
 
 PG_FUNCTION_INFO_V1(bottledwater_key_schema);
@@ -68,14 +69,24 @@ Datum bottledwater_row_schema(PG_FUNCTION_ARGS) {
 }
 
 
+PG_FUNCTION_INFO_V1(bottledwater_protocol_version);
+
+/* Returns the latest version of the frame protocol that this build of the extension
+ * can send. Clients use it to decide which version to ask the output plugin for. */
+Datum bottledwater_protocol_version(PG_FUNCTION_ARGS) {
+    PG_RETURN_INT32(PROTOCOL_VERSION);
+}
+
+
 PG_FUNCTION_INFO_V1(bottledwater_frame_schema);
 
-/* Returns a JSON string containing the frame schema of the logical log output plugin.
+/* Returns a JSON string containing the frame schema of the logical log output plugin,
+ * in the given version of the protocol (default 1).
  * This should be used by clients to decode the data streamed from the log, allowing
  * schema evolution to handle version changes of the plugin. */
 Datum bottledwater_frame_schema(PG_FUNCTION_ARGS) {
     bytea *json;
-    avro_schema_t schema = schema_for_frame();
+    avro_schema_t schema = schema_for_frame(protocol_version_arg(fcinfo, 0));
     int err = try_writing(&json, &write_schema_json, schema);
     avro_schema_decref(schema);
 
@@ -92,7 +103,8 @@ PG_FUNCTION_INFO_V1(bottledwater_export);
 
 /* Given a search pattern for tables ('%' matches all tables), returns a set of byte array values.
  * Each byte array is a frame of our wire protocol, containing schemas and/or rows of the selected
- * tables. This is a set-returning function (SRF), which means it gets called once for each row of
+ * tables. The optional arguments after allow_unkeyed select structural schemas, and the version
+ * of the protocol (default 1). This is a set-returning function (SRF), which means it gets called once for each row of
  * output, allowing us to stream through large datasets without loading everything into memory.
  *
  * SRF docs: http://www.postgresql.org/docs/9.4/static/xfunc-c.html#XFUNC-C-RETURN-SET */
@@ -100,7 +112,7 @@ Datum bottledwater_export(PG_FUNCTION_ARGS) {
     FuncCallContext *funcctx;
     MemoryContext oldcontext;
     export_state *state;
-    int ret;
+    int ret, version;
     bytea *result;
 
     oldcontext = CurrentMemoryContext;
@@ -127,10 +139,12 @@ Datum bottledwater_export(PG_FUNCTION_ARGS) {
                                                   ALLOCSET_DEFAULT_MAXSIZE);
 
         state->current_table = 0;
-        state->frame_schema = schema_for_frame();
+        version = protocol_version_arg(fcinfo, 3);
+        state->frame_schema = schema_for_frame(version);
         state->frame_iface = avro_generic_class_from_schema(state->frame_schema);
         avro_generic_value_new(state->frame_iface, &state->frame_value);
-        state->schema_cache = schema_cache_new(funcctx->multi_call_memory_ctx);
+        state->schema_cache = schema_cache_new(funcctx->multi_call_memory_ctx,
+                PG_NARGS() > 2 && PG_GETARG_BOOL(2), version);
         funcctx->user_fctx = state;
 
         get_table_list(state, PG_GETARG_TEXT_P(0), PG_GETARG_BOOL(1));
@@ -349,9 +363,9 @@ bytea *schema_for_relname(char *relname, bool get_key) {
     Relation rel = relation_openrv(relvar, AccessShareLock);
 
     if (get_key) {
-        schema = schema_for_table_key(rel, NULL);
+        schema = schema_for_table_key(rel, false, NULL);
     } else {
-        schema = schema_for_table_row(rel);
+        schema = schema_for_table_row(rel, false);
     }
 
     relation_close(rel, AccessShareLock);
@@ -366,3 +380,15 @@ bytea *schema_for_relname(char *relname, bool get_key) {
     }
     return json;
 }
+
+/* Returns the protocol version passed as the given (optional) argument of a SQL
+ * function, or version 1 if the argument was omitted. */
+int protocol_version_arg(FunctionCallInfo fcinfo, int argno) {
+    int version = PG_NARGS() > argno ? PG_GETARG_INT32(argno) : PROTOCOL_VERSION_1;
+
+    if (version < PROTOCOL_VERSION_1 || version > PROTOCOL_VERSION) {
+        elog(ERROR, "Protocol version %d is not supported by this version of bottledwater "
+                "(supported: %d to %d)", version, PROTOCOL_VERSION_1, PROTOCOL_VERSION);
+    }
+    return version;
+}
@@ -0,0 +1,870 @@
+/* The arrow sink (--sink=arrow:DIR) writes the rows of each table to files in Arrow's
+ * IPC streaming format, which analytics tools (e.g. pyarrow, DuckDB, Spark) read
+ * directly, and convert to Parquet cheaply. Which files are written, and when they are
+ * complete, is described in table_sink.c.
+ *
+ * Rows are decoded from their Avro binary encoding straight into column builders,
+ * which are set up from the table's Avro row schema:
+ *
+ *   - boolean, int, long, float, double, string and bytes become the Arrow types of
+ *     the same names; enums become strings (the symbol), and fixed becomes binary.
+ *   - A union of null and one other type becomes a nullable column of that type.
+ *   - Records become structs, and other unions become dense unions.
+ *   - Anything else (arrays and maps) is kept in its Avro binary encoding, as binary.
+ *
+ * Once a table has --sink-batch-rows rows buffered (or ARROW_BATCH_BYTES of them),
+ * they are written to its file as one record batch. The buffers of a record batch may
+ * be compressed with zstd (--sink-codec=zstd), if built with WITH_ZSTD=1. Multi-byte
+ * values are written little-endian, as declared in the schema. */
+
+#include "table_sink.h"
+
+#include <avro.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define ARROW_SUFFIX ".arrows"
+#define ARROW_BATCH_BYTES (64 * 1024 * 1024)
+#define ARROW_CONTINUATION 0xffffffffU
+#define ARROW_ZSTD_LEVEL 3
+
+/* From Arrow's Schema.fbs and Message.fbs */
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_NULL 1
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_FLOATING_POINT 3
+#define ARROW_TYPE_BINARY 4
+#define ARROW_TYPE_UTF8 5
+#define ARROW_TYPE_BOOL 6
+#define ARROW_TYPE_STRUCT 13
+#define ARROW_TYPE_UNION 14
+#define ARROW_PRECISION_SINGLE 1
+#define ARROW_PRECISION_DOUBLE 2
+#define ARROW_UNION_DENSE 1
+#define ARROW_CODEC_ZSTD 1
+
+#define FB_MAX_FIELDS 8
+
+#define check(err, call) { err = call; if (err) return err; }
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t capacity;
+} arrow_buf;
+
+/* Builds one column of a record batch. */
+typedef struct arrow_column {
+    char *name;
+    avro_schema_t schema;       /* Schema of the values (the non-null branch, if nullable) */
+    avro_type_t avro_type;
+    int arrow_type;             /* ARROW_TYPE_* */
+    int bit_width;              /* Of ints and floating point numbers */
+    bool nullable;              /* Whether the Avro type is a union of null and schema */
+    int null_branch;            /* If so, which branch of the union is null */
+    bool raw;                   /* Whether values are kept in their Avro encoding */
+    int64_t length;             /* Number of values */
+    int64_t null_count;
+    arrow_buf validity;         /* Bitmap of non-null values (if nullable) */
+    arrow_buf offsets;          /* Strings and binary: int32 offsets into data; unions: into children */
+    arrow_buf data;             /* Values; unions: int8 type ids */
+    int num_children;           /* Struct fields, or union branches */
+    struct arrow_column *children;
+} arrow_column;
+
+/* The record batch being built for a table. */
+typedef struct {
+    avro_schema_t schema;       /* Row schema */
+    arrow_column row;           /* Struct column whose children are the table's columns */
+    size_t batch_bytes;         /* Size of the rows in the batch, as encoded in Avro */
+} arrow_table;
+
+typedef struct {
+    bool zstd;                  /* Compress record batch buffers */
+    arrow_buf meta;             /* Flatbuffer metadata of the message being written */
+    arrow_buf body;             /* Body of the record batch being written */
+    arrow_buf nodes;            /* Its FieldNode structs */
+    arrow_buf buffers;          /* Its Buffer structs */
+    int num_nodes;
+    int num_buffers;
+} arrow_state;
+
+/* A flatbuffer table that is about to be written. Scalar fields are given by value;
+ * offsets to other objects (written after the table) are filled in with fb_set_offset(). */
+typedef struct {
+    int num_fields;
+    int size[FB_MAX_FIELDS];        /* Size of each field in bytes (0 = absent) */
+    uint64_t value[FB_MAX_FIELDS];  /* Value of each scalar field */
+    size_t pos[FB_MAX_FIELDS];      /* Where each field was written */
+} fb_table;
+
+static int arrow_sink_open(sink_t sink);
+static int arrow_open(sink_t sink);
+static int arrow_schema(sink_t sink, table_file *table);
+static int arrow_begin(sink_t sink, table_file *table);
+static int arrow_append(sink_t sink, table_file *table, const char *row, size_t row_len);
+static int arrow_finish(sink_t sink, table_file *table);
+static void arrow_free_table(table_file *table);
+static void arrow_close(sink_t sink);
+int arrow_write_batch(sink_t sink, table_file *table);
+int arrow_write_message(sink_t sink, table_file *table, arrow_buf *body);
+int arrow_column_init(sink_t sink, arrow_column *col, const char *name, avro_schema_t schema);
+void arrow_column_reset(arrow_column *col);
+void arrow_column_free(arrow_column *col);
+int arrow_column_read(arrow_column *col, const char **pos, const char *end);
+void arrow_column_append_null(arrow_column *col);
+void arrow_column_set_valid(arrow_column *col, bool valid);
+void arrow_column_collect(arrow_state *state, arrow_column *col);
+void arrow_add_buffer(arrow_state *state, const void *data, size_t len);
+size_t arrow_write_field(arrow_buf *meta, arrow_column *col);
+size_t arrow_write_type(arrow_buf *meta, arrow_column *col);
+int arrow_read_long(const char **pos, const char *end, int64_t *value);
+int arrow_skip(avro_schema_t schema, const char **pos, const char *end);
+size_t fb_write_table(arrow_buf *buf, fb_table *table);
+size_t fb_start_vector(arrow_buf *buf, int count, int elem_align);
+size_t fb_write_string(arrow_buf *buf, const char *str);
+void fb_set_offset(arrow_buf *buf, size_t pos, size_t target);
+void arrow_buf_reserve(arrow_buf *buf, size_t extra);
+void arrow_buf_append(arrow_buf *buf, const void *data, size_t len);
+void arrow_buf_put(arrow_buf *buf, uint64_t value, int size);
+void arrow_buf_set(arrow_buf *buf, size_t pos, uint64_t value, int size);
+void arrow_buf_pad(arrow_buf *buf, size_t align);
+
+static const table_format arrow_format = {ARROW_SUFFIX, arrow_open, arrow_schema,
+    arrow_begin, arrow_append, arrow_finish, arrow_free_table, arrow_close};
+
+const sink_ops arrow_sink_ops = {"arrow", arrow_sink_open, table_sink_schema,
+    table_sink_produce, table_sink_commit, table_sink_poll, table_sink_close};
+
+
+static int arrow_sink_open(sink_t sink) {
+    return table_sink_open(sink, &arrow_format);
+}
+
+
+static int arrow_open(sink_t sink) {
+    table_sink_state *sink_state = sink->state;
+    arrow_state *state = malloc(sizeof(arrow_state));
+    memset(state, 0, sizeof(arrow_state));
+    sink_state->format_state = state;
+
+    if (!sink->codec || strcmp(sink->codec, "none") == 0) return 0;
+#ifdef HAVE_ZSTD
+    if (strcmp(sink->codec, "zstd") == 0 || strcmp(sink->codec, "zstandard") == 0) {
+        state->zstd = true;
+        return 0;
+    }
+#endif
+    sink_error(sink, "Unsupported Arrow codec: %s", sink->codec);
+    return EINVAL;
+}
+
+
+/* Sets up the column builders for the table's (new) row schema. */
+static int arrow_schema(sink_t sink, table_file *table) {
+    arrow_table *at = table->format_data;
+    if (at) {
+        arrow_column_free(&at->row);
+        avro_schema_decref(at->schema);
+    } else {
+        at = malloc(sizeof(arrow_table));
+        table->format_data = at;
+    }
+    memset(at, 0, sizeof(arrow_table));
+
+    if (avro_schema_from_json_length(table->schema_json, table->schema_len, &at->schema)) {
+        sink_error(sink, "Could not parse row schema of %s: %s", table->table_name, avro_strerror());
+        return EINVAL;
+    }
+    if (avro_typeof(at->schema) != AVRO_RECORD) {
+        sink_error(sink, "Row schema of %s is not a record", table->table_name);
+        return EINVAL;
+    }
+    return arrow_column_init(sink, &at->row, table->table_name, at->schema);
+}
+
+
+/* Starts the stream with the schema message. */
+static int arrow_begin(sink_t sink, table_file *table) {
+    arrow_state *state = ((table_sink_state *) sink->state)->format_state;
+    arrow_table *at = table->format_data;
+    arrow_buf *meta = &state->meta;
+    meta->len = 0;
+
+    fb_table message = {4, {2, 1, 4, 8}, {ARROW_METADATA_V5, ARROW_HEADER_SCHEMA, 0, 0}};
+    arrow_buf_put(meta, 0, 4);
+    fb_set_offset(meta, 0, fb_write_table(meta, &message));
+
+    // Schema: endianness (little, the default), fields
+    fb_table schema = {2, {0, 4}, {0, 0}};
+    fb_set_offset(meta, message.pos[2], fb_write_table(meta, &schema));
+
+    size_t fields = fb_start_vector(meta, at->row.num_children, 4);
+    fb_set_offset(meta, schema.pos[1], fields);
+    for (int i = 0; i < at->row.num_children; i++) arrow_buf_put(meta, 0, 4);
+    for (int i = 0; i < at->row.num_children; i++) {
+        fb_set_offset(meta, fields + 4 + 4 * i, arrow_write_field(meta, &at->row.children[i]));
+    }
+
+    return arrow_write_message(sink, table, NULL);
+}
+
+
+/* Decodes a row into the column builders, and writes a record batch once enough rows
+ * have been collected. */
+static int arrow_append(sink_t sink, table_file *table, const char *row, size_t row_len) {
+    arrow_table *at = table->format_data;
+    const char *pos = row, *end = row + row_len;
+
+    for (int i = 0; i < at->row.num_children; i++) {
+        if (arrow_column_read(&at->row.children[i], &pos, end)) {
+            sink_error(sink, "Row of %s does not match its schema", table->table_name);
+            return EINVAL;
+        }
+    }
+    if (pos != end) {
+        sink_error(sink, "Row of %s is longer than its schema allows", table->table_name);
+        return EINVAL;
+    }
+
+    at->row.length++;
+    at->batch_bytes += row_len;
+    table->buffered = at->batch_bytes;
+
+    if (at->row.length >= sink->batch_rows || at->batch_bytes >= ARROW_BATCH_BYTES) {
+        return arrow_write_batch(sink, table);
+    }
+    return 0;
+}
+
+
+/* Writes the last record batch, and the end-of-stream marker. */
+static int arrow_finish(sink_t sink, table_file *table) {
+    int err;
+    check(err, arrow_write_batch(sink, table));
+
+    char eos[8] = {0xff, 0xff, 0xff, 0xff, 0, 0, 0, 0};
+    struct iovec iov = {eos, sizeof(eos)};
+    return table_sink_write(sink, table, &iov, 1);
+}
+
+
+static void arrow_free_table(table_file *table) {
+    arrow_table *at = table->format_data;
+    if (!at) return;
+    arrow_column_free(&at->row);
+    if (at->schema) avro_schema_decref(at->schema);
+    free(at);
+    table->format_data = NULL;
+}
+
+
+static void arrow_close(sink_t sink) {
+    arrow_state *state = ((table_sink_state *) sink->state)->format_state;
+    if (!state) return;
+    free(state->meta.data);
+    free(state->body.data);
+    free(state->nodes.data);
+    free(state->buffers.data);
+    free(state);
+}
+
+
+/* Writes the rows collected for a table as one record batch, and empties the column
+ * builders. */
+int arrow_write_batch(sink_t sink, table_file *table) {
+    arrow_state *state = ((table_sink_state *) sink->state)->format_state;
+    arrow_table *at = table->format_data;
+    if (at->row.length == 0) return 0;
+
+    state->body.len = state->nodes.len = state->buffers.len = 0;
+    state->num_nodes = state->num_buffers = 0;
+    for (int i = 0; i < at->row.num_children; i++) {
+        arrow_column_collect(state, &at->row.children[i]);
+    }
+
+    arrow_buf *meta = &state->meta;
+    meta->len = 0;
+    fb_table message = {4, {2, 1, 4, 8},
+        {ARROW_METADATA_V5, ARROW_HEADER_RECORD_BATCH, 0, state->body.len}};
+    arrow_buf_put(meta, 0, 4);
+    fb_set_offset(meta, 0, fb_write_table(meta, &message));
+
+    // RecordBatch: length, nodes, buffers, compression
+    fb_table batch = {4, {8, 4, 4, state->zstd ? 4 : 0}, {at->row.length, 0, 0, 0}};
+    fb_set_offset(meta, message.pos[2], fb_write_table(meta, &batch));
+
+    fb_set_offset(meta, batch.pos[1], fb_start_vector(meta, state->num_nodes, 8));
+    arrow_buf_append(meta, state->nodes.data, state->nodes.len);
+    fb_set_offset(meta, batch.pos[2], fb_start_vector(meta, state->num_buffers, 8));
+    arrow_buf_append(meta, state->buffers.data, state->buffers.len);
+
+    if (state->zstd) {
+        // BodyCompression: codec, method (each buffer compressed separately)
+        fb_table compression = {2, {1, 1}, {ARROW_CODEC_ZSTD, 0}};
+        fb_set_offset(meta, batch.pos[3], fb_write_table(meta, &compression));
+    }
+
+    int err;
+    check(err, arrow_write_message(sink, table, &state->body));
+
+    arrow_column_reset(&at->row);
+    at->batch_bytes = 0;
+    table->buffered = 0;
+    return 0;
+}
+
+
+/* Writes the message whose metadata is in state->meta, followed by its body, if any. */
+int arrow_write_message(sink_t sink, table_file *table, arrow_buf *body) {
+    arrow_state *state = ((table_sink_state *) sink->state)->format_state;
+    arrow_buf_pad(&state->meta, 8);
+
+    char prefix[8];
+    uint32_t continuation = ARROW_CONTINUATION, meta_len = state->meta.len;
+    for (int i = 0; i < 4; i++) {
+        prefix[i] = (continuation >> (8 * i)) & 0xff;
+        prefix[4 + i] = (meta_len >> (8 * i)) & 0xff;
+    }
+
+    struct iovec iov[3] = {
+        {prefix, sizeof(prefix)},
+        {state->meta.data, state->meta.len},
+        {body ? body->data : NULL, body ? body->len : 0}
+    };
+    return table_sink_write(sink, table, iov, body ? 3 : 2);
+}
+
+
+/* Sets up a column builder for values of the given Avro schema. */
+int arrow_column_init(sink_t sink, arrow_column *col, const char *name, avro_schema_t schema) {
+    int err;
+    memset(col, 0, sizeof(arrow_column));
+    col->name = strdup(name);
+
+    // [null, T] and [T, null] become a nullable T
+    if (avro_typeof(schema) == AVRO_UNION && avro_schema_union_size(schema) == 2) {
+        for (int i = 0; i < 2; i++) {
+            if (avro_typeof(avro_schema_union_branch(schema, i)) != AVRO_NULL) continue;
+            col->nullable = true;
+            col->null_branch = i;
+            schema = avro_schema_union_branch(schema, 1 - i);
+            break;
+        }
+    }
+
+    col->schema = schema;
+    col->avro_type = avro_typeof(schema);
+
+    switch (col->avro_type) {
+        case AVRO_NULL:     col->arrow_type = ARROW_TYPE_NULL; break;
+        case AVRO_BOOLEAN:  col->arrow_type = ARROW_TYPE_BOOL; break;
+        case AVRO_INT32:    col->arrow_type = ARROW_TYPE_INT; col->bit_width = 32; break;
+        case AVRO_INT64:    col->arrow_type = ARROW_TYPE_INT; col->bit_width = 64; break;
+        case AVRO_FLOAT:    col->arrow_type = ARROW_TYPE_FLOATING_POINT; col->bit_width = 32; break;
+        case AVRO_DOUBLE:   col->arrow_type = ARROW_TYPE_FLOATING_POINT; col->bit_width = 64; break;
+        case AVRO_STRING:
+        case AVRO_ENUM:     col->arrow_type = ARROW_TYPE_UTF8; break;
+        case AVRO_BYTES:
+        case AVRO_FIXED:    col->arrow_type = ARROW_TYPE_BINARY; break;
+
+        case AVRO_RECORD:
+            col->arrow_type = ARROW_TYPE_STRUCT;
+            col->num_children = avro_schema_record_size(schema);
+            col->children = malloc(col->num_children * sizeof(arrow_column));
+            for (int i = 0; i < col->num_children; i++) {
+                check(err, arrow_column_init(sink, &col->children[i],
+                            avro_schema_record_field_name(schema, i),
+                            avro_schema_record_field_get_by_index(schema, i)));
+            }
+            break;
+
+        case AVRO_UNION:
+            col->arrow_type = ARROW_TYPE_UNION;
+            col->num_children = avro_schema_union_size(schema);
+            col->children = malloc(col->num_children * sizeof(arrow_column));
+            for (int i = 0; i < col->num_children; i++) {
+                avro_schema_t branch = avro_schema_union_branch(schema, i);
+                check(err, arrow_column_init(sink, &col->children[i],
+                            avro_schema_type_name(branch), branch));
+            }
+            break;
+
+        default:
+            col->arrow_type = ARROW_TYPE_BINARY;
+            col->raw = true;
+            break;
+    }
+
+    arrow_column_reset(col);
+    return 0;
+}
+
+
+/* Empties a column builder (and its children), keeping the memory for the next batch. */
+void arrow_column_reset(arrow_column *col) {
+    col->length = col->null_count = 0;
+    col->validity.len = col->offsets.len = col->data.len = 0;
+    if (col->arrow_type == ARROW_TYPE_UTF8 || col->arrow_type == ARROW_TYPE_BINARY) {
+        arrow_buf_put(&col->offsets, 0, 4);
+    }
+    for (int i = 0; i < col->num_children; i++) arrow_column_reset(&col->children[i]);
+}
+
+
+void arrow_column_free(arrow_column *col) {
+    for (int i = 0; i < col->num_children; i++) arrow_column_free(&col->children[i]);
+    free(col->children);
+    free(col->name);
+    free(col->validity.data);
+    free(col->offsets.data);
+    free(col->data.data);
+}
+
+
+/* Decodes one Avro value and appends it to the column. Returns non-zero if the data
+ * ends prematurely or is invalid. */
+int arrow_column_read(arrow_column *col, const char **pos, const char *end) {
+    int64_t value;
+    int err;
+
+    if (col->nullable) {
+        check(err, arrow_read_long(pos, end, &value));
+        if (value == col->null_branch) {
+            arrow_column_append_null(col);
+            return 0;
+        }
+        arrow_column_set_valid(col, true);
+    }
+
+    const char *start = *pos;
+    if (col->raw) {
+        check(err, arrow_skip(col->schema, pos, end));
+        arrow_buf_append(&col->data, start, *pos - start);
+        arrow_buf_put(&col->offsets, col->data.len, 4);
+        col->length++;
+        return 0;
+    }
+
+    switch (col->avro_type) {
+        case AVRO_NULL:
+            col->null_count++;
+            break;
+
+        case AVRO_BOOLEAN:
+            if (*pos >= end) return EINVAL;
+            if (col->length % 8 == 0) arrow_buf_put(&col->data, 0, 1);
+            if (*(*pos)++) col->data.data[col->length / 8] |= 1 << (col->length % 8);
+            break;
+
+        case AVRO_INT32:
+        case AVRO_INT64:
+            check(err, arrow_read_long(pos, end, &value));
+            arrow_buf_put(&col->data, value, col->bit_width / 8);
+            break;
+
+        case AVRO_FLOAT:
+        case AVRO_DOUBLE:
+            // Avro also encodes them in IEEE 754 format, little-endian
+            if (end - *pos < col->bit_width / 8) return EINVAL;
+            arrow_buf_append(&col->data, *pos, col->bit_width / 8);
+            *pos += col->bit_width / 8;
+            break;
+
+        case AVRO_STRING:
+        case AVRO_BYTES:
+            check(err, arrow_read_long(pos, end, &value));
+            if (value < 0 || end - *pos < value) return EINVAL;
+            arrow_buf_append(&col->data, *pos, value);
+            arrow_buf_put(&col->offsets, col->data.len, 4);
+            *pos += value;
+            break;
+
+        case AVRO_FIXED:
+            check(err, arrow_skip(col->schema, pos, end));
+            arrow_buf_append(&col->data, start, *pos - start);
+            arrow_buf_put(&col->offsets, col->data.len, 4);
+            break;
+
+        case AVRO_ENUM: {
+            check(err, arrow_read_long(pos, end, &value));
+            const char *symbol = avro_schema_enum_get(col->schema, value);
+            if (!symbol) return EINVAL;
+            arrow_buf_append(&col->data, symbol, strlen(symbol));
+            arrow_buf_put(&col->offsets, col->data.len, 4);
+            break;
+        }
+
+        case AVRO_RECORD:
+            for (int i = 0; i < col->num_children; i++) {
+                check(err, arrow_column_read(&col->children[i], pos, end));
+            }
+            break;
+
+        case AVRO_UNION:
+            check(err, arrow_read_long(pos, end, &value));
+            if (value < 0 || value >= col->num_children) return EINVAL;
+            arrow_buf_put(&col->data, value, 1);
+            arrow_buf_put(&col->offsets, col->children[value].length, 4);
+            check(err, arrow_column_read(&col->children[value], pos, end));
+            break;
+    }
+
+    col->length++;
+    return 0;
+}
+
+
+/* Appends a null, or (for columns that aren't nullable, e.g. the fields of a struct
+ * that is null) an empty value. */
+void arrow_column_append_null(arrow_column *col) {
+    if (col->nullable) {
+        arrow_column_set_valid(col, false);
+        col->null_count++;
+    }
+
+    switch (col->arrow_type) {
+        case ARROW_TYPE_NULL:
+            if (!col->nullable) col->null_count++;
+            break;
+        case ARROW_TYPE_BOOL:
+            if (col->length % 8 == 0) arrow_buf_put(&col->data, 0, 1);
+            break;
+        case ARROW_TYPE_INT:
+        case ARROW_TYPE_FLOATING_POINT:
+            arrow_buf_put(&col->data, 0, col->bit_width / 8);
+            break;
+        case ARROW_TYPE_UTF8:
+        case ARROW_TYPE_BINARY:
+            arrow_buf_put(&col->offsets, col->data.len, 4);
+            break;
+        case ARROW_TYPE_STRUCT:
+            for (int i = 0; i < col->num_children; i++) {
+                arrow_column_append_null(&col->children[i]);
+            }
+            break;
+        case ARROW_TYPE_UNION:
+            arrow_buf_put(&col->data, 0, 1);
+            arrow_buf_put(&col->offsets, col->children[0].length, 4);
+            arrow_column_append_null(&col->children[0]);
+            break;
+    }
+    col->length++;
+}
+
+
+/* Sets the validity bit of the value about to be appended to a nullable column. */
+void arrow_column_set_valid(arrow_column *col, bool valid) {
+    if (col->length % 8 == 0) arrow_buf_put(&col->validity, 0, 1);
+    if (valid) col->validity.data[col->length / 8] |= 1 << (col->length % 8);
+}
+
+
+/* Adds the column's FieldNode and buffers (and its children's) to the record batch
+ * being written, in the order in which Arrow expects them. */
+void arrow_column_collect(arrow_state *state, arrow_column *col) {
+    arrow_buf_put(&state->nodes, col->length, 8);
+    arrow_buf_put(&state->nodes, col->null_count, 8);
+    state->num_nodes++;
+
+    if (col->arrow_type == ARROW_TYPE_NULL) return;
+    if (col->arrow_type != ARROW_TYPE_UNION) {
+        // Without nulls, the validity bitmap may be left out
+        arrow_add_buffer(state, col->validity.data, col->null_count > 0 ? col->validity.len : 0);
+    }
+
+    switch (col->arrow_type) {
+        case ARROW_TYPE_UTF8:
+        case ARROW_TYPE_BINARY:
+        case ARROW_TYPE_UNION:
+            if (col->arrow_type == ARROW_TYPE_UNION) {
+                arrow_add_buffer(state, col->data.data, col->data.len);
+            }
+            arrow_add_buffer(state, col->offsets.data, col->offsets.len);
+            if (col->arrow_type != ARROW_TYPE_UNION) {
+                arrow_add_buffer(state, col->data.data, col->data.len);
+            }
+            break;
+        case ARROW_TYPE_STRUCT:
+            break;
+        default:
+            arrow_add_buffer(state, col->data.data, col->data.len);
+            break;
+    }
+
+    for (int i = 0; i < col->num_children; i++) {
+        arrow_column_collect(state, &col->children[i]);
+    }
+}
+
+
+/* Appends a buffer to the body of the record batch (compressed, if so configured),
+ * padded to a multiple of 8 bytes, and records where it is. */
+void arrow_add_buffer(arrow_state *state, const void *data, size_t len) {
+    size_t offset = state->body.len;
+
+    if (len > 0 && !state->zstd) {
+        arrow_buf_append(&state->body, data, len);
+    } else if (len > 0) {
+#ifdef HAVE_ZSTD
+        // Each buffer is prefixed with its uncompressed length, or -1 if it is stored
+        // uncompressed because compression didn't help.
+        size_t bound = ZSTD_compressBound(len);
+        arrow_buf_reserve(&state->body, 8 + bound);
+        size_t compressed = ZSTD_compress(state->body.data + offset + 8, bound, data, len,
+                ARROW_ZSTD_LEVEL);
+        if (!ZSTD_isError(compressed) && compressed < len) {
+            arrow_buf_put(&state->body, len, 8);
+            state->body.len += compressed;
+        } else {
+            arrow_buf_put(&state->body, (uint64_t) -1, 8);
+            arrow_buf_append(&state->body, data, len);
+        }
+#endif
+    }
+
+    arrow_buf_put(&state->buffers, offset, 8);
+    arrow_buf_put(&state->buffers, state->body.len - offset, 8);
+    state->num_buffers++;
+    arrow_buf_pad(&state->body, 8);
+}
+
+
+/* Writes the Field table describing a column (and its children). */
+size_t arrow_write_field(arrow_buf *meta, arrow_column *col) {
+    // Field: name, nullable, type_type, type, dictionary (absent), children
+    fb_table field = {6, {4, 1, 1, 4, 0, 4},
+        {0, col->nullable || col->arrow_type == ARROW_TYPE_NULL, col->arrow_type, 0, 0, 0}};
+    size_t pos = fb_write_table(meta, &field);
+
+    fb_set_offset(meta, field.pos[0], fb_write_string(meta, col->name));
+    fb_set_offset(meta, field.pos[3], arrow_write_type(meta, col));
+
+    size_t children = fb_start_vector(meta, col->num_children, 4);
+    fb_set_offset(meta, field.pos[5], children);
+    for (int i = 0; i < col->num_children; i++) arrow_buf_put(meta, 0, 4);
+    for (int i = 0; i < col->num_children; i++) {
+        fb_set_offset(meta, children + 4 + 4 * i, arrow_write_field(meta, &col->children[i]));
+    }
+    return pos;
+}
+
+
+/* Writes the table describing a column's type. */
+size_t arrow_write_type(arrow_buf *meta, arrow_column *col) {
+    fb_table type = {0};
+    switch (col->arrow_type) {
+        case ARROW_TYPE_INT:            // Int: bitWidth, is_signed
+            type = (fb_table) {2, {4, 1}, {col->bit_width, 1}};
+            break;
+        case ARROW_TYPE_FLOATING_POINT: // FloatingPoint: precision
+            type = (fb_table) {1, {2}, {col->bit_width == 32 ?
+                ARROW_PRECISION_SINGLE : ARROW_PRECISION_DOUBLE}};
+            break;
+        case ARROW_TYPE_UNION:          // Union: mode (type ids are the branch indexes)
+            type = (fb_table) {1, {2}, {ARROW_UNION_DENSE}};
+            break;
+    }
+    return fb_write_table(meta, &type);
+}
+
+
+/* Decodes a long (or int) in Avro's variable-length zig-zag format. */
+int arrow_read_long(const char **pos, const char *end, int64_t *value) {
+    uint64_t n = 0;
+    for (int shift = 0; *pos < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*pos)++;
+        n |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = (int64_t) (n >> 1) ^ -(int64_t) (n & 1);
+            return 0;
+        }
+    }
+    return EINVAL;
+}
+
+
+/* Moves past one Avro value of the given schema. */
+int arrow_skip(avro_schema_t schema, const char **pos, const char *end) {
+    int64_t value;
+    int err;
+
+    switch (avro_typeof(schema)) {
+        case AVRO_NULL:
+            return 0;
+        case AVRO_BOOLEAN:
+            value = 1;
+            break;
+        case AVRO_INT32:
+        case AVRO_INT64:
+        case AVRO_ENUM:
+            return arrow_read_long(pos, end, &value);
+        case AVRO_FLOAT:
+            value = 4;
+            break;
+        case AVRO_DOUBLE:
+            value = 8;
+            break;
+        case AVRO_STRING:
+        case AVRO_BYTES:
+            check(err, arrow_read_long(pos, end, &value));
+            break;
+        case AVRO_FIXED:
+            value = avro_schema_fixed_size(schema);
+            break;
+
+        case AVRO_RECORD:
+            for (int i = 0; i < avro_schema_record_size(schema); i++) {
+                check(err, arrow_skip(avro_schema_record_field_get_by_index(schema, i), pos, end));
+            }
+            return 0;
+
+        case AVRO_UNION:
+            check(err, arrow_read_long(pos, end, &value));
+            if (value < 0 || value >= avro_schema_union_size(schema)) return EINVAL;
+            return arrow_skip(avro_schema_union_branch(schema, value), pos, end);
+
+        case AVRO_ARRAY:
+        case AVRO_MAP: {
+            // Blocks of items, ending with an empty one. A negative count is followed
+            // by the block's size in bytes.
+            bool is_map = avro_typeof(schema) == AVRO_MAP;
+            avro_schema_t items = is_map ? avro_schema_map_values(schema) : avro_schema_array_items(schema);
+            while (true) {
+                int64_t count, size;
+                check(err, arrow_read_long(pos, end, &count));
+                if (count == 0) return 0;
+                if (count < 0) {
+                    count = -count;
+                    check(err, arrow_read_long(pos, end, &size));
+                }
+                for (int64_t i = 0; i < count; i++) {
+                    if (is_map) {
+                        // The key, a string
+                        check(err, arrow_read_long(pos, end, &size));
+                        if (size < 0 || end - *pos < size) return EINVAL;
+                        *pos += size;
+                    }
+                    check(err, arrow_skip(items, pos, end));
+                }
+            }
+        }
+
+        case AVRO_LINK:
+            return arrow_skip(avro_schema_link_target(schema), pos, end);
+
+        default:
+            return EINVAL;
+    }
+
+    if (value < 0 || end - *pos < value) return EINVAL;
+    *pos += value;
+    return 0;
+}
+
+
+/* Writes a flatbuffer table, preceded by its vtable. Fields are laid out largest
+ * first, so that each is naturally aligned. Returns the position of the table. */
+size_t fb_write_table(arrow_buf *buf, fb_table *table) {
+    uint16_t field_offset[FB_MAX_FIELDS] = {0};
+    size_t inline_size = 4; // the offset to the vtable
+    for (int size = 8; size >= 1; size /= 2) {
+        for (int i = 0; i < table->num_fields; i++) {
+            if (table->size[i] != size) continue;
+            inline_size = (inline_size + size - 1) / size * size;
+            field_offset[i] = inline_size;
+            inline_size += size;
+        }
+    }
+
+    arrow_buf_pad(buf, 2);
+    size_t vtable = buf->len;
+    arrow_buf_put(buf, 4 + 2 * table->num_fields, 2);
+    arrow_buf_put(buf, inline_size, 2);
+    for (int i = 0; i < table->num_fields; i++) arrow_buf_put(buf, field_offset[i], 2);
+
+    // The vtable is found by subtracting the signed offset at the start of the table
+    arrow_buf_pad(buf, 8);
+    size_t start = buf->len;
+    arrow_buf_put(buf, start - vtable, 4);
+    for (size_t i = 4; i < inline_size; i++) arrow_buf_put(buf, 0, 1);
+
+    for (int i = 0; i < table->num_fields; i++) {
+        table->pos[i] = start + field_offset[i];
+        if (table->size[i] > 0) arrow_buf_set(buf, table->pos[i], table->value[i], table->size[i]);
+    }
+    return start;
+}
+
+
+/* Starts a vector of count elements, which the caller appends. Returns its position. */
+size_t fb_start_vector(arrow_buf *buf, int count, int elem_align) {
+    arrow_buf_pad(buf, 4);
+    if ((buf->len + 4) % elem_align != 0) arrow_buf_put(buf, 0, 4);
+    size_t pos = buf->len;
+    arrow_buf_put(buf, count, 4);
+    return pos;
+}
+
+
+size_t fb_write_string(arrow_buf *buf, const char *str) {
+    size_t len = strlen(str);
+    arrow_buf_pad(buf, 4);
+    size_t pos = buf->len;
+    arrow_buf_put(buf, len, 4);
+    arrow_buf_append(buf, str, len);
+    arrow_buf_put(buf, 0, 1);
+    return pos;
+}
+
+
+/* Points the offset field at pos to the object at target (which comes after it). */
+void fb_set_offset(arrow_buf *buf, size_t pos, size_t target) {
+    arrow_buf_set(buf, pos, target - pos, 4);
+}
+
+
+void arrow_buf_reserve(arrow_buf *buf, size_t extra) {
+    if (buf->len + extra <= buf->capacity) return;
+    size_t new_capacity = buf->capacity > 0 ? buf->capacity : 256;
+    while (buf->len + extra > new_capacity) new_capacity *= 4;
+    char *data = realloc(buf->data, new_capacity);
+    if (!data) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    buf->data = data;
+    buf->capacity = new_capacity;
+}
+
+
+void arrow_buf_append(arrow_buf *buf, const void *data, size_t len) {
+    arrow_buf_reserve(buf, len);
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+
+/* Appends an integer of the given size in bytes, little-endian. */
+void arrow_buf_put(arrow_buf *buf, uint64_t value, int size) {
+    arrow_buf_reserve(buf, size);
+    buf->len += size;
+    arrow_buf_set(buf, buf->len - size, value, size);
+}
+
+
+void arrow_buf_set(arrow_buf *buf, size_t pos, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) buf->data[pos + i] = (value >> (8 * i)) & 0xff;
+}
+
+
+void arrow_buf_pad(arrow_buf *buf, size_t align) {
+    while (buf->len % align != 0) arrow_buf_put(buf, 0, 1);
+}
@@ -0,0 +1,468 @@
+/* Tests for the arrow sink (arrow_sink.c): writes a few rows of a table through the
+ * sink, into a directory under /tmp, and reads the published file back, checking the
+ * framing of the IPC stream (continuation markers, metadata lengths, 8-byte alignment
+ * and the end-of-stream marker), the flatbuffer metadata of the schema and the record
+ * batch, and the buffers of the batch: their offsets, the validity bitmaps, and the
+ * values. Also checks that when a table's rows in a transaction are split across two
+ * files, table_sink.c publishes both at the commit.
+ *
+ * Run with "make test". */
+
+#include "sink.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TABLE_NAME "public.test"
+#define FILE_NAME TABLE_NAME ".0000000000000000.arrows"
+#define NEXT_FILE_NAME TABLE_NAME ".0000000000000001.arrows"
+#define COMMIT_LSN 0x1234abcdULL
+#define NUM_ROWS 3
+#define NUM_FIELDS 3
+
+/* id is a long, name a nullable string, and flag a boolean */
+#define ROW_SCHEMA "{\"type\":\"record\",\"name\":\"test\",\"fields\":[" \
+    "{\"name\":\"id\",\"type\":\"long\"}," \
+    "{\"name\":\"name\",\"type\":[\"null\",\"string\"]}," \
+    "{\"name\":\"flag\",\"type\":\"boolean\"}]}"
+
+/* From Arrow's Schema.fbs and Message.fbs */
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_UTF8 5
+#define ARROW_TYPE_BOOL 6
+
+#define expect(cond, ...) { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+}
+
+/* The rows, as the Avro binary encoding of (1, "a", true), (2, null, false) and
+ * (300, "hello", true), each after the 5 bytes of schema ID prefix. */
+static const unsigned char rows[NUM_ROWS][16] = {
+    {0, 0, 0, 0, 1, 0x02, 0x02, 0x02, 'a', 0x01},
+    {0, 0, 0, 0, 1, 0x04, 0x00, 0x00},
+    {0, 0, 0, 0, 1, 0xd8, 0x04, 0x02, 0x0a, 'h', 'e', 'l', 'l', 'o', 0x01}
+};
+static const size_t row_lens[NUM_ROWS] = {10, 8, 15};
+
+/* Each field's name, Arrow type, whether it is nullable, and its null count */
+static const char *field_names[NUM_FIELDS] = {"id", "name", "flag"};
+static const int field_types[NUM_FIELDS] = {ARROW_TYPE_INT, ARROW_TYPE_UTF8, ARROW_TYPE_BOOL};
+static const bool field_nullable[NUM_FIELDS] = {false, true, false};
+static const int field_null_counts[NUM_FIELDS] = {0, 1, 0};
+
+/* The buffers of the record batch, in order: each field's validity bitmap (left out
+ * if there are no nulls), then its offsets (strings only) and values. Bitmaps are
+ * compared in full, so their padding must be zero. */
+typedef struct {
+    const char *data;
+    size_t len;
+} expected_buffer;
+
+static const expected_buffer expected_buffers[] = {
+    {"", 0},                                                    // id: validity
+    {"\x01\0\0\0\0\0\0\0\x02\0\0\0\0\0\0\0\x2c\x01\0\0\0\0\0\0", 24},   // id: values
+    {"\x05", 1},                                                // name: validity
+    {"\0\0\0\0\x01\0\0\0\x01\0\0\0\x06\0\0\0", 16},             // name: offsets
+    {"ahello", 6},                                              // name: values
+    {"", 0},                                                    // flag: validity
+    {"\x05", 1}                                                 // flag: values
+};
+
+/* The metadata of the message being checked, within which flatbuffers are read */
+static const uint8_t *meta_start, *meta_end;
+
+static char *progname;
+static int failures = 0;
+
+static void on_ack(void *_acks, void *msg_opaque, const char *err);
+sink_t sink_for(const char *dir, int *acks, topic_list_entry *entry, rd_kafka_message_t *batch);
+void produce_rows(sink_t sink, topic_list_entry *entry, int first, int count);
+void write_table(const char *dir);
+char *read_file(const char *path, size_t *len);
+uint64_t read_le(const uint8_t *pos, int size);
+const uint8_t *read_message(const uint8_t **pos, const uint8_t *end, int header_type,
+        uint64_t *body_len);
+const uint8_t *fb_field(const uint8_t *table, int field, int size);
+const uint8_t *fb_deref(const uint8_t *offset);
+const uint8_t *fb_vector(const uint8_t *table, int field, uint32_t *count);
+void check_schema(const uint8_t *schema);
+void check_record_batch(const uint8_t *batch, const uint8_t *body, uint64_t body_len);
+bool manifest_lists(const char *dir, const char *file_name, int num_rows);
+void remove_files(const char *dir);
+void test_round_trip(void);
+void test_split_transaction(void);
+
+
+static void on_ack(void *_acks, void *msg_opaque, const char *err) {
+    int *acks = _acks;
+    expect(err == NULL, "message not acknowledged: %s", err);
+    (*acks)++;
+}
+
+
+/* Opens an arrow sink writing to dir, and tells it about the table. */
+sink_t sink_for(const char *dir, int *acks, topic_list_entry *entry, rd_kafka_message_t *batch) {
+    sink_t sink = sink_new(&arrow_sink_ops, dir);
+    sink->on_ack = on_ack;
+    sink->cb_context = acks;
+    expect(sink_open(sink) == 0, "open failed: %s", sink->error);
+
+    memset(entry, 0, sizeof(topic_list_entry));
+    entry->relid = 42;
+    entry->table_name = TABLE_NAME;
+    entry->topic_name = "test";
+    entry->batch = batch;
+    entry->batch_capacity = NUM_ROWS;
+    expect(sink_schema(sink, entry, ROW_SCHEMA, strlen(ROW_SCHEMA)) == 0,
+            "schema failed: %s", sink->error);
+    return sink;
+}
+
+
+/* Hands count of the rows, starting with the given one, to the sink. */
+void produce_rows(sink_t sink, topic_list_entry *entry, int first, int count) {
+    memset(entry->batch, 0, count * sizeof(rd_kafka_message_t));
+    for (int i = 0; i < count; i++) {
+        entry->batch[i].payload = (void *) rows[first + i];
+        entry->batch[i].len = row_lens[first + i];
+    }
+    entry->batch_len = count;
+    expect(sink_produce(sink, entry) == 0, "produce failed: %s", sink->error);
+}
+
+
+/* Writes the rows through the arrow sink, commits them, and closes the sink, which
+ * publishes the file. */
+void write_table(const char *dir) {
+    int acks = 0;
+    topic_list_entry entry;
+    rd_kafka_message_t batch[NUM_ROWS];
+    sink_t sink = sink_for(dir, &acks, &entry, batch);
+
+    produce_rows(sink, &entry, 0, NUM_ROWS);
+    expect(sink_commit(sink, COMMIT_LSN) == 0, "commit failed: %s", sink->error);
+    expect(acks == NUM_ROWS, "%d of %d messages acknowledged", acks, NUM_ROWS);
+
+    sink_free(sink);
+}
+
+
+/* Reads a whole file into memory, with room for a null terminator. Returns NULL if
+ * it can't be read. */
+char *read_file(const char *path, size_t *len) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    size_t capacity = 4096;
+    char *data = malloc(capacity);
+    *len = 0;
+    while (true) {
+        *len += fread(data + *len, 1, capacity - *len, file);
+        if (*len < capacity) break;
+        capacity *= 4;
+        data = realloc(data, capacity);
+    }
+    fclose(file);
+    return data;
+}
+
+
+/* Reads an unsigned little-endian integer of the given size in bytes. */
+uint64_t read_le(const uint8_t *pos, int size) {
+    uint64_t value = 0;
+    for (int i = size - 1; i >= 0; i--) value = (value << 8) | pos[i];
+    return value;
+}
+
+
+/* Checks the framing of the message at *pos (the continuation marker, and the length
+ * of its metadata), and that it is of the expected kind. Sets up meta_start and
+ * meta_end for reading its metadata, moves *pos past it (but not its body), and
+ * returns the message's header table, or NULL if the message is broken. */
+const uint8_t *read_message(const uint8_t **pos, const uint8_t *end, int header_type,
+        uint64_t *body_len) {
+    if (end - *pos < 8) {
+        expect(false, "stream ends before the message");
+        return NULL;
+    }
+    expect(read_le(*pos, 4) == 0xffffffffU, "no continuation marker");
+
+    uint32_t meta_len = read_le(*pos + 4, 4);
+    expect(meta_len % 8 == 0, "metadata length %u is not a multiple of 8", meta_len);
+    if (meta_len < 4 || meta_len > end - *pos - 8) {
+        expect(false, "metadata length %u out of range", meta_len);
+        return NULL;
+    }
+    meta_start = *pos + 8;
+    meta_end = meta_start + meta_len;
+    *pos = meta_end;
+
+    const uint8_t *message = fb_deref(meta_start);
+    const uint8_t *version = fb_field(message, 0, 2);
+    const uint8_t *type = fb_field(message, 1, 1);
+    const uint8_t *header = fb_field(message, 2, 4);
+    const uint8_t *length = fb_field(message, 3, 8);
+    if (!version || !type || !header) {
+        expect(false, "message lacks version, header_type or header");
+        return NULL;
+    }
+    expect(read_le(version, 2) == 4, "metadata version is %d, not V5",
+            (int) read_le(version, 2));
+    expect(*type == header_type, "header type is %d, not %d", *type, header_type);
+
+    *body_len = length ? read_le(length, 8) : 0;
+    return fb_deref(header);
+}
+
+
+/* Returns where a field of a flatbuffer table is, or NULL if it is absent (or the
+ * table, its vtable or the field lie outside the metadata). */
+const uint8_t *fb_field(const uint8_t *table, int field, int size) {
+    if (!table || table < meta_start || meta_end - table < 4) return NULL;
+    expect((table - meta_start) % 4 == 0, "table not aligned");
+
+    const uint8_t *vtable = table - (int32_t) read_le(table, 4);
+    if (vtable < meta_start || meta_end - vtable < 4) return NULL;
+    uint16_t vtable_len = read_le(vtable, 2), table_len = read_le(vtable + 2, 2);
+    if (4 + 2 * field + 2 > vtable_len || meta_end - vtable < vtable_len) return NULL;
+
+    uint16_t offset = read_le(vtable + 4 + 2 * field, 2);
+    if (offset == 0) return NULL;
+    if (offset + size > table_len || meta_end - table < offset + size) return NULL;
+    expect((table + offset - meta_start) % size == 0, "field %d not aligned", field);
+    return table + offset;
+}
+
+
+/* Follows an offset to the object after it. */
+const uint8_t *fb_deref(const uint8_t *offset) {
+    if (!offset) return NULL;
+    const uint8_t *target = offset + read_le(offset, 4);
+    return target < meta_end ? target : NULL;
+}
+
+
+/* Returns the elements of a vector field of a table, or NULL if it is absent. */
+const uint8_t *fb_vector(const uint8_t *table, int field, uint32_t *count) {
+    const uint8_t *vector = fb_deref(fb_field(table, field, 4));
+    if (!vector || meta_end - vector < 4) return NULL;
+    *count = read_le(vector, 4);
+    return vector + 4;
+}
+
+
+/* Checks the fields of the Schema: their names, types and nullability. */
+void check_schema(const uint8_t *schema) {
+    uint32_t num_fields = 0;
+    const uint8_t *fields = fb_vector(schema, 1, &num_fields);
+    expect(fields && num_fields == NUM_FIELDS, "schema has %u fields, not %d", num_fields, NUM_FIELDS);
+    if (!fields || num_fields != NUM_FIELDS) return;
+
+    for (int i = 0; i < NUM_FIELDS; i++) {
+        const uint8_t *field = fb_deref(fields + 4 * i);
+        const uint8_t *name = fb_deref(fb_field(field, 0, 4));
+        const uint8_t *nullable = fb_field(field, 1, 1);
+        const uint8_t *type_type = fb_field(field, 2, 1);
+        const uint8_t *type = fb_deref(fb_field(field, 3, 4));
+
+        size_t name_len = strlen(field_names[i]);
+        expect(name && read_le(name, 4) == name_len && memcmp(name + 4, field_names[i], name_len) == 0,
+                "field %d is not named %s", i, field_names[i]);
+        expect((nullable && *nullable) == field_nullable[i], "field %s: wrong nullability",
+                field_names[i]);
+        expect(type_type && *type_type == field_types[i], "field %s: type %d, not %d",
+                field_names[i], type_type ? *type_type : 0, field_types[i]);
+        expect(type != NULL, "field %s: no type table", field_names[i]);
+
+        if (field_types[i] == ARROW_TYPE_INT) {
+            const uint8_t *bit_width = fb_field(type, 0, 4);
+            const uint8_t *is_signed = fb_field(type, 1, 1);
+            expect(bit_width && read_le(bit_width, 4) == 64, "field %s: not 64 bits wide",
+                    field_names[i]);
+            expect(is_signed && *is_signed, "field %s: not signed", field_names[i]);
+        }
+    }
+}
+
+
+/* Checks the RecordBatch: its length, the FieldNode of each column, and where each
+ * buffer is in the body and what it contains. */
+void check_record_batch(const uint8_t *batch, const uint8_t *body, uint64_t body_len) {
+    const uint8_t *length = fb_field(batch, 0, 8);
+    expect(length && read_le(length, 8) == NUM_ROWS, "record batch has %d rows, not %d",
+            length ? (int) read_le(length, 8) : -1, NUM_ROWS);
+    expect(fb_field(batch, 3, 4) == NULL, "record batch is compressed");
+
+    uint32_t num_nodes = 0;
+    const uint8_t *nodes = fb_vector(batch, 1, &num_nodes);
+    expect(nodes && num_nodes == NUM_FIELDS, "%u field nodes, not %d", num_nodes, NUM_FIELDS);
+    if (nodes && num_nodes == NUM_FIELDS) {
+        expect((nodes - meta_start) % 8 == 0, "field nodes not aligned");
+        for (int i = 0; i < NUM_FIELDS; i++) {
+            uint64_t node_length = read_le(nodes + 16 * i, 8);
+            uint64_t null_count = read_le(nodes + 16 * i + 8, 8);
+            expect(node_length == NUM_ROWS && null_count == field_null_counts[i],
+                    "field %s: length %d and null count %d, not %d and %d", field_names[i],
+                    (int) node_length, (int) null_count, NUM_ROWS, field_null_counts[i]);
+        }
+    }
+
+    int num_expected = sizeof(expected_buffers) / sizeof(expected_buffers[0]);
+    uint32_t num_buffers = 0;
+    const uint8_t *buffers = fb_vector(batch, 2, &num_buffers);
+    expect(buffers && num_buffers == num_expected, "%u buffers, not %d", num_buffers, num_expected);
+    if (!buffers || num_buffers != num_expected) return;
+    expect((buffers - meta_start) % 8 == 0, "buffers not aligned");
+
+    uint64_t prev_end = 0;
+    for (int i = 0; i < num_expected; i++) {
+        uint64_t offset = read_le(buffers + 16 * i, 8), len = read_le(buffers + 16 * i + 8, 8);
+        expect(offset % 8 == 0, "buffer %d at offset %d, which is not 8-byte aligned",
+                i, (int) offset);
+        expect(offset >= prev_end, "buffer %d overlaps the one before", i);
+        if (offset > body_len || len > body_len - offset) {
+            expect(false, "buffer %d extends past the end of the body", i);
+            return;
+        }
+        prev_end = offset + len;
+
+        const expected_buffer *expected = &expected_buffers[i];
+        expect(len == expected->len && memcmp(body + offset, expected->data, len) == 0,
+                "buffer %d has the wrong contents (%d bytes, expected %d)", i, (int) len,
+                (int) expected->len);
+    }
+}
+
+
+/* Returns whether the manifest lists the file, with the commit's LSN and the given
+ * number of rows. */
+bool manifest_lists(const char *dir, const char *file_name, int num_rows) {
+    char path[1024], line[1024];
+    snprintf(path, sizeof(path), "%s/MANIFEST", dir);
+    snprintf(line, sizeof(line), "%X/%X %d %s\n", (uint32_t) (COMMIT_LSN >> 32),
+            (uint32_t) COMMIT_LSN, num_rows, file_name);
+
+    size_t len;
+    char *manifest = read_file(path, &len);
+    if (!manifest) return false;
+    manifest[len] = '\0';
+    bool found = strstr(manifest, line) != NULL;
+    free(manifest);
+    return found;
+}
+
+
+/* Removes the manifest and the files that the tests write, and the directory. */
+void remove_files(const char *dir) {
+    const char *names[] = {"MANIFEST", FILE_NAME, NEXT_FILE_NAME,
+        FILE_NAME ".inprogress", NEXT_FILE_NAME ".inprogress"};
+    char path[1024];
+    for (int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+
+void test_round_trip() {
+    char dir[] = "/tmp/arrow_sink_test.XXXXXX";
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "%s: Could not create directory: %s\n", progname, strerror(errno));
+        exit(1);
+    }
+    write_table(dir);
+    expect(manifest_lists(dir, FILE_NAME, NUM_ROWS), "file not in the manifest");
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/" FILE_NAME, dir);
+    size_t len;
+    char *data = read_file(path, &len);
+    expect(data != NULL, "could not read %s: %s", path, strerror(errno));
+    if (!data) {
+        remove_files(dir);
+        return;
+    }
+
+    const uint8_t *pos = (const uint8_t *) data, *end = pos + len;
+    uint64_t body_len;
+
+    const uint8_t *schema = read_message(&pos, end, ARROW_HEADER_SCHEMA, &body_len);
+    expect(body_len == 0, "schema message has a body");
+    if (schema) check_schema(schema);
+
+    const uint8_t *batch = read_message(&pos, end, ARROW_HEADER_RECORD_BATCH, &body_len);
+    if (batch) {
+        expect((pos - (const uint8_t *) data) % 8 == 0, "record batch body not aligned");
+        expect(body_len % 8 == 0, "body length %d is not a multiple of 8", (int) body_len);
+        expect(body_len <= end - pos, "body extends past the end of the file");
+        if (body_len <= end - pos) {
+            check_record_batch(batch, pos, body_len);
+            pos += body_len;
+        }
+    }
+
+    expect(end - pos == 8 && read_le(pos, 4) == 0xffffffffU && read_le(pos + 4, 4) == 0,
+            "stream does not end with the end-of-stream marker");
+
+    free(data);
+    remove_files(dir);
+}
+
+
+/* A schema change in the middle of a transaction finishes the table's file, so its
+ * rows in the transaction end up in two files. Neither may be published before the
+ * commit, and both must be published at it. */
+void test_split_transaction() {
+    char dir[] = "/tmp/arrow_sink_test.XXXXXX";
+    if (!mkdtemp(dir)) {
+        fprintf(stderr, "%s: Could not create directory: %s\n", progname, strerror(errno));
+        exit(1);
+    }
+
+    int acks = 0;
+    topic_list_entry entry;
+    rd_kafka_message_t batch[NUM_ROWS];
+    sink_t sink = sink_for(dir, &acks, &entry, batch);
+
+    produce_rows(sink, &entry, 0, 2);
+    const char *new_schema = ROW_SCHEMA " ";
+    expect(sink_schema(sink, &entry, new_schema, strlen(new_schema)) == 0,
+            "schema change failed: %s", sink->error);
+    produce_rows(sink, &entry, 2, 1);
+
+    expect(sink_poll(sink, 0) == 0, "poll failed: %s", sink->error);
+    expect(!manifest_lists(dir, FILE_NAME, 2), "file published before the commit");
+
+    expect(sink_commit(sink, COMMIT_LSN) == 0, "commit failed: %s", sink->error);
+    expect(manifest_lists(dir, FILE_NAME, 2), "first file not published at the commit");
+    expect(manifest_lists(dir, NEXT_FILE_NAME, 1), "second file not published at the commit");
+
+    sink_free(sink);
+    remove_files(dir);
+}
+
+
+int main(int argc, char **argv) {
+    progname = argv[0];
+
+    test_round_trip();
+    test_split_transaction();
+
+    if (failures) {
+        fprintf(stderr, "%s: %d check(s) failed\n", progname, failures);
+        return 1;
+    }
+    fprintf(stderr, "%s: all tests passed\n", progname);
+    return 0;
+}
@@ -0,0 +1,329 @@
+/* The avro sink (--sink=avro:DIR) writes the rows of each table to Avro Object
+ * Container Files in directory DIR, for bulk loading into a data lake without Kafka.
+ * Which files are written, and when they are complete, is described in table_sink.c.
+ *
+ * Each file holds rows with one row schema (as received from Postgres), which is
+ * written into the file's header. Rows are copied into the file exactly as they were
+ * encoded for Kafka, minus the schema ID prefix, so nothing is re-encoded.
+ *
+ * Rows are collected into blocks of about OCF_BLOCK_SIZE bytes, which are compressed
+ * with the codec chosen with --sink-codec ("deflate" by default; "snappy" and
+ * "zstandard" if built with WITH_SNAPPY=1 or WITH_ZSTD=1) and written with one system
+ * call each. */
+
+#include "table_sink.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef HAVE_SNAPPY
+#include <snappy-c.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define OCF_MAGIC "Obj\x01"
+#define OCF_MAGIC_LEN 4
+#define OCF_SYNC_LEN 16
+#define OCF_BLOCK_SIZE (1024 * 1024)
+#define OCF_ZSTD_LEVEL 3
+#define OCF_MAX_LONG_LEN 10     /* Bytes needed at most to encode a 64-bit long */
+
+#define check(err, call) { err = call; if (err) return err; }
+
+typedef enum {
+    OCF_CODEC_NULL,
+    OCF_CODEC_DEFLATE,
+    OCF_CODEC_SNAPPY,
+    OCF_CODEC_ZSTD
+} ocf_codec;
+
+static const char *ocf_codec_names[] = {"null", "deflate", "snappy", "zstandard"};
+
+/* The block being collected for a table's current file. */
+typedef struct {
+    char sync[OCF_SYNC_LEN];    /* Sync marker of the file */
+    char *block;                /* Rows not yet written to the file */
+    size_t block_len;
+    size_t block_capacity;
+    int64_t block_count;        /* Number of rows in block */
+} ocf_file;
+
+typedef struct {
+    ocf_codec codec;
+    z_stream deflate;           /* Reused for every block, with OCF_CODEC_DEFLATE */
+    bool deflate_ready;         /* Whether deflate needs deflateEnd() */
+    char *compressed;           /* Buffer for a compressed block */
+    size_t compressed_capacity;
+    unsigned int rand_seed;     /* For generating sync markers */
+} ocf_state;
+
+static int avro_sink_open(sink_t sink);
+static int ocf_open(sink_t sink);
+static int ocf_begin(sink_t sink, table_file *table);
+static int ocf_append(sink_t sink, table_file *table, const char *row, size_t row_len);
+static int ocf_write_block(sink_t sink, table_file *table);
+static void ocf_free_table(table_file *table);
+static void ocf_close(sink_t sink);
+int ocf_parse_codec(sink_t sink, const char *name);
+int ocf_compress(sink_t sink, const char *data, size_t len, const char **out, size_t *out_len);
+size_t ocf_encode_long(int64_t value, char *buf);
+
+static const table_format ocf_format = {".avro", ocf_open, NULL, ocf_begin, ocf_append,
+    ocf_write_block, ocf_free_table, ocf_close};
+
+const sink_ops avro_sink_ops = {"avro", avro_sink_open, table_sink_schema, table_sink_produce,
+    table_sink_commit, table_sink_poll, table_sink_close};
+
+
+static int avro_sink_open(sink_t sink) {
+    return table_sink_open(sink, &ocf_format);
+}
+
+
+static int ocf_open(sink_t sink) {
+    table_sink_state *sink_state = sink->state;
+    ocf_state *state = malloc(sizeof(ocf_state));
+    memset(state, 0, sizeof(ocf_state));
+    sink_state->format_state = state;
+    state->rand_seed = time(NULL) ^ getpid();
+
+    int err;
+    check(err, ocf_parse_codec(sink, sink->codec ? sink->codec : "deflate"));
+
+    if (state->codec == OCF_CODEC_DEFLATE) {
+        if (deflateInit2(&state->deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+                    Z_DEFAULT_STRATEGY) != Z_OK) {
+            sink_error(sink, "Could not initialize deflate: %s",
+                    state->deflate.msg ? state->deflate.msg : "out of memory");
+            return EIO;
+        }
+        state->deflate_ready = true;
+    }
+    return 0;
+}
+
+
+/* Writes the header of a new file: magic, metadata map with the schema and codec,
+ * and sync marker. */
+static int ocf_begin(sink_t sink, table_file *table) {
+    ocf_state *state = ((table_sink_state *) sink->state)->format_state;
+    ocf_file *file = table->format_data;
+    if (!file) {
+        file = malloc(sizeof(ocf_file));
+        memset(file, 0, sizeof(ocf_file));
+        table->format_data = file;
+    }
+
+    for (int i = 0; i < OCF_SYNC_LEN; i++) file->sync[i] = rand_r(&state->rand_seed) & 0xff;
+
+    const char *codec = ocf_codec_names[state->codec];
+    char head[64], schema_len[OCF_MAX_LONG_LEN], codec_head[64];
+    size_t head_len = 0, codec_head_len = 0;
+
+    memcpy(head, OCF_MAGIC, OCF_MAGIC_LEN);
+    head_len += OCF_MAGIC_LEN;
+    head_len += ocf_encode_long(2, head + head_len);
+    head_len += ocf_encode_long(strlen("avro.schema"), head + head_len);
+    memcpy(head + head_len, "avro.schema", strlen("avro.schema"));
+    head_len += strlen("avro.schema");
+
+    codec_head_len += ocf_encode_long(strlen("avro.codec"), codec_head);
+    memcpy(codec_head + codec_head_len, "avro.codec", strlen("avro.codec"));
+    codec_head_len += strlen("avro.codec");
+    codec_head_len += ocf_encode_long(strlen(codec), codec_head + codec_head_len);
+    memcpy(codec_head + codec_head_len, codec, strlen(codec));
+    codec_head_len += strlen(codec);
+    codec_head_len += ocf_encode_long(0, codec_head + codec_head_len);
+
+    struct iovec iov[5] = {
+        {head, head_len},
+        {schema_len, ocf_encode_long(table->schema_len, schema_len)},
+        {table->schema_json, table->schema_len},
+        {codec_head, codec_head_len},
+        {file->sync, OCF_SYNC_LEN}
+    };
+    return table_sink_write(sink, table, iov, 5);
+}
+
+
+/* Adds a row to the table's block, and writes the block once it is big enough. */
+static int ocf_append(sink_t sink, table_file *table, const char *row, size_t row_len) {
+    ocf_file *file = table->format_data;
+    table_sink_buf_append(&file->block, &file->block_len, &file->block_capacity, row, row_len);
+    file->block_count++;
+    table->buffered = file->block_len;
+
+    if (file->block_len >= OCF_BLOCK_SIZE) return ocf_write_block(sink, table);
+    return 0;
+}
+
+
+/* Compresses the table's block of rows, and appends it to the file. */
+static int ocf_write_block(sink_t sink, table_file *table) {
+    ocf_file *file = table->format_data;
+    if (file->block_count == 0) return 0;
+
+    const char *data;
+    size_t data_len;
+    int err;
+    check(err, ocf_compress(sink, file->block, file->block_len, &data, &data_len));
+
+    char head[2 * OCF_MAX_LONG_LEN];
+    size_t head_len = ocf_encode_long(file->block_count, head);
+    head_len += ocf_encode_long(data_len, head + head_len);
+
+    struct iovec iov[3] = {
+        {head, head_len},
+        {(void *) data, data_len},
+        {file->sync, OCF_SYNC_LEN}
+    };
+    check(err, table_sink_write(sink, table, iov, 3));
+
+    file->block_len = 0;
+    file->block_count = 0;
+    table->buffered = 0;
+    return 0;
+}
+
+
+static void ocf_free_table(table_file *table) {
+    ocf_file *file = table->format_data;
+    if (!file) return;
+    free(file->block);
+    free(file);
+    table->format_data = NULL;
+}
+
+
+static void ocf_close(sink_t sink) {
+    ocf_state *state = ((table_sink_state *) sink->state)->format_state;
+    if (!state) return;
+    if (state->deflate_ready) deflateEnd(&state->deflate);
+    free(state->compressed);
+    free(state);
+}
+
+
+int ocf_parse_codec(sink_t sink, const char *name) {
+    ocf_state *state = ((table_sink_state *) sink->state)->format_state;
+    if (strcmp(name, "zstd") == 0) name = "zstandard";
+
+    for (int i = 0; i < sizeof(ocf_codec_names) / sizeof(ocf_codec_names[0]); i++) {
+        if (strcmp(ocf_codec_names[i], name) != 0) continue;
+        state->codec = i;
+
+#ifndef HAVE_SNAPPY
+        if (state->codec == OCF_CODEC_SNAPPY) break;
+#endif
+#ifndef HAVE_ZSTD
+        if (state->codec == OCF_CODEC_ZSTD) break;
+#endif
+        return 0;
+    }
+
+    sink_error(sink, "Unsupported Avro codec: %s", name);
+    return EINVAL;
+}
+
+
+/* Compresses a block with the sink's codec. On success, *out points either to data
+ * (with the null codec) or to a buffer that is valid until the next call. */
+int ocf_compress(sink_t sink, const char *data, size_t len, const char **out, size_t *out_len) {
+    ocf_state *state = ((table_sink_state *) sink->state)->format_state;
+    size_t bound;
+
+    switch (state->codec) {
+        case OCF_CODEC_DEFLATE: bound = deflateBound(&state->deflate, len); break;
+#ifdef HAVE_SNAPPY
+        case OCF_CODEC_SNAPPY: bound = snappy_max_compressed_length(len) + 4; break;
+#endif
+#ifdef HAVE_ZSTD
+        case OCF_CODEC_ZSTD: bound = ZSTD_compressBound(len); break;
+#endif
+        default:
+            *out = data;
+            *out_len = len;
+            return 0;
+    }
+
+    if (bound > state->compressed_capacity) {
+        char *compressed = realloc(state->compressed, bound);
+        if (!compressed) {
+            sink_error(sink, "Out of memory");
+            return ENOMEM;
+        }
+        state->compressed = compressed;
+        state->compressed_capacity = bound;
+    }
+    *out = state->compressed;
+
+    switch (state->codec) {
+        case OCF_CODEC_DEFLATE:
+            // Raw deflate (RFC 1951) data, without zlib's header and checksum
+            deflateReset(&state->deflate);
+            state->deflate.next_in = (Bytef *) data;
+            state->deflate.avail_in = len;
+            state->deflate.next_out = (Bytef *) state->compressed;
+            state->deflate.avail_out = bound;
+            if (deflate(&state->deflate, Z_FINISH) != Z_STREAM_END) {
+                sink_error(sink, "deflate failed: %s",
+                        state->deflate.msg ? state->deflate.msg : "unknown error");
+                return EIO;
+            }
+            *out_len = state->deflate.total_out;
+            return 0;
+
+#ifdef HAVE_SNAPPY
+        case OCF_CODEC_SNAPPY: {
+            // Followed by the CRC32 of the uncompressed data, big-endian
+            size_t snappy_len = bound - 4;
+            if (snappy_compress(data, len, state->compressed, &snappy_len) != SNAPPY_OK) {
+                sink_error(sink, "snappy compression failed");
+                return EIO;
+            }
+            uint32_t crc = crc32(0, (const Bytef *) data, len);
+            for (int i = 0; i < 4; i++) {
+                state->compressed[snappy_len + i] = (crc >> (24 - 8 * i)) & 0xff;
+            }
+            *out_len = snappy_len + 4;
+            return 0;
+        }
+#endif
+
+#ifdef HAVE_ZSTD
+        case OCF_CODEC_ZSTD: {
+            size_t zstd_len = ZSTD_compress(state->compressed, bound, data, len, OCF_ZSTD_LEVEL);
+            if (ZSTD_isError(zstd_len)) {
+                sink_error(sink, "zstd compression failed: %s", ZSTD_getErrorName(zstd_len));
+                return EIO;
+            }
+            *out_len = zstd_len;
+            return 0;
+        }
+#endif
+
+        default:
+            sink_error(sink, "Unsupported Avro codec %d", state->codec);
+            return EINVAL;
+    }
+}
+
+
+/* Encodes a long in Avro's variable-length zig-zag format. Returns the number of
+ * bytes written to buf (at most OCF_MAX_LONG_LEN). */
+size_t ocf_encode_long(int64_t value, char *buf) {
+    uint64_t n = ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+    size_t len = 0;
+    while (n >= 0x80) {
+        buf[len++] = (n & 0x7f) | 0x80;
+        n >>= 7;
+    }
+    buf[len++] = n;
+    return len;
+}
@@ -1,12 +1,26 @@
-#include "connect.h"
-#include "registry.h"
+#include "producer.h"
 
-#include <librdkafka/rdkafka.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#define HAVE_EPOLL 1
+#endif
+
+/* Since librdkafka 0.9.2, the client can write to a file descriptor whenever its main
+ * queue (which carries delivery reports) becomes non-empty. With older versions we
+ * fall back to polling librdkafka on a timer. */
+#if defined(HAVE_EPOLL) && RD_KAFKA_VERSION >= 0x000902ff
+#define HAVE_KAFKA_QUEUE_EVENTS 1
+#endif
 
 #define DEFAULT_REPLICATION_SLOT "bottledwater"
 #define APP_NAME "bottledwater"
@@ -15,10 +29,7 @@
  * slot is created. This must match the name of the Postgres extension. */
 #define OUTPUT_PLUGIN "bottledwater"
 
-#define DEFAULT_BROKER_LIST "localhost:9092"
-#define DEFAULT_SCHEMA_REGISTRY "http://localhost:8081"
-
-#define check(err, call) { err = call; if (err) return err; }
+#define MAX_PRODUCERS 64
 
 #define ensure(context, call) { \
     if (call) { \
@@ -27,76 +38,35 @@
     } \
 }
 
-#define PRODUCER_CONTEXT_ERROR_LEN 512
-#define MAX_IN_FLIGHT_TRANSACTIONS 1000
-
-typedef struct {
-    uint32_t xid;         /* Postgres transaction identifier */
-    int recvd_events;     /* Number of row-level events received so far for this transaction */
-    int pending_events;   /* Number of row-level events waiting to be acknowledged by Kafka */
-    uint64_t commit_lsn;  /* WAL position of the transaction's commit event */
-} transaction_info;
-
-typedef struct {
-    client_context_t client;            /* The connection to Postgres */
-    schema_registry_t registry;         /* Submits Avro schemas to schema registry */
-    char *brokers;                      /* Comma-separated list of host:port for Kafka brokers */
-    transaction_info xact_list[MAX_IN_FLIGHT_TRANSACTIONS]; /* Circular buffer */
-    int xact_head;                      /* Index into xact_list currently being received from PG */
-    int xact_tail;                      /* Oldest index in xact_list not yet acknowledged by Kafka */
-    rd_kafka_conf_t *kafka_conf;
-    rd_kafka_topic_conf_t *topic_conf;
-    rd_kafka_t *kafka;
-    char error[PRODUCER_CONTEXT_ERROR_LEN];
-} producer_context;
-
-typedef producer_context *producer_context_t;
-
-#define xact_list_full(context) \
-    (((context)->xact_head + 1) % MAX_IN_FLIGHT_TRANSACTIONS == (context)->xact_tail)
-
-typedef struct {
-    producer_context_t context;
-    uint64_t wal_pos;
-    Oid relid;
-    transaction_info *xact;
-} msg_envelope;
-
-typedef msg_envelope *msg_envelope_t;
-
-static char *progname;
+#define MAX_PG_FDS 2              /* Replication connection, plus snapshot connection */
+#define MAX_EPOLL_EVENTS 8
+#define EVENT_SOURCE_PG 0
+#define EVENT_SOURCE_KAFKA 1
+#define EVENT_SOURCE_TIMER 2
+#define KAFKA_POLL_INTERVAL_MS 100 /* Timer tick if librdkafka can't wake us up itself */
+#define KEEPALIVE_INTERVAL_MS 1000 /* Timer tick for keepalives otherwise */
+#define REGISTRY_POLL_INTERVAL_MS 10 /* Wakeup interval while schema registrations are in flight */
+#define SPOOL_POLL_INTERVAL_MS 100 /* Wakeup interval while the spool is being drained */
+
+char *progname;
 static bool received_sigint = false;
 
 void usage(void);
 void parse_options(producer_context_t context, int argc, char **argv);
+void parse_route_option(producer_context_t context, char *option);
+void parse_sink_option(producer_context_t context, char *option);
+void parse_claim_check_option(producer_context_t context, char *option);
+void apply_profile(producer_context_t context, const char *profile);
 char *parse_config_option(char *option);
 void set_kafka_config(producer_context_t context, char *property, char *value);
 void set_topic_config(producer_context_t context, char *property, char *value);
-static int on_begin_txn(void *_context, uint64_t wal_pos, uint32_t xid);
-static int on_commit_txn(void *_context, uint64_t wal_pos, uint32_t xid);
-static int on_table_schema(void *_context, uint64_t wal_pos, Oid relid,
-        const char *key_schema_json, size_t key_schema_len, avro_schema_t key_schema,
-        const char *row_schema_json, size_t row_schema_len, avro_schema_t row_schema);
-static int on_insert_row(void *_context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len, avro_value_t *key_val,
-        const void *new_bin, size_t new_len, avro_value_t *new_val);
-static int on_update_row(void *_context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len, avro_value_t *key_val,
-        const void *old_bin, size_t old_len, avro_value_t *old_val,
-        const void *new_bin, size_t new_len, avro_value_t *new_val);
-static int on_delete_row(void *_context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len, avro_value_t *key_val,
-        const void *old_bin, size_t old_len, avro_value_t *old_val);
-int send_kafka_msg(producer_context_t context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len,
-        const void *val_bin, size_t val_len);
-static void on_deliver_msg(rd_kafka_t *kafka, const rd_kafka_message_t *msg, void *envelope);
-void maybe_checkpoint(producer_context_t context);
-void backpressure(producer_context_t context);
+long parse_number_option(const char *option, const char *value);
 client_context_t init_client(void);
-producer_context_t init_producer(client_context_t client);
-void start_producer(producer_context_t context);
-void exit_nicely(producer_context_t context, int status);
+void event_loop(producer_context_t context);
+#ifdef HAVE_EPOLL
+void event_loop_add(producer_context_t context, int epoll_fd, int fd, uint32_t source);
+void event_loop_drain(int fd);
+#endif
 
 
 void usage() {
@@ -112,6 +82,13 @@ void usage() {
             "                          Comma-separated list of Kafka broker hosts/ports.\n"
             "  -r, --schema-registry=http://hostname:port   (default: %s)\n"
             "                          URL of the service where Avro schemas are registered.\n"
+            "  --schema-cache=FILE     Remember the IDs assigned by the schema registry in FILE,\n"
+            "                          so that after a restart, rows can be sent right away\n"
+            "                          (the IDs are then checked with the registry gradually).\n"
+            "  --structural-schemas    Give tables that differ only in their Postgres schema\n"
+            "                          (e.g. one schema per tenant) the same Avro schemas, so\n"
+            "                          that each is registered only once. Messages carry the\n"
+            "                          table in their headers. Needs extension version 0.2.\n"
             "  -u, --allow-unkeyed     Allow export of tables that don't have a primary key.\n"
             "                          This is disallowed by default, because updates and\n"
             "                          deletes need a primary key to identify their row.\n"
@@ -120,9 +97,118 @@ void usage() {
             "                          (see --config-help for list of properties).\n"
             "  -T, --topic-config property=value\n"
             "                          Set topic configuration property for Kafka producer.\n"
+            "  --pipeline              Receive and decode the replication stream on separate\n"
+            "                          threads from the one producing to Kafka.\n"
+            "  --decode-threads=N      Parse frames on a pool of N threads (implies --pipeline).\n"
+            "  --feedback-bytes=N      Tell Postgres about progress as soon as another N bytes\n"
+            "                          of WAL have been acknowledged by Kafka, so that it can\n"
+            "                          release them (default: %d; 0 = only periodically).\n"
+            "  --feedback-min-interval=MS\n"
+            "                          Don't send progress updates more often than this\n"
+            "                          (default: %d milliseconds).\n"
+            "  --feedback-interval=SECS\n"
+            "                          Send a progress update at least this often, even if\n"
+            "                          idle (default: %d seconds).\n"
+            "  --stats-interval=SECS   Periodically print replication progress, including how\n"
+            "                          much WAL is being held back, throughput, and latency\n"
+            "                          from commit in Postgres to acknowledgement (which\n"
+            "                          assumes that the two machines' clocks agree)\n"
+            "                          (default: never).\n"
+            "  --profile=PROFILE       Tune batching, waiting and progress updates together:\n"
+            "                          'latency' sends each message right away, and tells\n"
+            "                          Postgres about progress often; 'throughput' lets\n"
+            "                          librdkafka collect and compress bigger batches, and\n"
+            "                          implies --pipeline. Other options override it,\n"
+            "                          wherever they are given.\n"
+            "  --partitioner=NAME      How to choose the partition for each message: 'murmur2'\n"
+            "                          (hash of the key, same as the Java client, so that\n"
+            "                          topics can be joined without repartitioning),\n"
+            "                          'consistent' (CRC32 of the key), 'random', or\n"
+            "                          'default' (librdkafka's partitioner setting).\n"
+            "  --partition-column=COL  For tables whose primary key includes column COL,\n"
+            "                          choose the partition by the murmur2 hash of that\n"
+            "                          column's value only; other tables use --partitioner\n"
+            "                          (or murmur2 if it is not given).\n"
+            "  --idempotent            Enable the Kafka producer's idempotence, so that retries\n"
+            "                          don't write duplicate messages.\n"
+            "  --transactional-id=ID   Produce inside Kafka transactions (with this producer\n"
+            "                          transactional.id), each covering whole Postgres\n"
+            "                          transactions, and record the last committed LSN in the\n"
+            "                          control topic in the same transaction. After a restart,\n"
+            "                          streaming resumes exactly there, so read_committed\n"
+            "                          consumers see no duplicates. Implies --idempotent.\n"
+            "  --control-topic=NAME    Topic for --transactional-id   (default: %s)\n"
+            "  --kafka-txn-interval=MS Commit a Kafka transaction at most this often\n"
+            "                          (default: %d milliseconds).\n"
+            "  --producers=N           Shard topics across N Kafka producers, each with a\n"
+            "                          thread of its own for delivery reports (default: 1).\n"
+            "                          Can't be combined with --transactional-id or\n"
+            "                          --spool-dir.\n"
+            "  --route=REGEX=TOPIC     Send changes to tables whose qualified name (schema.table)\n"
+            "                          matches the regular expression REGEX to topic TOPIC,\n"
+            "                          which may contain ${schema}, ${table}, and ${1}..${9}\n"
+            "                          for the expression's groups. Many tables may share a\n"
+            "                          topic; messages carry the table in their headers.\n"
+            "                          May be given several times; the first match wins.\n"
+            "  --topic-template=TOPIC  Topic for tables that match no --route, e.g.\n"
+            "                          '${schema}.${table}' (default: the table name).\n"
+            "  --coalesce              Send only the last version of each row (by key) that was\n"
+            "                          changed within a transaction; for compacted topics.\n"
+            "  --coalesce-window=MS    Like --coalesce, but hold messages for up to MS\n"
+            "                          milliseconds, coalescing across transactions.\n"
+            "                          Can't be combined with --transactional-id.\n"
+            "  --txn-headers           Give each message headers with the LSN, xid and time of\n"
+            "                          its transaction's commit, and its sequence number within\n"
+            "                          the transaction, for consumers to drop duplicates. With\n"
+            "                          this, --coalesce only merges changes within a transaction.\n"
+            "                          Needs extension version 0.2.\n"
+            "  --spool-dir=DIR         When Kafka is unavailable, or can't keep up, write messages\n"
+            "                          to files in DIR instead of stopping replication, and\n"
+            "                          send them on (in order) once Kafka has recovered.\n"
+            "                          Messages may then be delivered more than once.\n"
+            "                          Can't be combined with --transactional-id.\n"
+            "  --spool-segment-size=BYTES\n"
+            "                          Size of each file in the spool (default: %d).\n"
+            "  --sink=NAME[:ARG]       Where to send messages: 'kafka' (the default), 'null'\n"
+            "                          (discard them; for measuring how fast changes can be\n"
+            "                          decoded), 'stdout', 'file:DIR' (files in DIR),\n"
+            "                          'avro:DIR' (Avro container files of each table's rows\n"
+            "                          in DIR, listed in DIR/MANIFEST once complete), or\n"
+            "                          'arrow:DIR' (likewise, as Arrow IPC stream files).\n"
+            "                          The options for partitions, --idempotent, Kafka\n"
+            "                          transactions, --producers, --spool-dir, --claim-check\n"
+            "                          and --txn-headers only apply to Kafka; --route and\n"
+            "                          --topic-template to Kafka and the stdout and file\n"
+            "                          sinks, which record each message's topic. --coalesce\n"
+            "                          applies to all sinks.\n"
+            "  --sink-file-size=BYTES  Start a new file after this many bytes with the file,\n"
+            "                          avro and arrow sinks (default: %d).\n"
+            "  --sink-file-age=SECS    ...or once the current file is this many seconds old\n"
+            "                          (default: never).\n"
+            "  --sink-codec=CODEC      Compression of the avro sink's files: null, deflate\n"
+            "                          (the default), snappy or zstandard (if built with\n"
+            "                          WITH_SNAPPY=1 or WITH_ZSTD=1); of the arrow sink's:\n"
+            "                          none (the default) or zstd (with WITH_ZSTD=1).\n"
+            "  --sink-batch-rows=N     Rows per record batch of the arrow sink (default: %d).\n"
+            "  --max-xact-memory=BYTES Memory to use at most for tracking transactions that\n"
+            "                          have not yet been acknowledged by Kafka; when it is\n"
+            "                          used up, stop reading from Postgres (default: %d).\n"
+            "  --claim-check=NAME:ARG  Store values bigger than --claim-check-threshold in a\n"
+            "                          blob store, e.g. 'file:DIR', and send a reference to\n"
+            "                          them instead (see client/blob_store.h).\n"
+            "  --claim-check-threshold=BYTES\n"
+            "                          Size above which values are stored (default: %d).\n"
+            "  --max-inflight-bytes=BYTES\n"
+            "                          Likewise for the messages themselves, from when they\n"
+            "                          are encoded until they are acknowledged (default: %d;\n"
+            "                          0 = no limit).\n"
             "  --config-help           Print the list of configuration properties. See also:\n"
             "            https://github.com/edenhill/librdkafka/blob/master/CONFIGURATION.md\n",
-            progname, DEFAULT_REPLICATION_SLOT, DEFAULT_BROKER_LIST, DEFAULT_SCHEMA_REGISTRY);
+            progname, DEFAULT_REPLICATION_SLOT, DEFAULT_BROKER_LIST, DEFAULT_SCHEMA_REGISTRY,
+            DEFAULT_FEEDBACK_BYTES, DEFAULT_FEEDBACK_MIN_INTERVAL_MS, DEFAULT_FEEDBACK_INTERVAL_SEC,
+            DEFAULT_CONTROL_TOPIC, DEFAULT_KAFKA_TXN_INTERVAL_MS, DEFAULT_SPOOL_SEGMENT_SIZE,
+            DEFAULT_SINK_FILE_SIZE, DEFAULT_SINK_BATCH_ROWS, DEFAULT_XACT_MEMORY,
+            DEFAULT_CLAIM_CHECK_THRESHOLD, DEFAULT_INFLIGHT_BYTES);
     exit(1);
 }
 
@@ -138,12 +224,68 @@ void parse_options(producer_context_t context, int argc, char **argv) {
         {"kafka-config",    required_argument, NULL, 'C'},
         {"topic-config",    required_argument, NULL, 'T'},
         {"config-help",     no_argument,       NULL,  1 },
+        {"pipeline",        no_argument,       NULL,  2 },
+        {"decode-threads",  required_argument, NULL,  3 },
+        {"feedback-bytes",  required_argument, NULL,  4 },
+        {"feedback-min-interval", required_argument, NULL, 5 },
+        {"feedback-interval", required_argument, NULL, 6 },
+        {"stats-interval",  required_argument, NULL,  7 },
+        {"max-xact-memory", required_argument, NULL,  8 },
+        {"partitioner",     required_argument, NULL,  9 },
+        {"partition-column", required_argument, NULL, 10 },
+        {"idempotent",      no_argument,       NULL, 11 },
+        {"transactional-id", required_argument, NULL, 12 },
+        {"control-topic",   required_argument, NULL, 13 },
+        {"kafka-txn-interval", required_argument, NULL, 14 },
+        {"route",           required_argument, NULL, 15 },
+        {"topic-template",  required_argument, NULL, 16 },
+        {"schema-cache",    required_argument, NULL, 17 },
+        {"structural-schemas", no_argument,    NULL, 18 },
+        {"coalesce",        no_argument,       NULL, 19 },
+        {"coalesce-window", required_argument, NULL, 20 },
+        {"spool-dir",       required_argument, NULL, 21 },
+        {"spool-segment-size", required_argument, NULL, 22 },
+        {"sink",            required_argument, NULL, 23 },
+        {"sink-file-size",  required_argument, NULL, 24 },
+        {"sink-file-age",   required_argument, NULL, 25 },
+        {"sink-codec",      required_argument, NULL, 26 },
+        {"sink-batch-rows", required_argument, NULL, 27 },
+        {"max-inflight-bytes", required_argument, NULL, 28 },
+        {"claim-check",     required_argument, NULL, 29 },
+        {"claim-check-threshold", required_argument, NULL, 30 },
+        {"txn-headers",     no_argument,       NULL, 31 },
+        {"producers",       required_argument, NULL, 32 },
+        {"profile",         required_argument, NULL, 33 },
         {NULL,              0,                 NULL,  0 }
     };
 
     progname = argv[0];
 
+    char *spool_dir = NULL;
+    size_t spool_segment_size = DEFAULT_SPOOL_SEGMENT_SIZE;
+    size_t sink_file_size = DEFAULT_SINK_FILE_SIZE;
+    int sink_file_age = 0;
+    char *sink_codec = NULL;
+    int sink_batch_rows = DEFAULT_SINK_BATCH_ROWS;
+    char *claim_check = NULL;
+    char *kafka_option = NULL;  // An option that only the Kafka sink uses, if given
+    char *topic_option = NULL;  // An option that only sinks with topics use, if given
+
     int option_index;
+
+    // A --profile only provides defaults, so it is applied before all other options,
+    // whether they come before or after it. Errors are reported by the second pass.
+    char *profile = NULL;
+    opterr = 0;
+    while (true) {
+        int c = getopt_long(argc, argv, "d:s:b:r:uC:T:", options, &option_index);
+        if (c == -1) break;
+        if (c == 33) profile = optarg;
+    }
+    if (profile) apply_profile(context, profile);
+    opterr = 1;
+    optind = 1;
+
     while (true) {
         int c = getopt_long(argc, argv, "d:s:b:r:uC:T:", options, &option_index);
         if (c == -1) break;
@@ -174,276 +316,376 @@ void parse_options(producer_context_t context, int argc, char **argv) {
                 rd_kafka_conf_properties_show(stderr);
                 exit(1);
                 break;
+            case 2:
+                context->client->pipelined = true;
+                break;
+            case 3:
+                context->client->pipelined = true;
+                context->client->decode_workers = parse_number_option("decode-threads", optarg);
+                if (context->client->decode_workers < 1) {
+                    fprintf(stderr, "%s: --decode-threads must be a positive number\n", progname);
+                    exit(1);
+                }
+                break;
+            case 4:
+                context->client->repl.feedback_bytes = parse_number_option("feedback-bytes", optarg);
+                break;
+            case 5:
+                context->client->repl.feedback_min_interval =
+                    parse_number_option("feedback-min-interval", optarg) * 1000;
+                break;
+            case 6:
+                context->client->repl.feedback_interval =
+                    parse_number_option("feedback-interval", optarg) * 1000000;
+                break;
+            case 7:
+                context->stats_interval = parse_number_option("stats-interval", optarg);
+                break;
+            case 8:
+                context->max_xact_slots = parse_number_option("max-xact-memory", optarg) /
+                    XACT_SLOT_SIZE;
+                break;
+            case 9:
+                if (partitioner_lookup(optarg, &context->partitioner)) {
+                    fprintf(stderr, "%s: Unknown partitioner: %s\n", progname, optarg);
+                    exit(1);
+                }
+                kafka_option = "--partitioner";
+                break;
+            case 10:
+                context->partition_column = strdup(optarg);
+                // The column's value is taken from the decoded key
+                context->client->repl.frame_reader->decode_rows = true;
+                kafka_option = "--partition-column";
+                break;
+            case 11:
+                set_kafka_config(context, "enable.idempotence", "true");
+                kafka_option = "--idempotent";
+                break;
+            case 12:
+#ifdef HAVE_KAFKA_TRANSACTIONS
+                set_kafka_config(context, "transactional.id", optarg);
+                context->transactional = true;
+#else
+                fprintf(stderr, "%s: --transactional-id requires librdkafka 1.4 or later\n", progname);
+                exit(1);
+#endif
+                break;
+            case 13:
+                context->control_topic_name = strdup(optarg);
+                break;
+            case 14:
+                context->kafka_txn_interval = parse_number_option("kafka-txn-interval", optarg);
+                break;
+            case 15:
+                parse_route_option(context, optarg);
+                topic_option = "--route";
+                break;
+            case 16:
+                topic_router_set_default(context->router, optarg);
+                topic_option = "--topic-template";
+                break;
+            case 17:
+                if (schema_registry_set_cache(context->registry, optarg)) {
+                    fprintf(stderr, "%s: %s\n", progname, context->registry->error);
+                    exit(1);
+                }
+                break;
+            case 18:
+                context->client->repl.structural_schemas = true;
+                break;
+            case 19:
+                if (!context->coalesce) context->coalesce = coalesce_map_new();
+                break;
+            case 20:
+                if (!context->coalesce) context->coalesce = coalesce_map_new();
+                context->coalesce_window = parse_number_option("coalesce-window", optarg);
+                break;
+            case 21:
+                spool_dir = optarg;
+                break;
+            case 22:
+                spool_segment_size = parse_number_option("spool-segment-size", optarg);
+                break;
+            case 23:
+                parse_sink_option(context, optarg);
+                break;
+            case 24:
+                sink_file_size = parse_number_option("sink-file-size", optarg);
+                break;
+            case 25:
+                sink_file_age = parse_number_option("sink-file-age", optarg);
+                break;
+            case 26:
+                sink_codec = optarg;
+                break;
+            case 27:
+                sink_batch_rows = parse_number_option("sink-batch-rows", optarg);
+                break;
+            case 28:
+                context->max_inflight_bytes = parse_number_option("max-inflight-bytes", optarg);
+                break;
+            case 29:
+                claim_check = optarg;
+                break;
+            case 30:
+                context->claim_check_threshold = parse_number_option("claim-check-threshold", optarg);
+                break;
+            case 31:
+                context->txn_headers = true;
+                break;
+            case 32:
+                context->num_shards = parse_number_option("producers", optarg);
+                if (context->num_shards < 1 || context->num_shards > MAX_PRODUCERS) {
+                    fprintf(stderr, "%s: --producers must be between 1 and %d\n",
+                            progname, MAX_PRODUCERS);
+                    exit(1);
+                }
+                break;
+            case 33:
+                break; // Already applied
             default:
                 usage();
         }
     }
 
     if (!context->client->conninfo || optind < argc) usage();
-}
-
-/* Splits an option string by equals sign. Modifies the option argument to be
- * only the part before the equals sign, and returns a pointer to the part after
- * the equals sign. */
-char *parse_config_option(char *option) {
-    char *equals = strchr(option, '=');
-    if (!equals) {
-        fprintf(stderr, "%s: Expected configuration in the form property=value, not \"%s\"\n",
-                progname, option);
+    context->sink->max_file_size = sink_file_size;
+    context->sink->max_file_age = sink_file_age;
+    context->sink->batch_rows = sink_batch_rows;
+    if (sink_codec) context->sink->codec = strdup(sink_codec);
+
+    // Transactions, the spool, claim checks and headers are features of the Kafka producer
+    if (context->sink->ops != &kafka_sink_ops && (context->transactional || spool_dir ||
+                claim_check || context->txn_headers || context->num_shards > 1)) {
+        fprintf(stderr, "%s: --transactional-id, --spool-dir, --claim-check, --txn-headers "
+                "and --producers can only be used with the Kafka sink\n", progname);
+        exit(1);
+    }
+    if (context->sink->ops != &kafka_sink_ops && kafka_option) {
+        fprintf(stderr, "%s: %s can only be used with the Kafka sink\n", progname, kafka_option);
         exit(1);
     }
 
-    // Overwrite equals sign with null, to split key and value into two strings
-    *equals = '\0';
-    return equals + 1;
-}
+    // The avro and arrow sinks write a file per table, and have no use for topics
+    if ((context->sink->ops == &avro_sink_ops || context->sink->ops == &arrow_sink_ops) &&
+            topic_option) {
+        fprintf(stderr, "%s: %s can't be used with the %s sink\n", progname, topic_option,
+                context->sink->ops->name);
+        exit(1);
+    }
 
-void set_kafka_config(producer_context_t context, char *property, char *value) {
-    if (rd_kafka_conf_set(context->kafka_conf, property, value,
-                context->error, PRODUCER_CONTEXT_ERROR_LEN) != RD_KAFKA_CONF_OK) {
-        fprintf(stderr, "%s: %s\n", progname, context->error);
+    // A Kafka transaction belongs to one producer, and the spool relies on delivery
+    // reports being handled on the main thread (see on_deliver_msg()).
+    if (context->num_shards > 1 && (context->transactional || spool_dir)) {
+        fprintf(stderr, "%s: --producers can't be used with --transactional-id or --spool-dir\n",
+                progname);
         exit(1);
     }
-}
 
-void set_topic_config(producer_context_t context, char *property, char *value) {
-    if (rd_kafka_topic_conf_set(context->topic_conf, property, value,
-                context->error, PRODUCER_CONTEXT_ERROR_LEN) != RD_KAFKA_CONF_OK) {
-        fprintf(stderr, "%s: %s\n", progname, context->error);
+    if (claim_check) parse_claim_check_option(context, claim_check);
+
+    if (context->max_xact_slots < 1) {
+        fprintf(stderr, "%s: --max-xact-memory must be at least %d bytes\n",
+                progname, (int) XACT_SLOT_SIZE);
         exit(1);
     }
-}
+    xact_list_grow(context);
 
+    // A Kafka transaction must contain every Postgres transaction up to the LSN it
+    // records, so messages can't be held back beyond their own transaction.
+    if (context->transactional && context->coalesce_window > 0) {
+        fprintf(stderr, "%s: --coalesce-window can't be used with --transactional-id\n", progname);
+        exit(1);
+    }
 
-static int on_begin_txn(void *_context, uint64_t wal_pos, uint32_t xid) {
-    producer_context_t context = (producer_context_t) _context;
-    replication_stream_t stream = &context->client->repl;
+    // Likewise, spooled messages are sent after Kafka transactions have moved on.
+    if (spool_dir) {
+        if (context->transactional) {
+            fprintf(stderr, "%s: --spool-dir can't be used with --transactional-id\n", progname);
+            exit(1);
+        }
 
-    if (xid == 0) {
-        if (context->xact_head != 0 || context->xact_tail != 0) {
-            fprintf(stderr, "%s: Expected snapshot to be the first transaction.\n", progname);
-            exit_nicely(context, 1);
+        context->spool = spool_new(spool_dir, spool_segment_size);
+        if (spool_open(context->spool)) {
+            fprintf(stderr, "%s: %s\n", progname, context->spool->error);
+            exit(1);
         }
 
-        fprintf(stderr, "Created replication slot \"%s\", capturing consistent snapshot \"%s\".\n",
-                stream->slot_name, stream->snapshot_name);
-        return 0;
+        // Messages left over from a previous run go first
+        context->spooling = context->spool->num_records > 0;
     }
 
-    // If the circular buffer is full, we have to block and wait for some transactions
-    // to be delivered to Kafka and acknowledged for the broker.
-    while (xact_list_full(context)) backpressure(context);
+    context->table_headers = topic_router_active(context->router) ||
+        context->client->repl.structural_schemas;
 
-    context->xact_head = (context->xact_head + 1) % MAX_IN_FLIGHT_TRANSACTIONS;
-    transaction_info *xact = &context->xact_list[context->xact_head];
-    xact->xid = xid;
-    xact->recvd_events = 0;
-    xact->pending_events = 0;
-    xact->commit_lsn = 0;
+    // The commit LSN and time come from begin events, which only have them from
+    // version 2 of the frame protocol onwards.
+    if (context->txn_headers) context->client->min_protocol_version = PROTOCOL_VERSION_2;
 
-    return 0;
+#ifndef HAVE_KAFKA_HEADERS
+    if (context->table_headers || context->txn_headers) {
+        fprintf(stderr, "%s: --route, --topic-template, --structural-schemas and --txn-headers "
+                "require librdkafka 0.11.4 or later\n", progname);
+        exit(1);
+    }
+#endif
 }
 
-static int on_commit_txn(void *_context, uint64_t wal_pos, uint32_t xid) {
-    producer_context_t context = (producer_context_t) _context;
-    transaction_info *xact = &context->xact_list[context->xact_head];
-
-    if (xid == 0) {
-        fprintf(stderr, "Snapshot complete, streaming changes from %X/%X.\n",
-                (uint32) (wal_pos >> 32), (uint32) wal_pos);
+/* Parses the value of a --route option, of the form REGEX=TOPIC. Topic names can't
+ * contain '=', so the last '=' separates the two (the expression may contain '='). */
+void parse_route_option(producer_context_t context, char *option) {
+    char *equals = strrchr(option, '=');
+    if (!equals || equals == option || equals[1] == '\0') {
+        fprintf(stderr, "%s: --route must be of the form REGEX=TOPIC: %s\n", progname, option);
+        exit(1);
     }
 
-    if (xid != xact->xid) {
-        fprintf(stderr, "%s: Mismatched begin/commit events (xid %u in flight, "
-                "xid %u committed)\n", progname, xact->xid, xid);
-        exit_nicely(context, 1);
+    *equals = '\0';
+    if (topic_router_add(context->router, option, equals + 1)) {
+        fprintf(stderr, "%s: %s\n", progname, context->router->error);
+        exit(1);
     }
-
-    xact->commit_lsn = wal_pos;
-    maybe_checkpoint(context);
-    return 0;
 }
 
+/* Parses the value of a --sink option, of the form NAME or NAME:ARG, and replaces the
+ * default Kafka sink with the one named. */
+void parse_sink_option(producer_context_t context, char *option) {
+    char *colon = strchr(option, ':');
+    if (colon) *colon = '\0';
 
-static int on_table_schema(void *_context, uint64_t wal_pos, Oid relid,
-        const char *key_schema_json, size_t key_schema_len, avro_schema_t key_schema,
-        const char *row_schema_json, size_t row_schema_len, avro_schema_t row_schema) {
-    producer_context_t context = (producer_context_t) _context;
-    const char *topic_name = avro_schema_name(row_schema);
-
-    topic_list_entry_t entry = schema_registry_update(context->registry, relid, topic_name,
-            key_schema_json, key_schema_len, row_schema_json, row_schema_len);
-
-    if (!entry) {
-        fprintf(stderr, "%s: %s\n", progname, context->registry->error);
-        exit_nicely(context, 1);
+    const sink_ops *ops = strcmp(option, "kafka") == 0 ? &kafka_sink_ops : sink_lookup(option);
+    if (!ops) {
+        fprintf(stderr, "%s: Unknown sink: %s\n", progname, option);
+        exit(1);
     }
 
-    if (!entry->topic) {
-        entry->topic = rd_kafka_topic_new(context->kafka, topic_name,
-                rd_kafka_topic_conf_dup(context->topic_conf));
-        if (!entry->topic) {
-            fprintf(stderr, "%s: Cannot open Kafka topic %s: %s\n", progname, topic_name,
-                    rd_kafka_err2str(rd_kafka_errno2err(errno)));
-            exit_nicely(context, 1);
-        }
-    }
-    return 0;
+    set_sink(context, ops, colon ? colon + 1 : NULL);
 }
 
+/* Applies the settings of a --profile. They are only defaults, which any other
+ * options override (including -C for librdkafka's):
+ *
+ *   - latency: librdkafka sends each message without waiting for more to batch them
+ *     with (queue.buffering.max.ms=0, without Nagle's algorithm); large transactions
+ *     are handed to it in small chunks; and Postgres is told about progress promptly.
+ *   - throughput: librdkafka waits up to 100 ms to fill batches of up to 10000
+ *     messages, which it compresses with lz4; transactions are handed to it in large
+ *     chunks; the replication stream is received and decoded on separate threads; and
+ *     progress updates are sent less often. */
+void apply_profile(producer_context_t context, const char *profile) {
+    replication_stream_t stream = &context->client->repl;
 
-static int on_insert_row(void *_context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len, avro_value_t *key_val,
-        const void *new_bin, size_t new_len, avro_value_t *new_val) {
-    producer_context_t context = (producer_context_t) _context;
-    return send_kafka_msg(context, wal_pos, relid, key_bin, key_len, new_bin, new_len);
-}
-
-static int on_update_row(void *_context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len, avro_value_t *key_val,
-        const void *old_bin, size_t old_len, avro_value_t *old_val,
-        const void *new_bin, size_t new_len, avro_value_t *new_val) {
-    producer_context_t context = (producer_context_t) _context;
-    return send_kafka_msg(context, wal_pos, relid, key_bin, key_len, new_bin, new_len);
-}
+    if (strcmp(profile, "latency") == 0) {
+        set_kafka_config(context, "queue.buffering.max.ms", "0");
+        set_kafka_config(context, "socket.nagle.disable", "true");
+        context->produce_batch_size = 100;
+        context->backpressure_ms = 10;
+        stream->feedback_interval = 1 * 1000000;
+        stream->feedback_min_interval = 10 * 1000;
+        stream->feedback_bytes = 1024 * 1024;
+
+    } else if (strcmp(profile, "throughput") == 0) {
+        set_kafka_config(context, "queue.buffering.max.ms", "100");
+        set_kafka_config(context, "queue.buffering.max.messages", "1000000");
+        set_kafka_config(context, "batch.num.messages", "10000");
+        set_kafka_config(context, "compression.codec", "lz4");
+        context->produce_batch_size = 10000;
+        context->backpressure_ms = DEFAULT_BACKPRESSURE_MS;
+        context->client->pipelined = true;
+        stream->feedback_interval = DEFAULT_FEEDBACK_INTERVAL_SEC * 1000000;
+        stream->feedback_min_interval = 1000 * 1000;
+        stream->feedback_bytes = 64 * 1024 * 1024;
 
-static int on_delete_row(void *_context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len, avro_value_t *key_val,
-        const void *old_bin, size_t old_len, avro_value_t *old_val) {
-    producer_context_t context = (producer_context_t) _context;
-    if (key_bin)
-        return send_kafka_msg(context, wal_pos, relid, key_bin, key_len, NULL, 0);
-    else
-        return 0; // delete on unkeyed table --> can't do anything
+    } else {
+        fprintf(stderr, "%s: Unknown --profile %s (expected 'latency' or 'throughput')\n",
+                progname, profile);
+        exit(1);
+    }
 }
 
 
-int send_kafka_msg(producer_context_t context, uint64_t wal_pos, Oid relid,
-        const void *key_bin, size_t key_len,
-        const void *val_bin, size_t val_len) {
-
-    transaction_info *xact = &context->xact_list[context->xact_head];
-    xact->recvd_events++;
-    xact->pending_events++;
+/* Parses the value of a --claim-check option, of the form NAME:ARG, and opens the
+ * blob store named. */
+void parse_claim_check_option(producer_context_t context, char *option) {
+    char *colon = strchr(option, ':');
+    if (colon) *colon = '\0';
 
-    msg_envelope_t envelope = malloc(sizeof(msg_envelope));
-    memset(envelope, 0, sizeof(msg_envelope));
-    envelope->context = context;
-    envelope->wal_pos = wal_pos;
-    envelope->relid = relid;
-    envelope->xact = xact;
-
-    void *key = NULL, *val = NULL;
-    topic_list_entry_t entry = schema_registry_encode_msg(context->registry, relid,
-            key_bin, key_len, &key, val_bin, val_len, &val);
-
-    if (!entry) {
-        fprintf(stderr, "%s: %s\n", progname, context->registry->error);
-        exit_nicely(context, 1);
+    const blob_store_ops *ops = blob_store_lookup(option);
+    if (!ops) {
+        fprintf(stderr, "%s: Unknown blob store: %s\n", progname, option);
+        exit(1);
     }
 
-    bool enqueued = false;
-    while (!enqueued) {
-        int err = rd_kafka_produce(entry->topic, RD_KAFKA_PARTITION_UA, RD_KAFKA_MSG_F_FREE,
-                val, val == NULL ? 0 : val_len + SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN,
-                key, key == NULL ? 0 : key_len + SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN,
-                envelope);
-        enqueued = (err == 0);
-
-        // If data from Postgres is coming in faster than we can send it on to Kafka, we
-        // create backpressure by blocking until the producer's queue has drained a bit.
-        if (rd_kafka_errno2err(errno) == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
-            backpressure(context);
-
-        } else if (err != 0) {
-            fprintf(stderr, "%s: Failed to produce to Kafka: %s\n",
-                progname, rd_kafka_err2str(rd_kafka_errno2err(errno)));
-            exit_nicely(context, 1);
-        }
+    context->blob_store = blob_store_new(ops, colon ? colon + 1 : NULL);
+    if (blob_store_open(context->blob_store)) {
+        fprintf(stderr, "%s: %s\n", progname, context->blob_store->error);
+        exit(1);
     }
-
-    return 0;
 }
 
-
-/* Called by Kafka producer once per message sent, to report the delivery status
- * (whether success or failure). */
-static void on_deliver_msg(rd_kafka_t *kafka, const rd_kafka_message_t *msg, void *opaque) {
-    // The pointer that is the last argument to rd_kafka_produce is passed back
-    // to us in the _private field in the struct. Seems a bit risky to rely on
-    // a field called _private, but it seems to be the only way?
-    msg_envelope_t envelope = (msg_envelope_t) msg->_private;
-
-    if (msg->err) {
-        fprintf(stderr, "%s: Message delivery failed: %s\n", progname, rd_kafka_message_errstr(msg));
-        exit_nicely(envelope->context, 1);
-    } else {
-        // Message successfully delivered to Kafka
-        envelope->xact->pending_events--;
-        maybe_checkpoint(envelope->context);
+/* Parses the value of a numeric command-line option, which must not be negative. */
+long parse_number_option(const char *option, const char *value) {
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || number < 0) {
+        fprintf(stderr, "%s: Expected a non-negative number for --%s, not \"%s\"\n",
+                progname, option, value);
+        exit(1);
     }
-    free(envelope);
+    return number;
 }
 
+/* Splits an option string by equals sign. Modifies the option argument to be
+ * only the part before the equals sign, and returns a pointer to the part after
+ * the equals sign. */
+char *parse_config_option(char *option) {
+    char *equals = strchr(option, '=');
+    if (!equals) {
+        fprintf(stderr, "%s: Expected configuration in the form property=value, not \"%s\"\n",
+                progname, option);
+        exit(1);
+    }
 
-/* When a Postgres transaction has been durably written to Kafka (i.e. we've seen the
- * commit event from Postgres, so we know the transaction is complete, and the Kafka
- * broker has acknowledged all messages in the transaction), we checkpoint it. This
- * allows the WAL for that transaction to be cleaned up in Postgres. */
-void maybe_checkpoint(producer_context_t context) {
-    transaction_info *xact = &context->xact_list[context->xact_tail];
-
-    while (xact->pending_events == 0 && (xact->commit_lsn > 0 || xact->xid == 0)) {
-
-        // Set the replication stream's "fsync LSN" (i.e. the WAL position up to which
-        // the data has been durably written). This will be sent back to Postgres in the
-        // next keepalive message, and used as the restart position if this client dies.
-        // This should ensure that no data is lost (although messages may be duplicated).
-        replication_stream_t stream = &context->client->repl;
-
-        if (stream->fsync_lsn > xact->commit_lsn) {
-            fprintf(stderr, "%s: WARNING: Commits not in WAL order! "
-                    "Checkpoint LSN is %X/%X, commit LSN is %X/%X.\n", progname,
-                    (uint32) (stream->fsync_lsn >> 32), (uint32) stream->fsync_lsn,
-                    (uint32) (xact->commit_lsn  >> 32), (uint32) xact->commit_lsn);
-        }
-
-#ifdef DEBUG
-        if (stream->fsync_lsn < xact->commit_lsn) {
-            fprintf(stderr, "Checkpointing %d events for xid %u, WAL position %X/%X.\n",
-                    xact->recvd_events, xact->xid,
-                    (uint32) (xact->commit_lsn >> 32), (uint32) xact->commit_lsn);
-        }
-#endif
-
-        stream->fsync_lsn = xact->commit_lsn;
-
-        // xid==0 is the initial snapshot transaction. Clear the flag when it's complete.
-        if (xact->xid == 0 && xact->commit_lsn > 0) {
-            context->client->taking_snapshot = false;
-        }
+    // Overwrite equals sign with null, to split key and value into two strings
+    *equals = '\0';
+    return equals + 1;
+}
 
-        if (context->xact_tail == context->xact_head) break;
+void set_kafka_config(producer_context_t context, char *property, char *value) {
+    if (rd_kafka_conf_set(context->kafka_conf, property, value,
+                context->error, PRODUCER_CONTEXT_ERROR_LEN) != RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "%s: %s\n", progname, context->error);
+        exit(1);
+    }
+}
 
-        context->xact_tail = (context->xact_tail + 1) % MAX_IN_FLIGHT_TRANSACTIONS;
-        xact = &context->xact_list[context->xact_tail];
+void set_topic_config(producer_context_t context, char *property, char *value) {
+    if (rd_kafka_topic_conf_set(context->topic_conf, property, value,
+                context->error, PRODUCER_CONTEXT_ERROR_LEN) != RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "%s: %s\n", progname, context->error);
+        exit(1);
     }
 }
 
 
 /* If the producing of messages to Kafka can't keep up with the consuming of messages from
  * Postgres, this function applies backpressure. It blocks for a little while, until a
- * timeout or until some network activity occurs in the Kafka client. At the same time, it
- * keeps the Postgres connection alive (without consuming any more data from it). This
- * function can be called in a loop until the buffer has drained. */
+ * timeout or until some network activity occurs in the Kafka client (or other sink). At
+ * the same time, it keeps the Postgres connection alive (without consuming any more data
+ * from it). This function can be called in a loop until the buffer has drained. */
 void backpressure(producer_context_t context) {
-    rd_kafka_poll(context->kafka, 200);
+    poll_sink(context, context->backpressure_ms);
+    poll_registry(context, 0);
 
     if (received_sigint) {
         fprintf(stderr, "Received interrupt during backpressure. Shutting down...\n");
         exit_nicely(context, 0);
     }
 
+    // In a pipelined client, the receiver thread takes care of keepalives.
+    if (context->client->pipeline) return;
+
     // Keep the replication connection alive, even if we're not consuming data from it.
     int err = replication_stream_keepalive(&context->client->repl);
     if (err) {
@@ -458,12 +700,7 @@ void backpressure(producer_context_t context) {
  * our connection to Postgres. */
 client_context_t init_client() {
     frame_reader_t frame_reader = frame_reader_new();
-    frame_reader->on_begin_txn    = on_begin_txn;
-    frame_reader->on_commit_txn   = on_commit_txn;
-    frame_reader->on_table_schema = on_table_schema;
-    frame_reader->on_insert_row   = on_insert_row;
-    frame_reader->on_update_row   = on_update_row;
-    frame_reader->on_delete_row   = on_delete_row;
+    frame_reader->batch_txn = true;
 
     client_context_t client = db_client_new();
     client->app_name = APP_NAME;
@@ -474,43 +711,209 @@ client_context_t init_client() {
     return client;
 }
 
-/* Initializes the producer context, which holds everything we need to know about
- * our connection to Kafka. */
-producer_context_t init_producer(client_context_t client) {
-    producer_context_t context = malloc(sizeof(producer_context));
-    memset(context, 0, sizeof(producer_context));
-    client->repl.frame_reader->cb_context = context;
-
-    context->client = client;
-    context->registry = schema_registry_new(DEFAULT_SCHEMA_REGISTRY);
-    context->brokers = DEFAULT_BROKER_LIST;
-    context->kafka_conf = rd_kafka_conf_new();
-    context->topic_conf = rd_kafka_topic_conf_new();
-    // xact_head, xact_tail and xact_list are set to zero by memset() above
-
-    set_topic_config(context, "produce.offset.report", "true");
-    rd_kafka_conf_set_dr_msg_cb(context->kafka_conf, on_deliver_msg);
-    return context;
+
+#ifdef HAVE_EPOLL
+
+/* Waits for events from Postgres and Kafka using epoll, so that each wakeup handles
+ * whatever is ready on any connection, and we never sleep while there is work to do.
+ * Postgres sockets wake us up when data arrives; librdkafka (if new enough), or with
+ * --producers the delivery threads, wake us up when delivery reports are ready; a
+ * timerfd ticks for keepalives. Returns when the replication stream ends or we are
+ * interrupted. */
+void event_loop(producer_context_t context) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        fprintf(stderr, "%s: epoll_create1() failed: %s\n", progname, strerror(errno));
+        exit_nicely(context, 1);
+    }
+
+    int tick_ms = KAFKA_POLL_INTERVAL_MS;
+    int kafka_fd = -1;
+
+    // Other sinks are polled on every tick
+    if (context->shards) {
+        // Written to by the delivery threads (see on_deliver_sharded())
+        kafka_fd = context->shard_pipe[0];
+    }
+#ifdef HAVE_KAFKA_QUEUE_EVENTS
+    else if (context->kafka) {
+        int kafka_pipe[2];
+        if (pipe(kafka_pipe) != 0 ||
+                fcntl(kafka_pipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+                fcntl(kafka_pipe[1], F_SETFL, O_NONBLOCK) != 0) {
+            fprintf(stderr, "%s: Could not create pipe: %s\n", progname, strerror(errno));
+            exit_nicely(context, 1);
+        }
+        context->kafka_queue = rd_kafka_queue_get_main(context->kafka);
+        rd_kafka_queue_io_event_enable(context->kafka_queue, kafka_pipe[1], "1", 1);
+        kafka_fd = kafka_pipe[0];
+    }
+#endif
+
+    if (kafka_fd >= 0) {
+        event_loop_add(context, epoll_fd, kafka_fd, EVENT_SOURCE_KAFKA);
+        tick_ms = KEEPALIVE_INTERVAL_MS;
+    }
+
+    // Commit Kafka transactions on time, even when idle
+    if (context->transactional && context->kafka_txn_interval > 0 &&
+            context->kafka_txn_interval < tick_ms) {
+        tick_ms = context->kafka_txn_interval;
+    }
+
+    // Send coalesced messages on time, even when idle
+    if (context->coalesce_window > 0 && context->coalesce_window < tick_ms) {
+        tick_ms = context->coalesce_window;
+    }
+
+    // Wake up often enough to send early progress updates when they become due
+    replication_stream_t stream = &context->client->repl;
+    if (stream->feedback_bytes > 0 && stream->feedback_min_interval > 0 &&
+            stream->feedback_min_interval / 1000 < tick_ms) {
+        tick_ms = stream->feedback_min_interval / 1000;
+    }
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        fprintf(stderr, "%s: timerfd_create() failed: %s\n", progname, strerror(errno));
+        exit_nicely(context, 1);
+    }
+    struct itimerspec tick;
+    tick.it_interval.tv_sec = tick_ms / 1000;
+    tick.it_interval.tv_nsec = (tick_ms % 1000) * 1000000L;
+    tick.it_value = tick.it_interval;
+    if (timerfd_settime(timer_fd, 0, &tick, NULL) != 0) {
+        fprintf(stderr, "%s: timerfd_settime() failed: %s\n", progname, strerror(errno));
+        exit_nicely(context, 1);
+    }
+    event_loop_add(context, epoll_fd, timer_fd, EVENT_SOURCE_TIMER);
+
+    int pg_fds[MAX_PG_FDS], num_pg_fds = 0;
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+
+    while (context->client->status >= 0 && !received_sigint) {
+        // Process everything that's buffered, and send a keepalive if one is due
+        ensure(context, db_client_poll(context->client));
+        maybe_report_stats(context);
+        if (poll_registry(context, 0)) produce_pending(context);
+        maybe_produce_coalesced(context);
+        drain_spool(context);
+        maybe_commit_kafka_txn(context, false);
+        if (context->client->status < 0) break;
+
+        // The set of sockets changes when the snapshot connection is closed
+        int fds[MAX_PG_FDS];
+        int num_fds = db_client_get_fds(context->client, fds, MAX_PG_FDS);
+        if (num_fds != num_pg_fds || memcmp(fds, pg_fds, num_fds * sizeof(int)) != 0) {
+            for (int i = 0; i < num_pg_fds; i++) {
+                // May fail if the socket was already closed, which removes it anyway
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pg_fds[i], NULL);
+            }
+            for (int i = 0; i < num_fds; i++) {
+                event_loop_add(context, epoll_fd, fds[i], EVENT_SOURCE_PG);
+                pg_fds[i] = fds[i];
+            }
+            num_pg_fds = num_fds;
+        }
+
+        // The registry's sockets aren't in the epoll set, so poll it on a short
+        // interval while it has requests in flight. Likewise, keep topping up the
+        // producer's queue from the spool while draining it.
+        int timeout = -1;
+        if (schema_registry_busy(context->registry)) {
+            timeout = REGISTRY_POLL_INTERVAL_MS;
+        } else if (context->spooling) {
+            timeout = SPOOL_POLL_INTERVAL_MS;
+        }
+        int num_events = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout);
+        if (num_events < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "%s: epoll_wait() failed: %s\n", progname, strerror(errno));
+            exit_nicely(context, 1);
+        }
+
+        bool pg_ready = false, kafka_ready = false;
+        for (int i = 0; i < num_events; i++) {
+            switch (events[i].data.u32) {
+                case EVENT_SOURCE_PG:
+                    pg_ready = true;
+                    break;
+                case EVENT_SOURCE_KAFKA:
+                    event_loop_drain(kafka_fd);
+                    kafka_ready = true;
+                    break;
+                case EVENT_SOURCE_TIMER:
+                    event_loop_drain(timer_fd);
+                    kafka_ready = true;
+                    break;
+            }
+        }
+
+        if (pg_ready) ensure(context, db_client_consume_input(context->client));
+        if (kafka_ready) poll_sink(context, 0);
+    }
+
+    close(timer_fd);
+    close(epoll_fd);
 }
 
-/* Connects to Kafka. This should be done before connecting to Postgres, as it
- * simply calls exit(1) on failure. */
-void start_producer(producer_context_t context) {
-    context->kafka = rd_kafka_new(RD_KAFKA_PRODUCER, context->kafka_conf,
-            context->error, PRODUCER_CONTEXT_ERROR_LEN);
-    if (!context->kafka) {
-        fprintf(stderr, "%s: Could not create Kafka producer: %s\n", progname, context->error);
-        exit(1);
+/* Registers a file descriptor with the epoll instance, to be woken up when it becomes
+ * readable. source identifies the descriptor when an event is returned. */
+void event_loop_add(producer_context_t context, int epoll_fd, int fd, uint32_t source) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = source;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        fprintf(stderr, "%s: epoll_ctl() failed: %s\n", progname, strerror(errno));
+        exit_nicely(context, 1);
     }
+}
 
-    if (rd_kafka_brokers_add(context->kafka, context->brokers) == 0) {
-        fprintf(stderr, "%s: No valid Kafka brokers specified\n", progname);
-        exit(1);
+/* Reads and discards everything that is readable on a non-blocking wakeup descriptor
+ * (a pipe or timerfd), so that it doesn't keep waking us up. */
+void event_loop_drain(int fd) {
+    char buf[64];
+    while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+#else /* HAVE_EPOLL */
+
+/* Portable event loop: polls Postgres, and waits on its sockets with select() when
+ * there is no data. Kafka delivery reports are handled once per iteration. */
+void event_loop(producer_context_t context) {
+    while (context->client->status >= 0 && !received_sigint) {
+        ensure(context, db_client_poll(context->client));
+        maybe_report_stats(context);
+        if (poll_registry(context, 0)) produce_pending(context);
+        maybe_produce_coalesced(context);
+        drain_spool(context);
+        maybe_commit_kafka_txn(context, false);
+
+        // While schema registrations are in flight, wait on those instead, briefly
+        if (schema_registry_busy(context->registry)) {
+            if (poll_registry(context, REGISTRY_POLL_INTERVAL_MS)) produce_pending(context);
+        } else if (context->spooling) {
+            poll_sink(context, SPOOL_POLL_INTERVAL_MS);
+        } else if (context->client->status == 0) {
+            ensure(context, db_client_wait(context->client));
+        }
+
+        poll_sink(context, 0);
     }
 }
 
+#endif /* HAVE_EPOLL */
+
 /* Shuts everything down and exits the process. */
 void exit_nicely(producer_context_t context, int status) {
+    db_client_stop(context->client);
+
+    // On a clean shutdown, commit what we have; otherwise it's aborted, and redone
+    // after a restart.
+    if (status == 0) maybe_commit_kafka_txn(context, true);
+
     // If a snapshot was in progress and not yet complete, and an error occurred, try to
     // drop the replication slot, so that the snapshot is retried when the user tries again.
     if (context->client->taking_snapshot && status != 0) {
@@ -521,9 +924,16 @@ void exit_nicely(producer_context_t context, int status) {
     }
 
     schema_registry_free(context->registry);
+    topic_router_free(context->router);
+    if (context->coalesce) coalesce_map_free(context->coalesce);
     frame_reader_free(context->client->repl.frame_reader);
     db_client_free(context->client);
-    if (context->kafka) rd_kafka_destroy(context->kafka);
+    sink_free(context->sink);
+
+    // Only now, since librdkafka may still have referenced messages in the spool
+    if (context->spool) spool_free(context->spool);
+    if (context->blob_store) blob_store_free(context->blob_store);
+    envelopes_free(context);
     curl_global_cleanup();
     rd_kafka_wait_destroyed(2000);
     exit(status);
@@ -540,7 +950,17 @@ int main(int argc, char **argv) {
 
     producer_context_t context = init_producer(init_client());
     parse_options(context, argc, argv);
-    start_producer(context);
+
+    if (sink_open(context->sink)) {
+        fprintf(stderr, "%s: %s\n", progname, context->sink->error);
+        exit_nicely(context, 1);
+    }
+
+    // A sink that records where to resume (like the avro sink's manifest) already has
+    // everything up to there
+    if (context->sink->tracks_lsn && context->sink->durable_lsn > context->client->resume_lsn) {
+        context->client->resume_lsn = context->sink->durable_lsn;
+    }
     ensure(context, db_client_start(context->client));
 
     replication_stream_t stream = &context->client->repl;
@@ -551,15 +971,7 @@ int main(int argc, char **argv) {
                 (uint32) (stream->start_lsn >> 32), (uint32) stream->start_lsn);
     }
 
-    while (context->client->status >= 0 && !received_sigint) {
-        ensure(context, db_client_poll(context->client));
-
-        if (context->client->status == 0) {
-            ensure(context, db_client_wait(context->client));
-        }
-
-        rd_kafka_poll(context->kafka, 0);
-    }
+    event_loop(context);
 
     if (received_sigint) {
         fprintf(stderr, "Interrupted, shutting down...\n");
@@ -0,0 +1,92 @@
+/* Keeps track of the messages that are waiting to be produced, by table and key, so
+ * that when a row changes again before its earlier message has been handed to Kafka,
+ * the new message can replace the old one (see --coalesce). On a compacted topic only
+ * the last value for each key is kept anyway, so the intermediate versions don't need
+ * to be sent at all.
+ *
+ * The map doesn't own the keys or the messages: it points at the encoded key in each
+ * message's buffer, and at the message's position in its topic's batch. It must be
+ * cleared before any of those messages are handed to the producer. */
+
+#include "coalesce.h"
+#include "partitioner.h"
+
+#include <string.h>
+
+#define INITIAL_CAPACITY 1024
+
+void coalesce_map_grow(coalesce_map_t map);
+
+
+/* Allocates an empty map. */
+coalesce_map_t coalesce_map_new() {
+    coalesce_map_t map = malloc(sizeof(coalesce_map));
+    memset(map, 0, sizeof(coalesce_map));
+    map->capacity = INITIAL_CAPACITY;
+    map->slots = calloc(map->capacity, sizeof(coalesce_slot));
+    return map;
+}
+
+
+/* Finds the slot for the given table and key. If the key is already in the map, the
+ * slot refers to the message waiting for it; otherwise, the slot is claimed for the
+ * key, and the caller must set its key and index (the key pointer must be non-NULL).
+ * The returned pointer is only valid until the next lookup. */
+coalesce_slot *coalesce_map_lookup(coalesce_map_t map, uint32_t relid, const void *key, size_t key_len) {
+    if (2 * (map->num_entries + 1) > map->capacity) coalesce_map_grow(map);
+
+    uint32_t hash = murmur2_hash(key, key_len) ^ (relid * 0x9e3779b1U);
+    int mask = map->capacity - 1;
+    map->received++;
+
+    for (int i = hash & mask; ; i = (i + 1) & mask) {
+        coalesce_slot *slot = &map->slots[i];
+        if (!slot->key) {
+            slot->hash = hash;
+            slot->relid = relid;
+            slot->key_len = key_len;
+            map->num_entries++;
+            return slot;
+        }
+
+        if (slot->hash == hash && slot->relid == relid && slot->key_len == key_len &&
+                memcmp(slot->key, key, key_len) == 0) {
+            map->coalesced++;
+            return slot;
+        }
+    }
+}
+
+
+/* Forgets all keys. The counters are kept. */
+void coalesce_map_clear(coalesce_map_t map) {
+    if (map->num_entries == 0) return;
+    memset(map->slots, 0, map->capacity * sizeof(coalesce_slot));
+    map->num_entries = 0;
+}
+
+
+/* Quadruples the size of the hash table, and re-inserts the slots in use. */
+void coalesce_map_grow(coalesce_map_t map) {
+    int old_capacity = map->capacity;
+    coalesce_slot *old_slots = map->slots;
+
+    map->capacity *= 4;
+    map->slots = calloc(map->capacity, sizeof(coalesce_slot));
+    int mask = map->capacity - 1;
+
+    for (int i = 0; i < old_capacity; i++) {
+        if (!old_slots[i].key) continue;
+        int j = old_slots[i].hash & mask;
+        while (map->slots[j].key) j = (j + 1) & mask;
+        map->slots[j] = old_slots[i];
+    }
+    free(old_slots);
+}
+
+
+/* Frees the map. */
+void coalesce_map_free(coalesce_map_t map) {
+    free(map->slots);
+    free(map);
+}
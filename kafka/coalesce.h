@@ -0,0 +1,30 @@
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct {
+    uint32_t hash;              /* Hash of relid and key (see coalesce_map_lookup()) */
+    uint32_t relid;             /* Table to which the key belongs */
+    const void *key;            /* Avro-encoded key, owned by the caller (NULL = empty slot) */
+    size_t key_len;
+    int index;                  /* Position of the latest message for this key in its batch */
+} coalesce_slot;
+
+typedef struct {
+    int num_entries;            /* Number of slots in use */
+    int capacity;               /* Allocated size of slots array (a power of two) */
+    coalesce_slot *slots;       /* Hash table, with linear probing */
+    uint64_t received;          /* Number of keyed messages looked up */
+    uint64_t coalesced;         /* Number of those that replaced an earlier message */
+} coalesce_map;
+
+typedef coalesce_map *coalesce_map_t;
+
+coalesce_map_t coalesce_map_new(void);
+coalesce_slot *coalesce_map_lookup(coalesce_map_t map, uint32_t relid, const void *key, size_t key_len);
+void coalesce_map_clear(coalesce_map_t map);
+void coalesce_map_free(coalesce_map_t map);
+
+#endif /* COALESCE_H */
@@ -0,0 +1,68 @@
+/* A histogram for latency measurements (see --stats-interval). Values below
+ * 2 * HISTOGRAM_SUB_BUCKETS have a bucket each; above that, the bucket of a value is
+ * given by the position of its highest set bit and the HISTOGRAM_SUB_BITS bits below
+ * it. Recording a value is thus a few shifts and an increment. */
+
+#include "histogram.h"
+
+#include <string.h>
+
+int histogram_bucket(uint64_t value);
+uint64_t histogram_bucket_max(int bucket);
+
+
+/* Adds one value to the histogram. */
+void histogram_record(histogram *hist, uint64_t value) {
+    hist->counts[histogram_bucket(value)]++;
+    hist->total++;
+    if (value > hist->max) hist->max = value;
+}
+
+
+/* Returns a value that at least the given percentage (0 to 100) of the recorded values
+ * are no greater than: the upper end of the bucket in which that percentile falls,
+ * but no more than the largest value recorded. Returns 0 if the histogram is empty. */
+uint64_t histogram_percentile(const histogram *hist, double percentile) {
+    if (hist->total == 0) return 0;
+
+    uint64_t rank = (uint64_t) (percentile / 100.0 * hist->total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > hist->total) rank = hist->total;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            uint64_t value = histogram_bucket_max(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+
+/* Forgets all recorded values. */
+void histogram_reset(histogram *hist) {
+    memset(hist, 0, sizeof(histogram));
+}
+
+
+int histogram_bucket(uint64_t value) {
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) return value;
+
+    int top = 63 - __builtin_clzll(value); /* Position of the highest set bit */
+    int shift = top - HISTOGRAM_SUB_BITS;
+    return 2 * HISTOGRAM_SUB_BUCKETS + (shift - 1) * HISTOGRAM_SUB_BUCKETS +
+        (int) ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+
+/* Returns the largest value that falls into the given bucket. */
+uint64_t histogram_bucket_max(int bucket) {
+    if (bucket < 2 * HISTOGRAM_SUB_BUCKETS) return bucket;
+
+    int shift = (bucket - 2 * HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS + 1;
+    uint64_t sub = (bucket - 2 * HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_SUB_BUCKETS;
+    uint64_t next = (HISTOGRAM_SUB_BUCKETS + sub + 1) << shift;
+    return next - 1;
+}
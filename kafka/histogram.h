@@ -0,0 +1,23 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (2 * HISTOGRAM_SUB_BUCKETS + (64 - HISTOGRAM_SUB_BITS - 1) * HISTOGRAM_SUB_BUCKETS)
+
+/* Counts of values (e.g. latencies in microseconds) in logarithmic buckets, each power
+ * of two being split into HISTOGRAM_SUB_BUCKETS, so that percentiles can be read off
+ * to within 1/HISTOGRAM_SUB_BUCKETS of the true value, in constant memory. */
+typedef struct {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;             /* Number of values recorded */
+    uint64_t max;               /* Largest value recorded */
+} histogram;
+
+void histogram_record(histogram *hist, uint64_t value);
+uint64_t histogram_percentile(const histogram *hist, double percentile);
+void histogram_reset(histogram *hist);
+
+#endif /* HISTOGRAM_H */
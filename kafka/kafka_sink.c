@@ -0,0 +1,925 @@
+/* The Kafka sink, which is the default destination for messages (see sink.h for the
+ * others). Messages are handed to librdkafka in batches, one producer per topic with
+ * --producers, each with a delivery thread of its own (a shard). If Kafka can't keep
+ * up, messages are written to the spool (--spool-dir) and drained back into Kafka once
+ * it recovers. With --kafka-txn, messages are produced in Kafka transactions, and the
+ * WAL position up to which they have been committed is kept in a control topic. */
+
+#include "producer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KAFKA_TXN_COMMIT_TIMEOUT_MS 10    /* How long the event loop waits for a commit at a time */
+#define KAFKA_TXN_SHUTDOWN_TIMEOUT_MS 30000 /* ...and how long a clean shutdown waits for one */
+#define KAFKA_TXN_TIMEOUT_MS 60000
+#define SHARD_POLL_INTERVAL_MS 100 /* How often delivery threads check for shutdown */
+#define TABLE_HEADER "bottledwater.table" /* Message header naming the table ("schema.table") */
+#define RELID_HEADER "bottledwater.relid" /* Message header with the table's Postgres OID */
+
+/* With --txn-headers, messages carry their position in the Postgres commit order as
+ * big-endian binary integers, so that consumers can drop duplicates (after a restart,
+ * or when messages were spooled) with (lsn, seq) > last seen, per partition. */
+#define TXN_LSN_HEADER "bottledwater.lsn"   /* 8 bytes: WAL position of the commit */
+#define TXN_XID_HEADER "bottledwater.xid"   /* 4 bytes: Postgres transaction ID (0 = snapshot) */
+#define TXN_SEQ_HEADER "bottledwater.seq"   /* 8 bytes: number of the change within its transaction, from 1 */
+#define TXN_TIME_HEADER "bottledwater.commit-time" /* 8 bytes: microseconds since the Unix epoch */
+#define SPOOL_DRAIN_QUEUE_LEN 10000 /* Messages from the spool in the producer's queue at most */
+#define SPOOL_RETRY_MS 5000        /* Wait after a failed delivery before draining the spool again */
+
+static int32_t on_partition_msg(const rd_kafka_topic_t *topic, const void *key, size_t key_len,
+        int32_t partition_cnt, void *topic_opaque, void *msg_opaque);
+static void on_deliver_msg(rd_kafka_t *kafka, const rd_kafka_message_t *msg, void *envelope);
+static void on_deliver_sharded(rd_kafka_t *kafka, const rd_kafka_message_t *msg, void *_shard);
+void *serve_shard(void *_shard);
+void poll_shards(producer_context_t context, int timeout_ms);
+rd_kafka_t *topic_producer(producer_context_t context, const char *topic_name);
+void claim_check_batch(producer_context_t context, topic_list_entry_t entry);
+static int kafka_sink_open(sink_t sink);
+static int kafka_sink_schema(sink_t sink, topic_list_entry_t entry,
+        const char *row_schema_json, size_t row_schema_len);
+static int kafka_sink_produce(sink_t sink, topic_list_entry_t entry);
+static int kafka_sink_poll(sink_t sink, int timeout_ms);
+static void kafka_sink_close(sink_t sink);
+#ifdef HAVE_KAFKA_HEADERS
+void produce_with_headers(producer_context_t context, topic_list_entry_t entry);
+void add_table_headers(rd_kafka_headers_t *headers, const char *table_name, Oid relid);
+void add_txn_headers(rd_kafka_headers_t *headers, uint32_t xid, uint64_t commit_lsn,
+        int64_t commit_time, uint64_t seq);
+void encode_big_endian(uint64_t value, char *buf, int len);
+#endif
+void spool_batch(producer_context_t context, topic_list_entry_t entry, int start);
+void spool_msg(producer_context_t context, msg_envelope_t envelope, const char *topic_name,
+        const char *table_name, const void *val, size_t val_len, const void *key, size_t key_len);
+bool produce_spooled(producer_context_t context, spool_record *record);
+bool delivery_error_retriable(rd_kafka_resp_err_t err);
+#ifdef HAVE_KAFKA_TRANSACTIONS
+uint64_t read_control_topic(producer_context_t context, rd_kafka_conf_t *conf);
+void produce_control_msg(producer_context_t context, uint64_t lsn);
+void check_kafka_error(producer_context_t context, rd_kafka_error_t *error, const char *what);
+#endif
+void start_producer(producer_context_t context);
+void start_shards(producer_context_t context);
+
+const sink_ops kafka_sink_ops = {"kafka", kafka_sink_open, kafka_sink_schema,
+    kafka_sink_produce, NULL, kafka_sink_poll, kafka_sink_close};
+
+
+/* Sets up the configuration of the Kafka producer, which command-line options may
+ * then add to (see set_kafka_config() and set_topic_config()). */
+void kafka_sink_init(producer_context_t context) {
+    context->kafka_conf = rd_kafka_conf_new();
+    context->topic_conf = rd_kafka_topic_conf_new();
+
+    if (rd_kafka_topic_conf_set(context->topic_conf, "produce.offset.report", "true",
+                context->error, PRODUCER_CONTEXT_ERROR_LEN) != RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "%s: %s\n", progname, context->error);
+        exit(1);
+    }
+    rd_kafka_conf_set_dr_msg_cb(context->kafka_conf, on_deliver_msg);
+}
+
+
+/* Chooses the partition for a message, if --partitioner or --partition-column was
+ * given (see start_producer()). librdkafka may call this on one of its own threads
+ * (if the topic's metadata wasn't available when the message was produced), so it
+ * only looks at the envelope and at settings that don't change after startup. */
+static int32_t on_partition_msg(const rd_kafka_topic_t *topic, const void *key, size_t key_len,
+        int32_t partition_cnt, void *topic_opaque, void *msg_opaque) {
+    msg_envelope_t envelope = (msg_envelope_t) msg_opaque;
+    if (envelope->has_partition_hash) {
+        return murmur2_partition(envelope->partition_hash, partition_cnt);
+    }
+
+    partitioner_fn partitioner = envelope->context->partitioner;
+    if (!partitioner) partitioner = partitioner_murmur2;
+    return partitioner(topic, key, key_len, partition_cnt, topic_opaque, msg_opaque);
+}
+
+
+/* Moves values that are too big for Kafka to the blob store, replacing each with a
+ * reference to it (see client/blob_store.c). The reference overwrites the start of the
+ * value in the envelope's buffer. This happens only now that the schema IDs in the
+ * values are final, and before anything could have been spooled. */
+void claim_check_batch(producer_context_t context, topic_list_entry_t entry) {
+    for (int i = 0; i < entry->batch_len; i++) {
+        rd_kafka_message_t *msg = &entry->batch[i];
+        if (!msg->payload || msg->len <= context->claim_check_threshold) continue;
+
+        if (blob_store_put(context->blob_store, msg->payload, msg->len, msg->payload)) {
+            fprintf(stderr, "%s: %s\n", progname, context->blob_store->error);
+            exit_nicely(context, 1);
+        }
+        msg->len = BLOB_REF_LEN;
+    }
+}
+
+
+/* Creates the Kafka topic for a table, unless it already has one. */
+static int kafka_sink_schema(sink_t sink, topic_list_entry_t entry,
+        const char *row_schema_json, size_t row_schema_len) {
+    producer_context_t context = (producer_context_t) sink->cb_context;
+    if (entry->topic) return 0;
+
+    entry->topic = rd_kafka_topic_new(topic_producer(context, entry->topic_name),
+            entry->topic_name, rd_kafka_topic_conf_dup(context->topic_conf));
+    if (!entry->topic) {
+        sink_error(sink, "Cannot open Kafka topic %s: %s", entry->topic_name,
+                rd_kafka_err2str(rd_kafka_errno2err(errno)));
+        return EIO;
+    }
+    return 0;
+}
+
+
+/* Hands a topic's batch of messages to librdkafka. If its queue fills up part-way
+ * through, applies backpressure and retries the rejected messages, in their original
+ * order, until all have been accepted; or, with --spool-dir, writes them to the spool
+ * instead. */
+static int kafka_sink_produce(sink_t sink, topic_list_entry_t entry) {
+    producer_context_t context = (producer_context_t) sink->cb_context;
+    rd_kafka_message_t *msgs = entry->batch;
+    kafka_txn_begin(context);
+    if (context->blob_store) claim_check_batch(context, entry);
+
+    // Until the spool has been drained, newer messages must queue up behind it
+    if (context->spooling) {
+        spool_batch(context, entry, 0);
+        return 0;
+    }
+
+#ifdef HAVE_KAFKA_HEADERS
+    if (context->table_headers || context->txn_headers) {
+        produce_with_headers(context, entry);
+        return 0;
+    }
+#endif
+
+    while (entry->batch_len > 0) {
+        int count = entry->batch_len;
+        int enqueued = rd_kafka_produce_batch(entry->topic, RD_KAFKA_PARTITION_UA, 0, msgs, count);
+        if (enqueued == count) break;
+
+        // Compact the rejected messages to the front of the batch. Queue space
+        // is only released when we serve delivery reports on this thread, so once the
+        // queue is full, later messages are normally rejected too.
+        int retry = 0;
+        for (int i = 0; i < count; i++) {
+            if (!msgs[i].err) continue;
+
+            if (msgs[i].err != RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+                fprintf(stderr, "%s: Failed to produce to Kafka: %s\n",
+                        progname, rd_kafka_err2str(msgs[i].err));
+                exit_nicely(context, 1);
+            }
+            msgs[retry] = msgs[i];
+            msgs[retry].err = 0;
+            retry++;
+        }
+        entry->batch_len = retry;
+
+        if (context->spool) {
+            start_spooling(context, "Kafka producer queue is full");
+            spool_batch(context, entry, 0);
+            return 0;
+        }
+
+        // If data from Postgres is coming in faster than we can send it on to Kafka, we
+        // create backpressure by blocking until the producer's queue has drained a bit.
+        backpressure(context);
+    }
+
+    entry->batch_len = 0;
+    return 0;
+}
+
+
+#ifdef HAVE_KAFKA_HEADERS
+/* Like kafka_sink_produce() (to which produce_topic_batch() in producer.c hands the
+ * batch), but tags each message with headers identifying its table, so that consumers
+ * can tell apart the tables that share a topic when routing or structural schemas are
+ * configured, and with --txn-headers, its transaction. rd_kafka_produce_batch() can't
+ * attach headers, so the messages are produced one at a time. */
+void produce_with_headers(producer_context_t context, topic_list_entry_t entry) {
+    int i = 0;
+    while (i < entry->batch_len) {
+        rd_kafka_message_t *msg = &entry->batch[i];
+        msg_envelope_t envelope = (msg_envelope_t) msg->_private;
+        rd_kafka_headers_t *headers = rd_kafka_headers_new(6);
+        if (context->table_headers) add_table_headers(headers, entry->table_name, entry->relid);
+        if (context->txn_headers) {
+            add_txn_headers(headers, envelope->xact->xid, envelope->xact->end_lsn,
+                    envelope->xact->commit_time, envelope->seq);
+        }
+
+        rd_kafka_resp_err_t err = rd_kafka_producev(topic_producer(context, entry->topic_name),
+                RD_KAFKA_V_RKT(entry->topic),
+                RD_KAFKA_V_VALUE(msg->payload, msg->len),
+                RD_KAFKA_V_KEY(msg->key, msg->key_len),
+                RD_KAFKA_V_OPAQUE(envelope),
+                RD_KAFKA_V_HEADERS(headers),
+                RD_KAFKA_V_END);
+        if (err) rd_kafka_headers_destroy(headers);
+
+        if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL && context->spool) {
+            start_spooling(context, "Kafka producer queue is full");
+            spool_batch(context, entry, i);
+            return;
+        } else if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            backpressure(context);
+        } else if (err) {
+            fprintf(stderr, "%s: Failed to produce to Kafka: %s\n", progname, rd_kafka_err2str(err));
+            exit_nicely(context, 1);
+        } else {
+            i++;
+        }
+    }
+
+    entry->batch_len = 0;
+}
+
+
+/* Adds headers naming a message's table (see TABLE_HEADER and RELID_HEADER). */
+void add_table_headers(rd_kafka_headers_t *headers, const char *table_name, Oid relid) {
+    char relid_str[16];
+    snprintf(relid_str, sizeof(relid_str), "%u", relid);
+    rd_kafka_header_add(headers, TABLE_HEADER, -1, table_name, -1);
+    rd_kafka_header_add(headers, RELID_HEADER, -1, relid_str, -1);
+}
+
+
+/* Adds headers with a message's position in the commit order (see TXN_LSN_HEADER). */
+void add_txn_headers(rd_kafka_headers_t *headers, uint32_t xid, uint64_t commit_lsn,
+        int64_t commit_time, uint64_t seq) {
+    char lsn_buf[8], xid_buf[4], seq_buf[8], time_buf[8];
+    encode_big_endian(commit_lsn, lsn_buf, 8);
+    encode_big_endian(xid, xid_buf, 4);
+    encode_big_endian(seq, seq_buf, 8);
+    encode_big_endian((uint64_t) commit_time, time_buf, 8);
+    rd_kafka_header_add(headers, TXN_LSN_HEADER, -1, lsn_buf, 8);
+    rd_kafka_header_add(headers, TXN_XID_HEADER, -1, xid_buf, 4);
+    rd_kafka_header_add(headers, TXN_SEQ_HEADER, -1, seq_buf, 8);
+    rd_kafka_header_add(headers, TXN_TIME_HEADER, -1, time_buf, 8);
+}
+
+
+/* Writes the low len bytes of value into buf, most significant first. */
+void encode_big_endian(uint64_t value, char *buf, int len) {
+    for (int i = 0; i < len; i++) {
+        buf[i] = (value >> (8 * (len - 1 - i))) & 0xff;
+    }
+}
+#endif
+
+
+/* Switches to writing messages to the spool (see --spool-dir), because Kafka is
+ * unavailable or can't keep up. They are sent on once it has recovered, after a short
+ * wait. May be called from the delivery report callback. */
+void start_spooling(producer_context_t context, const char *reason) {
+    context->spool_retry_at = current_time_ms() + SPOOL_RETRY_MS;
+    if (context->spooling) return;
+
+    fprintf(stderr, "%s; writing messages to spool %s until Kafka has caught up.\n",
+            reason, context->spool->dir);
+    context->spooling = true;
+    context->spool_purge_due = true;
+}
+
+
+/* Writes the messages in a topic's batch, from index start onwards, to the spool
+ * instead of handing them to librdkafka. Once they are on disk, they count as
+ * acknowledged, so Postgres can release the WAL behind them. */
+void spool_batch(producer_context_t context, topic_list_entry_t entry, int start) {
+#ifdef HAVE_KAFKA_PURGE
+    // Messages still waiting in the producer's queue are older than this batch, so
+    // they have to go to the spool first: purging them fails their deliveries, and
+    // on_deliver_msg() spools them.
+    if (context->spool_purge_due) {
+        context->spool_purge_due = false;
+        rd_kafka_purge(context->kafka, RD_KAFKA_PURGE_F_QUEUE);
+        rd_kafka_poll(context->kafka, 0);
+    }
+#endif
+
+    for (int i = start; i < entry->batch_len; i++) {
+        rd_kafka_message_t *msg = &entry->batch[i];
+        spool_msg(context, (msg_envelope_t) msg->_private, entry->topic_name, entry->table_name,
+                msg->payload, msg->len, msg->key, msg->key_len);
+    }
+
+    if (spool_sync(context->spool)) {
+        fprintf(stderr, "%s: %s\n", progname, context->spool->error);
+        exit_nicely(context, 1);
+    }
+
+    for (int i = start; i < entry->batch_len; i++) {
+        msg_envelope_t envelope = (msg_envelope_t) entry->batch[i]._private;
+        __atomic_sub_fetch(&envelope->xact->pending_events, 1, __ATOMIC_RELAXED);
+        envelope_put(context, envelope);
+    }
+    entry->batch_len = 0;
+    maybe_checkpoint(context);
+}
+
+
+/* Appends one message to the spool. The caller must spool_sync() before treating it
+ * as acknowledged. */
+void spool_msg(producer_context_t context, msg_envelope_t envelope, const char *topic_name,
+        const char *table_name, const void *val, size_t val_len, const void *key, size_t key_len) {
+    spool_record record;
+    memset(&record, 0, sizeof(record));
+    record.wal_pos = envelope->wal_pos;
+    record.relid = envelope->relid;
+    record.has_partition_hash = envelope->has_partition_hash;
+    record.partition_hash = envelope->partition_hash;
+    if (context->txn_headers) {
+        record.has_txn = true;
+        record.xid = envelope->xact->xid;
+        record.commit_lsn = envelope->xact->end_lsn;
+        record.commit_time = envelope->xact->commit_time;
+        record.seq = envelope->seq;
+    }
+    record.topic_name = topic_name;
+    record.table_name = table_name ? table_name : "";
+    record.key = key;
+    record.key_len = key_len;
+    record.val = val;
+    record.val_len = val_len;
+
+    if (spool_append(context->spool, &record)) {
+        fprintf(stderr, "%s: %s\n", progname, context->spool->error);
+        exit_nicely(context, 1);
+    }
+}
+
+
+/* Sends messages from the spool on to Kafka, keeping at most SPOOL_DRAIN_QUEUE_LEN of
+ * them in the producer's queue at a time. Once all of them have been delivered, new
+ * messages are sent to Kafka directly again. */
+void drain_spool(producer_context_t context) {
+    if (!context->spooling || current_time_ms() < context->spool_retry_at) return;
+
+    spool_record record;
+    while (rd_kafka_outq_len(context->kafka) < SPOOL_DRAIN_QUEUE_LEN &&
+            spool_read(context->spool, &record)) {
+        if (!produce_spooled(context, &record)) {
+            spool_unread(context->spool, &record);
+            break;
+        }
+    }
+
+    if (spool_drained(context->spool)) {
+        fprintf(stderr, "Spool drained, sending messages to Kafka directly again.\n");
+        context->spooling = false;
+    }
+}
+
+
+/* Hands one message read from the spool to librdkafka, without copying it (the
+ * record stays mapped until it is acknowledged). Returns false if the producer's
+ * queue is full. */
+bool produce_spooled(producer_context_t context, spool_record *record) {
+    if (!context->spool_topic || strcmp(rd_kafka_topic_name(context->spool_topic), record->topic_name) != 0) {
+        if (context->spool_topic) rd_kafka_topic_destroy(context->spool_topic);
+        context->spool_topic = rd_kafka_topic_new(context->kafka, record->topic_name,
+                rd_kafka_topic_conf_dup(context->topic_conf));
+        if (!context->spool_topic) {
+            fprintf(stderr, "%s: Cannot open Kafka topic %s: %s\n", progname,
+                    record->topic_name, rd_kafka_err2str(rd_kafka_errno2err(errno)));
+            exit_nicely(context, 1);
+        }
+    }
+
+    msg_envelope_t envelope = envelope_get(context);
+    envelope->wal_pos = record->wal_pos;
+    envelope->relid = record->relid;
+    envelope->has_partition_hash = record->has_partition_hash;
+    envelope->partition_hash = record->partition_hash;
+    envelope->spool_segment = record->segment;
+
+    rd_kafka_resp_err_t err = RD_KAFKA_RESP_ERR_NO_ERROR;
+#ifdef HAVE_KAFKA_HEADERS
+    // Records spooled before --txn-headers was given have no transaction to report
+    bool txn_headers = context->txn_headers && record->has_txn;
+    if (context->table_headers || txn_headers) {
+        rd_kafka_headers_t *headers = rd_kafka_headers_new(6);
+        if (context->table_headers) add_table_headers(headers, record->table_name, record->relid);
+        if (txn_headers) {
+            add_txn_headers(headers, record->xid, record->commit_lsn, record->commit_time,
+                    record->seq);
+        }
+
+        err = rd_kafka_producev(context->kafka,
+                RD_KAFKA_V_RKT(context->spool_topic),
+                RD_KAFKA_V_VALUE((void *) record->val, record->val_len),
+                RD_KAFKA_V_KEY(record->key, record->key_len),
+                RD_KAFKA_V_OPAQUE(envelope),
+                RD_KAFKA_V_HEADERS(headers),
+                RD_KAFKA_V_END);
+        if (err) rd_kafka_headers_destroy(headers);
+    } else
+#endif
+    if (rd_kafka_produce(context->spool_topic, RD_KAFKA_PARTITION_UA, 0, (void *) record->val,
+                record->val_len, record->key, record->key_len, envelope) != 0) {
+        err = rd_kafka_errno2err(errno);
+    }
+
+    if (err == RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+        envelope_put(context, envelope);
+        return false;
+    } else if (err) {
+        fprintf(stderr, "%s: Failed to produce to Kafka: %s\n", progname, rd_kafka_err2str(err));
+        exit_nicely(context, 1);
+    }
+    return true;
+}
+
+
+/* Returns true if a delivery failure means that Kafka is unavailable (or was too slow),
+ * rather than that something is wrong with the message, so that it is worth keeping
+ * the message in the spool and trying again later. */
+bool delivery_error_retriable(rd_kafka_resp_err_t err) {
+    switch (err) {
+        case RD_KAFKA_RESP_ERR__MSG_TIMED_OUT:
+        case RD_KAFKA_RESP_ERR__TRANSPORT:
+        case RD_KAFKA_RESP_ERR__ALL_BROKERS_DOWN:
+#ifdef HAVE_KAFKA_PURGE
+        case RD_KAFKA_RESP_ERR__PURGE_QUEUE:
+        case RD_KAFKA_RESP_ERR__PURGE_INFLIGHT:
+#endif
+        case RD_KAFKA_RESP_ERR_LEADER_NOT_AVAILABLE:
+        case RD_KAFKA_RESP_ERR_NOT_LEADER_FOR_PARTITION:
+        case RD_KAFKA_RESP_ERR_REQUEST_TIMED_OUT:
+        case RD_KAFKA_RESP_ERR_NOT_ENOUGH_REPLICAS:
+        case RD_KAFKA_RESP_ERR_NOT_ENOUGH_REPLICAS_AFTER_APPEND:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+/* Called by Kafka producer once per message sent, to report the delivery status
+ * (whether success or failure). Unless the spool is involved, the outcome is passed
+ * on to on_sink_ack(). */
+static void on_deliver_msg(rd_kafka_t *kafka, const rd_kafka_message_t *msg, void *opaque) {
+    // The envelope pointer we put in the _private field of the message passed to
+    // rd_kafka_produce_batch is passed back to us in the same field. Seems a bit
+    // risky to rely on a field called _private, but it seems to be the only way?
+    msg_envelope_t envelope = (msg_envelope_t) msg->_private;
+    producer_context_t context = envelope->context;
+
+    // A message from the spool stays there until it has been delivered; if it wasn't,
+    // the spool is sent again from the start, after a pause.
+    if (envelope->spool_segment && (!msg->err || delivery_error_retriable(msg->err))) {
+        if (msg->err) start_spooling(context, rd_kafka_message_errstr(msg));
+        spool_ack(context->spool, envelope->spool_segment, !msg->err);
+
+    } else if (msg->err && envelope->xact && context->spool && delivery_error_retriable(msg->err)) {
+        // Kafka is unavailable, so keep the message in the spool until it is back
+        const char *table_name = NULL;
+        topic_list_entry_t entry = schema_registry_lookup(context->registry, envelope->relid);
+        if (entry) table_name = entry->table_name;
+
+        start_spooling(context, rd_kafka_message_errstr(msg));
+        spool_msg(context, envelope, rd_kafka_topic_name(msg->rkt), table_name,
+                msg->payload, msg->len, msg->key, msg->key_len);
+        if (spool_sync(context->spool)) {
+            fprintf(stderr, "%s: %s\n", progname, context->spool->error);
+            exit_nicely(context, 1);
+        }
+        __atomic_sub_fetch(&envelope->xact->pending_events, 1, __ATOMIC_RELAXED);
+        maybe_checkpoint(context);
+
+    } else {
+        sink_ack(context->sink, envelope, msg->err ? rd_kafka_message_errstr(msg) : NULL);
+        return;
+    }
+    envelope_put(context, envelope);
+}
+
+
+/* Called on a shard's delivery thread (see --producers) once per message sent. Only
+ * counts down the transaction's pending events, and leaves the rest to the main thread
+ * (see poll_shards()): the envelope is pushed onto the shard's acked list, and if the
+ * list was empty, the main thread is woken up. */
+static void on_deliver_sharded(rd_kafka_t *kafka, const rd_kafka_message_t *msg, void *_shard) {
+    producer_shard *shard = (producer_shard *) _shard;
+    msg_envelope_t envelope = (msg_envelope_t) msg->_private;
+
+    // A failed message is reported by on_sink_ack(), which also counts it down
+    envelope->err = msg->err;
+    if (!msg->err) __atomic_sub_fetch(&envelope->xact->pending_events, 1, __ATOMIC_RELEASE);
+
+    msg_envelope_t head = __atomic_load_n(&shard->acked, __ATOMIC_RELAXED);
+    do {
+        envelope->next_free = head;
+    } while (!__atomic_compare_exchange_n(&shard->acked, &head, envelope, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // If the pipe is full, the main thread is going to wake up anyway
+    if (!head && write(shard->context->shard_pipe[1], "1", 1) < 0) return;
+}
+
+
+/* Body of a shard's delivery thread, which serves the delivery reports of its
+ * producer until kafka_sink_close() stops it. */
+void *serve_shard(void *_shard) {
+    producer_shard *shard = (producer_shard *) _shard;
+    while (!__atomic_load_n(&shard->context->shards_stopping, __ATOMIC_ACQUIRE)) {
+        rd_kafka_poll(shard->kafka, SHARD_POLL_INTERVAL_MS);
+    }
+    return NULL;
+}
+
+
+/* Recycles the envelopes that the delivery threads have handed back, waiting up to
+ * timeout_ms for some if there are none. The wakeup pipe is drained before the lists
+ * are taken, so that a message delivered meanwhile wakes us up again. */
+void poll_shards(producer_context_t context, int timeout_ms) {
+    bool any = false;
+    for (int i = 0; i < context->num_shards && !any; i++) {
+        any = __atomic_load_n(&context->shards[i].acked, __ATOMIC_RELAXED) != NULL;
+    }
+
+    if (!any && timeout_ms > 0) {
+        struct pollfd fd = {context->shard_pipe[0], POLLIN, 0};
+        if (poll(&fd, 1, timeout_ms) > 0) {
+            char buf[64];
+            while (read(context->shard_pipe[0], buf, sizeof(buf)) > 0);
+        }
+    }
+
+    for (int i = 0; i < context->num_shards; i++) {
+        msg_envelope_t envelope = __atomic_exchange_n(&context->shards[i].acked, NULL, __ATOMIC_ACQUIRE);
+        while (envelope) {
+            msg_envelope_t next = envelope->next_free;
+            if (envelope->err) {
+                sink_ack(context->sink, envelope, rd_kafka_err2str(envelope->err));
+            } else {
+                context->acked_msgs++;
+                context->acked_bytes += envelope->msg_size;
+                envelope_put(context, envelope);
+            }
+            envelope = next;
+        }
+    }
+    maybe_checkpoint(context);
+}
+
+
+/* Returns the producer for a topic: with --producers, topics are assigned to the
+ * producers by the hash of their name, so that each topic's messages (and thus each
+ * partition's) go through a single producer, in order. */
+rd_kafka_t *topic_producer(producer_context_t context, const char *topic_name) {
+    if (!context->shards) return context->kafka;
+    uint32_t hash = murmur2_hash(topic_name, strlen(topic_name));
+    return context->shards[murmur2_partition(hash, context->num_shards)].kafka;
+}
+
+
+/* Begins a Kafka transaction, if we're in transactional mode and one isn't open
+ * already. Called before any message is handed to the producer. */
+void kafka_txn_begin(producer_context_t context) {
+#ifdef HAVE_KAFKA_TRANSACTIONS
+    if (!context->transactional || context->kafka_txn_open) return;
+
+    // No messages can be produced until the previous transaction has committed
+    while (context->kafka_txn_committing) {
+        maybe_commit_kafka_txn(context, false);
+        if (context->kafka_txn_committing) backpressure(context);
+    }
+
+    check_kafka_error(context, rd_kafka_begin_transaction(context->kafka),
+            "Could not begin Kafka transaction");
+    context->kafka_txn_open = true;
+    context->kafka_txn_started = current_time_ms();
+#endif
+}
+
+
+/* Commits the open Kafka transaction once it has been open for --kafka-txn-interval
+ * (or right away if force is set), along with a message on the control topic that
+ * records the commit LSN of the last Postgres transaction in it. Kafka transactions
+ * only ever end between Postgres transactions, so that the recorded LSN is exactly
+ * where to resume; the one exception is the initial snapshot, which may be too big
+ * for one Kafka transaction, and is redone from scratch if it doesn't complete.
+ *
+ * The commit has to wait until Kafka has acknowledged all of the transaction's
+ * messages. So that the event loop can meanwhile keep receiving from Postgres and
+ * sending it feedback, it only waits KAFKA_TXN_COMMIT_TIMEOUT_MS at a time; until
+ * the commit completes, it is retried by each call (kafka_txn_begin() waits for it). */
+void maybe_commit_kafka_txn(producer_context_t context, bool force) {
+#ifdef HAVE_KAFKA_TRANSACTIONS
+    uint64_t lsn = context->kafka_txn_lsn;
+
+    if (context->kafka_txn_open) {
+        if (context->pg_txn_open && context->pg_txn_xid != 0) return;
+        if (!force && current_time_ms() - context->kafka_txn_started < context->kafka_txn_interval) {
+            return;
+        }
+        if (lsn > context->kafka_committed_lsn) produce_control_msg(context, lsn);
+
+        // From here on, kafka_txn_lsn stays put until the commit is done
+        context->kafka_txn_open = false;
+        context->kafka_txn_committing = true;
+    }
+    if (!context->kafka_txn_committing) return;
+
+    // If the commit fails other than by timing out, we exit and start again from the
+    // last LSN that did make it into the control topic.
+    rd_kafka_error_t *error = rd_kafka_commit_transaction(context->kafka,
+            force ? KAFKA_TXN_SHUTDOWN_TIMEOUT_MS : KAFKA_TXN_COMMIT_TIMEOUT_MS);
+    if (error && !force && rd_kafka_error_is_retriable(error)) {
+        rd_kafka_error_destroy(error);
+        return;
+    }
+    check_kafka_error(context, error, "Could not commit Kafka transaction");
+    context->kafka_txn_committing = false;
+    context->kafka_committed_lsn = lsn;
+
+    // Deliveries have usually been acknowledged before the transaction committed
+    rd_kafka_poll(context->kafka, 0);
+    update_fsync_lsn(context, context->acked_lsn);
+#endif
+}
+
+
+#ifdef HAVE_KAFKA_TRANSACTIONS
+/* Produces the message on the control topic that records the LSN up to which the
+ * open Kafka transaction contains the replication stream. */
+void produce_control_msg(producer_context_t context, uint64_t lsn) {
+    char key[NAMEDATALEN], value[32];
+    int key_len = snprintf(key, sizeof(key), "%s", context->client->repl.slot_name);
+    int value_len = snprintf(value, sizeof(value), "%X/%X", (uint32) (lsn >> 32), (uint32) lsn);
+
+    msg_envelope_t envelope = envelope_get(context);
+    while (rd_kafka_produce(context->control_topic, 0, RD_KAFKA_MSG_F_COPY,
+                value, value_len, key, key_len, envelope) != 0) {
+        if (rd_kafka_errno2err(errno) != RD_KAFKA_RESP_ERR__QUEUE_FULL) {
+            fprintf(stderr, "%s: Failed to produce to control topic: %s\n",
+                    progname, rd_kafka_err2str(rd_kafka_errno2err(errno)));
+            exit_nicely(context, 1);
+        }
+        backpressure(context);
+    }
+}
+#endif
+
+
+#ifdef HAVE_KAFKA_TRANSACTIONS
+/* Exits with an error message if a transactional API call failed. */
+void check_kafka_error(producer_context_t context, rd_kafka_error_t *error, const char *what) {
+    if (!error) return;
+    fprintf(stderr, "%s: %s: %s\n", progname, what, rd_kafka_error_string(error));
+    rd_kafka_error_destroy(error);
+    exit_nicely(context, 1);
+}
+#endif
+
+
+#ifdef HAVE_KAFKA_TRANSACTIONS
+/* Reads the LSN that was recorded in the control topic by the last Kafka transaction
+ * that committed for our replication slot, or returns 0 if there is none. Must be
+ * called after the transactional producer has been initialized, since that aborts
+ * any transaction left open by a previous instance. Takes ownership of conf. */
+uint64_t read_control_topic(producer_context_t context, rd_kafka_conf_t *conf) {
+    const char *slot_name = context->client->repl.slot_name;
+    size_t slot_len = strlen(slot_name);
+    char error[PRODUCER_CONTEXT_ERROR_LEN];
+    uint64_t lsn = 0;
+
+    if (rd_kafka_conf_set(conf, "isolation.level", "read_committed", error, sizeof(error)) != RD_KAFKA_CONF_OK ||
+            rd_kafka_conf_set(conf, "enable.partition.eof", "true", error, sizeof(error)) != RD_KAFKA_CONF_OK) {
+        fprintf(stderr, "%s: Could not configure control topic consumer: %s\n", progname, error);
+        exit_nicely(context, 1);
+    }
+
+    rd_kafka_t *consumer = rd_kafka_new(RD_KAFKA_CONSUMER, conf, error, sizeof(error));
+    if (!consumer) {
+        fprintf(stderr, "%s: Could not create Kafka consumer: %s\n", progname, error);
+        exit_nicely(context, 1);
+    }
+    rd_kafka_brokers_add(consumer, context->brokers);
+
+    int64_t low, high;
+    rd_kafka_resp_err_t err = rd_kafka_query_watermark_offsets(consumer,
+            context->control_topic_name, 0, &low, &high, 10000);
+    if (err == RD_KAFKA_RESP_ERR_UNKNOWN_TOPIC_OR_PART) {
+        low = high = 0;
+    } else if (err) {
+        fprintf(stderr, "%s: Could not query control topic %s: %s\n", progname,
+                context->control_topic_name, rd_kafka_err2str(err));
+        exit_nicely(context, 1);
+    }
+
+    // Each Kafka transaction adds a control message and a commit marker, perhaps
+    // interleaved with other instances' messages, so scan backwards from the end in
+    // growing windows until we find one of ours.
+    rd_kafka_topic_t *topic = rd_kafka_topic_new(consumer, context->control_topic_name, NULL);
+    int64_t end = high, window = 64;
+
+    while (lsn == 0 && end > low) {
+        int64_t start = end - window > low ? end - window : low;
+
+        if (rd_kafka_consume_start(topic, 0, start) != 0) {
+            fprintf(stderr, "%s: Could not read control topic: %s\n", progname,
+                    rd_kafka_err2str(rd_kafka_errno2err(errno)));
+            exit_nicely(context, 1);
+        }
+
+        while (true) {
+            rd_kafka_message_t *msg = rd_kafka_consume(topic, 0, 10000);
+            if (!msg) {
+                fprintf(stderr, "%s: Timed out reading control topic\n", progname);
+                exit_nicely(context, 1);
+            }
+
+            bool done = (msg->err == RD_KAFKA_RESP_ERR__PARTITION_EOF || msg->offset >= end);
+            if (msg->err && !done) {
+                fprintf(stderr, "%s: Could not read control topic: %s\n", progname,
+                        rd_kafka_message_errstr(msg));
+                exit_nicely(context, 1);
+            }
+
+            uint32 h32, l32;
+            char value[32];
+            if (!done && msg->key_len == slot_len && memcmp(msg->key, slot_name, slot_len) == 0 &&
+                    msg->len < sizeof(value)) {
+                memcpy(value, msg->payload, msg->len);
+                value[msg->len] = '\0';
+                if (sscanf(value, "%X/%X", &h32, &l32) == 2) {
+                    lsn = ((uint64_t) h32) << 32 | l32;
+                }
+            }
+
+            rd_kafka_message_destroy(msg);
+            if (done) break;
+        }
+
+        rd_kafka_consume_stop(topic, 0);
+        end = start;
+        window *= 4;
+    }
+
+    rd_kafka_topic_destroy(topic);
+    rd_kafka_destroy(consumer);
+    return lsn;
+}
+#endif
+
+
+/* Connects to Kafka. This should be done before connecting to Postgres, as it
+ * simply calls exit(1) on failure. */
+void start_producer(producer_context_t context) {
+    if (context->num_shards > 1) {
+        start_shards(context);
+        return;
+    }
+
+#ifdef HAVE_KAFKA_TRANSACTIONS
+    // Taken before rd_kafka_new(), which takes ownership of kafka_conf
+    rd_kafka_conf_t *consumer_conf = NULL;
+    if (context->transactional) consumer_conf = rd_kafka_conf_dup(context->kafka_conf);
+#endif
+
+    context->kafka = rd_kafka_new(RD_KAFKA_PRODUCER, context->kafka_conf,
+            context->error, PRODUCER_CONTEXT_ERROR_LEN);
+    if (!context->kafka) {
+        fprintf(stderr, "%s: Could not create Kafka producer: %s\n", progname, context->error);
+        exit(1);
+    }
+
+    // Topics are created later, from a copy of topic_conf
+    if (context->partitioner || context->partition_column) {
+        rd_kafka_topic_conf_set_partitioner_cb(context->topic_conf, on_partition_msg);
+    }
+
+    if (rd_kafka_brokers_add(context->kafka, context->brokers) == 0) {
+        fprintf(stderr, "%s: No valid Kafka brokers specified\n", progname);
+        exit(1);
+    }
+
+#ifdef HAVE_KAFKA_TRANSACTIONS
+    if (context->transactional) {
+        // Fences off any previous instance with the same transactional.id, and aborts
+        // whatever transaction it left open.
+        check_kafka_error(context, rd_kafka_init_transactions(context->kafka, KAFKA_TXN_TIMEOUT_MS),
+                "Could not initialize Kafka transactions");
+
+        context->control_topic = rd_kafka_topic_new(context->kafka, context->control_topic_name,
+                rd_kafka_topic_conf_dup(context->topic_conf));
+        if (!context->control_topic) {
+            fprintf(stderr, "%s: Cannot open Kafka topic %s: %s\n", progname,
+                    context->control_topic_name, rd_kafka_err2str(rd_kafka_errno2err(errno)));
+            exit(1);
+        }
+
+        // Resume from the last Postgres transaction that made it into Kafka, if the slot
+        // hasn't already been confirmed past it.
+        context->kafka_committed_lsn = read_control_topic(context, consumer_conf);
+        context->client->resume_lsn = context->kafka_committed_lsn;
+        if (context->kafka_committed_lsn) {
+            fprintf(stderr, "Last Kafka transaction committed at %X/%X.\n",
+                    (uint32) (context->kafka_committed_lsn >> 32),
+                    (uint32) context->kafka_committed_lsn);
+        }
+    }
+#endif
+}
+
+
+/* Creates the producers for --producers, and starts their delivery threads. Each has
+ * its own copy of the configuration, with its shard as the callbacks' opaque. */
+void start_shards(producer_context_t context) {
+    if (pipe(context->shard_pipe) != 0 ||
+            fcntl(context->shard_pipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+            fcntl(context->shard_pipe[1], F_SETFL, O_NONBLOCK) != 0) {
+        fprintf(stderr, "%s: Could not create pipe: %s\n", progname, strerror(errno));
+        exit(1);
+    }
+
+    // Topics are created later, from a copy of topic_conf
+    if (context->partitioner || context->partition_column) {
+        rd_kafka_topic_conf_set_partitioner_cb(context->topic_conf, on_partition_msg);
+    }
+
+    context->shards = malloc(context->num_shards * sizeof(producer_shard));
+    memset(context->shards, 0, context->num_shards * sizeof(producer_shard));
+
+    for (int i = 0; i < context->num_shards; i++) {
+        producer_shard *shard = &context->shards[i];
+        shard->context = context;
+
+        rd_kafka_conf_t *conf = rd_kafka_conf_dup(context->kafka_conf);
+        rd_kafka_conf_set_dr_msg_cb(conf, on_deliver_sharded);
+        rd_kafka_conf_set_opaque(conf, shard);
+
+        shard->kafka = rd_kafka_new(RD_KAFKA_PRODUCER, conf, context->error, PRODUCER_CONTEXT_ERROR_LEN);
+        if (!shard->kafka) {
+            fprintf(stderr, "%s: Could not create Kafka producer: %s\n", progname, context->error);
+            exit(1);
+        }
+        if (rd_kafka_brokers_add(shard->kafka, context->brokers) == 0) {
+            fprintf(stderr, "%s: No valid Kafka brokers specified\n", progname);
+            exit(1);
+        }
+
+        int err = pthread_create(&shard->thread, NULL, serve_shard, shard);
+        if (err) {
+            fprintf(stderr, "%s: Could not start delivery thread: %s\n", progname, strerror(err));
+            exit(1);
+        }
+    }
+
+    rd_kafka_conf_destroy(context->kafka_conf);
+    context->kafka_conf = NULL;
+}
+
+
+static int kafka_sink_open(sink_t sink) {
+    start_producer((producer_context_t) sink->cb_context);
+    return 0;
+}
+
+
+static int kafka_sink_poll(sink_t sink, int timeout_ms) {
+    producer_context_t context = (producer_context_t) sink->cb_context;
+    if (context->shards) {
+        poll_shards(context, timeout_ms);
+    } else {
+        rd_kafka_poll(context->kafka, timeout_ms);
+    }
+    return 0;
+}
+
+
+/* Destroys the producer(s), along with the topics that aren't owned by the registry. */
+static void kafka_sink_close(sink_t sink) {
+    producer_context_t context = (producer_context_t) sink->cb_context;
+    if (context->shards) {
+        __atomic_store_n(&context->shards_stopping, 1, __ATOMIC_RELEASE);
+        for (int i = 0; i < context->num_shards; i++) {
+            pthread_join(context->shards[i].thread, NULL);
+            rd_kafka_destroy(context->shards[i].kafka);
+        }
+        close(context->shard_pipe[0]);
+        close(context->shard_pipe[1]);
+        free(context->shards);
+        context->shards = NULL;
+    }
+
+    if (context->kafka_queue) rd_kafka_queue_destroy(context->kafka_queue);
+    if (context->control_topic) rd_kafka_topic_destroy(context->control_topic);
+    if (context->spool_topic) rd_kafka_topic_destroy(context->spool_topic);
+    if (context->kafka) rd_kafka_destroy(context->kafka);
+    context->kafka_queue = NULL;
+    context->control_topic = context->spool_topic = NULL;
+    context->kafka = NULL;
+}
@@ -0,0 +1,95 @@
+/* Partitioners for choosing which Kafka partition a message is sent to, selectable
+ * with the --partitioner option.
+ *
+ * The point of "murmur2" is compatibility with the Java client: its default
+ * partitioner takes the murmur2 hash of the serialized key, modulo the number of
+ * partitions. Our keys are serialized exactly as Confluent's Avro serializer would
+ * serialize them (schema ID prefix followed by Avro binary), so a JVM producer using
+ * the same key schema puts the same key in the same partition. That means topics
+ * written by Bottled Water are co-partitioned with other topics keyed the same way,
+ * and Kafka Streams can join them without repartitioning. */
+
+#include "partitioner.h"
+
+#include <string.h>
+
+typedef struct {
+    const char *name;
+    partitioner_fn fn;
+} partitioner_entry;
+
+static const partitioner_entry partitioners[] = {
+    {"default",    NULL},                                 /* librdkafka's own choice */
+    {"murmur2",    partitioner_murmur2},                  /* Java client compatible */
+    {"consistent", rd_kafka_msg_partitioner_consistent},  /* CRC32 of the key */
+    {"random",     rd_kafka_msg_partitioner_random},
+    {NULL,         NULL}
+};
+
+
+/* Looks up a partitioner by the name given on the command line. On success, sets
+ * *fn_out (to NULL for "default", meaning the topic's configured partitioner should
+ * be left alone) and returns zero. Returns non-zero if there is no such partitioner. */
+int partitioner_lookup(const char *name, partitioner_fn *fn_out) {
+    for (const partitioner_entry *entry = partitioners; entry->name; entry++) {
+        if (strcmp(entry->name, name) == 0) {
+            *fn_out = entry->fn;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/* 32-bit murmur2 hash, exactly as implemented by the Java client's
+ * org.apache.kafka.common.utils.Utils.murmur2() (including its seed). */
+uint32_t murmur2_hash(const void *data, size_t len) {
+    const uint32_t seed = 0x9747b28c, m = 0x5bd1e995;
+    const int r = 24;
+    const unsigned char *bytes = data;
+    size_t tail = len & ~((size_t) 3);
+    uint32_t h = seed ^ (uint32_t) len;
+
+    for (size_t i = 0; i < tail; i += 4) {
+        uint32_t k = (uint32_t) bytes[i] | (uint32_t) bytes[i + 1] << 8 |
+            (uint32_t) bytes[i + 2] << 16 | (uint32_t) bytes[i + 3] << 24;
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h *= m;
+        h ^= k;
+    }
+
+    switch (len & 3) {
+        case 3: h ^= (uint32_t) bytes[tail + 2] << 16; // fall through
+        case 2: h ^= (uint32_t) bytes[tail + 1] << 8;  // fall through
+        case 1: h ^= (uint32_t) bytes[tail];
+                h *= m;
+    }
+
+    h ^= h >> 13;
+    h *= m;
+    h ^= h >> 15;
+    return h;
+}
+
+
+/* Maps a murmur2 hash to a partition the way the Java client does: clear the sign
+ * bit, then take the remainder. */
+int32_t murmur2_partition(uint32_t hash, int32_t partition_cnt) {
+    return (int32_t) ((hash & 0x7fffffff) % (uint32_t) partition_cnt);
+}
+
+
+/* Partitioner callback that hashes the key with murmur2. Messages without a key
+ * (from tables without a primary key) are spread randomly. Unlike librdkafka's
+ * partitioners, doesn't avoid partitions that are currently unavailable, since a
+ * key must always map to the same partition for joins to work. */
+int32_t partitioner_murmur2(const rd_kafka_topic_t *topic, const void *key, size_t key_len,
+        int32_t partition_cnt, void *topic_opaque, void *msg_opaque) {
+    if (!key || key_len == 0) {
+        return rd_kafka_msg_partitioner_random(topic, key, key_len, partition_cnt,
+                topic_opaque, msg_opaque);
+    }
+    return murmur2_partition(murmur2_hash(key, key_len), partition_cnt);
+}
@@ -0,0 +1,17 @@
+#ifndef PARTITIONER_H
+#define PARTITIONER_H
+
+#include <librdkafka/rdkafka.h>
+
+/* Parameters: topic, key, key_len, partition_cnt, topic_opaque, msg_opaque.
+ * Same signature as librdkafka's own partitioners (rd_kafka_msg_partitioner_*). */
+typedef int32_t (*partitioner_fn)(const rd_kafka_topic_t *, const void *, size_t,
+        int32_t, void *, void *);
+
+int partitioner_lookup(const char *name, partitioner_fn *fn_out);
+uint32_t murmur2_hash(const void *data, size_t len);
+int32_t murmur2_partition(uint32_t hash, int32_t partition_cnt);
+int32_t partitioner_murmur2(const rd_kafka_topic_t *topic, const void *key, size_t key_len,
+        int32_t partition_cnt, void *topic_opaque, void *msg_opaque);
+
+#endif /* PARTITIONER_H */
@@ -0,0 +1,920 @@
+/* The producer: turns the change stream from Postgres into messages, hands them to
+ * the sink (Kafka, see kafka_sink.c, unless --sink says otherwise), and tracks their
+ * acknowledgement, so that Postgres is only told that a transaction has been
+ * processed once all of its messages are safely stored. */
+
+#include "producer.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ENVELOPE_SLAB_SIZE 256     /* Number of message envelopes allocated at a time */
+#define MAX_RETAINED_PAYLOAD 65536 /* Larger payload buffers are freed rather than reused */
+
+#define check(err, call) { err = call; if (err) return err; }
+
+typedef struct envelope_slab {
+    struct envelope_slab *next;
+    msg_envelope envelopes[ENVELOPE_SLAB_SIZE];
+} envelope_slab;
+
+static int on_frame_batch(void *_context, frame_batch_t batch);
+static int on_begin_txn(producer_context_t context, uint64_t wal_pos, uint32_t xid,
+        uint64_t end_lsn, int64_t commit_time);
+static int on_commit_txn(producer_context_t context, uint64_t wal_pos, uint32_t xid);
+static int on_table_schema(producer_context_t context, uint64_t wal_pos, Oid relid,
+        const char *key_schema_json, size_t key_schema_len,
+        const char *row_schema_json, size_t row_schema_len,
+        const char *relnamespace, size_t relnamespace_len);
+int send_kafka_msg(producer_context_t context, topic_list_entry_t topic, uint64_t wal_pos,
+        const void *key_bin, size_t key_len, avro_value_t *key_val,
+        const void *val_bin, size_t val_len);
+bool partition_hash(producer_context_t context, avro_value_t *key_val, uint32_t *hash_out);
+static void on_sink_ack(void *_context, void *msg_opaque, const char *err);
+void *ensure_buffer(char **buf, size_t *size, size_t needed);
+void produce_topic_batch(producer_context_t context, topic_list_entry_t entry);
+static void on_schema_registered(void *_context, topic_list_entry_t entry);
+void maybe_commit_sink(producer_context_t context);
+void wait_for_schema(producer_context_t context, topic_list_entry_t entry);
+void wait_for_inflight_bytes(producer_context_t context, size_t msg_size);
+
+
+/* Initializes the producer context, which holds everything we need to know about
+ * our connection to Kafka. */
+producer_context_t init_producer(client_context_t client) {
+    producer_context_t context = malloc(sizeof(producer_context));
+    memset(context, 0, sizeof(producer_context));
+    client->repl.frame_reader->on_batch = on_frame_batch;
+    client->repl.frame_reader->cb_context = context;
+
+    context->client = client;
+    context->registry = schema_registry_new(DEFAULT_SCHEMA_REGISTRY);
+    context->router = topic_router_new();
+    context->registry->on_registered = on_schema_registered;
+    context->registry->cb_context = context;
+    set_sink(context, &kafka_sink_ops, NULL);
+    context->brokers = DEFAULT_BROKER_LIST;
+    context->max_xact_slots = DEFAULT_XACT_MEMORY / XACT_SLOT_SIZE;
+    context->max_inflight_bytes = DEFAULT_INFLIGHT_BYTES;
+    context->claim_check_threshold = DEFAULT_CLAIM_CHECK_THRESHOLD;
+    context->produce_batch_size = DEFAULT_PRODUCE_BATCH_SIZE;
+    context->backpressure_ms = DEFAULT_BACKPRESSURE_MS;
+    context->last_stats = current_time_ms();
+    context->control_topic_name = DEFAULT_CONTROL_TOPIC;
+    context->kafka_txn_interval = DEFAULT_KAFKA_TXN_INTERVAL_MS;
+    // The transaction buffer is allocated by parse_options(), once --max-xact-memory
+    // is known; xact_head and xact_tail are set to zero by memset() above
+
+    kafka_sink_init(context);
+    return context;
+}
+
+
+/* Makes the producer send its messages to a sink of the given kind, replacing the
+ * one it had before (if any). */
+void set_sink(producer_context_t context, const sink_ops *ops, const char *target) {
+    if (context->sink) sink_free(context->sink);
+    context->sink = sink_new(ops, target);
+    context->sink->on_ack = on_sink_ack;
+    context->sink->cb_context = context;
+}
+
+
+/* Called by the frame reader with the events of (part of) a transaction. Looking up
+ * the topic is amortized over consecutive rows for the same table, and the Kafka
+ * producer is polled once per batch rather than once per row. */
+static int on_frame_batch(void *_context, frame_batch_t batch) {
+    producer_context_t context = (producer_context_t) _context;
+    topic_list_entry_t topic = NULL;
+    int err = 0;
+
+    for (int i = 0; i < batch->num_events; i++) {
+        frame_event *event = &batch->events[i];
+
+        if (event->relid != InvalidOid && (!topic || topic->relid != event->relid)) {
+            topic = schema_registry_lookup(context->registry, event->relid);
+
+            if (!topic && event->type != PROTOCOL_MSG_TABLE_SCHEMA) {
+                fprintf(stderr, "%s: relid %u has no registered schema\n", progname, event->relid);
+                exit_nicely(context, 1);
+            }
+        }
+
+        switch (event->type) {
+            case PROTOCOL_MSG_BEGIN_TXN:
+                check(err, on_begin_txn(context, event->wal_pos, event->xid,
+                            event->commit_lsn, event->commit_time));
+                break;
+
+            case PROTOCOL_MSG_COMMIT_TXN:
+                check(err, on_commit_txn(context, event->wal_pos, event->xid));
+                break;
+
+            case PROTOCOL_MSG_TABLE_SCHEMA:
+                check(err, on_table_schema(context, event->wal_pos, event->relid,
+                            event->key_bin, event->key_len, event->new_bin, event->new_len,
+                            event->relnamespace, event->relnamespace_len));
+                topic = NULL;
+                break;
+
+            case PROTOCOL_MSG_INSERT:
+            case PROTOCOL_MSG_UPDATE:
+                check(err, send_kafka_msg(context, topic, event->wal_pos,
+                            event->key_bin, event->key_len, &event->key_val,
+                            event->new_bin, event->new_len));
+                break;
+
+            case PROTOCOL_MSG_DELETE:
+                // delete on unkeyed table --> can't do anything
+                if (event->key_bin) {
+                    check(err, send_kafka_msg(context, topic, event->wal_pos,
+                                event->key_bin, event->key_len, &event->key_val, NULL, 0));
+                }
+                break;
+        }
+    }
+
+    poll_sink(context, 0);
+    return err;
+}
+
+
+static int on_begin_txn(producer_context_t context, uint64_t wal_pos, uint32_t xid,
+        uint64_t end_lsn, int64_t commit_time) {
+    replication_stream_t stream = &context->client->repl;
+    context->pg_txn_open = true;
+    context->pg_txn_xid = xid;
+
+    if (xid == 0) {
+        if (context->xact_head != 0 || context->xact_tail != 0) {
+            fprintf(stderr, "%s: Expected snapshot to be the first transaction.\n", progname);
+            exit_nicely(context, 1);
+        }
+
+        // The snapshot uses the initial slot (see on_commit_txn())
+        context->xact_list[0]->end_lsn = end_lsn;
+        context->xact_list[0]->commit_time = commit_time;
+
+        fprintf(stderr, "Created replication slot \"%s\", capturing consistent snapshot \"%s\".\n",
+                stream->slot_name, stream->snapshot_name);
+        return 0;
+    }
+
+    // If the circular buffer is full, and we've used up our memory budget for it, we
+    // have to block and wait for some transactions to be delivered to Kafka and
+    // acknowledged by the broker. Some of them may have been held back waiting for
+    // the schema registry, so send whatever has become ready meanwhile. With a spool,
+    // they are written to disk instead.
+    while (xact_list_full(context) && !xact_list_grow(context)) {
+        if (context->spool) start_spooling(context, "Too many transactions in flight");
+        produce_pending(context);
+        backpressure(context);
+    }
+
+    context->xact_head = (context->xact_head + 1) % context->xact_capacity;
+    transaction_info *xact = context->xact_list[context->xact_head];
+    xact->xid = xid;
+    xact->recvd_events = 0;
+    xact->pending_events = 0;
+    xact->commit_lsn = 0;
+    xact->end_lsn = end_lsn;
+    xact->commit_time = commit_time;
+
+    return 0;
+}
+
+
+static int on_commit_txn(producer_context_t context, uint64_t wal_pos, uint32_t xid) {
+    transaction_info *xact = context->xact_list[context->xact_head];
+
+    if (xid == 0) {
+        fprintf(stderr, "Snapshot complete, streaming changes from %X/%X.\n",
+                (uint32) (wal_pos >> 32), (uint32) wal_pos);
+    }
+
+    if (xid != xact->xid) {
+        fprintf(stderr, "%s: Mismatched begin/commit events (xid %u in flight, "
+                "xid %u committed)\n", progname, xact->xid, xid);
+        exit_nicely(context, 1);
+    }
+
+    // In transactional mode, a Kafka transaction must contain all of the Postgres
+    // transactions up to the LSN it records, so their messages can't be held back
+    // waiting for the schema registry.
+    if (context->transactional) wait_for_schema(context, NULL);
+    if (context->coalesce_window > 0) {
+        maybe_produce_coalesced(context);
+    } else {
+        produce_pending(context);
+    }
+
+    // A transaction that produced no messages doesn't need a slot of its own. If an
+    // earlier transaction is still in flight, let that one carry this commit's LSN
+    // instead, so that a run of empty transactions only takes up a single slot.
+    if (xact->recvd_events == 0 && xid != 0 && context->xact_head != context->xact_tail) {
+        context->xact_head = (context->xact_head - 1 + context->xact_capacity) %
+            context->xact_capacity;
+        xact = context->xact_list[context->xact_head];
+    }
+
+    xact->commit_lsn = wal_pos;
+    context->pg_txn_open = false;
+    context->last_commit_lsn = wal_pos;
+    if (context->kafka_txn_open) context->kafka_txn_lsn = wal_pos;
+
+    maybe_checkpoint(context);
+    maybe_commit_kafka_txn(context, false);
+    maybe_commit_sink(context);
+    return 0;
+}
+
+
+static int on_table_schema(producer_context_t context, uint64_t wal_pos, Oid relid,
+        const char *key_schema_json, size_t key_schema_len,
+        const char *row_schema_json, size_t row_schema_len,
+        const char *relnamespace, size_t relnamespace_len) {
+    // Messages already encoded with the old schema IDs go out first.
+    topic_list_entry_t old_entry = schema_registry_lookup(context->registry, relid);
+    if (old_entry) wait_for_schema(context, old_entry);
+    produce_pending(context);
+
+    // Parse the schema here rather than asking the frame reader, which may be on
+    // another thread, and may already have moved on to a newer version of the schema.
+    avro_schema_t row_schema;
+    if (avro_schema_from_json_length(row_schema_json, row_schema_len, &row_schema)) {
+        fprintf(stderr, "%s: Could not parse row schema for relid %u: %s\n",
+                progname, relid, avro_strerror());
+        exit_nicely(context, 1);
+    }
+
+    // The record is named after the table. From protocol version 2 onwards, the
+    // extension tells us the name of the Postgres schema. In version 1 it doesn't, but
+    // then it is the last component of the record's namespace, as structural schemas
+    // (which leave it out; see oid2avro.c) require version 2.
+    const char *table = avro_schema_name(row_schema);
+    const char *namespace = avro_schema_namespace(row_schema);
+    char *schema;
+    if (relnamespace) {
+        schema = strndup(relnamespace, relnamespace_len);
+    } else {
+        const char *last = namespace ? strrchr(namespace, '.') : NULL;
+        schema = strdup(last ? last + 1 : (namespace ? namespace : ""));
+    }
+
+    char *table_name = format_string("%s.%s", schema, table);
+    char *topic_name = topic_router_route(context->router, schema, table);
+    if (!topic_name) {
+        fprintf(stderr, "%s: %s\n", progname, context->router->error);
+        exit_nicely(context, 1);
+    }
+
+    // If tables may share a topic, the default "<topic>-key" and "<topic>-value"
+    // subjects would mix up their schemas, so register them under subjects named after
+    // the topic and the record instead (Confluent's TopicRecordNameStrategy). Records
+    // without a namespace (with structural schemas) are known by their name alone.
+    char *key_subject = NULL, *row_subject = NULL;
+    bool record_subjects = topic_router_active(context->router);
+    if (record_subjects) {
+        row_subject = namespace ? format_string("%s-%s.%s", topic_name, namespace, table) :
+            format_string("%s-%s", topic_name, table);
+
+        // Unkeyed tables have no key schema
+        avro_schema_t key_schema;
+        if (key_schema_json && key_schema_len > 0) {
+            if (avro_schema_from_json_length(key_schema_json, key_schema_len, &key_schema)) {
+                fprintf(stderr, "%s: Could not parse key schema for relid %u: %s\n",
+                        progname, relid, avro_strerror());
+                exit_nicely(context, 1);
+            }
+            const char *key_namespace = avro_schema_namespace(key_schema);
+            const char *key_name = avro_schema_name(key_schema);
+            key_subject = key_namespace ?
+                format_string("%s-%s.%s", topic_name, key_namespace, key_name) :
+                format_string("%s-%s", topic_name, key_name);
+            avro_schema_decref(key_schema);
+        } else {
+            key_subject = strdup("");
+        }
+    }
+
+    topic_list_entry_t entry = schema_registry_update(context->registry, relid, topic_name,
+            table_name, key_subject, row_subject,
+            key_schema_json, key_schema_len, row_schema_json, row_schema_len);
+    avro_schema_decref(row_schema);
+    free(topic_name);
+    free(table_name);
+    free(schema);
+    free(key_subject);
+    free(row_subject);
+
+    if (!entry) {
+        fprintf(stderr, "%s: %s\n", progname, context->registry->error);
+        exit_nicely(context, 1);
+    }
+
+    if (sink_schema(context->sink, entry, row_schema_json, row_schema_len)) {
+        fprintf(stderr, "%s: %s\n", progname, context->sink->error);
+        exit_nicely(context, 1);
+    }
+    return 0;
+}
+
+
+/* Queues one row-level event to be sent to Kafka, using the topic and schema IDs in
+ * the registry's entry for the event's table. Messages are handed to the sink by
+ * produce_pending() when the transaction commits, or sooner if a batch fills up.
+ * If the table's schema is still being registered, its messages are encoded with a
+ * placeholder ID, and held in its batch until on_schema_registered() fills it in.
+ *
+ * With --coalesce, if a message for the same key is still waiting in the batch, the
+ * new message takes its place (and its envelope), and the transaction that the old
+ * message came from no longer waits for it. With --txn-headers, it also keeps the
+ * old message's sequence number, so that the numbers stay in order within the batch;
+ * for the same reason, only messages from the same transaction are replaced. */
+int send_kafka_msg(producer_context_t context, topic_list_entry_t entry, uint64_t wal_pos,
+        const void *key_bin, size_t key_len, avro_value_t *key_val,
+        const void *val_bin, size_t val_len) {
+
+    // The value and the key are encoded into a single buffer owned by the envelope,
+    // which stays valid until on_sink_ack() recycles it.
+    size_t val_size = val_bin ? val_len + SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN : 0;
+    size_t key_size = key_bin ? key_len + SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN : 0;
+    wait_for_inflight_bytes(context, val_size + key_size);
+
+    transaction_info *xact = context->xact_list[context->xact_head];
+    xact->recvd_events++;
+    __atomic_add_fetch(&xact->pending_events, 1, __ATOMIC_RELAXED);
+
+    coalesce_slot *slot = NULL;
+    rd_kafka_message_t *msg = NULL;
+    msg_envelope_t envelope;
+
+    if (context->coalesce && key_bin) {
+        slot = coalesce_map_lookup(context->coalesce, entry->relid, key_bin, key_len);
+        if (slot->key) msg = &entry->batch[slot->index];
+        if (msg && context->txn_headers && ((msg_envelope_t) msg->_private)->xact != xact) msg = NULL;
+    }
+
+    if (msg) {
+        envelope = (msg_envelope_t) msg->_private;
+        __atomic_sub_fetch(&envelope->xact->pending_events, 1, __ATOMIC_RELAXED);
+        maybe_checkpoint(context);
+    } else {
+        envelope = envelope_get(context);
+        envelope->seq = xact->recvd_events;
+    }
+    envelope->wal_pos = wal_pos;
+    envelope->relid = entry->relid;
+    envelope->xact = xact;
+    envelope->has_partition_hash = partition_hash(context, key_val, &envelope->partition_hash);
+
+    char *buf = ensure_buffer(&envelope->payload, &envelope->payload_size, val_size + key_size);
+    context->inflight_bytes += val_size + key_size - envelope->msg_size;
+    envelope->msg_size = val_size + key_size;
+    if (context->inflight_bytes > context->inflight_bytes_peak) {
+        context->inflight_bytes_peak = context->inflight_bytes;
+    }
+
+    if (val_bin) schema_registry_encode_msg(entry->row_schema_id, val_bin, val_len, buf);
+    if (key_bin) schema_registry_encode_msg(entry->key_schema_id, key_bin, key_len, buf + val_size);
+
+    // Rather than producing each message individually, collect them per topic, and
+    // hand them to the sink in one go when the transaction commits.
+    if (!entry->batch_dirty) {
+        if (context->num_dirty_topics == context->dirty_topics_capacity) {
+            int capacity = context->dirty_topics_capacity > 0 ? 4 * context->dirty_topics_capacity : 16;
+            topic_list_entry_t *dirty_topics = realloc(context->dirty_topics,
+                    capacity * sizeof(topic_list_entry_t));
+            if (!dirty_topics) {
+                fprintf(stderr, "%s: Out of memory\n", progname);
+                exit_nicely(context, 1);
+            }
+            context->dirty_topics = dirty_topics;
+            context->dirty_topics_capacity = capacity;
+        }
+        context->dirty_topics[context->num_dirty_topics++] = entry;
+        entry->batch_dirty = 1;
+    }
+
+    if (!msg) {
+        if (entry->batch_len == entry->batch_capacity) {
+            int capacity = entry->batch_capacity > 0 ? 4 * entry->batch_capacity : 16;
+            if (capacity > context->produce_batch_size) capacity = context->produce_batch_size;
+            rd_kafka_message_t *batch = realloc(entry->batch, capacity * sizeof(rd_kafka_message_t));
+            if (!batch) {
+                fprintf(stderr, "%s: Out of memory\n", progname);
+                exit_nicely(context, 1);
+            }
+            entry->batch = batch;
+            entry->batch_capacity = capacity;
+        }
+        msg = &entry->batch[entry->batch_len++];
+        memset(msg, 0, sizeof(rd_kafka_message_t));
+    }
+    msg->payload = val_bin ? buf : NULL;
+    msg->len = val_size;
+    msg->key = key_bin ? buf + val_size : NULL;
+    msg->key_len = key_size;
+    msg->_private = envelope;
+
+    if (slot) {
+        slot->key = buf + val_size + SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN;
+        slot->index = msg - entry->batch;
+    }
+    if (context->coalesce && !context->coalesce_since) context->coalesce_since = current_time_ms();
+
+    // Large transactions (including the initial snapshot) are sent in chunks.
+    if (entry->batch_len >= context->produce_batch_size) produce_topic_batch(context, entry);
+    return 0;
+}
+
+
+/* If --partition-column was given and the table's key has that column, computes the
+ * murmur2 hash of the column's value (in Avro binary encoding) and returns true. Rows
+ * with the same value in that column then go to the same partition, even across
+ * tables, and even if the rest of their keys differ. */
+bool partition_hash(producer_context_t context, avro_value_t *key_val, uint32_t *hash_out) {
+    if (!context->partition_column || !key_val || !key_val->iface) return false;
+
+    avro_value_t column;
+    if (avro_value_get_by_name(key_val, context->partition_column, &column, NULL)) {
+        return false;
+    }
+
+    size_t size;
+    if (avro_value_sizeof(&column, &size)) {
+        fprintf(stderr, "%s: Could not encode partition column: %s\n", progname, avro_strerror());
+        exit_nicely(context, 1);
+    }
+
+    char *buf = ensure_buffer(&context->hash_buf, &context->hash_buf_size, size > 0 ? size : 1);
+    if (!context->hash_writer) {
+        context->hash_writer = avro_writer_memory(buf, size);
+    } else {
+        avro_writer_memory_set_dest(context->hash_writer, buf, size);
+    }
+
+    if (avro_value_write(context->hash_writer, &column)) {
+        fprintf(stderr, "%s: Could not encode partition column: %s\n", progname, avro_strerror());
+        exit_nicely(context, 1);
+    }
+
+    *hash_out = murmur2_hash(buf, size);
+    return true;
+}
+
+
+/* Hands all messages accumulated for one topic to the sink. */
+void produce_topic_batch(producer_context_t context, topic_list_entry_t entry) {
+    // If a table's batch fills up before its schema IDs are known, only then do we
+    // have to wait for the registry.
+    if (entry->registrations > 0) wait_for_schema(context, entry);
+
+    // The map points into the batches, which are about to be handed over
+    if (context->coalesce) coalesce_map_clear(context->coalesce);
+
+    if (sink_produce(context->sink, entry)) {
+        fprintf(stderr, "%s: %s\n", progname, context->sink->error);
+        exit_nicely(context, 1);
+    }
+}
+
+
+/* Hands all messages that have been accumulated, across all topics, to librdkafka.
+ * Called when a transaction commits, and before anything that needs the batches to
+ * be empty. */
+void produce_pending(producer_context_t context) {
+    int waiting = 0;
+    for (int i = 0; i < context->num_dirty_topics; i++) {
+        topic_list_entry_t entry = context->dirty_topics[i];
+
+        // Tables whose schemas are still being registered stay on the list, while
+        // everything else carries on.
+        if (entry->registrations > 0) {
+            context->dirty_topics[waiting++] = entry;
+            continue;
+        }
+
+        if (entry->batch_len > 0) produce_topic_batch(context, entry);
+        entry->batch_dirty = 0;
+    }
+    context->num_dirty_topics = waiting;
+    context->schemas_registered = false;
+    context->coalesce_since = 0;
+    maybe_commit_sink(context);
+}
+
+
+/* With --coalesce-window, hands the messages that have been accumulated to librdkafka
+ * once the oldest of them has been held for the length of the window. Until then,
+ * later changes to the same rows replace them. */
+void maybe_produce_coalesced(producer_context_t context) {
+    if (context->coalesce_window <= 0 || context->coalesce_since == 0) return;
+    if (current_time_ms() - context->coalesce_since < context->coalesce_window) return;
+    produce_pending(context);
+}
+
+
+/* Called by the schema registry client when a table's schema IDs become known.
+ * Fills them in to the messages that were encoded while they were being
+ * registered; produce_pending() can then send them. */
+static void on_schema_registered(void *_context, topic_list_entry_t entry) {
+    producer_context_t context = (producer_context_t) _context;
+    if (entry->batch_len > 0) context->schemas_registered = true;
+
+    for (int i = 0; i < entry->batch_len; i++) {
+        rd_kafka_message_t *msg = &entry->batch[i];
+        if (msg->payload) schema_registry_set_msg_schema(entry->row_schema_id, msg->payload);
+        if (msg->key) schema_registry_set_msg_schema(entry->key_schema_id, msg->key);
+    }
+}
+
+
+/* Makes progress on schema registry requests, waiting up to timeout_ms for a
+ * response. Returns true if a table with messages waiting for its schema IDs has
+ * had them filled in, so that produce_pending() can now send them. */
+bool poll_registry(producer_context_t context, int timeout_ms) {
+    if (schema_registry_poll(context->registry, timeout_ms)) {
+        fprintf(stderr, "%s: %s\n", progname, context->registry->error);
+        exit_nicely(context, 1);
+    }
+    return context->schemas_registered;
+}
+
+
+/* Lets the sink make progress, and handles its acknowledgements, waiting up to
+ * timeout_ms for some. */
+void poll_sink(producer_context_t context, int timeout_ms) {
+    if (sink_poll(context->sink, timeout_ms)) {
+        fprintf(stderr, "%s: %s\n", progname, context->sink->error);
+        exit_nicely(context, 1);
+    }
+    if (context->sink->tracks_lsn) update_fsync_lsn(context, context->acked_lsn);
+}
+
+
+/* Tells the sink about the last Postgres commit, once all of the messages up to it
+ * have been handed over (i.e. none are held back by the schema registry or
+ * --coalesce-window), so that sinks that write files can finish them there. */
+void maybe_commit_sink(producer_context_t context) {
+    if (context->pg_txn_open || context->num_dirty_topics > 0) return;
+    if (context->last_commit_lsn <= context->sink_commit_lsn) return;
+
+    if (sink_commit(context->sink, context->last_commit_lsn)) {
+        fprintf(stderr, "%s: %s\n", progname, context->sink->error);
+        exit_nicely(context, 1);
+    }
+    context->sink_commit_lsn = context->last_commit_lsn;
+    if (context->sink->tracks_lsn) update_fsync_lsn(context, context->acked_lsn);
+}
+
+
+/* Blocks until the given table's schemas have been registered (or all tables', if
+ * entry is NULL). */
+void wait_for_schema(producer_context_t context, topic_list_entry_t entry) {
+    if (schema_registry_wait(context->registry, entry)) {
+        fprintf(stderr, "%s: %s\n", progname, context->registry->error);
+        exit_nicely(context, 1);
+    }
+}
+
+
+/* Blocks while adding a message of msg_size bytes would take the messages that haven't
+ * been acknowledged yet over --max-inflight-bytes. Messages that are still being
+ * accumulated count too, so they are handed over (or spooled) to let them drain. A
+ * message bigger than the whole budget is let through once nothing else is in flight. */
+void wait_for_inflight_bytes(producer_context_t context, size_t msg_size) {
+    if (context->max_inflight_bytes == 0) return;
+
+    while (context->inflight_bytes > 0 &&
+            context->inflight_bytes + msg_size > context->max_inflight_bytes) {
+        if (context->spool) start_spooling(context, "Too many bytes of messages in flight");
+        produce_pending(context);
+        backpressure(context);
+    }
+}
+
+
+/* Called by the sink once per message, to report whether it was durably written.
+ * Exits if it wasn't. */
+static void on_sink_ack(void *_context, void *msg_opaque, const char *err) {
+    producer_context_t context = (producer_context_t) _context;
+    msg_envelope_t envelope = (msg_envelope_t) msg_opaque;
+
+    if (err) {
+        fprintf(stderr, "%s: Message delivery failed: %s\n", progname, err);
+        exit_nicely(context, 1);
+    }
+
+    // Control topic messages (see maybe_commit_kafka_txn()) don't belong to any
+    // Postgres transaction.
+    if (envelope->xact) {
+        context->acked_msgs++;
+        context->acked_bytes += envelope->msg_size;
+        __atomic_sub_fetch(&envelope->xact->pending_events, 1, __ATOMIC_RELAXED);
+        maybe_checkpoint(context);
+    }
+    envelope_put(context, envelope);
+}
+
+
+/* Takes an envelope from the free list, allocating another slab of them if the
+ * list is empty. */
+msg_envelope_t envelope_get(producer_context_t context) {
+    if (!context->free_envelopes) {
+        envelope_slab *slab = malloc(sizeof(envelope_slab));
+        if (!slab) {
+            fprintf(stderr, "%s: Out of memory\n", progname);
+            exit_nicely(context, 1);
+        }
+        memset(slab, 0, sizeof(envelope_slab));
+        slab->next = context->slabs;
+        context->slabs = slab;
+
+        for (int i = 0; i < ENVELOPE_SLAB_SIZE; i++) {
+            slab->envelopes[i].context = context;
+            slab->envelopes[i].next_free = context->free_envelopes;
+            context->free_envelopes = &slab->envelopes[i];
+        }
+    }
+
+    msg_envelope_t envelope = context->free_envelopes;
+    context->free_envelopes = envelope->next_free;
+    envelope->next_free = NULL;
+    return envelope;
+}
+
+
+/* Returns an envelope to the free list once librdkafka is done with it, which ends
+ * its message's count against --max-inflight-bytes. Its payload buffer is kept for
+ * the next message, unless an unusually large row inflated it. */
+void envelope_put(producer_context_t context, msg_envelope_t envelope) {
+    context->inflight_bytes -= envelope->msg_size;
+    envelope->msg_size = 0;
+    if (envelope->payload_size > MAX_RETAINED_PAYLOAD) {
+        free(envelope->payload);
+        envelope->payload = NULL;
+        envelope->payload_size = 0;
+    }
+    envelope->xact = NULL;
+    envelope->spool_segment = NULL;
+    envelope->err = RD_KAFKA_RESP_ERR_NO_ERROR;
+    envelope->next_free = context->free_envelopes;
+    context->free_envelopes = envelope;
+}
+
+
+/* Grows *buf (whose allocated size is *size) so that it can hold at least `needed`
+ * bytes, and returns it. Exits if memory cannot be allocated. */
+void *ensure_buffer(char **buf, size_t *size, size_t needed) {
+    if (*size >= needed) return *buf;
+
+    size_t new_size = *size > 0 ? *size : 256;
+    while (new_size < needed) new_size *= 4;
+
+    char *new_buf = realloc(*buf, new_size);
+    if (!new_buf) {
+        fprintf(stderr, "%s: Out of memory\n", progname);
+        exit(1);
+    }
+    *buf = new_buf;
+    *size = new_size;
+    return new_buf;
+}
+
+
+/* Frees all envelope slabs and the buffers they own. Must only be called after
+ * the Kafka producer has been destroyed, since it may still reference them. */
+void envelopes_free(producer_context_t context) {
+    while (context->slabs) {
+        envelope_slab *slab = context->slabs;
+        context->slabs = slab->next;
+        for (int i = 0; i < ENVELOPE_SLAB_SIZE; i++) {
+            free(slab->envelopes[i].payload);
+        }
+        free(slab);
+    }
+    context->free_envelopes = NULL;
+    free(context->dirty_topics);
+    context->dirty_topics = NULL;
+    context->num_dirty_topics = 0;
+    context->dirty_topics_capacity = 0;
+}
+
+
+/* Enlarges the circular buffer of in-flight transactions (or allocates it initially),
+ * unless that would take it over the memory budget. Returns false if it could not be
+ * grown. The transaction_info structs themselves don't move, so envelopes can keep
+ * pointing at them; the slots are just unwrapped so that xact_tail becomes zero. */
+bool xact_list_grow(producer_context_t context) {
+    int old_capacity = context->xact_capacity;
+    int new_capacity = old_capacity > 0 ? 4 * old_capacity : INITIAL_XACT_SLOTS;
+
+    if (old_capacity >= context->max_xact_slots) return false;
+    if (new_capacity > context->max_xact_slots) new_capacity = context->max_xact_slots;
+
+    transaction_info **new_list = malloc(new_capacity * sizeof(transaction_info *));
+    if (!new_list) return false;
+
+    for (int i = 0; i < new_capacity; i++) {
+        if (i < old_capacity) {
+            new_list[i] = context->xact_list[(context->xact_tail + i) % old_capacity];
+        } else {
+            new_list[i] = malloc(sizeof(transaction_info));
+            if (!new_list[i]) {
+                fprintf(stderr, "%s: Out of memory\n", progname);
+                exit(1);
+            }
+            memset(new_list[i], 0, sizeof(transaction_info));
+        }
+    }
+
+    if (old_capacity > 0) {
+        context->xact_head = (context->xact_head - context->xact_tail + old_capacity) % old_capacity;
+        context->xact_tail = 0;
+    }
+
+    free(context->xact_list);
+    context->xact_list = new_list;
+    context->xact_capacity = new_capacity;
+    return true;
+}
+
+
+/* When a Postgres transaction has been durably written to Kafka (i.e. we've seen the
+ * commit event from Postgres, so we know the transaction is complete, and the Kafka
+ * broker has acknowledged all messages in the transaction), we checkpoint it. This
+ * allows the WAL for that transaction to be cleaned up in Postgres. With --producers,
+ * the delivery threads count down the pending events, but only the main thread moves
+ * xact_tail, so transactions are still checkpointed strictly in commit order. */
+void maybe_checkpoint(producer_context_t context) {
+    transaction_info *xact = context->xact_list[context->xact_tail];
+
+    while (__atomic_load_n(&xact->pending_events, __ATOMIC_ACQUIRE) == 0 &&
+            (xact->commit_lsn > 0 || xact->xid == 0)) {
+
+        // Set the replication stream's "fsync LSN" (i.e. the WAL position up to which
+        // the data has been durably written). This will be sent back to Postgres in the
+        // next keepalive message, and used as the restart position if this client dies.
+        // This should ensure that no data is lost (although messages may be duplicated).
+        replication_stream_t stream = &context->client->repl;
+
+        if (stream->fsync_lsn > xact->commit_lsn) {
+            fprintf(stderr, "%s: WARNING: Commits not in WAL order! "
+                    "Checkpoint LSN is %X/%X, commit LSN is %X/%X.\n", progname,
+                    (uint32) (stream->fsync_lsn >> 32), (uint32) stream->fsync_lsn,
+                    (uint32) (xact->commit_lsn  >> 32), (uint32) xact->commit_lsn);
+        }
+
+#ifdef DEBUG
+        if (stream->fsync_lsn < xact->commit_lsn) {
+            fprintf(stderr, "Checkpointing %d events for xid %u, WAL position %X/%X.\n",
+                    xact->recvd_events, xact->xid,
+                    (uint32) (xact->commit_lsn >> 32), (uint32) xact->commit_lsn);
+        }
+#endif
+
+        update_fsync_lsn(context, xact->commit_lsn);
+
+        // End-to-end latency, which relies on the clocks of this machine and the
+        // Postgres server agreeing. The snapshot has no commit time.
+        if (xact->commit_time > 0) {
+            int64_t latency = current_time_us() - xact->commit_time;
+            histogram_record(&context->latency, latency > 0 ? latency : 0);
+            xact->commit_time = 0;
+        }
+
+        // xid==0 is the initial snapshot transaction. Clear the flag when it's complete.
+        if (xact->xid == 0 && xact->commit_lsn > 0) {
+            context->client->taking_snapshot = false;
+        }
+
+        if (context->xact_tail == context->xact_head) break;
+
+        context->xact_tail = (context->xact_tail + 1) % context->xact_capacity;
+        xact = context->xact_list[context->xact_tail];
+    }
+}
+
+
+/* Passes the position up to which Kafka has acknowledged everything on to the
+ * replication stream. With Kafka transactions, messages can be acknowledged and then
+ * aborted, so Postgres must not be told about anything beyond the last Kafka
+ * transaction that actually committed. Likewise, sinks that track LSNs (such as the
+ * avro sink) may acknowledge messages before the files containing them are complete. */
+void update_fsync_lsn(producer_context_t context, uint64_t lsn) {
+    context->acked_lsn = lsn;
+    bool capped = context->transactional || context->sink->tracks_lsn;
+    if (context->transactional && lsn > context->kafka_committed_lsn) {
+        lsn = context->kafka_committed_lsn;
+    }
+    if (context->sink->tracks_lsn && lsn > context->sink->durable_lsn) {
+        lsn = context->sink->durable_lsn;
+    }
+
+    // Atomic, since a pipelined client's receiver thread reads it concurrently
+    replication_stream_t stream = &context->client->repl;
+    if (lsn > stream->fsync_lsn || !capped) {
+        __atomic_store_n(&stream->fsync_lsn, lsn, __ATOMIC_RELEASE);
+    }
+}
+
+
+/* Like sprintf(), but into a newly malloced string of the right length, so that long
+ * names aren't silently truncated. */
+char *format_string(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    char *str = malloc(len + 1);
+    if (!str) {
+        fprintf(stderr, "%s: Out of memory\n", progname);
+        exit(1);
+    }
+    va_start(args, fmt);
+    vsnprintf(str, len + 1, fmt, args);
+    va_end(args);
+    return str;
+}
+
+
+/* Returns the current time, in milliseconds since the epoch. */
+int64_t current_time_ms() {
+    return current_time_us() / 1000;
+}
+
+
+/* Returns the current time, in microseconds since the epoch. */
+int64_t current_time_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/* If --stats-interval was given, and that much time has passed since the last report,
+ * prints a line showing how far we've got: how far we've received the stream from
+ * Postgres, how far Kafka has acknowledged it (which is what we report back to
+ * Postgres), and how much WAL the server has to keep around because of that. */
+void maybe_report_stats(producer_context_t context) {
+    if (context->stats_interval <= 0) return;
+
+    int64_t now = current_time_ms();
+    if (now - context->last_stats < context->stats_interval * 1000LL) return;
+    double elapsed = (now - context->last_stats) / 1000.0;
+    context->last_stats = now;
+
+    replication_stream_t stream = &context->client->repl;
+    XLogRecPtr recvd_lsn = __atomic_load_n(&stream->recvd_lsn, __ATOMIC_RELAXED);
+    XLogRecPtr fsync_lsn = __atomic_load_n(&stream->fsync_lsn, __ATOMIC_RELAXED);
+    int in_flight = (context->xact_head - context->xact_tail + context->xact_capacity) %
+        context->xact_capacity;
+
+    fprintf(stderr, "Received up to %X/%X, acknowledged up to %X/%X, "
+            "%llu bytes of WAL held back, %d transactions in flight.\n",
+            (uint32) (recvd_lsn >> 32), (uint32) recvd_lsn,
+            (uint32) (fsync_lsn >> 32), (uint32) fsync_lsn,
+            (unsigned long long) replication_stream_held_back(stream), in_flight);
+    fprintf(stderr, "Messages in flight: %llu bytes (peak %llu, limit %llu).\n",
+            (unsigned long long) context->inflight_bytes,
+            (unsigned long long) context->inflight_bytes_peak,
+            (unsigned long long) context->max_inflight_bytes);
+
+    fprintf(stderr, "Throughput: %.0f messages/s, %.0f bytes/s acknowledged.\n",
+            context->acked_msgs / elapsed, context->acked_bytes / elapsed);
+    context->acked_msgs = context->acked_bytes = 0;
+
+    histogram *latency = &context->latency;
+    if (latency->total > 0) {
+        fprintf(stderr, "Latency from commit to acknowledgement: p50 %.1f ms, p99 %.1f ms, "
+                "max %.1f ms (%llu transactions).\n",
+                histogram_percentile(latency, 50) / 1000.0,
+                histogram_percentile(latency, 99) / 1000.0,
+                latency->max / 1000.0, (unsigned long long) latency->total);
+        histogram_reset(latency);
+    }
+
+    if (context->coalesce && context->coalesce->received > 0) {
+        coalesce_map_t map = context->coalesce;
+        fprintf(stderr, "Coalesced %llu of %llu keyed messages (%.1f%%).\n",
+                (unsigned long long) map->coalesced, (unsigned long long) map->received,
+                100.0 * map->coalesced / map->received);
+    }
+
+    if (context->blob_store && context->blob_store->num_put > 0) {
+        fprintf(stderr, "Claim checks: %llu values (%llu bytes) stored in the blob store.\n",
+                (unsigned long long) context->blob_store->num_put,
+                (unsigned long long) context->blob_store->bytes_put);
+    }
+
+    if (context->spooling) {
+        fprintf(stderr, "Spooling: %llu messages written to %s, %d being sent.\n",
+                (unsigned long long) context->spool->num_records, context->spool->dir,
+                context->spool->outstanding);
+    }
+}
@@ -0,0 +1,199 @@
+#ifndef PRODUCER_H
+#define PRODUCER_H
+
+#include "blob_store.h"
+#include "coalesce.h"
+#include "connect.h"
+#include "histogram.h"
+#include "partitioner.h"
+#include "registry.h"
+#include "routing.h"
+#include "sink.h"
+#include "spool.h"
+
+#include <librdkafka/rdkafka.h>
+#include <pthread.h>
+
+/* The transactional producer API appeared in librdkafka 1.4. */
+#if RD_KAFKA_VERSION >= 0x010400ff
+#define HAVE_KAFKA_TRANSACTIONS 1
+#endif
+
+/* Message headers (needed to tell tables apart in a shared topic, see --route)
+ * appeared in librdkafka 0.11.4. */
+#if RD_KAFKA_VERSION >= 0x000b04ff
+#define HAVE_KAFKA_HEADERS 1
+#endif
+
+/* rd_kafka_purge(), which lets us take back messages that are still waiting in the
+ * producer's queue when we start spooling (see --spool-dir), appeared in librdkafka 1.0. */
+#if RD_KAFKA_VERSION >= 0x010000ff
+#define HAVE_KAFKA_PURGE 1
+#endif
+
+#define DEFAULT_BROKER_LIST "localhost:9092"
+#define DEFAULT_SCHEMA_REGISTRY "http://localhost:8081"
+#define DEFAULT_CONTROL_TOPIC "bottledwater-control"
+#define DEFAULT_KAFKA_TXN_INTERVAL_MS 100
+
+#define PRODUCER_CONTEXT_ERROR_LEN 512
+#define INITIAL_XACT_SLOTS 1024   /* Initial size of the in-flight transaction buffer */
+#define DEFAULT_XACT_MEMORY (16 * 1024 * 1024) /* Limit on that buffer's size, in bytes */
+#define DEFAULT_INFLIGHT_BYTES (256 * 1024 * 1024) /* Limit on messages not yet acknowledged */
+#define DEFAULT_CLAIM_CHECK_THRESHOLD (900 * 1000) /* Below Kafka's default message.max.bytes */
+#define XACT_SLOT_SIZE (sizeof(transaction_info) + sizeof(transaction_info *))
+#define DEFAULT_PRODUCE_BATCH_SIZE 1000 /* Hand a topic's messages to librdkafka at least this often */
+#define DEFAULT_BACKPRESSURE_MS 200 /* How long backpressure() waits for the sink at a time */
+
+typedef struct {
+    uint32_t xid;         /* Postgres transaction identifier */
+    int recvd_events;     /* Number of row-level events received so far for this transaction */
+    int pending_events;   /* Number of row-level events waiting to be acknowledged by Kafka
+                             (atomic, since delivery threads decrement it; see --producers) */
+    uint64_t commit_lsn;  /* WAL position of the transaction's commit event */
+    uint64_t end_lsn;     /* Where it is going to commit, as announced by its begin event */
+    int64_t commit_time;  /* When it committed, in microseconds since the Unix epoch
+                             (reset to 0 once its latency has been recorded) */
+} transaction_info;
+
+struct producer_context;
+
+/* One of the Kafka producers that topics are sharded across (see --producers). Its
+ * delivery reports are served by a thread of its own, which hands the envelopes of
+ * delivered messages back to the main thread through the acked list. */
+typedef struct {
+    struct producer_context *context;
+    rd_kafka_t *kafka;
+    pthread_t thread;
+    struct msg_envelope *acked;         /* Linked through next_free; pushed atomically */
+} producer_shard;
+
+typedef struct producer_context {
+    client_context_t client;            /* The connection to Postgres */
+    schema_registry_t registry;         /* Submits Avro schemas to schema registry */
+    sink_t sink;                        /* Where messages go (Kafka, unless --sink says otherwise) */
+    char *brokers;                      /* Comma-separated list of host:port for Kafka brokers */
+    transaction_info **xact_list;       /* Circular buffer of transactions in flight */
+    int xact_capacity;                  /* Number of slots in xact_list */
+    int max_xact_slots;                 /* Limit on xact_capacity (see --max-xact-memory) */
+    int xact_head;                      /* Index into xact_list currently being received from PG */
+    int xact_tail;                      /* Oldest index in xact_list not yet acknowledged by Kafka */
+    size_t inflight_bytes;              /* Size of messages encoded but not yet acknowledged */
+    size_t inflight_bytes_peak;         /* Highest inflight_bytes has been */
+    size_t max_inflight_bytes;          /* Limit on inflight_bytes (--max-inflight-bytes, 0 = none) */
+    rd_kafka_conf_t *kafka_conf;
+    rd_kafka_topic_conf_t *topic_conf;
+    rd_kafka_t *kafka;                  /* The producer (NULL if there are several) */
+    rd_kafka_queue_t *kafka_queue;      /* Main queue, if we asked it to signal an fd */
+    producer_shard *shards;             /* With --producers=N (N > 1), the producers */
+    int num_shards;
+    int shard_pipe[2];                  /* Written by delivery threads to wake up the main thread */
+    int shards_stopping;                /* Set (atomically) to ask the delivery threads to exit */
+    int stats_interval;                 /* Seconds between progress reports (0 = never) */
+    int64_t last_stats;                 /* When the last progress report was printed, in ms */
+    uint64_t acked_msgs;                /* Messages acknowledged by the sink since then */
+    uint64_t acked_bytes;               /* Their size */
+    histogram latency;                  /* Microseconds from Postgres commit to acknowledgement */
+    int produce_batch_size;             /* Messages per topic handed to the sink at least (--profile) */
+    int backpressure_ms;                /* Wait for the sink in backpressure() (--profile) */
+    struct msg_envelope *free_envelopes; /* Envelopes not currently in flight, for reuse */
+    struct envelope_slab *slabs;        /* All envelope allocations, so they can be freed */
+    topic_list_entry_t *dirty_topics;   /* Topics with messages waiting in entry->batch */
+    int num_dirty_topics;               /* Number of entries in dirty_topics */
+    int dirty_topics_capacity;          /* Allocated size of dirty_topics array */
+    partitioner_fn partitioner;         /* Set by --partitioner (NULL = librdkafka default) */
+    char *partition_column;             /* Key column to partition by (--partition-column) */
+    avro_writer_t hash_writer;          /* Encodes partition_column values for hashing */
+    char *hash_buf;                     /* Buffer for hash_writer */
+    size_t hash_buf_size;               /* Allocated size of hash_buf */
+    bool transactional;                 /* Wrap messages in Kafka transactions (--transactional-id) */
+    char *control_topic_name;           /* Topic recording the LSN of each Kafka transaction */
+    rd_kafka_topic_t *control_topic;
+    int kafka_txn_interval;             /* Milliseconds between Kafka transaction commits */
+    bool kafka_txn_open;                /* Whether a Kafka transaction has been begun */
+    bool kafka_txn_committing;          /* Whether it is waiting for its commit to complete */
+    int64_t kafka_txn_started;          /* When it was begun, in ms (see current_time_ms()) */
+    bool pg_txn_open;                   /* Between a Postgres transaction's begin and commit */
+    uint32_t pg_txn_xid;                /* The Postgres transaction that is open */
+    uint64_t kafka_txn_lsn;             /* Last Postgres commit included in the Kafka transaction */
+    uint64_t kafka_committed_lsn;       /* Last Postgres commit whose Kafka transaction committed */
+    uint64_t acked_lsn;                 /* Last Postgres commit fully acknowledged by Kafka */
+    uint64_t last_commit_lsn;           /* Last Postgres commit received */
+    uint64_t sink_commit_lsn;           /* Last Postgres commit passed to sink_commit() */
+    topic_router_t router;              /* Maps tables to topics (--route, --topic-template) */
+    bool table_headers;                 /* Tag messages with their table (see produce_with_headers()) */
+    bool txn_headers;                   /* Tag messages with their commit LSN etc. (--txn-headers) */
+    bool schemas_registered;            /* Set when held messages become ready to send */
+    coalesce_map_t coalesce;            /* Messages waiting to be produced, by key (--coalesce) */
+    int coalesce_window;                /* Milliseconds to hold messages for coalescing (0 = one transaction) */
+    int64_t coalesce_since;             /* When the oldest held message was queued, in ms (0 = none) */
+    spool_t spool;                      /* Messages that Kafka couldn't take (--spool-dir) */
+    bool spooling;                      /* Write messages to the spool until it has been drained */
+    bool spool_purge_due;               /* Move the producer's queue to the spool (see spool_batch()) */
+    int64_t spool_retry_at;             /* Don't drain the spool before this time, in ms */
+    rd_kafka_topic_t *spool_topic;      /* Topic of the last message drained from the spool */
+    blob_store_t blob_store;            /* Where values that are too big go (--claim-check) */
+    size_t claim_check_threshold;       /* Values larger than this go to blob_store */
+    char error[PRODUCER_CONTEXT_ERROR_LEN];
+} producer_context;
+
+typedef producer_context *producer_context_t;
+
+#define xact_list_full(context) \
+    (((context)->xact_head + 1) % (context)->xact_capacity == (context)->xact_tail)
+
+/* Tracks one message from the time it is encoded until its delivery is reported.
+ * Envelopes are recycled through context->free_envelopes rather than being malloced
+ * for every row; each one also owns the buffer holding its message value and key,
+ * which librdkafka references without copying, so that buffer is reused too. */
+typedef struct msg_envelope {
+    producer_context_t context;
+    uint64_t wal_pos;
+    Oid relid;
+    transaction_info *xact;
+    uint64_t seq;                       /* Number of the change within xact, from 1 */
+    char *payload;                      /* Prefixed Avro-encoded row, then prefixed key */
+    size_t payload_size;                /* Allocated size of payload */
+    size_t msg_size;                    /* Bytes of payload counted in context->inflight_bytes */
+    bool has_partition_hash;            /* Whether partition_hash determines the partition */
+    uint32_t partition_hash;            /* Hash of the message's partition column value */
+    spool_segment *spool_segment;       /* If the message was drained from the spool, where from */
+    rd_kafka_resp_err_t err;            /* Outcome of delivery, when reported by a delivery thread */
+    struct msg_envelope *next_free;     /* Next unused envelope in the free list (or acked list) */
+} msg_envelope;
+
+typedef msg_envelope *msg_envelope_t;
+
+/* Name of the program, for error messages */
+extern char *progname;
+
+/* producer.c: turns the change stream into messages, and tracks their acknowledgement */
+producer_context_t init_producer(client_context_t client);
+void set_sink(producer_context_t context, const sink_ops *ops, const char *target);
+void produce_pending(producer_context_t context);
+void maybe_produce_coalesced(producer_context_t context);
+bool poll_registry(producer_context_t context, int timeout_ms);
+void poll_sink(producer_context_t context, int timeout_ms);
+msg_envelope_t envelope_get(producer_context_t context);
+void envelope_put(producer_context_t context, msg_envelope_t envelope);
+void envelopes_free(producer_context_t context);
+bool xact_list_grow(producer_context_t context);
+void maybe_checkpoint(producer_context_t context);
+void update_fsync_lsn(producer_context_t context, uint64_t lsn);
+void maybe_report_stats(producer_context_t context);
+int64_t current_time_ms(void);
+int64_t current_time_us(void);
+char *format_string(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+
+/* kafka_sink.c: the Kafka sink (kafka_sink_ops), with the spool and Kafka transactions */
+void kafka_sink_init(producer_context_t context);
+void start_spooling(producer_context_t context, const char *reason);
+void drain_spool(producer_context_t context);
+void kafka_txn_begin(producer_context_t context);
+void maybe_commit_kafka_txn(producer_context_t context, bool force);
+
+/* bottledwater.c: option parsing and the event loop */
+void backpressure(producer_context_t context);
+void exit_nicely(producer_context_t context, int status);
+
+#endif /* PRODUCER_H */
@@ -8,7 +8,24 @@
  *   - The next four bytes are the schema ID in big-endian byte order.
  *
  * Anyone who wants to consume the messages can look up the schema ID in the
- * schema registry to obtain the schema, and thus decode the message. */
+ * schema registry to obtain the schema, and thus decode the message.
+ *
+ * Requests to the registry are made asynchronously, through a cURL multi handle, so
+ * that a burst of schema changes doesn't stall replication. The caller drives them
+ * with schema_registry_poll(), and is told through registry->on_registered when
+ * both of a table's schema IDs are known.
+ *
+ * With a schema cache (see schema_cache.c), IDs that were obtained in an earlier run
+ * are used straight away. The registry is still asked, to make sure the cached IDs
+ * are still valid, but only a few of those requests are made at a time, and
+ * nothing waits for them. If the registry can't be reached, the cached IDs are kept;
+ * only if it answers with a different ID is that an error.
+ *
+ * Many tables may have the same schema under the same subject (for example, one
+ * table per tenant, each in its own Postgres schema, all sent to one topic). Only
+ * one request is made for each distinct subject and schema: tables that need an ID
+ * which is already being requested wait for that request, and once the registry has
+ * answered, its ID is reused for the rest of the run. */
 
 #include "registry.h"
 
@@ -19,13 +36,36 @@
 #include <string.h>
 
 #define CONTENT_TYPE "application/vnd.schemaregistry.v1+json"
+#define MAX_RESPONSE_LEN 1024
+#define MAX_VALIDATIONS 4 /* Number of requests to check cached IDs to make at a time */
+
+/* A request to the schema registry that is in flight, or waiting to be made. */
+struct schema_request {
+    CURL *curl;                            /* Handle for this request, owned by registry->multi */
+    topic_list_entry_t entry;              /* Table whose schema is being registered */
+    int is_key;                            /* 1 for the key schema, 0 for the row schema */
+    char *req_body;                        /* JSON request body, referenced by curl */
+    avro_writer_t resp_writer;             /* Accumulates the response in resp_body */
+    char resp_body[MAX_RESPONSE_LEN];
+    char curl_error[CURL_ERROR_SIZE];      /* Buffer for libcurl error messages */
+    uint64_t fingerprint;                  /* Key for the schema ID in registry->cache */
+    int cached_id;                         /* If only validating a cached ID, that ID */
+    struct schema_request *followers;      /* Other tables waiting for the outcome of this request */
+    struct schema_request *next;           /* Next request in registry->requests, deferred or followers */
+};
 
-void *add_schema_prefix(int schema_id, const void *avro_bin, size_t avro_len);
 int registry_request(schema_registry_t registry, topic_list_entry_t entry, int is_key,
-        const char *schema_json, size_t schema_len);
+        const char *subject, const char *schema_json, size_t schema_len);
+int registry_request_done(schema_registry_t registry, schema_request *request, CURLcode result);
+void registry_request_finish(schema_registry_t registry, schema_request *request, int err, int schema_id);
+schema_request *registry_request_find(schema_registry_t registry, uint64_t fingerprint);
+void registry_request_unlink(schema_request **list, schema_request *request);
+void registry_request_free(schema_registry_t registry, schema_request *request);
+void registry_start_validations(schema_registry_t registry);
+void set_schema_id(topic_list_entry_t entry, int is_key, int schema_id);
 static size_t registry_response_cb(void *data, size_t size, size_t nmemb, void *writer);
-int registry_parse_response(schema_registry_t registry, CURLcode result, char *resp_body,
-        int resp_len, int *schema_id_out);
+int registry_parse_response(schema_registry_t registry, schema_request *request,
+        CURLcode result, int *schema_id_out);
 topic_list_entry_t topic_list_lookup(schema_registry_t registry, int64_t relid);
 topic_list_entry_t topic_list_replace(schema_registry_t registry, int64_t relid);
 topic_list_entry_t topic_list_entry_new(schema_registry_t registry);
@@ -36,7 +76,8 @@ schema_registry_t schema_registry_new(char *url) {
     schema_registry_t registry = malloc(sizeof(schema_registry));
     memset(registry, 0, sizeof(schema_registry));
 
-    registry->curl = curl_easy_init();
+    registry->multi = curl_multi_init();
+    registry->known = schema_cache_new(NULL);
     registry->curl_headers = curl_slist_append(NULL, "Content-Type: " CONTENT_TYPE);
     registry->curl_headers = curl_slist_append(registry->curl_headers, "Accept: " CONTENT_TYPE);
     registry->num_topics = 0;
@@ -63,118 +104,391 @@ void schema_registry_set_url(schema_registry_t registry, char *url) {
 }
 
 
-/* Prefixes Avro-encoded key and row records with IDs of the schema used for encoding. Sets
- * key_out and row_out to malloc'ed arrays that are SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN bytes
- * longer than the key_len and row_len bytes that were passed in, respectively. The caller is
- * responsible for freeing key_out and row_out. Returns the topic list entry on success,
- * or NULL on error. */
-topic_list_entry_t schema_registry_encode_msg(schema_registry_t registry, int64_t relid,
-        const void *key_bin, size_t key_len, void **key_out,
-        const void *row_bin, size_t row_len, void **row_out) {
-
-    topic_list_entry_t entry = topic_list_lookup(registry, relid);
-    if (!entry) {
-        registry_error(registry, "relid %" PRIu64 " has no registered schema", relid);
-        return NULL;
+/* Starts using a cache of schema IDs, persisted in the file at the given path.
+ * Returns 0 on success, or non-zero (with registry->error set) if the file can't
+ * be used. */
+int schema_registry_set_cache(schema_registry_t registry, const char *path) {
+    schema_cache_t cache = schema_cache_new(path);
+    if (schema_cache_load(cache)) {
+        registry_error(registry, "%s", cache->error);
+        schema_cache_free(cache);
+        return EIO;
     }
 
-    *key_out = add_schema_prefix(entry->key_schema_id, key_bin, key_len);
-    *row_out = add_schema_prefix(entry->row_schema_id, row_bin, row_len);
-    return entry;
+    if (registry->cache) schema_cache_free(registry->cache);
+    registry->cache = cache;
+    return 0;
 }
 
 
-/* Adds a 5-byte schema ID prefix to a byte array. */
-void *add_schema_prefix(int schema_id, const void *avro_bin, size_t avro_len) {
-    if (!avro_bin) return NULL;
+/* Returns the topic list entry for the table with the given relid, or NULL if no
+ * schema has been registered for that table. */
+topic_list_entry_t schema_registry_lookup(schema_registry_t registry, int64_t relid) {
+    return topic_list_lookup(registry, relid);
+}
 
-    uint32_t schema_id_big_endian = htonl(schema_id);
 
-    char *msg = malloc(avro_len + SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN);
-    msg[0] = '\0';
-    memcpy(msg + 1, &schema_id_big_endian, 4);
+/* Encodes a message in the schema registry's wire format: a zero byte, followed by
+ * the 4-byte big-endian schema ID, followed by the Avro-encoded data. The caller
+ * provides the output buffer, which must be SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN bytes
+ * longer than the Avro data, so that it can be reused from one message to the next. */
+void schema_registry_encode_msg(int schema_id, const void *avro_bin, size_t avro_len,
+        void *msg_out) {
+    char *msg = msg_out;
+    schema_registry_set_msg_schema(schema_id, msg);
     memcpy(msg + SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN, avro_bin, avro_len);
+}
 
-    return msg;
+
+/* Overwrites the schema ID in the prefix of a message encoded by
+ * schema_registry_encode_msg(). Used to fill in the ID of a message that was encoded
+ * while its schema was still being registered. */
+void schema_registry_set_msg_schema(int schema_id, void *msg_out) {
+    uint32_t schema_id_big_endian = htonl(schema_id);
+    char *msg = msg_out;
+    msg[0] = '\0';
+    memcpy(msg + 1, &schema_id_big_endian, 4);
 }
 
 
 /* Submits a new or updated schema to the registry. Re-registering a previously
  * registered schema is idempotent -- indeed, this is how we find out the schema
- * ID for an existing schema. Returns the topic list entry on success, or NULL
- * on failure. Consult registry->error for error message on failure. */
+ * ID for an existing schema. Returns the topic list entry once the requests have
+ * been started; its schema IDs are filled in when they complete, and until then
+ * entry->registrations is non-zero. Returns NULL on failure. Consult
+ * registry->error for error message on failure.
+ *
+ * The schemas are registered under the subjects "<topic>-key" and "<topic>-value",
+ * unless key_subject or row_subject is given. Several tables may share a topic (see
+ * routing.c), in which case each table needs subjects of its own. */
 topic_list_entry_t schema_registry_update(schema_registry_t registry,
-        int64_t relid, const char *topic_name,
+        int64_t relid, const char *topic_name, const char *table_name,
+        const char *key_subject, const char *row_subject,
         const char *key_schema_json, size_t key_schema_len,
         const char *row_schema_json, size_t row_schema_len) {
 
-    topic_list_entry_t entry = topic_list_replace(registry, relid);
+    // The entry's old schema IDs must not be overwritten by an earlier request
+    // completing after the new ones have been assigned.
+    topic_list_entry_t entry = topic_list_lookup(registry, relid);
+    if (entry && schema_registry_wait(registry, entry)) return NULL;
+
+    entry = topic_list_replace(registry, relid);
     entry->relid = relid;
     entry->topic_name = strdup(topic_name);
+    entry->table_name = strdup(table_name);
+    entry->key_schema_id = 0;
+    entry->row_schema_id = 0;
 
-    if (registry_request(registry, entry, 1, key_schema_json, key_schema_len)) return NULL;
-    if (registry_request(registry, entry, 0, row_schema_json, row_schema_len)) return NULL;
+    if (registry_request(registry, entry, 1, key_subject, key_schema_json, key_schema_len)) return NULL;
+    if (registry_request(registry, entry, 0, row_subject, row_schema_json, row_schema_len)) return NULL;
     return entry;
 }
 
 
-/* Submits a schema to the registry. If is_key == 1, it's a key schema, and if is_key == 0,
- * it's a row schema. Returns 0 on success. */
+/* Makes progress on the requests in flight, waiting up to timeout_ms milliseconds
+ * for some activity if none is possible right away (0 = don't wait). Calls
+ * registry->on_registered for each table whose schemas have now been registered.
+ * Returns 0 on success, or non-zero (with registry->error set) if a request failed. */
+int schema_registry_poll(schema_registry_t registry, int timeout_ms) {
+    registry_start_validations(registry);
+    if (!registry->requests) return 0;
+
+    CURLMcode mc;
+    int running;
+    if (timeout_ms > 0) {
+        mc = curl_multi_wait(registry->multi, NULL, 0, timeout_ms, NULL);
+        if (mc != CURLM_OK) {
+            registry_error(registry, "Schema registry request failed: %s", curl_multi_strerror(mc));
+            return EIO;
+        }
+    }
+
+    mc = curl_multi_perform(registry->multi, &running);
+    if (mc != CURLM_OK) {
+        registry_error(registry, "Schema registry request failed: %s", curl_multi_strerror(mc));
+        return EIO;
+    }
+
+    CURLMsg *msg;
+    int remaining;
+    while ((msg = curl_multi_info_read(registry->multi, &remaining))) {
+        if (msg->msg != CURLMSG_DONE) continue;
+
+        schema_request *request;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &request);
+        int err = registry_request_done(registry, request, msg->data.result);
+        if (err) return err;
+    }
+    return 0;
+}
+
+
+/* Blocks until the schemas of the given table have been registered, or until all
+ * tables' have if entry is NULL. (Checks of cached IDs may still be in progress.)
+ * Returns 0 on success, or non-zero (with registry->error set) if a request failed. */
+int schema_registry_wait(schema_registry_t registry, topic_list_entry_t entry) {
+    while (entry ? entry->registrations > 0 : registry->num_registering > 0) {
+        int err = schema_registry_poll(registry, 1000);
+        if (err) return err;
+    }
+    return 0;
+}
+
+
+/* Returns true if there are requests in flight, or waiting to be made, so that
+ * schema_registry_poll() should be called soon. */
+bool schema_registry_busy(schema_registry_t registry) {
+    return registry->requests || registry->deferred;
+}
+
+
+/* Starts submitting a schema to the registry. If is_key == 1, it's a key schema, and if
+ * is_key == 0, it's a row schema. If subject is NULL, the default subject for the topic
+ * is used. If the schema's ID is in the cache, the entry gets it right away, and the
+ * request to check it is deferred. If the same subject and schema have already been
+ * registered, no request is made, and if they are being registered, the entry follows
+ * that request. Returns 0 if the request was started or queued. */
 int registry_request(schema_registry_t registry, topic_list_entry_t entry, int is_key,
-        const char *schema_json, size_t schema_len) {
+        const char *subject, const char *schema_json, size_t schema_len) {
     if (!schema_json || schema_len == 0) return 0; // Nothing to do
 
     char url[512];
-    int url_len = snprintf(url, sizeof(url), "%s/subjects/%s-%s/versions",
+    int url_len;
+    if (subject) {
+        url_len = snprintf(url, sizeof(url), "%s/subjects/%s/versions",
+                registry->registry_url, subject);
+    } else {
+        url_len = snprintf(url, sizeof(url), "%s/subjects/%s-%s/versions",
                 registry->registry_url, entry->topic_name, is_key ? "key" : "value");
+    }
 
     if (url_len >= sizeof(url)) {
         registry_error(registry, "Schema registry URL is too long: %s", url);
         return EINVAL;
     }
 
+    uint64_t fingerprint = schema_fingerprint(url, schema_json, schema_len);
+    int known_id = schema_cache_get(registry->known, fingerprint);
+    if (known_id) {
+        set_schema_id(entry, is_key, known_id);
+        return 0;
+    }
+
+    schema_request *leader = registry_request_find(registry, fingerprint);
+    if (leader) {
+        schema_request *follower = malloc(sizeof(schema_request));
+        memset(follower, 0, sizeof(schema_request));
+        follower->entry = entry;
+        follower->is_key = is_key;
+        follower->fingerprint = fingerprint;
+        follower->cached_id = leader->cached_id;
+        follower->next = leader->followers;
+        leader->followers = follower;
+
+        if (follower->cached_id) {
+            set_schema_id(entry, is_key, follower->cached_id);
+        } else {
+            registry->num_registering++;
+            entry->registrations++;
+        }
+        return 0;
+    }
+
     json_t *req_json = json_pack("{s:s}", "schema", schema_json);
     char *req_body = json_dumps(req_json, JSON_COMPACT);
+    json_decref(req_json);
     if (!req_body) {
         registry_error(registry, "Could not encode JSON request for schema registry");
         return EINVAL;
     }
 
-    char resp_body[1024];
-    avro_writer_t resp_writer = avro_writer_memory(resp_body, sizeof(resp_body));
+    schema_request *request = malloc(sizeof(schema_request));
+    memset(request, 0, sizeof(schema_request));
+    request->curl = curl_easy_init();
+    request->entry = entry;
+    request->is_key = is_key;
+    request->req_body = req_body;
+    request->fingerprint = fingerprint;
+    if (registry->cache) request->cached_id = schema_cache_get(registry->cache, request->fingerprint);
+    request->resp_writer = avro_writer_memory(request->resp_body, sizeof(request->resp_body));
+
+    // curl copies the URL, but not the request body
+    curl_easy_setopt(request->curl, CURLOPT_URL, url);
+    curl_easy_setopt(request->curl, CURLOPT_POSTFIELDS, request->req_body);
+    curl_easy_setopt(request->curl, CURLOPT_HTTPHEADER, registry->curl_headers);
+    curl_easy_setopt(request->curl, CURLOPT_WRITEFUNCTION, registry_response_cb);
+    curl_easy_setopt(request->curl, CURLOPT_WRITEDATA, request->resp_writer);
+    curl_easy_setopt(request->curl, CURLOPT_ERRORBUFFER, request->curl_error);
+    curl_easy_setopt(request->curl, CURLOPT_PRIVATE, request);
+
+    if (request->cached_id) {
+        set_schema_id(entry, is_key, request->cached_id);
+        request->next = registry->deferred;
+        registry->deferred = request;
+        return 0;
+    }
 
-    curl_easy_setopt(registry->curl, CURLOPT_URL, url);
-    curl_easy_setopt(registry->curl, CURLOPT_POSTFIELDS, req_body);
-    curl_easy_setopt(registry->curl, CURLOPT_HTTPHEADER, registry->curl_headers);
-    curl_easy_setopt(registry->curl, CURLOPT_WRITEFUNCTION, registry_response_cb);
-    curl_easy_setopt(registry->curl, CURLOPT_WRITEDATA, resp_writer);
-    curl_easy_setopt(registry->curl, CURLOPT_ERRORBUFFER, registry->curl_error);
+    CURLMcode mc = curl_multi_add_handle(registry->multi, request->curl);
+    if (mc != CURLM_OK) {
+        registry_error(registry, "Could not send schema to registry: %s", curl_multi_strerror(mc));
+        avro_writer_free(request->resp_writer);
+        curl_easy_cleanup(request->curl);
+        free(request->req_body);
+        free(request);
+        return EIO;
+    }
+
+    request->next = registry->requests;
+    registry->requests = request;
+    registry->num_registering++;
+    entry->registrations++;
 
-    CURLcode result = curl_easy_perform(registry->curl);
+    // Get the request on its way without waiting for the response
+    int running;
+    curl_multi_perform(registry->multi, &running);
+    return 0;
+}
 
+
+/* Handles the completion of a request: records the schema ID it obtained for its
+ * table and any followers, and for each table for which it was the last one
+ * outstanding, tells registry->on_registered. A request that only checked a cached
+ * ID fails only if the registry assigned a different one. */
+int registry_request_done(schema_registry_t registry, schema_request *request, CURLcode result) {
     int schema_id = 0;
-    int resp_len = avro_writer_tell(resp_writer);
-    int err = registry_parse_response(registry, result, resp_body, resp_len, &schema_id);
-
-    if (!err) {
-        if (is_key) {
-            entry->key_schema_id = schema_id;
-            fprintf(stderr, "Registered key schema for topic \"%s\" with ID %d\n",
-                    entry->topic_name, schema_id);
-        } else {
-            entry->row_schema_id = schema_id;
-            fprintf(stderr, "Registered value schema for topic \"%s\" with ID %d\n",
-                    entry->topic_name, schema_id);
+    int err = registry_parse_response(registry, request, result, &schema_id);
+
+    if (err && request->cached_id) {
+        // Not worth failing over; the cached ID is probably fine
+        fprintf(stderr, "Warning: could not check cached schema ID %d for topic \"%s\": %s\n",
+                request->cached_id, request->entry->topic_name, registry->error);
+        err = 0;
+        schema_id = request->cached_id;
+
+    } else if (!err) {
+        schema_cache_put(registry->known, request->fingerprint, schema_id);
+
+        if (registry->cache && schema_cache_put(registry->cache, request->fingerprint, schema_id)) {
+            fprintf(stderr, "Warning: %s\n", registry->cache->error);
         }
     }
 
-    avro_writer_free(resp_writer);
-    free(req_body);
-    json_decref(req_json);
+    if (request->cached_id && schema_id != request->cached_id) {
+        // The registry has lost its state, or the cache file is from elsewhere. Messages
+        // already sent with the cached ID can't be fixed; the cache now has the right ID
+        // for the next run.
+        registry_error(registry, "Schema registry assigned ID %d to the %s schema for topic "
+                "\"%s\", but ID %d was cached", schema_id, request->is_key ? "key" : "value",
+                request->entry->topic_name, request->cached_id);
+        err = EINVAL;
+    }
+
+    registry_request_unlink(&registry->requests, request);
+    if (request->cached_id) registry->num_validating--;
+
+    registry_request_finish(registry, request, err, schema_id);
+    for (schema_request *follower = request->followers; follower; follower = follower->next) {
+        registry_request_finish(registry, follower, err, schema_id);
+    }
+
+    registry_request_free(registry, request);
     return err;
 }
 
 
+/* Updates one table's entry with the schema ID that the registry returned for a
+ * request (or for the request that it was following), and calls on_registered if
+ * the table has no more registrations outstanding. */
+void registry_request_finish(schema_registry_t registry, schema_request *request, int err, int schema_id) {
+    topic_list_entry_t entry = request->entry;
+
+    if (!err && !request->cached_id) {
+        set_schema_id(entry, request->is_key, schema_id);
+        fprintf(stderr, "Registered %s schema for table \"%s\" (topic \"%s\") with ID %d\n",
+                request->is_key ? "key" : "value", entry->table_name, entry->topic_name,
+                schema_id);
+    }
+
+    if (request->cached_id) return;
+    registry->num_registering--;
+    entry->registrations--;
+    if (!err && entry->registrations == 0 && registry->on_registered) {
+        registry->on_registered(registry->cb_context, entry);
+    }
+}
+
+
+/* Returns the request in flight or deferred for the given fingerprint, or NULL if
+ * there is none. */
+schema_request *registry_request_find(schema_registry_t registry, uint64_t fingerprint) {
+    for (schema_request *request = registry->requests; request; request = request->next) {
+        if (request->fingerprint == fingerprint) return request;
+    }
+    for (schema_request *request = registry->deferred; request; request = request->next) {
+        if (request->fingerprint == fingerprint) return request;
+    }
+    return NULL;
+}
+
+
+/* Starts some of the deferred requests that check cached schema IDs, keeping no more
+ * than MAX_VALIDATIONS in flight, so that they don't get in the way of registering
+ * new schemas. */
+void registry_start_validations(schema_registry_t registry) {
+    while (registry->deferred && registry->num_validating < MAX_VALIDATIONS) {
+        schema_request *request = registry->deferred;
+        registry->deferred = request->next;
+
+        CURLMcode mc = curl_multi_add_handle(registry->multi, request->curl);
+        if (mc != CURLM_OK) {
+            // Not worth failing over; the cached ID is probably fine
+            fprintf(stderr, "Warning: could not check cached schema ID: %s\n",
+                    curl_multi_strerror(mc));
+            registry_request_free(registry, request);
+            continue;
+        }
+
+        request->next = registry->requests;
+        registry->requests = request;
+        registry->num_validating++;
+    }
+}
+
+
+/* Sets the key or row schema ID of a topic list entry. */
+void set_schema_id(topic_list_entry_t entry, int is_key, int schema_id) {
+    if (is_key) {
+        entry->key_schema_id = schema_id;
+    } else {
+        entry->row_schema_id = schema_id;
+    }
+}
+
+
+/* Removes a request from a list (registry->requests or registry->deferred). */
+void registry_request_unlink(schema_request **list, schema_request *request) {
+    schema_request **link = list;
+    while (*link != request) link = &(*link)->next;
+    *link = request->next;
+}
+
+
+/* Frees a request that is no longer on any list, along with its followers. */
+void registry_request_free(schema_registry_t registry, schema_request *request) {
+    while (request->followers) {
+        schema_request *follower = request->followers;
+        request->followers = follower->next;
+        free(follower);
+    }
+
+    curl_multi_remove_handle(registry->multi, request->curl);
+    curl_easy_cleanup(request->curl);
+    avro_writer_free(request->resp_writer);
+    free(request->req_body);
+    free(request);
+}
+
+
 /* Called by cURL when bytes of response are received from the schema registry.
  * Appends them to a buffer, so that we can parse the response when finished. */
 static size_t registry_response_cb(void *data, size_t size, size_t nmemb, void *writer) {
@@ -190,15 +504,18 @@ static size_t registry_response_cb(void *data, size_t size, size_t nmemb, void *
 /* Handles the response from a schema-publishing request to the schema registry.
  * On failure, sets an error message and returns non-zero. On success, returns zero
  * and assigns the schema ID to *schema_id_out. */
-int registry_parse_response(schema_registry_t registry, CURLcode result, char *resp_body,
-        int resp_len, int *schema_id_out) {
+int registry_parse_response(schema_registry_t registry, schema_request *request,
+        CURLcode result, int *schema_id_out) {
     if (result != CURLE_OK) {
-        registry_error(registry, "Could not send schema to registry: %s", registry->curl_error);
+        registry_error(registry, "Could not send schema to registry: %s", request->curl_error);
         return EIO;
     }
 
     long resp_code = 0;
-    curl_easy_getinfo(registry->curl, CURLINFO_RESPONSE_CODE, &resp_code);
+    curl_easy_getinfo(request->curl, CURLINFO_RESPONSE_CODE, &resp_code);
+
+    char *resp_body = request->resp_body;
+    int resp_len = avro_writer_tell(request->resp_writer);
 
     json_error_t parse_err;
     json_t *resp_json = json_loadb(resp_body, resp_len, 0, &parse_err);
@@ -266,6 +583,7 @@ topic_list_entry_t topic_list_replace(schema_registry_t registry, int64_t relid)
     topic_list_entry_t entry = topic_list_lookup(registry, relid);
     if (entry) {
         free(entry->topic_name);
+        free(entry->table_name);
         return entry;
     } else {
         return topic_list_entry_new(registry);
@@ -295,11 +613,25 @@ void schema_registry_free(schema_registry_t registry) {
         topic_list_entry_t entry = registry->topics[i];
         if (entry->topic) rd_kafka_topic_destroy(entry->topic);
         free(entry->topic_name);
+        free(entry->table_name);
+        free(entry->batch);
         free(entry);
     }
 
+    while (registry->requests) {
+        schema_request *request = registry->requests;
+        registry->requests = request->next;
+        registry_request_free(registry, request);
+    }
+    while (registry->deferred) {
+        schema_request *request = registry->deferred;
+        registry->deferred = request->next;
+        registry_request_free(registry, request);
+    }
+    if (registry->cache) schema_cache_free(registry->cache);
+    schema_cache_free(registry->known);
+    curl_multi_cleanup(registry->multi);
     curl_slist_free_all(registry->curl_headers);
-    curl_easy_cleanup(registry->curl);
     free(registry->topics);
     free(registry->registry_url);
     free(registry);
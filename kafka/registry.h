@@ -1,8 +1,11 @@
 #ifndef REGISTRY_H
 #define REGISTRY_H
 
+#include "schema_cache.h"
+
 #include <librdkafka/rdkafka.h>
 #include <curl/curl.h>
+#include <stdbool.h>
 
 /* 5 bytes prefix is added by schema_registry_encode_msg(). */
 #define SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN 5
@@ -11,18 +14,38 @@
 
 typedef struct {
     uint64_t relid;             /* Uniquely identifies a table, even when it is renamed */
-    char *topic_name;           /* Derived from schema record name, in turn derived from table name */
+    char *topic_name;           /* Derived from table name, unless routed elsewhere (see routing.c) */
+    char *table_name;           /* Qualified name of the table ("schema.table") */
     int key_schema_id;          /* Identifier for the current key schema, assigned by the registry */
     int row_schema_id;          /* Identifier for the current row schema, assigned by the registry */
+    int registrations;          /* Number of requests to the registry in flight for this table */
     rd_kafka_topic_t *topic;    /* Kafka topic to which messages are produced */
+    void *sink_data;            /* Per-table state of a sink other than Kafka (see sink.h) */
+    rd_kafka_message_t *batch;  /* Messages waiting to be handed to the Kafka producer */
+    int batch_len;              /* Number of messages in batch */
+    int batch_capacity;         /* Allocated size of batch array */
+    int batch_dirty;            /* Non-zero if on the producer's list of topics to flush */
 } topic_list_entry;
 
 typedef topic_list_entry *topic_list_entry_t;
 
+typedef struct schema_request schema_request;
+
+/* Called when all the schemas of a table have been registered, and its schema IDs
+ * are known. */
+typedef void (*schema_registered_cb)(void *, topic_list_entry_t);
+
 typedef struct {
-    CURL *curl;                            /* HTTP client for making requests to schema registry */
+    CURLM *multi;                          /* HTTP client running requests to schema registry */
     struct curl_slist *curl_headers;       /* HTTP headers for requests to schema registry */
-    char curl_error[CURL_ERROR_SIZE];      /* Buffer for libcurl error messages */
+    schema_request *requests;              /* Linked list of requests in flight */
+    schema_request *deferred;              /* Requests to check cached IDs, not yet started */
+    int num_registering;                   /* Requests in flight that tables are waiting for */
+    int num_validating;                    /* Requests in flight checking cached IDs */
+    schema_cache_t cache;                  /* Schema IDs from previous runs (NULL = none) */
+    schema_cache_t known;                  /* Schema IDs confirmed by the registry in this run */
+    schema_registered_cb on_registered;    /* Called when a table's schema IDs become known */
+    void *cb_context;                      /* Passed to on_registered */
     char error[SCHEMA_REGISTRY_ERROR_LEN]; /* Buffer for general error messages */
     char *registry_url;                    /* URL of server (set with schema_registry_set_url()) */
     int num_topics;                        /* Number of topics in use */
@@ -34,13 +57,19 @@ typedef schema_registry *schema_registry_t;
 
 schema_registry_t schema_registry_new(char *url);
 void schema_registry_set_url(schema_registry_t registry, char *url);
-topic_list_entry_t schema_registry_encode_msg(schema_registry_t registry, int64_t relid,
-        const void *key_bin, size_t key_len, void **key_out,
-        const void *row_bin, size_t row_len, void **row_out);
+int schema_registry_set_cache(schema_registry_t registry, const char *path);
+topic_list_entry_t schema_registry_lookup(schema_registry_t registry, int64_t relid);
+void schema_registry_encode_msg(int schema_id, const void *avro_bin, size_t avro_len,
+        void *msg_out);
+void schema_registry_set_msg_schema(int schema_id, void *msg_out);
 topic_list_entry_t schema_registry_update(schema_registry_t registry,
-        int64_t relid, const char *topic_name,
+        int64_t relid, const char *topic_name, const char *table_name,
+        const char *key_subject, const char *row_subject,
         const char *key_schema_json, size_t key_schema_len,
         const char *row_schema_json, size_t row_schema_len);
+int schema_registry_poll(schema_registry_t registry, int timeout_ms);
+int schema_registry_wait(schema_registry_t registry, topic_list_entry_t entry);
+bool schema_registry_busy(schema_registry_t registry);
 void schema_registry_free(schema_registry_t reader);
 
 #endif /* REGISTRY_H */
@@ -0,0 +1,585 @@
+/* Tests for the schema registry client (registry.c), against a stub registry that
+ * listens on a local port. The stub answers each POST to /subjects/.../versions the
+ * way Confluent's registry does, giving each distinct subject and schema an ID of
+ * its own, except for subjects that start with "error" (HTTP 500 with a message) or
+ * "broken" (HTTP 503 with a body that isn't JSON). It can be told to hold back its
+ * responses, to check what the client does while requests are in flight.
+ *
+ * The schema ID cache (schema_cache.c) is tested through the registry client too,
+ * with cache files in the temporary directory.
+ *
+ * Run with "make test". */
+
+#include "registry.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_REQUEST_LEN 4096
+#define MAX_SCHEMAS 64
+#define MAX_SETTLE_POLLS 100 /* Give up on requests that take longer than 10 seconds */
+
+#define KEY_SCHEMA "{\"type\":\"record\",\"name\":\"key\",\"fields\":[{\"name\":\"id\",\"type\":\"int\"}]}"
+#define ROW_SCHEMA "{\"type\":\"record\",\"name\":\"row\",\"fields\":[{\"name\":\"id\",\"type\":\"int\"}]}"
+
+#define expect(cond, ...) { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+        failures++; \
+    } \
+}
+
+typedef struct {
+    int listen_fd;
+    int port;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    bool hold;                  /* Whether responses are being held back */
+    int num_requests;           /* Requests received so far */
+    int num_schemas;
+    char *schemas[MAX_SCHEMAS]; /* Subject and body of each distinct request; ID = index + 1 */
+} stub_registry;
+
+typedef struct {
+    int num_registered;         /* Calls of on_registered */
+    topic_list_entry_t last;    /* Entry passed to the last of them */
+} registered_log;
+
+static char *progname;
+static int failures = 0;
+
+stub_registry *stub_start(void);
+void stub_hold(stub_registry *stub, bool hold);
+int stub_requests(stub_registry *stub);
+void stub_stop(stub_registry *stub);
+void *stub_serve(void *_stub);
+void stub_handle(stub_registry *stub, int fd);
+int stub_schema_id(stub_registry *stub, const char *path, const char *body);
+schema_registry_t registry_for(stub_registry *stub, registered_log *log);
+static void on_registered(void *_log, topic_list_entry_t entry);
+void test_async_registration(void);
+void test_follower_dedup(void);
+void test_http_errors(void);
+void test_unreachable(void);
+char *cache_file_new(const char *registry_url, const char *subject, const char *schema_json,
+        int schema_id);
+int registry_settle(schema_registry_t registry);
+void test_cached_id(void);
+void test_cached_id_mismatch(void);
+void test_cached_id_unreachable(void);
+void test_cache_persists(void);
+
+
+/* Starts the stub registry on an ephemeral port of the loopback interface. */
+stub_registry *stub_start() {
+    stub_registry *stub = malloc(sizeof(stub_registry));
+    memset(stub, 0, sizeof(stub_registry));
+    pthread_mutex_init(&stub->lock, NULL);
+    pthread_cond_init(&stub->released, NULL);
+
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    stub->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (stub->listen_fd < 0 ||
+            bind(stub->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+            listen(stub->listen_fd, 16) != 0 ||
+            getsockname(stub->listen_fd, (struct sockaddr *) &addr, &addr_len) != 0) {
+        fprintf(stderr, "%s: Could not start stub registry: %s\n", progname, strerror(errno));
+        exit(1);
+    }
+    stub->port = ntohs(addr.sin_port);
+
+    if (pthread_create(&stub->thread, NULL, stub_serve, stub) != 0) {
+        fprintf(stderr, "%s: Could not start stub registry thread\n", progname);
+        exit(1);
+    }
+    return stub;
+}
+
+
+/* Holds back responses (until called again with hold = false), or lets them go. */
+void stub_hold(stub_registry *stub, bool hold) {
+    pthread_mutex_lock(&stub->lock);
+    stub->hold = hold;
+    pthread_cond_broadcast(&stub->released);
+    pthread_mutex_unlock(&stub->lock);
+}
+
+
+/* Returns the number of requests that the stub has received. */
+int stub_requests(stub_registry *stub) {
+    pthread_mutex_lock(&stub->lock);
+    int num_requests = stub->num_requests;
+    pthread_mutex_unlock(&stub->lock);
+    return num_requests;
+}
+
+
+/* Stops the stub registry, and frees it. Shutting down the listening socket wakes
+ * up the thread that is blocked in accept(). */
+void stub_stop(stub_registry *stub) {
+    stub_hold(stub, false);
+    shutdown(stub->listen_fd, SHUT_RDWR);
+    pthread_join(stub->thread, NULL);
+    close(stub->listen_fd);
+
+    for (int i = 0; i < stub->num_schemas; i++) free(stub->schemas[i]);
+    pthread_cond_destroy(&stub->released);
+    pthread_mutex_destroy(&stub->lock);
+    free(stub);
+}
+
+
+/* Body of the stub's thread: serves one connection at a time, one request per
+ * connection, until the listening socket is shut down. */
+void *stub_serve(void *_stub) {
+    stub_registry *stub = (stub_registry *) _stub;
+    while (true) {
+        int fd = accept(stub->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) continue;
+            return NULL;
+        }
+        stub_handle(stub, fd);
+        close(fd);
+    }
+}
+
+
+/* Reads one HTTP request from a connection, and answers it. */
+void stub_handle(stub_registry *stub, int fd) {
+    char request[MAX_REQUEST_LEN + 1];
+    size_t len = 0;
+    char *body = NULL;
+    size_t content_length = 0;
+
+    // Read the headers, then as much of the body as Content-Length says there is
+    while (!body || len < (body - request) + content_length) {
+        if (len == MAX_REQUEST_LEN) return;
+        ssize_t n = read(fd, request + len, MAX_REQUEST_LEN - len);
+        if (n <= 0) return;
+        len += n;
+        request[len] = '\0';
+
+        if (!body) {
+            char *end = strstr(request, "\r\n\r\n");
+            if (!end) continue;
+            body = end + 4;
+
+            for (char *line = strstr(request, "\r\n"); line && line < end; line = strstr(line + 2, "\r\n")) {
+                if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+                    content_length = strtoul(line + 17, NULL, 10);
+                }
+            }
+        }
+    }
+
+    char path[256] = "";
+    sscanf(request, "POST %255s", path);
+    char *subject = strstr(path, "/subjects/");
+    subject = subject ? subject + strlen("/subjects/") : path;
+
+    pthread_mutex_lock(&stub->lock);
+    stub->num_requests++;
+    while (stub->hold) pthread_cond_wait(&stub->released, &stub->lock);
+    pthread_mutex_unlock(&stub->lock);
+
+    char resp_body[256];
+    const char *status;
+    if (strncmp(subject, "error", 5) == 0) {
+        status = "500 Internal Server Error";
+        snprintf(resp_body, sizeof(resp_body), "{\"error_code\":50001,\"message\":\"Stub failure\"}");
+    } else if (strncmp(subject, "broken", 6) == 0) {
+        status = "503 Service Unavailable";
+        snprintf(resp_body, sizeof(resp_body), "<html>Service Unavailable</html>");
+    } else {
+        status = "200 OK";
+        snprintf(resp_body, sizeof(resp_body), "{\"id\":%d}", stub_schema_id(stub, path, body));
+    }
+
+    char response[512];
+    int resp_len = snprintf(response, sizeof(response),
+            "HTTP/1.1 %s\r\nContent-Type: application/vnd.schemaregistry.v1+json\r\n"
+            "Content-Length: %zu\r\nConnection: close\r\n\r\n%s",
+            status, strlen(resp_body), resp_body);
+    if (write(fd, response, resp_len) < 0) return;
+}
+
+
+/* Returns the ID that the stub assigns to a schema under a subject, which is the same
+ * every time the same subject and schema are registered. */
+int stub_schema_id(stub_registry *stub, const char *path, const char *body) {
+    char key[MAX_REQUEST_LEN + 256];
+    snprintf(key, sizeof(key), "%s %s", path, body);
+
+    pthread_mutex_lock(&stub->lock);
+    int i;
+    for (i = 0; i < stub->num_schemas; i++) {
+        if (strcmp(stub->schemas[i], key) == 0) break;
+    }
+    if (i == stub->num_schemas && i < MAX_SCHEMAS) {
+        stub->schemas[stub->num_schemas++] = strdup(key);
+    }
+    pthread_mutex_unlock(&stub->lock);
+    return i + 1;
+}
+
+
+/* Creates a schema registry client that talks to the stub, and logs the calls of
+ * its on_registered callback. */
+schema_registry_t registry_for(stub_registry *stub, registered_log *log) {
+    char url[64];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d", stub->port);
+
+    schema_registry_t registry = schema_registry_new(url);
+    memset(log, 0, sizeof(registered_log));
+    registry->on_registered = on_registered;
+    registry->cb_context = log;
+    return registry;
+}
+
+
+static void on_registered(void *_log, topic_list_entry_t entry) {
+    registered_log *log = (registered_log *) _log;
+    log->num_registered++;
+    log->last = entry;
+}
+
+
+/* Registering a table's schemas doesn't wait for the registry: the entry is returned
+ * while the requests are in flight, and on_registered is called once both IDs are in. */
+void test_async_registration() {
+    stub_registry *stub = stub_start();
+    registered_log log;
+    schema_registry_t registry = registry_for(stub, &log);
+
+    stub_hold(stub, true);
+    topic_list_entry_t entry = schema_registry_update(registry, 1001, "users", "public.users",
+            NULL, NULL, KEY_SCHEMA, strlen(KEY_SCHEMA), ROW_SCHEMA, strlen(ROW_SCHEMA));
+    expect(entry != NULL, "schema_registry_update failed: %s", registry->error);
+    if (!entry) goto done;
+
+    expect(entry->registrations == 2, "expected 2 registrations in flight, got %d", entry->registrations);
+    expect(entry->key_schema_id == 0 && entry->row_schema_id == 0,
+            "schema IDs assigned before the registry answered");
+    expect(schema_registry_busy(registry), "registry not busy with requests in flight");
+    expect(schema_registry_poll(registry, 50) == 0, "poll failed: %s", registry->error);
+    expect(log.num_registered == 0, "on_registered called before the registry answered");
+
+    stub_hold(stub, false);
+    expect(schema_registry_wait(registry, entry) == 0, "wait failed: %s", registry->error);
+    expect(entry->registrations == 0, "%d registrations still in flight", entry->registrations);
+    expect(entry->key_schema_id > 0 && entry->row_schema_id > 0 &&
+            entry->key_schema_id != entry->row_schema_id,
+            "unexpected schema IDs %d and %d", entry->key_schema_id, entry->row_schema_id);
+    expect(log.num_registered == 1 && log.last == entry,
+            "on_registered called %d times", log.num_registered);
+    expect(stub_requests(stub) == 2, "expected 2 requests, got %d", stub_requests(stub));
+
+done:
+    schema_registry_free(registry);
+    stub_stop(stub);
+}
+
+
+/* Tables that need the same subject and schema share one request: those that come
+ * along while it is in flight follow it, and those that come later reuse its ID
+ * without asking the registry again. */
+void test_follower_dedup() {
+    stub_registry *stub = stub_start();
+    registered_log log;
+    schema_registry_t registry = registry_for(stub, &log);
+
+    stub_hold(stub, true);
+    topic_list_entry_t first = schema_registry_update(registry, 2001, "tenants", "tenant_a.orders",
+            "tenants-orders-key", "tenants-orders-value",
+            KEY_SCHEMA, strlen(KEY_SCHEMA), ROW_SCHEMA, strlen(ROW_SCHEMA));
+    topic_list_entry_t second = schema_registry_update(registry, 2002, "tenants", "tenant_b.orders",
+            "tenants-orders-key", "tenants-orders-value",
+            KEY_SCHEMA, strlen(KEY_SCHEMA), ROW_SCHEMA, strlen(ROW_SCHEMA));
+    expect(first && second, "schema_registry_update failed: %s", registry->error);
+    if (!first || !second) goto done;
+
+    expect(second->registrations == 2, "follower should wait for 2 requests, not %d",
+            second->registrations);
+    expect(registry->num_registering == 4, "expected 4 registrations, got %d",
+            registry->num_registering);
+
+    stub_hold(stub, false);
+    expect(schema_registry_wait(registry, NULL) == 0, "wait failed: %s", registry->error);
+    expect(stub_requests(stub) == 2, "expected 2 requests for 2 tables, got %d", stub_requests(stub));
+    expect(first->key_schema_id > 0 && first->key_schema_id == second->key_schema_id &&
+            first->row_schema_id == second->row_schema_id,
+            "leader got IDs %d/%d, follower %d/%d", first->key_schema_id, first->row_schema_id,
+            second->key_schema_id, second->row_schema_id);
+    expect(log.num_registered == 2, "on_registered called %d times, not 2", log.num_registered);
+
+    topic_list_entry_t third = schema_registry_update(registry, 2003, "tenants", "tenant_c.orders",
+            "tenants-orders-key", "tenants-orders-value",
+            KEY_SCHEMA, strlen(KEY_SCHEMA), ROW_SCHEMA, strlen(ROW_SCHEMA));
+    expect(third != NULL, "schema_registry_update failed: %s", registry->error);
+    if (!third) goto done;
+
+    expect(third->registrations == 0 && third->key_schema_id == first->key_schema_id &&
+            third->row_schema_id == first->row_schema_id,
+            "known schema IDs not reused (%d registrations)", third->registrations);
+    expect(!schema_registry_busy(registry), "request made for known schema IDs");
+    expect(stub_requests(stub) == 2, "expected no more requests, got %d", stub_requests(stub));
+
+done:
+    schema_registry_free(registry);
+    stub_stop(stub);
+}
+
+
+/* An HTTP error from the registry fails the registration, with the registry's
+ * message if it sent one, and on_registered is not called. */
+void test_http_errors() {
+    stub_registry *stub = stub_start();
+    registered_log log;
+    schema_registry_t registry = registry_for(stub, &log);
+
+    topic_list_entry_t entry = schema_registry_update(registry, 3001, "accounts", "public.accounts",
+            "error-key", NULL, KEY_SCHEMA, strlen(KEY_SCHEMA), NULL, 0);
+    expect(entry != NULL, "schema_registry_update failed: %s", registry->error);
+    if (!entry) goto done;
+
+    expect(schema_registry_wait(registry, entry) != 0, "HTTP 500 not reported as an error");
+    expect(strstr(registry->error, "HTTP status 500: Stub failure") != NULL,
+            "unexpected error message: %s", registry->error);
+    expect(entry->registrations == 0 && registry->num_registering == 0,
+            "failed request still counted (%d, %d)", entry->registrations, registry->num_registering);
+    expect(log.num_registered == 0, "on_registered called for a failed registration");
+
+    entry = schema_registry_update(registry, 3002, "ledger", "public.ledger",
+            "broken-key", NULL, KEY_SCHEMA, strlen(KEY_SCHEMA), NULL, 0);
+    expect(entry != NULL, "schema_registry_update failed: %s", registry->error);
+    if (!entry) goto done;
+
+    expect(schema_registry_wait(registry, entry) != 0, "HTTP 503 not reported as an error");
+    expect(strstr(registry->error, "HTTP status 503") != NULL,
+            "unexpected error message: %s", registry->error);
+
+done:
+    schema_registry_free(registry);
+    stub_stop(stub);
+}
+
+
+/* If the registry can't be reached at all, the registration fails with cURL's error. */
+void test_unreachable() {
+    stub_registry *stub = stub_start();
+    registered_log log;
+    schema_registry_t registry = registry_for(stub, &log);
+    stub_stop(stub); // Nothing is listening on the port any more
+
+    topic_list_entry_t entry = schema_registry_update(registry, 4001, "users", "public.users",
+            NULL, NULL, KEY_SCHEMA, strlen(KEY_SCHEMA), NULL, 0);
+    expect(entry != NULL, "schema_registry_update failed: %s", registry->error);
+    if (entry) {
+        expect(schema_registry_wait(registry, entry) != 0, "connection failure not reported");
+        expect(strstr(registry->error, "Could not send schema to registry") != NULL,
+                "unexpected error message: %s", registry->error);
+    }
+    schema_registry_free(registry);
+}
+
+
+/* Creates a schema cache file in the temporary directory, holding the given ID for a
+ * schema under a subject of the registry at registry_url, and returns its path. */
+char *cache_file_new(const char *registry_url, const char *subject, const char *schema_json,
+        int schema_id) {
+    char path[] = "/tmp/registry_test.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "%s: Could not create cache file: %s\n", progname, strerror(errno));
+        exit(1);
+    }
+    close(fd);
+
+    schema_cache_t cache = schema_cache_new(path);
+    if (schema_cache_load(cache)) {
+        fprintf(stderr, "%s: %s\n", progname, cache->error);
+        exit(1);
+    }
+    if (schema_id) {
+        char url[256];
+        snprintf(url, sizeof(url), "%s/subjects/%s/versions", registry_url, subject);
+        schema_cache_put(cache, schema_fingerprint(url, schema_json, strlen(schema_json)), schema_id);
+    }
+    schema_cache_free(cache);
+    return strdup(path);
+}
+
+
+/* Polls the registry client until it has no more requests in flight or deferred.
+ * Returns the first error from schema_registry_poll(), or 0. */
+int registry_settle(schema_registry_t registry) {
+    for (int i = 0; i < MAX_SETTLE_POLLS && schema_registry_busy(registry); i++) {
+        int err = schema_registry_poll(registry, 100);
+        if (err) return err;
+    }
+    return 0;
+}
+
+
+/* A cached schema ID is used straight away, without asking the registry; the request
+ * that checks it is only made once the registry is polled, and confirms it. */
+void test_cached_id() {
+    stub_registry *stub = stub_start();
+    registered_log log;
+    schema_registry_t registry = registry_for(stub, &log);
+    char *path = cache_file_new(registry->registry_url, "users-key", KEY_SCHEMA, 1);
+    expect(schema_registry_set_cache(registry, path) == 0, "set_cache failed: %s", registry->error);
+
+    topic_list_entry_t entry = schema_registry_update(registry, 5001, "users", "public.users",
+            NULL, NULL, KEY_SCHEMA, strlen(KEY_SCHEMA), NULL, 0);
+    expect(entry != NULL, "schema_registry_update failed: %s", registry->error);
+    if (!entry) goto done;
+
+    expect(entry->registrations == 0 && entry->key_schema_id == 1,
+            "cached ID not used (ID %d, %d registrations)", entry->key_schema_id, entry->registrations);
+    expect(schema_registry_wait(registry, NULL) == 0, "wait failed: %s", registry->error);
+    expect(stub_requests(stub) == 0, "registry asked before being polled (%d requests)",
+            stub_requests(stub));
+
+    expect(registry_settle(registry) == 0, "check of cached ID failed: %s", registry->error);
+    expect(stub_requests(stub) == 1, "expected 1 request to check the cached ID, got %d",
+            stub_requests(stub));
+    expect(entry->key_schema_id == 1, "cached ID replaced by %d", entry->key_schema_id);
+
+done:
+    schema_registry_free(registry);
+    stub_stop(stub);
+    unlink(path);
+    free(path);
+}
+
+
+/* If the registry assigns a different ID than the cached one, that is an error: the
+ * messages that were sent with the cached ID point at the wrong schema. */
+void test_cached_id_mismatch() {
+    stub_registry *stub = stub_start();
+    registered_log log;
+    schema_registry_t registry = registry_for(stub, &log);
+    char *path = cache_file_new(registry->registry_url, "users-key", KEY_SCHEMA, 7);
+    expect(schema_registry_set_cache(registry, path) == 0, "set_cache failed: %s", registry->error);
+
+    topic_list_entry_t entry = schema_registry_update(registry, 6001, "users", "public.users",
+            NULL, NULL, KEY_SCHEMA, strlen(KEY_SCHEMA), NULL, 0);
+    expect(entry != NULL, "schema_registry_update failed: %s", registry->error);
+    if (!entry) goto done;
+
+    expect(entry->key_schema_id == 7, "cached ID not used (ID %d)", entry->key_schema_id);
+    expect(registry_settle(registry) != 0, "mismatch with cached ID not reported");
+    expect(strstr(registry->error, "assigned ID 1") && strstr(registry->error, "ID 7 was cached"),
+            "unexpected error message: %s", registry->error);
+
+done:
+    schema_registry_free(registry);
+    stub_stop(stub);
+    unlink(path);
+    free(path);
+}
+
+
+/* If the registry can't be reached to check a cached ID, the cached ID is kept, and
+ * that is not an error. */
+void test_cached_id_unreachable() {
+    stub_registry *stub = stub_start();
+    registered_log log;
+    schema_registry_t registry = registry_for(stub, &log);
+    stub_stop(stub); // Nothing is listening on the port any more
+
+    char *path = cache_file_new(registry->registry_url, "users-key", KEY_SCHEMA, 5);
+    expect(schema_registry_set_cache(registry, path) == 0, "set_cache failed: %s", registry->error);
+
+    topic_list_entry_t entry = schema_registry_update(registry, 7001, "users", "public.users",
+            NULL, NULL, KEY_SCHEMA, strlen(KEY_SCHEMA), NULL, 0);
+    expect(entry != NULL, "schema_registry_update failed: %s", registry->error);
+    if (entry) {
+        expect(entry->key_schema_id == 5, "cached ID not used (ID %d)", entry->key_schema_id);
+        expect(registry_settle(registry) == 0, "unreachable registry failed a cached ID: %s",
+                registry->error);
+        expect(!schema_registry_busy(registry), "check of cached ID never finished");
+        expect(entry->key_schema_id == 5, "cached ID replaced by %d", entry->key_schema_id);
+    }
+
+    schema_registry_free(registry);
+    unlink(path);
+    free(path);
+}
+
+
+/* IDs obtained from the registry are written to the cache file, for the next run. */
+void test_cache_persists() {
+    stub_registry *stub = stub_start();
+    registered_log log;
+    schema_registry_t registry = registry_for(stub, &log);
+    char *path = cache_file_new(registry->registry_url, NULL, NULL, 0);
+    expect(schema_registry_set_cache(registry, path) == 0, "set_cache failed: %s", registry->error);
+
+    topic_list_entry_t entry = schema_registry_update(registry, 8001, "users", "public.users",
+            NULL, NULL, KEY_SCHEMA, strlen(KEY_SCHEMA), NULL, 0);
+    expect(entry != NULL, "schema_registry_update failed: %s", registry->error);
+    if (!entry) goto done;
+
+    expect(entry->registrations == 1, "uncached schema not registered");
+    expect(schema_registry_wait(registry, entry) == 0, "wait failed: %s", registry->error);
+
+    char url[256];
+    snprintf(url, sizeof(url), "%s/subjects/users-key/versions", registry->registry_url);
+    schema_cache_t cache = schema_cache_new(path);
+    expect(schema_cache_load(cache) == 0, "could not reload cache: %s", cache->error);
+    int cached_id = schema_cache_get(cache, schema_fingerprint(url, KEY_SCHEMA, strlen(KEY_SCHEMA)));
+    expect(cached_id > 0 && cached_id == entry->key_schema_id,
+            "cache file has ID %d, registry assigned %d", cached_id, entry->key_schema_id);
+    schema_cache_free(cache);
+
+done:
+    schema_registry_free(registry);
+    stub_stop(stub);
+    unlink(path);
+    free(path);
+}
+
+
+int main(int argc, char **argv) {
+    progname = argv[0];
+    setenv("no_proxy", "127.0.0.1", 1); // The stub must be reached directly
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    test_async_registration();
+    test_follower_dedup();
+    test_http_errors();
+    test_unreachable();
+    test_cached_id();
+    test_cached_id_mismatch();
+    test_cached_id_unreachable();
+    test_cache_persists();
+
+    curl_global_cleanup();
+    if (failures) {
+        fprintf(stderr, "%s: %d check(s) failed\n", progname, failures);
+        return 1;
+    }
+    fprintf(stderr, "%s: all tests passed\n", progname);
+    return 0;
+}
@@ -0,0 +1,184 @@
+/* Decides which Kafka topic each table's changes are sent to. By default every table
+ * gets a topic of its own, named after the table. With thousands of small tables that
+ * means thousands of topics, so routing rules can map many tables into a shared topic
+ * instead. Each rule is a regular expression that is matched against the qualified
+ * table name ("schema.table"), and a template for the topic name, for example:
+ *
+ *   --route='^tenant_[0-9]+\.(.*)$=tenants.${1}'
+ *   --topic-template='${schema}.${table}'
+ *
+ * Templates may refer to ${schema}, ${table}, and the capture groups ${1} to ${9} of
+ * the rule's regular expression. */
+
+#include "routing.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_TOPIC_NAME_LEN 249 /* Kafka's limit on topic name length */
+#define MAX_CAPTURE_GROUPS 10  /* Whole match, plus ${1} to ${9} */
+
+char *expand_template(topic_router_t router, const char *template, const char *schema,
+        const char *table, const char *qualified, const regmatch_t *groups);
+void router_error(topic_router_t router, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+
+/* Allocates a router with no rules. */
+topic_router_t topic_router_new() {
+    topic_router_t router = malloc(sizeof(topic_router));
+    memset(router, 0, sizeof(topic_router));
+    router->capacity = 4;
+    router->rules = malloc(router->capacity * sizeof(route_rule));
+    return router;
+}
+
+
+/* Adds a rule that routes tables whose qualified name matches the extended regular
+ * expression pattern to the topic given by template. Returns 0 on success, or sets
+ * router->error and returns non-zero if the pattern is invalid. */
+int topic_router_add(topic_router_t router, const char *pattern, const char *template) {
+    if (router->num_rules == router->capacity) {
+        route_rule *rules = realloc(router->rules, 4 * router->capacity * sizeof(route_rule));
+        if (!rules) {
+            router_error(router, "Out of memory");
+            return ENOMEM;
+        }
+        router->rules = rules;
+        router->capacity *= 4;
+    }
+
+    route_rule *rule = &router->rules[router->num_rules];
+    int err = regcomp(&rule->regex, pattern, REG_EXTENDED);
+    if (err) {
+        char message[256];
+        regerror(err, &rule->regex, message, sizeof(message));
+        router_error(router, "Invalid routing pattern \"%s\": %s", pattern, message);
+        return err;
+    }
+
+    rule->pattern = strdup(pattern);
+    rule->template = strdup(template);
+    router->num_rules++;
+    return 0;
+}
+
+
+/* Sets the template used for tables that don't match any rule. */
+void topic_router_set_default(topic_router_t router, const char *template) {
+    free(router->default_template);
+    router->default_template = strdup(template);
+}
+
+
+/* Returns true if any routing has been configured. */
+bool topic_router_active(topic_router_t router) {
+    return router->num_rules > 0 || router->default_template != NULL;
+}
+
+
+/* Returns the name of the topic to which changes to the given table should be sent,
+ * as a string that the caller must free. Returns NULL and sets router->error if the
+ * resulting name is not a valid topic name. */
+char *topic_router_route(topic_router_t router, const char *schema, const char *table) {
+    char qualified[2 * MAX_TOPIC_NAME_LEN];
+    snprintf(qualified, sizeof(qualified), "%s.%s", schema, table);
+
+    for (int i = 0; i < router->num_rules; i++) {
+        regmatch_t groups[MAX_CAPTURE_GROUPS];
+        if (regexec(&router->rules[i].regex, qualified, MAX_CAPTURE_GROUPS, groups, 0) == 0) {
+            return expand_template(router, router->rules[i].template, schema, table,
+                    qualified, groups);
+        }
+    }
+
+    if (router->default_template) {
+        return expand_template(router, router->default_template, schema, table, qualified, NULL);
+    }
+    return strdup(table);
+}
+
+
+/* Substitutes variables into a topic name template. groups are the capture groups
+ * from matching the rule's regular expression against qualified (NULL if none). */
+char *expand_template(topic_router_t router, const char *template, const char *schema,
+        const char *table, const char *qualified, const regmatch_t *groups) {
+    char name[MAX_TOPIC_NAME_LEN + 1];
+    size_t len = 0;
+
+    for (const char *p = template; *p; ) {
+        const char *value = NULL;
+        size_t value_len = 0;
+
+        if (p[0] == '$' && p[1] == '{') {
+            const char *end = strchr(p, '}');
+            if (!end) {
+                router_error(router, "Unterminated variable in topic template \"%s\"", template);
+                return NULL;
+            }
+
+            size_t var_len = end - p - 2;
+            if (var_len == 6 && strncmp(p + 2, "schema", 6) == 0) {
+                value = schema;
+                value_len = strlen(schema);
+            } else if (var_len == 5 && strncmp(p + 2, "table", 5) == 0) {
+                value = table;
+                value_len = strlen(table);
+            } else if (var_len == 1 && p[2] >= '1' && p[2] <= '9' && groups) {
+                const regmatch_t *group = &groups[p[2] - '0'];
+                if (group->rm_so >= 0) {
+                    value = qualified + group->rm_so;
+                    value_len = group->rm_eo - group->rm_so;
+                }
+            } else {
+                router_error(router, "Unknown variable \"%.*s\" in topic template \"%s\"",
+                        (int) (end - p + 1), p, template);
+                return NULL;
+            }
+            p = end + 1;
+        } else {
+            value = p;
+            value_len = 1;
+            p++;
+        }
+
+        if (len + value_len > MAX_TOPIC_NAME_LEN) {
+            router_error(router, "Topic name for table %s is too long", qualified);
+            return NULL;
+        }
+        if (value) memcpy(name + len, value, value_len);
+        len += value_len;
+    }
+
+    if (len == 0) {
+        router_error(router, "Topic name for table %s is empty", qualified);
+        return NULL;
+    }
+
+    name[len] = '\0';
+    return strdup(name);
+}
+
+
+/* Frees a router and all its rules. */
+void topic_router_free(topic_router_t router) {
+    for (int i = 0; i < router->num_rules; i++) {
+        regfree(&router->rules[i].regex);
+        free(router->rules[i].pattern);
+        free(router->rules[i].template);
+    }
+    free(router->rules);
+    free(router->default_template);
+    free(router);
+}
+
+
+/* Updates the router's statically allocated error buffer with a message. */
+void router_error(topic_router_t router, char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(router->error, TOPIC_ROUTER_ERROR_LEN, fmt, args);
+    va_end(args);
+}
@@ -0,0 +1,32 @@
+#ifndef ROUTING_H
+#define ROUTING_H
+
+#include <regex.h>
+#include <stdbool.h>
+
+#define TOPIC_ROUTER_ERROR_LEN 512
+
+typedef struct {
+    char *pattern;              /* Regular expression matched against "schema.table" */
+    regex_t regex;              /* Compiled form of pattern */
+    char *template;             /* Topic name, with ${schema}, ${table}, ${1}..${9} substituted */
+} route_rule;
+
+typedef struct {
+    int num_rules;              /* Number of rules in use */
+    int capacity;               /* Allocated size of rules array */
+    route_rule *rules;          /* Tried in order; the first matching rule wins */
+    char *default_template;     /* Used if no rule matches (NULL = topic named after the table) */
+    char error[TOPIC_ROUTER_ERROR_LEN];
+} topic_router;
+
+typedef topic_router *topic_router_t;
+
+topic_router_t topic_router_new(void);
+int topic_router_add(topic_router_t router, const char *pattern, const char *template);
+void topic_router_set_default(topic_router_t router, const char *template);
+bool topic_router_active(topic_router_t router);
+char *topic_router_route(topic_router_t router, const char *schema, const char *table);
+void topic_router_free(topic_router_t router);
+
+#endif /* ROUTING_H */
@@ -0,0 +1,220 @@
+/* Remembers the IDs that the schema registry has assigned to schemas, in a local file,
+ * so that after a restart we don't have to wait for the registry before sending any
+ * rows. Postgres sends every table's schema again at the start of each session, and
+ * re-registering thousands of them one by one takes minutes.
+ *
+ * An ID is looked up by a fingerprint of the registry URL for the subject and the
+ * schema JSON. The hash in TableSchema messages isn't used for this, as it doesn't
+ * cover everything that affects the JSON (such as column nullability), nor the
+ * registry and subject, which depend on our command-line options. The
+ * file is append-only: a 8-byte header, followed by one record per fingerprint:
+ *
+ *   - the fingerprint (8 bytes),
+ *   - the schema ID (4 bytes),
+ *   - a check value derived from both (4 bytes), so that a record that was only
+ *     partly written when we crashed is recognized and ignored.
+ *
+ * If the same fingerprint appears more than once, the last record wins. Records are
+ * in host byte order, as the file is only meant to be read on the machine that wrote
+ * it. */
+
+#include "schema_cache.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+
+#define SCHEMA_CACHE_MAGIC "BWSCHID1"
+#define SCHEMA_CACHE_MAGIC_LEN 8
+#define SCHEMA_CACHE_CHECK 0x5ca1ab1eU
+#define FNV_HASH_BASE 0xcbf29ce484222325ULL
+#define FNV_HASH_PRIME 0x100000001b3ULL
+
+typedef struct {
+    uint64_t fingerprint;
+    int32_t schema_id;
+    uint32_t check;
+} schema_cache_record;
+
+uint64_t fnv_hash(uint64_t base, const char *str, size_t len);
+uint32_t record_check(uint64_t fingerprint, int32_t schema_id);
+void schema_cache_insert(schema_cache_t cache, uint64_t fingerprint, int schema_id);
+void cache_error(schema_cache_t cache, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+
+/* Computes the key under which the ID of a schema registered at the given URL (which
+ * identifies the registry and subject) is stored. */
+uint64_t schema_fingerprint(const char *url, const char *schema_json, size_t schema_len) {
+    uint64_t hash = fnv_hash(FNV_HASH_BASE, url, strlen(url) + 1);
+    return fnv_hash(hash, schema_json, schema_len);
+}
+
+
+/* Allocates an empty cache, to be persisted in the file at the given path. Call
+ * schema_cache_load() before using it. If path is NULL, the cache is only kept in
+ * memory, and must not be loaded. */
+schema_cache_t schema_cache_new(const char *path) {
+    schema_cache_t cache = malloc(sizeof(schema_cache));
+    memset(cache, 0, sizeof(schema_cache));
+    cache->path = path ? strdup(path) : NULL;
+    cache->capacity = 1024;
+    cache->slots = calloc(cache->capacity, sizeof(schema_cache_slot));
+    return cache;
+}
+
+
+/* Returns the schema ID stored for the given fingerprint, or 0 if there is none. */
+int schema_cache_get(schema_cache_t cache, uint64_t fingerprint) {
+    int mask = cache->capacity - 1;
+    for (int i = fingerprint & mask; cache->slots[i].schema_id; i = (i + 1) & mask) {
+        if (cache->slots[i].fingerprint == fingerprint) return cache->slots[i].schema_id;
+    }
+    return 0;
+}
+
+
+/* Records the schema ID for a fingerprint, appending it to the file unless it is
+ * already there. Returns 0 on success, or sets cache->error and returns non-zero if
+ * the file could not be written (the in-memory entry is updated either way). */
+int schema_cache_put(schema_cache_t cache, uint64_t fingerprint, int schema_id) {
+    if (schema_cache_get(cache, fingerprint) == schema_id) return 0;
+    schema_cache_insert(cache, fingerprint, schema_id);
+    if (!cache->file) return 0;
+
+    schema_cache_record record;
+    memset(&record, 0, sizeof(record));
+    record.fingerprint = fingerprint;
+    record.schema_id = schema_id;
+    record.check = record_check(fingerprint, schema_id);
+
+    if (fwrite(&record, sizeof(record), 1, cache->file) != 1 || fflush(cache->file) != 0) {
+        cache_error(cache, "Could not write schema cache %s: %s", cache->path, strerror(errno));
+        return EIO;
+    }
+    return 0;
+}
+
+
+/* Reads the records in the cache file, creating it if it doesn't exist, and leaves it
+ * open for appending. Returns 0 on success, or sets cache->error and returns non-zero
+ * if the file can't be used. */
+int schema_cache_load(schema_cache_t cache) {
+    cache->file = fopen(cache->path, "a+b");
+    if (!cache->file) {
+        cache_error(cache, "Could not open schema cache %s: %s", cache->path, strerror(errno));
+        return errno;
+    }
+
+    char magic[SCHEMA_CACHE_MAGIC_LEN];
+    rewind(cache->file);
+    size_t magic_len = fread(magic, 1, sizeof(magic), cache->file);
+
+    if (magic_len == 0) {
+        // New file
+        if (fwrite(SCHEMA_CACHE_MAGIC, SCHEMA_CACHE_MAGIC_LEN, 1, cache->file) != 1 ||
+                fflush(cache->file) != 0) {
+            cache_error(cache, "Could not write schema cache %s: %s", cache->path, strerror(errno));
+            return EIO;
+        }
+        return 0;
+    }
+
+    if (magic_len != sizeof(magic) || memcmp(magic, SCHEMA_CACHE_MAGIC, sizeof(magic)) != 0) {
+        cache_error(cache, "%s is not a schema cache file", cache->path);
+        return EINVAL;
+    }
+
+    schema_cache_record record;
+    int skipped = 0;
+    while (fread(&record, sizeof(record), 1, cache->file) == 1) {
+        if (record.schema_id <= 0 ||
+                record.check != record_check(record.fingerprint, record.schema_id)) {
+            skipped++;
+            continue;
+        }
+        schema_cache_insert(cache, record.fingerprint, record.schema_id);
+    }
+
+    if (skipped > 0) {
+        fprintf(stderr, "Ignored %d damaged record(s) in schema cache %s\n", skipped, cache->path);
+    }
+    fprintf(stderr, "Loaded %d schema ID(s) from %s\n", cache->num_entries, cache->path);
+
+    // In append mode, writes go to the end regardless of the read position. If the
+    // file ends with a partial record, it stays there and is skipped over again
+    // (misaligning the records after it) unless we pad it to a whole record.
+    fseek(cache->file, 0, SEEK_END);
+    long excess = (ftell(cache->file) - SCHEMA_CACHE_MAGIC_LEN) % sizeof(schema_cache_record);
+    if (excess > 0) {
+        char padding[sizeof(schema_cache_record)];
+        memset(padding, 0, sizeof(padding));
+        fwrite(padding, sizeof(schema_cache_record) - excess, 1, cache->file);
+        fflush(cache->file);
+    }
+    return 0;
+}
+
+
+/* Adds or replaces an entry in the in-memory hash table, growing it when it is more
+ * than half full. */
+void schema_cache_insert(schema_cache_t cache, uint64_t fingerprint, int schema_id) {
+    if (2 * (cache->num_entries + 1) > cache->capacity) {
+        schema_cache_slot *old_slots = cache->slots;
+        int old_capacity = cache->capacity;
+
+        cache->capacity *= 4;
+        cache->slots = calloc(cache->capacity, sizeof(schema_cache_slot));
+        cache->num_entries = 0;
+        for (int i = 0; i < old_capacity; i++) {
+            if (old_slots[i].schema_id) {
+                schema_cache_insert(cache, old_slots[i].fingerprint, old_slots[i].schema_id);
+            }
+        }
+        free(old_slots);
+    }
+
+    int mask = cache->capacity - 1;
+    int i = fingerprint & mask;
+    while (cache->slots[i].schema_id && cache->slots[i].fingerprint != fingerprint) {
+        i = (i + 1) & mask;
+    }
+
+    if (!cache->slots[i].schema_id) cache->num_entries++;
+    cache->slots[i].fingerprint = fingerprint;
+    cache->slots[i].schema_id = schema_id;
+}
+
+
+/* Frees the cache, and closes its file. */
+void schema_cache_free(schema_cache_t cache) {
+    if (cache->file) fclose(cache->file);
+    free(cache->slots);
+    free(cache->path);
+    free(cache);
+}
+
+
+/* FNV-1a hash algorithm. */
+uint64_t fnv_hash(uint64_t base, const char *str, size_t len) {
+    uint64_t hash = base;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char) str[i]) * FNV_HASH_PRIME;
+    }
+    return hash;
+}
+
+
+/* Value stored alongside each record to detect partially written ones. */
+uint32_t record_check(uint64_t fingerprint, int32_t schema_id) {
+    return (uint32_t) (fingerprint >> 32) ^ (uint32_t) fingerprint ^
+        (uint32_t) schema_id ^ SCHEMA_CACHE_CHECK;
+}
+
+
+/* Updates the cache's statically allocated error buffer with a message. */
+void cache_error(schema_cache_t cache, char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(cache->error, SCHEMA_CACHE_ERROR_LEN, fmt, args);
+    va_end(args);
+}
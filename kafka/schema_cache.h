@@ -0,0 +1,33 @@
+#ifndef SCHEMA_CACHE_H
+#define SCHEMA_CACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SCHEMA_CACHE_ERROR_LEN 512
+
+typedef struct {
+    uint64_t fingerprint;       /* Hash of the subject URL and schema (see schema_fingerprint()) */
+    int32_t schema_id;          /* ID assigned by the registry (0 = empty slot) */
+} schema_cache_slot;
+
+typedef struct {
+    char *path;                 /* File in which the cache is persisted (NULL = memory only) */
+    FILE *file;                 /* Open for appending new entries */
+    int num_entries;            /* Number of slots in use */
+    int capacity;               /* Allocated size of slots array (a power of two) */
+    schema_cache_slot *slots;   /* Hash table, with linear probing */
+    char error[SCHEMA_CACHE_ERROR_LEN];
+} schema_cache;
+
+typedef schema_cache *schema_cache_t;
+
+uint64_t schema_fingerprint(const char *url, const char *schema_json, size_t schema_len);
+schema_cache_t schema_cache_new(const char *path);
+int schema_cache_load(schema_cache_t cache);
+int schema_cache_get(schema_cache_t cache, uint64_t fingerprint);
+int schema_cache_put(schema_cache_t cache, uint64_t fingerprint, int schema_id);
+void schema_cache_free(schema_cache_t cache);
+
+#endif /* SCHEMA_CACHE_H */
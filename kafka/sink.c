@@ -0,0 +1,388 @@
+/* Destinations for messages other than Kafka (which is implemented in kafka_sink.c),
+ * selected with --sink:
+ *
+ *   - null: discards every message, and acknowledges it right away. Useful for
+ *     measuring how fast changes can be received and decoded, without Kafka.
+ *   - stdout: writes messages to standard output, in the format below.
+ *   - file:DIR: writes messages to files in directory DIR, starting a new file once
+ *     the current one reaches --sink-file-size (or --sink-file-age). Files are named
+ *     by a sequence number in hex, which carries on from the files already in the
+ *     directory.
+ *   - avro:DIR: writes the rows of each table to Avro container files (avro_sink.c).
+ *   - arrow:DIR: writes the rows of each table to Arrow IPC stream files, column by
+ *     column (arrow_sink.c).
+ *
+ * The stdout and file sinks write each message as four 4-byte big-endian lengths (of
+ * the topic name, the qualified table name, the key and the value; 0xffffffff if
+ * there is no key, or for the value of a deleted row), followed by those four fields.
+ * Keys and values are as they would have been sent to Kafka, i.e. prefixed with their
+ * schema ID. Each file starts with SINK_FILE_MAGIC.
+ *
+ * Messages are acknowledged by sink_poll(), in groups, once they have been flushed
+ * (and, for files, synced to disk). So as not to sync after every transaction, that
+ * happens at most every FILE_SINK_SYNC_INTERVAL_MS, unless the caller is prepared to
+ * wait. */
+
+#include "sink.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define SINK_FILE_MAGIC "BWMSGS1\n"
+#define SINK_FILE_MAGIC_LEN 8
+#define SINK_FILE_SUFFIX ".msgs"
+#define SINK_FILE_ABSENT 0xffffffffU
+#define FILE_SINK_SYNC_INTERVAL_MS 100
+
+#define check(err, call) { err = call; if (err) return err; }
+
+typedef struct {
+    FILE *file;
+    bool is_stdout;             /* Don't rotate, sync or close the file */
+    uint64_t next_seq;          /* Sequence number of the next file to create */
+    size_t file_size;           /* Bytes written to the current file */
+    int64_t file_opened;        /* When the current file was created, in ms */
+    void **unacked;             /* Opaques of messages written but not yet acknowledged */
+    int num_unacked;
+    int unacked_capacity;
+    int64_t unacked_since;      /* When the oldest of them was written, in ms */
+} file_sink_state;
+
+static int null_sink_produce(sink_t sink, topic_list_entry_t entry);
+static int file_sink_open(sink_t sink);
+static int stdout_sink_open(sink_t sink);
+static int file_sink_produce(sink_t sink, topic_list_entry_t entry);
+static int file_sink_poll(sink_t sink, int timeout_ms);
+static void file_sink_close(sink_t sink);
+int file_sink_write(sink_t sink, const char *topic_name, const char *table_name,
+        const void *key, size_t key_len, const void *val, size_t val_len);
+int file_sink_field(sink_t sink, const void *data, size_t len);
+int file_sink_rotate(sink_t sink);
+int file_sink_sync(sink_t sink);
+
+const sink_ops null_sink_ops = {"null", NULL, NULL, null_sink_produce, NULL, NULL, NULL};
+const sink_ops stdout_sink_ops = {"stdout", stdout_sink_open, NULL, file_sink_produce,
+    NULL, file_sink_poll, file_sink_close};
+const sink_ops file_sink_ops = {"file", file_sink_open, NULL, file_sink_produce,
+    NULL, file_sink_poll, file_sink_close};
+
+
+/* Allocates a sink of the given kind. target is copied (it may be NULL). The caller
+ * sets on_ack and cb_context, and then calls sink_open(). */
+sink_t sink_new(const sink_ops *ops, const char *target) {
+    sink_t sink = malloc(sizeof(struct sink));
+    memset(sink, 0, sizeof(struct sink));
+    sink->ops = ops;
+    sink->target = target ? strdup(target) : NULL;
+    sink->max_file_size = DEFAULT_SINK_FILE_SIZE;
+    sink->batch_rows = DEFAULT_SINK_BATCH_ROWS;
+    return sink;
+}
+
+
+/* Returns the sink of the given name that is implemented here, or NULL if there is
+ * none (the Kafka sink is looked up by the caller). */
+const sink_ops *sink_lookup(const char *name) {
+    const sink_ops *all[] = {&null_sink_ops, &stdout_sink_ops, &file_sink_ops, &avro_sink_ops,
+        &arrow_sink_ops};
+    for (int i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (strcmp(all[i]->name, name) == 0) return all[i];
+    }
+    return NULL;
+}
+
+
+/* Prepares the sink for messages. */
+int sink_open(sink_t sink) {
+    return sink->ops->open ? sink->ops->open(sink) : 0;
+}
+
+
+/* Tells the sink about a table whose topic or schema is new. */
+int sink_schema(sink_t sink, topic_list_entry_t entry,
+        const char *row_schema_json, size_t row_schema_len) {
+    if (!sink->ops->schema) return 0;
+    return sink->ops->schema(sink, entry, row_schema_json, row_schema_len);
+}
+
+
+/* Hands all messages in the table's batch to the sink, which acknowledges them later
+ * (or right away). Afterwards the batch is empty. */
+int sink_produce(sink_t sink, topic_list_entry_t entry) {
+    int err = sink->ops->produce(sink, entry);
+    entry->batch_len = 0;
+    return err;
+}
+
+
+/* Tells the sink that all messages up to and including the Postgres transaction that
+ * committed at lsn have been handed to it. Sinks that track LSNs (see tracks_lsn) move
+ * durable_lsn forward once those messages are safe. */
+int sink_commit(sink_t sink, uint64_t lsn) {
+    return sink->ops->commit ? sink->ops->commit(sink, lsn) : 0;
+}
+
+
+/* Lets the sink make progress, and report the messages that have been acknowledged
+ * since the last call. Waits up to timeout_ms for something to happen, if the sink has
+ * anything to wait for. */
+int sink_poll(sink_t sink, int timeout_ms) {
+    return sink->ops->poll ? sink->ops->poll(sink, timeout_ms) : 0;
+}
+
+
+/* Reports the outcome of one message to the sink's owner. */
+void sink_ack(sink_t sink, void *msg_opaque, const char *err) {
+    if (sink->on_ack) sink->on_ack(sink->cb_context, msg_opaque, err);
+}
+
+
+/* Closes the sink (messages that haven't been acknowledged by now never will be),
+ * and frees it. */
+void sink_free(sink_t sink) {
+    if (sink->ops->close) sink->ops->close(sink);
+    free(sink->target);
+    free(sink->codec);
+    free(sink);
+}
+
+
+/* The null sink: every message counts as delivered as soon as it is produced. */
+static int null_sink_produce(sink_t sink, topic_list_entry_t entry) {
+    for (int i = 0; i < entry->batch_len; i++) {
+        sink_ack(sink, entry->batch[i]._private, NULL);
+    }
+    return 0;
+}
+
+
+static int file_sink_open(sink_t sink) {
+    if (!sink->target || !*sink->target) {
+        sink_error(sink, "The file sink needs a directory (--sink=file:DIR)");
+        return EINVAL;
+    }
+
+    if (mkdir(sink->target, 0755) != 0 && errno != EEXIST) {
+        sink_error(sink, "Could not create directory %s: %s", sink->target, strerror(errno));
+        return EIO;
+    }
+
+    DIR *dir = opendir(sink->target);
+    if (!dir) {
+        sink_error(sink, "Could not open directory %s: %s", sink->target, strerror(errno));
+        return EIO;
+    }
+
+    // Carry on numbering from the files left by earlier runs
+    file_sink_state *state = malloc(sizeof(file_sink_state));
+    memset(state, 0, sizeof(file_sink_state));
+    sink->state = state;
+
+    struct dirent *dirent;
+    while ((dirent = readdir(dir))) {
+        uint64_t seq;
+        char suffix[8];
+        if (sscanf(dirent->d_name, "%16" SCNx64 "%7s", &seq, suffix) == 2 &&
+                strcmp(suffix, SINK_FILE_SUFFIX) == 0 && seq >= state->next_seq) {
+            state->next_seq = seq + 1;
+        }
+    }
+    closedir(dir);
+
+    return file_sink_rotate(sink);
+}
+
+
+static int stdout_sink_open(sink_t sink) {
+    file_sink_state *state = malloc(sizeof(file_sink_state));
+    memset(state, 0, sizeof(file_sink_state));
+    state->file = stdout;
+    state->is_stdout = true;
+    sink->state = state;
+
+    if (fwrite(SINK_FILE_MAGIC, SINK_FILE_MAGIC_LEN, 1, stdout) != 1) {
+        sink_error(sink, "Could not write to stdout: %s", strerror(errno));
+        return EIO;
+    }
+    return 0;
+}
+
+
+static int file_sink_produce(sink_t sink, topic_list_entry_t entry) {
+    file_sink_state *state = sink->state;
+    int err;
+
+    for (int i = 0; i < entry->batch_len; i++) {
+        rd_kafka_message_t *msg = &entry->batch[i];
+        check(err, file_sink_write(sink, entry->topic_name, entry->table_name,
+                    msg->key, msg->key_len, msg->payload, msg->len));
+
+        if (state->num_unacked == 0) state->unacked_since = sink_time_ms();
+        if (state->num_unacked == state->unacked_capacity) {
+            int capacity = state->unacked_capacity > 0 ? 4 * state->unacked_capacity : 256;
+            void **unacked = realloc(state->unacked, capacity * sizeof(void *));
+            if (!unacked) {
+                sink_error(sink, "Out of memory");
+                return ENOMEM;
+            }
+            state->unacked = unacked;
+            state->unacked_capacity = capacity;
+        }
+        state->unacked[state->num_unacked++] = msg->_private;
+
+        if (!state->is_stdout && state->file_size >= sink->max_file_size) {
+            check(err, file_sink_rotate(sink));
+        }
+    }
+    return 0;
+}
+
+
+/* Flushes what has been written, and acknowledges it, if the oldest message has been
+ * waiting long enough or the caller is prepared to wait (timeout_ms > 0). Starts a
+ * new file if the current one is older than --sink-file-age. */
+static int file_sink_poll(sink_t sink, int timeout_ms) {
+    file_sink_state *state = sink->state;
+    if (!state->is_stdout && sink->max_file_age > 0 && state->file_size > SINK_FILE_MAGIC_LEN &&
+            sink_time_ms() - state->file_opened >= sink->max_file_age * 1000LL) {
+        return file_sink_rotate(sink);
+    }
+    if (state->num_unacked == 0) return 0;
+    if (timeout_ms <= 0 && sink_time_ms() - state->unacked_since < FILE_SINK_SYNC_INTERVAL_MS) {
+        return 0;
+    }
+    return file_sink_sync(sink);
+}
+
+
+static void file_sink_close(sink_t sink) {
+    file_sink_state *state = sink->state;
+    if (!state) return;
+
+    if (state->file) {
+        fflush(state->file);
+        if (!state->is_stdout) fclose(state->file);
+    }
+    free(state->unacked);
+    free(state);
+    sink->state = NULL;
+}
+
+
+/* Appends one message to the current file. */
+int file_sink_write(sink_t sink, const char *topic_name, const char *table_name,
+        const void *key, size_t key_len, const void *val, size_t val_len) {
+    size_t topic_len = strlen(topic_name), table_len = strlen(table_name);
+    uint32_t lengths[4] = {
+        htonl(topic_len),
+        htonl(table_len),
+        htonl(key ? key_len : SINK_FILE_ABSENT),
+        htonl(val ? val_len : SINK_FILE_ABSENT)
+    };
+    int err;
+
+    check(err, file_sink_field(sink, lengths, sizeof(lengths)));
+    check(err, file_sink_field(sink, topic_name, topic_len));
+    check(err, file_sink_field(sink, table_name, table_len));
+    if (key) check(err, file_sink_field(sink, key, key_len));
+    if (val) check(err, file_sink_field(sink, val, val_len));
+    return 0;
+}
+
+
+int file_sink_field(sink_t sink, const void *data, size_t len) {
+    file_sink_state *state = sink->state;
+    if (len > 0 && fwrite(data, len, 1, state->file) != 1) {
+        sink_error(sink, "Could not write to %s: %s",
+                state->is_stdout ? "stdout" : sink->target, strerror(errno));
+        return EIO;
+    }
+    state->file_size += len;
+    return 0;
+}
+
+
+/* Syncs and closes the current file, if any, and starts the next one. */
+int file_sink_rotate(sink_t sink) {
+    file_sink_state *state = sink->state;
+    int err;
+
+    if (state->file) {
+        check(err, file_sink_sync(sink));
+        if (fclose(state->file) != 0) {
+            state->file = NULL;
+            sink_error(sink, "Could not close file in %s: %s", sink->target, strerror(errno));
+            return EIO;
+        }
+        state->file = NULL;
+    }
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%016" PRIx64 SINK_FILE_SUFFIX, sink->target, state->next_seq++);
+
+    state->file = fopen(path, "wx");
+    if (!state->file) {
+        sink_error(sink, "Could not create %s: %s", path, strerror(errno));
+        return EIO;
+    }
+    state->file_size = 0;
+    state->file_opened = sink_time_ms();
+    check(err, file_sink_field(sink, SINK_FILE_MAGIC, SINK_FILE_MAGIC_LEN));
+
+    // Make the new file's directory entry durable too
+    int dir_fd = open(sink->target, O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+
+/* Flushes everything written so far to the file (and the file to disk), and then
+ * acknowledges the messages. */
+int file_sink_sync(sink_t sink) {
+    file_sink_state *state = sink->state;
+
+    if (fflush(state->file) != 0 || (!state->is_stdout && fsync(fileno(state->file)) != 0)) {
+        sink_error(sink, "Could not flush %s: %s",
+                state->is_stdout ? "stdout" : sink->target, strerror(errno));
+        return EIO;
+    }
+
+    // Acknowledging may cause more messages to be produced, so take the list first
+    int count = state->num_unacked;
+    void **unacked = state->unacked;
+    state->unacked = NULL;
+    state->num_unacked = state->unacked_capacity = 0;
+
+    for (int i = 0; i < count; i++) sink_ack(sink, unacked[i], NULL);
+    free(unacked);
+    return 0;
+}
+
+
+/* Returns the time on a monotonic clock, in milliseconds. */
+int64_t sink_time_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+/* Updates the sink's statically allocated error buffer with a message. */
+void sink_error(sink_t sink, char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(sink->error, SINK_ERROR_LEN, fmt, args);
+    va_end(args);
+}
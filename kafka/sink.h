@@ -0,0 +1,73 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include "registry.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SINK_ERROR_LEN 512
+#define DEFAULT_SINK_FILE_SIZE (256 * 1024 * 1024)
+#define DEFAULT_SINK_BATCH_ROWS 65536
+
+typedef struct sink sink;
+typedef sink *sink_t;
+
+/* Called once for every message handed to a sink: with err == NULL once the message
+ * has been durably written, or with a description of the problem if it could not be.
+ * msg_opaque is the _private field of the message. */
+typedef void (*sink_ack_cb)(void *, void *msg_opaque, const char *err);
+
+/* The operations that each kind of sink implements (see kafka_sink.c, sink.c and
+ * table_sink.c). Those returning int return 0 on success, or non-zero (with
+ * sink->error set) on failure. */
+typedef struct {
+    const char *name;
+    int (*open)(sink_t sink);                               /* Called once, before anything else */
+    int (*schema)(sink_t sink, topic_list_entry_t entry,    /* A table's topic or schema changed */
+            const char *row_schema_json, size_t row_schema_len);
+    int (*produce)(sink_t sink, topic_list_entry_t entry);  /* Takes all messages in entry->batch */
+    int (*commit)(sink_t sink, uint64_t lsn);               /* Everything up to commit lsn was produced */
+    int (*poll)(sink_t sink, int timeout_ms);               /* Reports acknowledgements via on_ack */
+    void (*close)(sink_t sink);                             /* Releases everything (even if open() failed) */
+} sink_ops;
+
+/* A destination for messages: Kafka (kafka_sink.c), or one of the sinks in sink.c and
+ * table_sink.c. */
+struct sink {
+    const sink_ops *ops;
+    char *target;               /* Argument of the sink, e.g. a directory (NULL = none) */
+    size_t max_file_size;       /* File sinks: start a new file once this size is reached */
+    int max_file_age;           /* File sinks: or once it is this many seconds old (0 = never) */
+    char *codec;                /* Avro and arrow sinks: compression (NULL = the default) */
+    int batch_rows;             /* Arrow sink: rows per record batch */
+    bool tracks_lsn;            /* Whether the sink decides how far Postgres may checkpoint */
+    uint64_t durable_lsn;       /* If so, the last commit whose messages are all safely stored */
+    sink_ack_cb on_ack;         /* Called as messages are acknowledged */
+    void *cb_context;           /* Passed to on_ack */
+    void *state;                /* Owned by the implementation */
+    char error[SINK_ERROR_LEN];
+};
+
+extern const sink_ops kafka_sink_ops;
+extern const sink_ops null_sink_ops;
+extern const sink_ops stdout_sink_ops;
+extern const sink_ops file_sink_ops;
+extern const sink_ops avro_sink_ops;
+extern const sink_ops arrow_sink_ops;
+
+sink_t sink_new(const sink_ops *ops, const char *target);
+const sink_ops *sink_lookup(const char *name);
+int sink_open(sink_t sink);
+int sink_schema(sink_t sink, topic_list_entry_t entry,
+        const char *row_schema_json, size_t row_schema_len);
+int sink_produce(sink_t sink, topic_list_entry_t entry);
+int sink_commit(sink_t sink, uint64_t lsn);
+int sink_poll(sink_t sink, int timeout_ms);
+void sink_ack(sink_t sink, void *msg_opaque, const char *err);
+void sink_error(sink_t sink, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+void sink_free(sink_t sink);
+int64_t sink_time_ms(void);
+
+#endif /* SINK_H */
@@ -0,0 +1,561 @@
+/* A local, durable queue of messages on their way to Kafka (see --spool-dir). When
+ * Kafka is unavailable or can't keep up, messages are appended here instead, and once
+ * they have been flushed to disk, the Postgres transactions they belong to count as
+ * acknowledged, so that the server doesn't have to hold on to its WAL. Messages are
+ * read back in order, and forwarded to Kafka when it recovers.
+ *
+ * The spool is a directory of segment files, named by a sequence number in hex, each
+ * of which is mapped into memory. Space for a segment is allocated on disk when it is
+ * created, so that a full disk is reported as an error rather than as a SIGBUS when
+ * the mapping is written to. A segment consists of an 8-byte header, followed by
+ * records, each of which is:
+ *
+ *   - the length of the record body (4 bytes), zero marking the end of the segment,
+ *   - a CRC-32 of the body (4 bytes),
+ *   - the body: a spool_header, followed by a spool_txn_header if the SPOOL_HAS_TXN
+ *     flag is set, the topic name and table name (both NUL-terminated), the key, and
+ *     the value,
+ *   - padding to a multiple of 8 bytes.
+ *
+ * A record that was only partly written when we crashed fails the CRC check, and it
+ * and everything after it in its segment is ignored. A segment file is deleted once
+ * all of its records have been delivered to Kafka. Numbers are in host byte order,
+ * as the files are only meant to be read on the machine that wrote them. */
+
+#include "spool.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define SPOOL_MAGIC "BWSPOOL1"
+#define SPOOL_MAGIC_LEN 8
+#define SPOOL_SUFFIX ".spool"
+#define SPOOL_ALIGN(n) (((n) + 7) & ~((size_t) 7))
+
+#define SPOOL_HAS_PARTITION_HASH 1
+#define SPOOL_HAS_KEY 2
+#define SPOOL_HAS_VALUE 4
+#define SPOOL_HAS_TXN 8
+
+typedef struct {
+    uint32_t body_len;
+    uint32_t crc;
+} spool_record_prefix;
+
+typedef struct {
+    uint64_t wal_pos;
+    uint32_t relid;
+    uint32_t partition_hash;
+    uint32_t flags;             /* SPOOL_HAS_* */
+    uint32_t topic_len;         /* Including the NUL */
+    uint32_t table_len;         /* Including the NUL */
+    uint32_t key_len;
+    uint32_t val_len;
+    uint32_t reserved;
+} spool_header;
+
+/* Where a message stands in the Postgres commit order (see --txn-headers). */
+typedef struct {
+    uint64_t commit_lsn;
+    int64_t commit_time;
+    uint64_t seq;
+    uint32_t xid;
+    uint32_t reserved;
+} spool_txn_header;
+
+spool_segment *spool_segment_create(spool_t spool, size_t min_size);
+spool_segment *spool_segment_open(spool_t spool, const char *name, uint64_t seq);
+size_t spool_segment_scan(spool_segment *segment);
+bool spool_parse_record(spool_segment *segment, size_t offset, spool_record *record, size_t *next_out);
+void spool_collect(spool_t spool);
+void spool_segment_delete(spool_t spool, spool_segment *segment);
+void spool_segment_free(spool_segment *segment);
+void spool_sync_dir(spool_t spool);
+void spool_error(spool_t spool, char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+
+/* Allocates a spool in the given directory, whose segment files are created with the
+ * given size (larger if a message doesn't fit). Call spool_open() before using it. */
+spool_t spool_new(const char *dir, size_t segment_size) {
+    spool_t new_spool = malloc(sizeof(spool));
+    memset(new_spool, 0, sizeof(spool));
+    new_spool->dir = strdup(dir);
+    new_spool->segment_size = segment_size;
+    return new_spool;
+}
+
+
+static int compare_seq(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Finds the segments left over from a previous run, so that their records are read
+ * before anything appended from now on. The directory is created if it doesn't
+ * exist. Returns 0 on success, or non-zero (with spool->error set) on failure. */
+int spool_open(spool_t spool) {
+    if (mkdir(spool->dir, 0700) != 0 && errno != EEXIST) {
+        spool_error(spool, "Could not create spool directory %s: %s", spool->dir, strerror(errno));
+        return EIO;
+    }
+
+    DIR *dir = opendir(spool->dir);
+    if (!dir) {
+        spool_error(spool, "Could not open spool directory %s: %s", spool->dir, strerror(errno));
+        return EIO;
+    }
+
+    int num_seqs = 0, capacity = 16;
+    uint64_t *seqs = malloc(capacity * sizeof(uint64_t));
+    if (!seqs) {
+        spool_error(spool, "Out of memory");
+        closedir(dir);
+        return ENOMEM;
+    }
+    struct dirent *dirent;
+    while ((dirent = readdir(dir))) {
+        uint64_t seq;
+        char suffix[8];
+        if (sscanf(dirent->d_name, "%16" SCNx64 "%7s", &seq, suffix) != 2 ||
+                strcmp(suffix, SPOOL_SUFFIX) != 0) {
+            continue;
+        }
+        if (num_seqs == capacity) {
+            uint64_t *new_seqs = realloc(seqs, 4 * capacity * sizeof(uint64_t));
+            if (!new_seqs) {
+                spool_error(spool, "Out of memory");
+                free(seqs);
+                closedir(dir);
+                return ENOMEM;
+            }
+            seqs = new_seqs;
+            capacity *= 4;
+        }
+        seqs[num_seqs++] = seq;
+    }
+    closedir(dir);
+
+    qsort(seqs, num_seqs, sizeof(uint64_t), compare_seq);
+
+    for (int i = 0; i < num_seqs; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "%016" PRIx64 SPOOL_SUFFIX, seqs[i]);
+        spool_segment *segment = spool_segment_open(spool, name, seqs[i]);
+        if (!segment) {
+            free(seqs);
+            return EIO;
+        }
+        spool->next_seq = seqs[i] + 1;
+
+        size_t records = spool_segment_scan(segment);
+        if (records == 0) {
+            spool_segment_delete(spool, segment);
+            continue;
+        }
+
+        if (spool->tail) spool->tail->next = segment; else spool->head = segment;
+        spool->tail = segment;
+        spool->num_records += records;
+    }
+    free(seqs);
+
+    spool->reading = spool->head;
+    if (spool->num_records > 0) {
+        fprintf(stderr, "Found %" PRIu64 " message(s) in spool %s\n", spool->num_records, spool->dir);
+    }
+    return 0;
+}
+
+
+/* Appends a message to the newest segment, starting a new one if it is full. The
+ * record is not durable until spool_sync() has been called. Returns 0 on success,
+ * or non-zero (with spool->error set) on failure. */
+int spool_append(spool_t spool, const spool_record *record) {
+    spool_header header;
+    memset(&header, 0, sizeof(header));
+    header.wal_pos = record->wal_pos;
+    header.relid = record->relid;
+    header.partition_hash = record->partition_hash;
+    header.flags = (record->has_partition_hash ? SPOOL_HAS_PARTITION_HASH : 0) |
+        (record->key ? SPOOL_HAS_KEY : 0) | (record->val ? SPOOL_HAS_VALUE : 0) |
+        (record->has_txn ? SPOOL_HAS_TXN : 0);
+    header.topic_len = strlen(record->topic_name) + 1;
+    header.table_len = strlen(record->table_name) + 1;
+    header.key_len = record->key ? record->key_len : 0;
+    header.val_len = record->val ? record->val_len : 0;
+
+    spool_txn_header txn;
+    memset(&txn, 0, sizeof(txn));
+    txn.commit_lsn = record->commit_lsn;
+    txn.commit_time = record->commit_time;
+    txn.seq = record->seq;
+    txn.xid = record->xid;
+    size_t txn_len = record->has_txn ? sizeof(txn) : 0;
+
+    size_t body_len = sizeof(header) + txn_len + header.topic_len + header.table_len +
+        header.key_len + header.val_len;
+    size_t record_len = SPOOL_ALIGN(sizeof(spool_record_prefix) + body_len);
+
+    // Leave room for the zero length that marks the end of the segment
+    spool_segment *segment = spool->tail;
+    if (!segment || !segment->writable ||
+            segment->write_offset + record_len + sizeof(spool_record_prefix) > segment->size) {
+        if (spool_sync(spool)) return EIO;
+        if (segment) segment->writable = false;
+
+        segment = spool_segment_create(spool, SPOOL_MAGIC_LEN + record_len + sizeof(spool_record_prefix));
+        if (!segment) return EIO;
+    }
+
+    char *start = segment->map + segment->write_offset;
+    char *body = start + sizeof(spool_record_prefix);
+    char *pos = body;
+    memcpy(pos, &header, sizeof(header));                 pos += sizeof(header);
+    if (txn_len) memcpy(pos, &txn, txn_len);
+    pos += txn_len;
+    memcpy(pos, record->topic_name, header.topic_len);     pos += header.topic_len;
+    memcpy(pos, record->table_name, header.table_len);     pos += header.table_len;
+    if (header.key_len) memcpy(pos, record->key, header.key_len);
+    pos += header.key_len;
+    if (header.val_len) memcpy(pos, record->val, header.val_len);
+
+    spool_record_prefix prefix;
+    prefix.body_len = body_len;
+    prefix.crc = crc32(0, (const Bytef *) body, body_len);
+    memcpy(start, &prefix, sizeof(prefix));
+
+    segment->write_offset += record_len;
+    spool->num_records++;
+    return 0;
+}
+
+
+/* Flushes the records appended since the last call to disk. Returns 0 on success, or
+ * non-zero (with spool->error set) on failure. */
+int spool_sync(spool_t spool) {
+    spool_segment *segment = spool->tail;
+    if (!segment || segment->synced_offset >= segment->write_offset) return 0;
+
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t start = segment->synced_offset - segment->synced_offset % page_size;
+    if (msync(segment->map + start, segment->write_offset - start, MS_SYNC) != 0) {
+        spool_error(spool, "Could not write spool segment %s: %s", segment->path, strerror(errno));
+        return EIO;
+    }
+    segment->synced_offset = segment->write_offset;
+    return 0;
+}
+
+
+/* Hands out the next record in the spool, if there is one. Each record must later be
+ * passed to spool_ack() (or to spool_unread(), if it wasn't used after all). After a
+ * record was not delivered, returns false until all outstanding records have been
+ * acknowledged, and then starts again from the oldest segment. */
+bool spool_read(spool_t spool, spool_record *record) {
+    if (spool->rewind) {
+        if (spool->outstanding > 0) return false;
+        for (spool_segment *segment = spool->head; segment; segment = segment->next) {
+            segment->read_offset = SPOOL_MAGIC_LEN;
+        }
+        spool->reading = spool->head;
+        spool->rewind = false;
+    }
+
+    spool_segment *segment = spool->reading;
+    while (segment) {
+        size_t next;
+        if (segment->read_offset < segment->write_offset &&
+                spool_parse_record(segment, segment->read_offset, record, &next)) {
+            segment->read_offset = next;
+            segment->outstanding++;
+            spool->outstanding++;
+            return true;
+        }
+
+        if (segment->writable || !segment->next) break;
+        segment = segment->next;
+        spool->reading = segment;
+    }
+    spool_collect(spool);
+    return false;
+}
+
+
+/* Puts back a record that was returned by spool_read() but not used, so that it is
+ * returned again by the next call. */
+void spool_unread(spool_t spool, const spool_record *record) {
+    spool_segment *segment = record->segment;
+    segment->read_offset = record->offset;
+    segment->outstanding--;
+    spool->outstanding--;
+    spool->reading = segment;
+}
+
+
+/* Acknowledges a record that was returned by spool_read(). If it was delivered, the
+ * segment is deleted once that is true of all its records; if not, the spool is read
+ * again from the oldest segment (so messages may be delivered more than once). */
+void spool_ack(spool_t spool, spool_segment *segment, bool delivered) {
+    segment->outstanding--;
+    spool->outstanding--;
+    if (!delivered) spool->rewind = true;
+    spool_collect(spool);
+}
+
+
+/* Returns true if every record in the spool has been delivered. In that case the
+ * remaining segment files are deleted, so that the spool is empty after a restart. */
+bool spool_drained(spool_t spool) {
+    if (spool->outstanding > 0 || spool->rewind) return false;
+    for (spool_segment *segment = spool->head; segment; segment = segment->next) {
+        if (segment->read_offset < segment->write_offset) return false;
+    }
+
+    while (spool->head) {
+        spool_segment *segment = spool->head;
+        spool->head = segment->next;
+        spool_segment_delete(spool, segment);
+    }
+    spool->tail = NULL;
+    spool->reading = NULL;
+    spool->num_records = 0;
+    return true;
+}
+
+
+/* Deletes the oldest segments, as long as all their records have been delivered, and
+ * no further records are being appended to them. */
+void spool_collect(spool_t spool) {
+    if (spool->rewind) return;
+
+    while (spool->head && !spool->head->writable && spool->head->outstanding == 0 &&
+            spool->head->read_offset >= spool->head->write_offset && spool->head != spool->reading) {
+        spool_segment *segment = spool->head;
+        spool->head = segment->next;
+        if (!spool->head) spool->tail = NULL;
+        spool_segment_delete(spool, segment);
+    }
+}
+
+
+/* Creates, preallocates and maps a new segment file, at least min_size bytes long,
+ * and makes it the newest segment. Returns NULL (with spool->error set) on failure. */
+spool_segment *spool_segment_create(spool_t spool, size_t min_size) {
+    size_t size = spool->segment_size > min_size ? spool->segment_size : min_size;
+    char name[32];
+    snprintf(name, sizeof(name), "%016" PRIx64 SPOOL_SUFFIX, spool->next_seq);
+
+    spool_segment *segment = malloc(sizeof(spool_segment));
+    memset(segment, 0, sizeof(spool_segment));
+    segment->seq = spool->next_seq++;
+    segment->path = malloc(strlen(spool->dir) + strlen(name) + 2);
+    sprintf(segment->path, "%s/%s", spool->dir, name);
+    segment->size = size;
+
+    segment->fd = open(segment->path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (segment->fd < 0) {
+        spool_error(spool, "Could not create spool segment %s: %s", segment->path, strerror(errno));
+        spool_segment_free(segment);
+        return NULL;
+    }
+
+    int err = posix_fallocate(segment->fd, 0, size);
+    if (err) {
+        spool_error(spool, "Could not allocate spool segment %s: %s", segment->path, strerror(err));
+        unlink(segment->path);
+        spool_segment_free(segment);
+        return NULL;
+    }
+
+    segment->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, segment->fd, 0);
+    if (segment->map == MAP_FAILED) {
+        spool_error(spool, "Could not map spool segment %s: %s", segment->path, strerror(errno));
+        segment->map = NULL;
+        unlink(segment->path);
+        spool_segment_free(segment);
+        return NULL;
+    }
+
+    memcpy(segment->map, SPOOL_MAGIC, SPOOL_MAGIC_LEN);
+    segment->write_offset = SPOOL_MAGIC_LEN;
+    segment->read_offset = SPOOL_MAGIC_LEN;
+    segment->writable = true;
+    spool_sync_dir(spool);
+
+    if (spool->tail) spool->tail->next = segment; else spool->head = segment;
+    spool->tail = segment;
+    if (!spool->reading) spool->reading = segment;
+    return segment;
+}
+
+
+/* Maps an existing segment file for reading. Returns NULL (with spool->error set) if
+ * it can't be opened. */
+spool_segment *spool_segment_open(spool_t spool, const char *name, uint64_t seq) {
+    spool_segment *segment = malloc(sizeof(spool_segment));
+    memset(segment, 0, sizeof(spool_segment));
+    segment->seq = seq;
+    segment->path = malloc(strlen(spool->dir) + strlen(name) + 2);
+    sprintf(segment->path, "%s/%s", spool->dir, name);
+
+    struct stat st;
+    segment->fd = open(segment->path, O_RDONLY);
+    if (segment->fd < 0 || fstat(segment->fd, &st) != 0) {
+        spool_error(spool, "Could not open spool segment %s: %s", segment->path, strerror(errno));
+        spool_segment_free(segment);
+        return NULL;
+    }
+
+    segment->size = st.st_size;
+    if (segment->size > 0) {
+        segment->map = mmap(NULL, segment->size, PROT_READ, MAP_SHARED, segment->fd, 0);
+        if (segment->map == MAP_FAILED) {
+            spool_error(spool, "Could not map spool segment %s: %s", segment->path, strerror(errno));
+            segment->map = NULL;
+            spool_segment_free(segment);
+            return NULL;
+        }
+    }
+    return segment;
+}
+
+
+/* Finds the end of the valid records in a segment that was written by an earlier
+ * run, and returns the number of records. */
+size_t spool_segment_scan(spool_segment *segment) {
+    size_t count = 0, offset = SPOOL_MAGIC_LEN, next;
+    spool_record record;
+
+    if (segment->size < SPOOL_MAGIC_LEN || memcmp(segment->map, SPOOL_MAGIC, SPOOL_MAGIC_LEN) != 0) {
+        fprintf(stderr, "Ignoring %s, which is not a spool segment\n", segment->path);
+        return 0;
+    }
+
+    while (spool_parse_record(segment, offset, &record, &next)) {
+        offset = next;
+        count++;
+    }
+    segment->write_offset = offset;
+    segment->synced_offset = offset;
+    segment->read_offset = SPOOL_MAGIC_LEN;
+    return count;
+}
+
+
+/* Decodes the record at the given offset into *record, and sets *next_out to the
+ * offset of the next one. Returns false if there is no intact record there. */
+bool spool_parse_record(spool_segment *segment, size_t offset, spool_record *record, size_t *next_out) {
+    spool_record_prefix prefix;
+    spool_header header;
+
+    if (offset + sizeof(prefix) + sizeof(header) > segment->size) return false;
+    memcpy(&prefix, segment->map + offset, sizeof(prefix));
+    if (prefix.body_len < sizeof(header) ||
+            prefix.body_len > segment->size - offset - sizeof(prefix)) {
+        return false;
+    }
+
+    const char *body = segment->map + offset + sizeof(prefix);
+    if (crc32(0, (const Bytef *) body, prefix.body_len) != prefix.crc) return false;
+
+    memcpy(&header, body, sizeof(header));
+    size_t txn_len = (header.flags & SPOOL_HAS_TXN) ? sizeof(spool_txn_header) : 0;
+    uint64_t lengths = (uint64_t) txn_len + header.topic_len + header.table_len +
+        header.key_len + header.val_len;
+    if (header.topic_len == 0 || header.table_len == 0 ||
+            sizeof(header) + lengths != prefix.body_len) {
+        return false;
+    }
+
+    const char *pos = body + sizeof(header);
+    memset(record, 0, sizeof(spool_record));
+    if (txn_len) {
+        spool_txn_header txn;
+        memcpy(&txn, pos, txn_len);
+        record->has_txn = true;
+        record->commit_lsn = txn.commit_lsn;
+        record->commit_time = txn.commit_time;
+        record->seq = txn.seq;
+        record->xid = txn.xid;
+        pos += txn_len;
+    }
+    record->wal_pos = header.wal_pos;
+    record->relid = header.relid;
+    record->has_partition_hash = (header.flags & SPOOL_HAS_PARTITION_HASH) != 0;
+    record->partition_hash = header.partition_hash;
+    record->topic_name = pos;                                     pos += header.topic_len;
+    record->table_name = pos;                                     pos += header.table_len;
+    record->key = (header.flags & SPOOL_HAS_KEY) ? pos : NULL;    pos += header.key_len;
+    record->key_len = header.key_len;
+    record->val = (header.flags & SPOOL_HAS_VALUE) ? pos : NULL;
+    record->val_len = header.val_len;
+    record->segment = segment;
+    record->offset = offset;
+
+    if (record->topic_name[header.topic_len - 1] != '\0' ||
+            record->table_name[header.table_len - 1] != '\0') {
+        return false;
+    }
+
+    *next_out = offset + SPOOL_ALIGN(sizeof(prefix) + prefix.body_len);
+    return true;
+}
+
+
+/* Removes a segment's file, and frees it. */
+void spool_segment_delete(spool_t spool, spool_segment *segment) {
+    if (unlink(segment->path) != 0) {
+        fprintf(stderr, "Warning: could not delete spool segment %s: %s\n",
+                segment->path, strerror(errno));
+    }
+    spool_segment_free(segment);
+}
+
+
+/* Unmaps and closes a segment, and frees the struct. */
+void spool_segment_free(spool_segment *segment) {
+    if (segment->map) munmap(segment->map, segment->size);
+    if (segment->fd >= 0) close(segment->fd);
+    free(segment->path);
+    free(segment);
+}
+
+
+/* Makes sure that a newly created segment file is still there after a crash. */
+void spool_sync_dir(spool_t spool) {
+    int fd = open(spool->dir, O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+}
+
+
+/* Unmaps and closes all segments (without deleting them), and frees the spool. */
+void spool_free(spool_t spool) {
+    spool_sync(spool);
+    while (spool->head) {
+        spool_segment *segment = spool->head;
+        spool->head = segment->next;
+        spool_segment_free(segment);
+    }
+    free(spool->dir);
+    free(spool);
+}
+
+
+/* Updates the spool's statically allocated error buffer with a message. */
+void spool_error(spool_t spool, char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(spool->error, SPOOL_ERROR_LEN, fmt, args);
+    va_end(args);
+}
@@ -0,0 +1,72 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SPOOL_ERROR_LEN 512
+#define DEFAULT_SPOOL_SEGMENT_SIZE (64 * 1024 * 1024)
+
+typedef struct spool_segment {
+    uint64_t seq;               /* Position of the segment in the spool (part of its file name) */
+    char *path;
+    int fd;
+    char *map;                  /* The whole file, mapped into memory */
+    size_t size;                /* Size of the file and mapping */
+    size_t write_offset;        /* End of the records in the segment */
+    size_t synced_offset;       /* Records up to here have been flushed to disk */
+    size_t read_offset;         /* Next record to be handed out by spool_read() */
+    int outstanding;            /* Records handed out but not yet acknowledged */
+    bool writable;              /* Whether records may be appended (only the newest segment) */
+    struct spool_segment *next; /* Next newer segment */
+} spool_segment;
+
+typedef struct {
+    char *dir;                  /* Directory containing the segment files */
+    size_t segment_size;        /* Size of newly created segment files */
+    uint64_t next_seq;          /* Sequence number of the next segment file to create */
+    spool_segment *head;        /* Oldest segment */
+    spool_segment *tail;        /* Newest segment */
+    spool_segment *reading;     /* Segment from which spool_read() is reading */
+    int outstanding;            /* Records handed out but not yet acknowledged, in total */
+    bool rewind;                /* A record was not delivered: read again from the head */
+    uint64_t num_records;       /* Records appended since the spool was last drained */
+    char error[SPOOL_ERROR_LEN];
+} spool;
+
+typedef spool *spool_t;
+
+/* One message, as written to or read from the spool. When read, the pointers point
+ * into the segment's mapping, and remain valid until the record is acknowledged. */
+typedef struct {
+    uint64_t wal_pos;           /* WAL position of the change */
+    uint32_t relid;             /* Table that the message came from */
+    bool has_partition_hash;    /* Whether partition_hash determines the partition */
+    uint32_t partition_hash;
+    bool has_txn;               /* Whether the following fields are set (see --txn-headers) */
+    uint32_t xid;               /* Transaction that the message came from */
+    uint64_t commit_lsn;        /* WAL position of that transaction's commit */
+    int64_t commit_time;        /* Its commit time, in microseconds since the Unix epoch */
+    uint64_t seq;               /* Position of the change within the transaction */
+    const char *topic_name;
+    const char *table_name;     /* Qualified table name ("schema.table") */
+    const void *key;            /* Encoded key (NULL = none) */
+    size_t key_len;
+    const void *val;            /* Encoded value (NULL = tombstone) */
+    size_t val_len;
+    spool_segment *segment;     /* Where the record was read from */
+    size_t offset;              /* Position of the record in the segment */
+} spool_record;
+
+spool_t spool_new(const char *dir, size_t segment_size);
+int spool_open(spool_t spool);
+int spool_append(spool_t spool, const spool_record *record);
+int spool_sync(spool_t spool);
+bool spool_read(spool_t spool, spool_record *record);
+void spool_unread(spool_t spool, const spool_record *record);
+void spool_ack(spool_t spool, spool_segment *segment, bool delivered);
+bool spool_drained(spool_t spool);
+void spool_free(spool_t spool);
+
+#endif /* SPOOL_H */
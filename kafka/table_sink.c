@@ -0,0 +1,646 @@
+/* Common parts of the sinks that write the rows of each table to files of their own,
+ * in directory DIR: the avro sink (avro_sink.c) and the arrow sink (arrow_sink.c). The
+ * layout of the files is up to the sink's table_format; this file takes care of when
+ * they are started and finished, and of keeping track of which are complete.
+ *
+ * A new file is started once the current one reaches --sink-file-size, or becomes
+ * older than --sink-file-age, or when the table's schema changes. Only rows (i.e. the
+ * values of messages, minus the schema ID prefix) are written; deleted rows have no
+ * value, and so do not appear in the files.
+ *
+ * Files are written as "<table>.<seq><suffix>.inprogress". A finished file is synced
+ * and closed, but only published (renamed to "<table>.<seq><suffix>" and added to the
+ * manifest) at the next commit passed to the sink, which may stand for several
+ * Postgres transactions. A file that is finished in the middle of a transaction (by
+ * its size, or a schema change) holds only some of the table's rows in that
+ * transaction, so at the commit the table's current file is finished too, and the two
+ * are published together. So a published file never holds part of a table's rows in
+ * a transaction unless the files with the rest were published at the same time.
+ *
+ * The manifest, DIR/MANIFEST, starts with the line
+ *
+ *     # resume <LSN>
+ *
+ * followed by one line per published file:
+ *
+ *     <commit LSN> <number of rows> <file name>
+ *
+ * where the LSN is that of the last commit whose rows the file may contain. It is
+ * rewritten (via a temporary file, which is then renamed) every time files are
+ * published, and at most every TABLE_SINK_RESUME_INTERVAL_MS when only the resume
+ * position has moved on.
+ *
+ * Files that are not listed in the manifest are incomplete, and are deleted when the
+ * sink is opened. Replication then resumes after the resume position: the commit
+ * before the first row of the oldest file that was still open, or if none were, the
+ * last commit. So no change is lost, but other tables may already have published
+ * files covering later commits, and those rows are written again, in new files. The
+ * sink is therefore at-least-once: after a restart, every change ends up in at least
+ * one published file, and the rows of some tables' transactions may be in two. (Rows
+ * can't be told apart by transaction here, since the messages handed over between two
+ * commits may come from several, so they aren't deduplicated.)
+ *
+ * Messages are acknowledged as soon as the format has taken them; the durability of
+ * files is reflected in sink->durable_lsn instead, which is the resume position in the
+ * manifest, and holds back the position up to which Postgres may discard WAL. */
+
+#include "table_sink.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TABLE_SINK_INPROGRESS_SUFFIX ".inprogress"
+#define TABLE_SINK_MANIFEST "MANIFEST"
+#define TABLE_SINK_MANIFEST_TMP "MANIFEST.tmp"
+#define TABLE_SINK_AGE_CHECK_INTERVAL_MS 1000
+#define TABLE_SINK_RESUME_INTERVAL_MS 1000
+#define TABLE_SINK_RESUME_PREFIX "# resume "
+
+#define check(err, call) { err = call; if (err) return err; }
+
+/* A file that is complete, but not yet published. */
+struct closed_file {
+    char *table_name;
+    uint64_t seq;
+    uint64_t num_records;
+    struct closed_file *next;
+};
+
+int table_sink_read_manifest(sink_t sink);
+int table_sink_clean_dir(sink_t sink);
+int table_sink_open_file(sink_t sink, table_file *table);
+int table_sink_close_file(sink_t sink, table_file *table);
+int table_sink_close_split(sink_t sink);
+int table_sink_close_expired(sink_t sink);
+int table_sink_publish(sink_t sink);
+int table_sink_write_manifest(sink_t sink);
+void table_sink_update_durable_lsn(sink_t sink);
+void table_sink_file_name(sink_t sink, char *buf, size_t size, const char *table_name,
+        uint64_t seq, bool inprogress);
+void table_sink_sync_dir(sink_t sink);
+
+
+/* Sets up a sink that writes files in the given format. Reads the manifest, removes
+ * files left incomplete by an earlier run, and sets durable_lsn to the position from
+ * which replication should resume. */
+int table_sink_open(sink_t sink, const table_format *format) {
+    int err;
+    if (!sink->target || !*sink->target) {
+        sink_error(sink, "The %s sink needs a directory (--sink=%s:DIR)",
+                sink->ops->name, sink->ops->name);
+        return EINVAL;
+    }
+
+    table_sink_state *state = malloc(sizeof(table_sink_state));
+    memset(state, 0, sizeof(table_sink_state));
+    state->format = format;
+    sink->state = state;
+    sink->tracks_lsn = true;
+    if (format->open) check(err, format->open(sink));
+
+    if (mkdir(sink->target, 0755) != 0 && errno != EEXIST) {
+        sink_error(sink, "Could not create directory %s: %s", sink->target, strerror(errno));
+        return EIO;
+    }
+
+    check(err, table_sink_read_manifest(sink));
+    check(err, table_sink_clean_dir(sink));
+
+    // Files opened before the first commit start where replication resumes
+    state->commit_lsn = state->resume_lsn;
+    sink->durable_lsn = state->resume_lsn;
+    if (sink->durable_lsn) {
+        fprintf(stderr, "Manifest in %s resumes from %X/%X.\n", sink->target,
+                (uint32_t) (sink->durable_lsn >> 32), (uint32_t) sink->durable_lsn);
+    }
+    return 0;
+}
+
+
+/* Remembers a table's row schema. A file can only have one schema, so if the table
+ * already has a file open with a different schema (or name), that file is finished. */
+int table_sink_schema(sink_t sink, topic_list_entry_t entry,
+        const char *row_schema_json, size_t row_schema_len) {
+    table_sink_state *state = sink->state;
+    table_file *table = entry->sink_data;
+    int err;
+
+    if (!table) {
+        table = malloc(sizeof(table_file));
+        memset(table, 0, sizeof(table_file));
+        table->relid = entry->relid;
+        table->fd = -1;
+        table->next = state->tables;
+        state->tables = table;
+        entry->sink_data = table;
+
+    } else if (table->schema_len == row_schema_len &&
+            memcmp(table->schema_json, row_schema_json, row_schema_len) == 0 &&
+            strcmp(table->table_name, entry->table_name) == 0) {
+        return 0;
+    }
+
+    if (table->fd >= 0) check(err, table_sink_close_file(sink, table));
+
+    free(table->table_name);
+    free(table->schema_json);
+    table->table_name = strdup(entry->table_name);
+    table->schema_json = malloc(row_schema_len);
+    memcpy(table->schema_json, row_schema_json, row_schema_len);
+    table->schema_len = row_schema_len;
+
+    return state->format->schema ? state->format->schema(sink, table) : 0;
+}
+
+
+/* Hands the rows in a table's batch to the format, starting a file if needed. The
+ * messages are acknowledged once all of them have been taken. */
+int table_sink_produce(sink_t sink, topic_list_entry_t entry) {
+    table_sink_state *state = sink->state;
+    table_file *table = entry->sink_data;
+    int err;
+
+    if (!table) {
+        sink_error(sink, "No schema for table %s", entry->table_name);
+        return EINVAL;
+    }
+
+    for (int i = 0; i < entry->batch_len; i++) {
+        rd_kafka_message_t *msg = &entry->batch[i];
+        if (!msg->payload || msg->len < SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN) continue;
+
+        if (table->fd < 0) check(err, table_sink_open_file(sink, table));
+
+        check(err, state->format->append(sink, table,
+                    (const char *) msg->payload + SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN,
+                    msg->len - SCHEMA_REGISTRY_MESSAGE_PREFIX_LEN));
+        table->num_records++;
+        table->uncommitted++;
+
+        if (table->file_size + table->buffered >= sink->max_file_size) {
+            check(err, table_sink_close_file(sink, table));
+        }
+    }
+
+    state->uncommitted += entry->batch_len;
+    for (int i = 0; i < entry->batch_len; i++) {
+        sink_ack(sink, entry->batch[i]._private, NULL);
+    }
+    return 0;
+}
+
+
+/* At a commit, finishes the files that hold the rest of a transaction whose rows were
+ * split, and files that have become too old, and publishes all finished files, so that
+ * they count as containing everything up to lsn. */
+int table_sink_commit(sink_t sink, uint64_t lsn) {
+    table_sink_state *state = sink->state;
+    int err;
+
+    state->commit_lsn = lsn;
+    state->uncommitted = 0;
+
+    check(err, table_sink_close_split(sink));
+    check(err, table_sink_close_expired(sink));
+    check(err, table_sink_publish(sink));
+    table_sink_update_durable_lsn(sink);
+    return 0;
+}
+
+
+/* Between transactions, finishes and publishes files that have become too old, so
+ * that a quiet table's file doesn't stay open (and hold back the WAL) indefinitely,
+ * and records how far the resume position has moved on. */
+int table_sink_poll(sink_t sink, int timeout_ms) {
+    table_sink_state *state = sink->state;
+    int err;
+
+    if (state->uncommitted > 0) return 0;
+    check(err, table_sink_close_expired(sink));
+    check(err, table_sink_publish(sink));
+    table_sink_update_durable_lsn(sink);
+    return 0;
+}
+
+
+/* If we are between transactions, publishes what has been written so far. Otherwise
+ * (or if that fails) unfinished files are left behind, to be deleted on the next run. */
+void table_sink_close(sink_t sink) {
+    table_sink_state *state = sink->state;
+    if (!state) return;
+
+    bool publish = state->uncommitted == 0;
+    state->next_resume_write = 0;
+    for (table_file *table = state->tables; table; table = table->next) {
+        if (table->fd >= 0 && publish && table_sink_close_file(sink, table)) publish = false;
+    }
+    if (publish && table_sink_publish(sink)) {
+        fprintf(stderr, "%s\n", sink->error);
+    }
+
+    while (state->tables) {
+        table_file *table = state->tables;
+        state->tables = table->next;
+        if (table->fd >= 0) close(table->fd);
+        if (state->format->free_table) state->format->free_table(table);
+        free(table->table_name);
+        free(table->schema_json);
+        free(table);
+    }
+
+    while (state->closed) {
+        closed_file *closed = state->closed;
+        state->closed = closed->next;
+        free(closed->table_name);
+        free(closed);
+    }
+
+    if (state->format->close) state->format->close(sink);
+    free(state->manifest);
+    free(state);
+    sink->state = NULL;
+}
+
+
+/* Writes all of the given buffers to the table's current file, in as few system calls
+ * as possible. */
+int table_sink_write(sink_t sink, table_file *table, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(table->fd, iov, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            sink_error(sink, "Could not write file for %s in %s: %s", table->table_name,
+                    sink->target, strerror(errno));
+            return EIO;
+        }
+        table->file_size += written;
+
+        while (iovcnt > 0 && written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+
+/* Appends data to a growable buffer, which is kept null-terminated. Exits if memory
+ * cannot be allocated. */
+void table_sink_buf_append(char **buf, size_t *len, size_t *capacity, const void *data, size_t data_len) {
+    if (*len + data_len + 1 > *capacity) {
+        size_t new_capacity = *capacity > 0 ? *capacity : 4096;
+        while (*len + data_len + 1 > new_capacity) new_capacity *= 4;
+        char *new_buf = realloc(*buf, new_capacity);
+        if (!new_buf) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        *buf = new_buf;
+        *capacity = new_capacity;
+    }
+    memcpy(*buf + *len, data, data_len);
+    *len += data_len;
+    (*buf)[*len] = '\0';
+}
+
+
+/* Loads the manifest, if there is one, and sets resume_lsn to the resume position
+ * recorded in it. (Manifests written before there was one only have the LSNs of
+ * files, of which the highest is the best guess.) */
+int table_sink_read_manifest(sink_t sink) {
+    table_sink_state *state = sink->state;
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/" TABLE_SINK_MANIFEST, sink->target);
+
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        if (errno == ENOENT) return 0;
+        sink_error(sink, "Could not open %s: %s", path, strerror(errno));
+        return EIO;
+    }
+
+    char line[1024];
+    uint64_t max_lsn = 0;
+    bool has_resume = false;
+    while (fgets(line, sizeof(line), file)) {
+        bool is_resume = strncmp(line, TABLE_SINK_RESUME_PREFIX,
+                strlen(TABLE_SINK_RESUME_PREFIX)) == 0;
+        const char *lsn_str = is_resume ? line + strlen(TABLE_SINK_RESUME_PREFIX) : line;
+        uint32_t hi, lo;
+        if (sscanf(lsn_str, "%X/%X", &hi, &lo) != 2 || !strchr(line, '\n')) {
+            sink_error(sink, "Malformed line in %s: %s", path, line);
+            fclose(file);
+            return EINVAL;
+        }
+
+        uint64_t lsn = ((uint64_t) hi << 32) | lo;
+        if (is_resume) {
+            state->resume_lsn = lsn;
+            has_resume = true;
+            continue;
+        }
+        if (lsn > max_lsn) max_lsn = lsn;
+        table_sink_buf_append(&state->manifest, &state->manifest_len, &state->manifest_capacity,
+                line, strlen(line));
+    }
+
+    bool failed = ferror(file);
+    fclose(file);
+    if (failed) {
+        sink_error(sink, "Could not read %s", path);
+        return EIO;
+    }
+    if (!has_resume) state->resume_lsn = max_lsn;
+    return 0;
+}
+
+
+/* Deletes files that are not listed in the manifest (because they were in progress,
+ * or because we crashed while publishing them), and carries on numbering from the
+ * highest sequence number in the directory. */
+int table_sink_clean_dir(sink_t sink) {
+    table_sink_state *state = sink->state;
+    const char *suffix = state->format->suffix;
+
+    DIR *dir = opendir(sink->target);
+    if (!dir) {
+        sink_error(sink, "Could not open directory %s: %s", sink->target, strerror(errno));
+        return EIO;
+    }
+
+    struct dirent *dirent;
+    while ((dirent = readdir(dir))) {
+        const char *name = dirent->d_name;
+        size_t len = strlen(name);
+        bool inprogress = false;
+
+        if (len > strlen(TABLE_SINK_INPROGRESS_SUFFIX) && strcmp(name + len -
+                    strlen(TABLE_SINK_INPROGRESS_SUFFIX), TABLE_SINK_INPROGRESS_SUFFIX) == 0) {
+            len -= strlen(TABLE_SINK_INPROGRESS_SUFFIX);
+            inprogress = true;
+        }
+        if (len <= strlen(suffix) ||
+                strncmp(name + len - strlen(suffix), suffix, strlen(suffix)) != 0) {
+            continue;
+        }
+
+        // The sequence number is the last component before the suffix
+        const char *seq_start = name + len - strlen(suffix);
+        while (seq_start > name && seq_start[-1] != '.') seq_start--;
+        uint64_t seq;
+        if (sscanf(seq_start, "%16" SCNx64, &seq) == 1 && seq >= state->next_seq) {
+            state->next_seq = seq + 1;
+        }
+
+        // Published files appear in the manifest as " <name>\n"
+        bool published = false;
+        if (!inprogress && state->manifest) {
+            char needle[1024];
+            snprintf(needle, sizeof(needle), " %s\n", name);
+            published = strstr(state->manifest, needle) != NULL;
+        }
+        if (published) continue;
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", sink->target, name);
+        if (!inprogress) {
+            fprintf(stderr, "Removing %s, which is not in the manifest.\n", path);
+        }
+        if (unlink(path) != 0) {
+            sink_error(sink, "Could not remove %s: %s", path, strerror(errno));
+            closedir(dir);
+            return EIO;
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+
+/* Creates the next file for a table, and has the format write its header. */
+int table_sink_open_file(sink_t sink, table_file *table) {
+    table_sink_state *state = sink->state;
+    char name[512], path[1024];
+
+    table->seq = state->next_seq++;
+    table_sink_file_name(sink, name, sizeof(name), table->table_name, table->seq, true);
+    snprintf(path, sizeof(path), "%s/%s", sink->target, name);
+
+    table->fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (table->fd < 0) {
+        sink_error(sink, "Could not create %s: %s", path, strerror(errno));
+        return EIO;
+    }
+
+    table->file_size = 0;
+    table->buffered = 0;
+    table->num_records = 0;
+    table->opened_at = sink_time_ms();
+    table->start_lsn = state->commit_lsn;
+
+    if (state->num_open++ == 0 || table->start_lsn < state->min_start_lsn) {
+        state->min_start_lsn = table->start_lsn;
+    }
+    return state->format->begin ? state->format->begin(sink, table) : 0;
+}
+
+
+/* Has the format write the rest of a table's file, syncs and closes it, and queues it
+ * to be published at the next commit. If the file has rows of the current transaction,
+ * the table's next file is finished at the commit too (see table_sink_close_split()). */
+int table_sink_close_file(sink_t sink, table_file *table) {
+    table_sink_state *state = sink->state;
+    int err;
+
+    if (table->uncommitted > 0) table->split = true;
+
+    if (state->format->finish) check(err, state->format->finish(sink, table));
+    if (fsync(table->fd) != 0 || close(table->fd) != 0) {
+        sink_error(sink, "Could not write file for %s in %s: %s", table->table_name,
+                sink->target, strerror(errno));
+        table->fd = -1;
+        return EIO;
+    }
+    table->fd = -1;
+
+    closed_file *closed = malloc(sizeof(closed_file));
+    closed->table_name = strdup(table->table_name);
+    closed->seq = table->seq;
+    closed->num_records = table->num_records;
+    closed->next = NULL;
+    if (state->closed_tail) {
+        state->closed_tail->next = closed;
+    } else {
+        state->closed = closed;
+    }
+    state->closed_tail = closed;
+
+    // Files are opened in LSN order, but may be closed in any order
+    state->num_open--;
+    state->min_start_lsn = UINT64_MAX;
+    for (table_file *other = state->tables; other; other = other->next) {
+        if (other->fd >= 0 && other->start_lsn < state->min_start_lsn) {
+            state->min_start_lsn = other->start_lsn;
+        }
+    }
+    return 0;
+}
+
+
+/* At a commit, finishes the current files of tables that had a file finished since the
+ * last one, so that the rows they took in between are published together. */
+int table_sink_close_split(sink_t sink) {
+    table_sink_state *state = sink->state;
+    int err;
+
+    for (table_file *table = state->tables; table; table = table->next) {
+        bool split = table->split;
+        table->split = false;
+        table->uncommitted = 0;
+        if (split && table->fd >= 0) check(err, table_sink_close_file(sink, table));
+    }
+    return 0;
+}
+
+
+/* Finishes files that are older than max_file_age. Only looks once a second. */
+int table_sink_close_expired(sink_t sink) {
+    table_sink_state *state = sink->state;
+    if (sink->max_file_age <= 0 || state->num_open == 0) return 0;
+
+    int64_t now = sink_time_ms();
+    if (now < state->next_age_check) return 0;
+    state->next_age_check = now + TABLE_SINK_AGE_CHECK_INTERVAL_MS;
+
+    int err;
+    for (table_file *table = state->tables; table; table = table->next) {
+        if (table->fd >= 0 && now - table->opened_at >= sink->max_file_age * 1000LL) {
+            check(err, table_sink_close_file(sink, table));
+        }
+    }
+    return 0;
+}
+
+
+/* Renames the finished files to their final names, and records them in the manifest,
+ * with the LSN of the last commit, along with the new resume position. If there are no
+ * files to publish, only rewrites the manifest if the resume position has moved on,
+ * and at most every TABLE_SINK_RESUME_INTERVAL_MS. Must only be called between
+ * transactions. */
+int table_sink_publish(sink_t sink) {
+    table_sink_state *state = sink->state;
+    uint64_t resume_lsn = state->num_open > 0 ? state->min_start_lsn : state->commit_lsn;
+
+    if (!state->closed) {
+        if (resume_lsn <= state->resume_lsn) return 0;
+        int64_t now = sink_time_ms();
+        if (now < state->next_resume_write) return 0;
+        state->next_resume_write = now + TABLE_SINK_RESUME_INTERVAL_MS;
+    }
+
+    while (state->closed) {
+        closed_file *closed = state->closed;
+        char name[512], from[1024], to[1024];
+
+        table_sink_file_name(sink, name, sizeof(name), closed->table_name, closed->seq, true);
+        snprintf(from, sizeof(from), "%s/%s", sink->target, name);
+        table_sink_file_name(sink, name, sizeof(name), closed->table_name, closed->seq, false);
+        snprintf(to, sizeof(to), "%s/%s", sink->target, name);
+
+        if (rename(from, to) != 0) {
+            sink_error(sink, "Could not rename %s to %s: %s", from, to, strerror(errno));
+            return EIO;
+        }
+
+        char line[1024];
+        int line_len = snprintf(line, sizeof(line), "%X/%X %" PRIu64 " %s\n",
+                (uint32_t) (state->commit_lsn >> 32), (uint32_t) state->commit_lsn,
+                closed->num_records, name);
+        table_sink_buf_append(&state->manifest, &state->manifest_len, &state->manifest_capacity,
+                line, line_len);
+
+        state->closed = closed->next;
+        free(closed->table_name);
+        free(closed);
+    }
+    state->closed_tail = NULL;
+
+    if (resume_lsn > state->resume_lsn) state->resume_lsn = resume_lsn;
+    return table_sink_write_manifest(sink);
+}
+
+
+/* Replaces the manifest atomically: writes a temporary file, syncs it, and renames
+ * it over the old one. */
+int table_sink_write_manifest(sink_t sink) {
+    table_sink_state *state = sink->state;
+    char tmp_path[1024], path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/" TABLE_SINK_MANIFEST_TMP, sink->target);
+    snprintf(path, sizeof(path), "%s/" TABLE_SINK_MANIFEST, sink->target);
+
+    FILE *file = fopen(tmp_path, "w");
+    if (!file) {
+        sink_error(sink, "Could not create %s: %s", tmp_path, strerror(errno));
+        return EIO;
+    }
+
+    bool failed = fprintf(file, TABLE_SINK_RESUME_PREFIX "%X/%X\n",
+            (uint32_t) (state->resume_lsn >> 32), (uint32_t) state->resume_lsn) < 0 ||
+        (state->manifest_len > 0 && fwrite(state->manifest, state->manifest_len, 1, file) != 1) ||
+        fflush(file) != 0 || fsync(fileno(file)) != 0;
+    if (fclose(file) != 0 || failed) {
+        sink_error(sink, "Could not write %s: %s", tmp_path, strerror(errno));
+        return EIO;
+    }
+
+    if (rename(tmp_path, path) != 0) {
+        sink_error(sink, "Could not rename %s to %s: %s", tmp_path, path, strerror(errno));
+        return EIO;
+    }
+
+    // Makes the renames (of the files and the manifest) durable
+    table_sink_sync_dir(sink);
+    return 0;
+}
+
+
+/* Postgres must keep the WAL from the resume position in the manifest onwards, since
+ * that is where a restart picks up. (The position only counts once it is in the
+ * manifest, since the files still open at the time are lost in a crash.) */
+void table_sink_update_durable_lsn(sink_t sink) {
+    table_sink_state *state = sink->state;
+    if (state->resume_lsn > sink->durable_lsn) sink->durable_lsn = state->resume_lsn;
+}
+
+
+/* Formats the name of a table's file. Slashes in the table name are replaced, so that
+ * the file ends up in the sink's directory. */
+void table_sink_file_name(sink_t sink, char *buf, size_t size, const char *table_name,
+        uint64_t seq, bool inprogress) {
+    table_sink_state *state = sink->state;
+    snprintf(buf, size, "%s.%016" PRIx64 "%s%s", table_name, seq, state->format->suffix,
+            inprogress ? TABLE_SINK_INPROGRESS_SUFFIX : "");
+    for (char *c = buf; *c; c++) {
+        if (*c == '/') *c = '_';
+    }
+}
+
+
+void table_sink_sync_dir(sink_t sink) {
+    int dir_fd = open(sink->target, O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef TABLE_SINK_H
+#define TABLE_SINK_H
+
+#include "sink.h"
+
+#include <sys/uio.h>
+
+/* A table, and the file that is currently being written for it (if any), in a sink
+ * that writes the rows of each table to files of their own (see table_sink.c). */
+typedef struct table_file {
+    uint64_t relid;
+    char *table_name;           /* Qualified table name, used in file names */
+    char *schema_json;          /* Row schema of the table */
+    size_t schema_len;
+    int fd;                     /* Current file (-1 = none) */
+    uint64_t seq;               /* Sequence number of the current file */
+    uint64_t num_records;       /* Rows in the current file, including buffered ones */
+    size_t file_size;           /* Bytes written to the current file */
+    size_t buffered;            /* Bytes of rows buffered by the format, not yet written */
+    int64_t opened_at;          /* When the current file was created, in ms */
+    uint64_t start_lsn;         /* Last commit before the current file's first row */
+    uint64_t uncommitted;       /* Rows taken since the last commit */
+    bool split;                 /* Whether a file with some of them has been finished */
+    void *format_data;          /* Owned by the format */
+    struct table_file *next;
+} table_file;
+
+/* How the files of a table sink are laid out. Those returning int return 0 on success,
+ * or non-zero (with sink->error set) on failure. Any of them except append may be NULL. */
+typedef struct {
+    const char *suffix;                                 /* File name extension, e.g. ".avro" */
+    int (*open)(sink_t sink);                           /* Sets up format_state */
+    int (*schema)(sink_t sink, table_file *table);      /* Table is new, or its schema changed */
+    int (*begin)(sink_t sink, table_file *table);       /* Writes the header of a new file */
+    int (*append)(sink_t sink, table_file *table,       /* Adds one row (Avro binary encoding) */
+            const char *row, size_t row_len);
+    int (*finish)(sink_t sink, table_file *table);      /* Writes buffered rows and any trailer */
+    void (*free_table)(table_file *table);              /* Frees format_data */
+    void (*close)(sink_t sink);                         /* Frees format_state */
+} table_format;
+
+typedef struct closed_file closed_file;
+
+typedef struct {
+    const table_format *format;
+    void *format_state;         /* Owned by the format */
+    table_file *tables;         /* All tables whose schemas we've seen */
+    int num_open;               /* Number of tables with a file open */
+    uint64_t min_start_lsn;     /* Lowest start_lsn of those tables */
+    closed_file *closed;        /* Files to publish at the next commit, oldest first */
+    closed_file *closed_tail;
+    char *manifest;             /* Contents of the manifest */
+    size_t manifest_len;
+    size_t manifest_capacity;
+    uint64_t next_seq;          /* Sequence number of the next file to create */
+    uint64_t commit_lsn;        /* Last commit passed to table_sink_commit() */
+    uint64_t resume_lsn;        /* Where replication resumes after a restart, per the manifest */
+    int64_t next_resume_write;  /* When the manifest may next be rewritten just for resume_lsn */
+    uint64_t uncommitted;       /* Messages produced since then */
+    int64_t next_age_check;     /* When to next look for files older than max_file_age */
+} table_sink_state;
+
+int table_sink_open(sink_t sink, const table_format *format);
+int table_sink_schema(sink_t sink, topic_list_entry_t entry,
+        const char *row_schema_json, size_t row_schema_len);
+int table_sink_produce(sink_t sink, topic_list_entry_t entry);
+int table_sink_commit(sink_t sink, uint64_t lsn);
+int table_sink_poll(sink_t sink, int timeout_ms);
+void table_sink_close(sink_t sink);
+int table_sink_write(sink_t sink, table_file *table, struct iovec *iov, int iovcnt);
+void table_sink_buf_append(char **buf, size_t *len, size_t *capacity, const void *data, size_t data_len);
+
+#endif /* TABLE_SINK_H */